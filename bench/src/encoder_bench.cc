@@ -0,0 +1,445 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+/**
+ * capsule-bench drives encoder::Run with synthetic frames, so encoder
+ * changes can be measured without launching a game.
+ *
+ * Every configuration of the preset x threads x pix_fmt sweep runs in
+ * its own child process, which keeps peak RSS and profiler state separate.
+ * Results are printed to stdout as tab-separated values, one row per
+ * configuration, so that runs from two builds can be diffed.
+ */
+
+#include <lab/platform.h>
+
+#include <microprofile.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "argparse.h"
+#include "encoder.h"
+#include "logging.h"
+#include "synthetic_source.h"
+
+static const char *const usage[] = {
+  "capsule-bench [options]",
+  NULL
+};
+
+namespace capsule {
+namespace bench {
+
+// microprofile timers defined in encoder.cc, reported in this order
+static const char *kStages[] = {
+  "Cycle",
+  "VRecv",
+  "VScale",
+  "VEncode",
+  "VMux2",
+  "VWaitOutputs",
+  "AResample",
+  "AEncode",
+};
+static const int kNumStages = sizeof(kStages) / sizeof(kStages[0]);
+
+static const int kAudioRate = 44100;
+static const int kAudioChannels = 2;
+
+struct BenchArgs {
+  int width;
+  int height;
+  int fps;
+  int frames;
+  int warmup;
+  int ring;
+  int audio;
+  const char *pattern;
+  const char *format;
+  const char *presets;
+  const char *threads;
+  const char *pix_fmts;
+  const char *outputs;
+  const char *dir;
+};
+
+struct Config {
+  std::string preset;
+  int threads;
+  std::string pix_fmt;
+};
+
+struct BenchContext {
+  BenchArgs *args;
+  SyntheticSource *source;
+  messages::PixFmt format;
+
+  int64_t frames_sent;
+  std::chrono::steady_clock::time_point start_time;
+
+  // one sample per encoder cycle, in milliseconds
+  std::vector<float> stage_samples[kNumStages];
+
+  std::vector<int16_t> audio_buf;
+  int64_t audio_frames_sent;
+};
+
+static std::vector<std::string> SplitList(const char *list) {
+  std::vector<std::string> items;
+  std::istringstream iss(list);
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+static float Percentile(std::vector<float> samples, double p) {
+  if (samples.empty()) {
+    return 0.0f;
+  }
+  std::sort(samples.begin(), samples.end());
+  size_t index = static_cast<size_t>(p * static_cast<double>(samples.size() - 1) + 0.5);
+  return samples[index];
+}
+
+static int ReceiveVideoFormat(BenchContext *ctx, encoder::VideoFormat *vfmt) {
+  vfmt->width = ctx->args->width;
+  vfmt->height = ctx->args->height;
+  vfmt->format = ctx->format;
+  vfmt->vflip = false;
+  vfmt->num_planes = 1;
+  vfmt->offset[0] = 0;
+  vfmt->linesize[0] = ctx->args->width * 4;
+  vfmt->frame_size = vfmt->linesize[0] * ctx->args->height;
+  return 0;
+}
+
+static int64_t ReceiveVideoFrame(BenchContext *ctx, uint8_t *buffer, size_t buffer_size, int64_t *timestamp) {
+  int64_t total_frames = ctx->args->warmup + ctx->args->frames;
+
+  if (ctx->frames_sent > ctx->args->warmup) {
+    // everything the encoder did for the previous frame is closed by now
+    MicroProfileFlip(nullptr);
+    for (int i = 0; i < kNumStages; i++) {
+      ctx->stage_samples[i].push_back(MicroProfileGetTime("Encoder", kStages[i]));
+    }
+  }
+
+  if (ctx->frames_sent == ctx->args->warmup) {
+    MicroProfileFlip(nullptr);
+    ctx->start_time = std::chrono::steady_clock::now();
+  }
+
+  if (ctx->frames_sent >= total_frames) {
+    return -1;
+  }
+
+  if (static_cast<int64_t>(buffer_size) < ctx->source->frame_size()) {
+    Log("Encoder buffer too small: %d < %d", (int) buffer_size, (int) ctx->source->frame_size());
+    exit(1);
+  }
+
+  ctx->source->CopyFrame(ctx->frames_sent, buffer);
+  *timestamp = ctx->frames_sent * 1000000 / ctx->args->fps;
+  ctx->frames_sent++;
+  return ctx->source->frame_size();
+}
+
+static int ReceiveAudioFormat(BenchContext * /* ctx */, encoder::AudioFormat *afmt) {
+  afmt->channels = kAudioChannels;
+  afmt->rate = kAudioRate;
+  afmt->format = messages::SampleFmt_S16;
+  return 0;
+}
+
+static void *ReceiveAudioFrames(BenchContext *ctx, int64_t *frames_received) {
+  // keep audio in step with the video frames handed out so far
+  int64_t frames_due = ctx->frames_sent * kAudioRate / ctx->args->fps;
+  int64_t buf_frames = static_cast<int64_t>(ctx->audio_buf.size()) / kAudioChannels;
+  int64_t offset = ctx->audio_frames_sent % buf_frames;
+
+  int64_t frames = frames_due - ctx->audio_frames_sent;
+  if (frames > buf_frames - offset) {
+    frames = buf_frames - offset;
+  }
+  if (frames < 0) {
+    frames = 0;
+  }
+
+  ctx->audio_frames_sent += frames;
+  *frames_received = frames;
+  return ctx->audio_buf.data() + offset * kAudioChannels;
+}
+
+// runs one configuration and prints its result row, called in a child process
+static void RunConfig(BenchArgs *bargs, SyntheticSource *source, messages::PixFmt format, Config &config, int out_fd) {
+  MicroProfileOnThreadCreate("Main");
+  MicroProfileSetEnableAllGroups(true);
+
+  MainArgs args;
+  memset(&args, 0, sizeof(args));
+  args.crf = -1;
+  args.fps = bargs->fps;
+  args.size_divider = 1;
+  args.pix_fmt = config.pix_fmt.c_str();
+  args.x264_preset = config.preset.c_str();
+  args.threads = config.threads;
+  args.outputs = bargs->outputs;
+
+  BenchContext ctx;
+  ctx.args = bargs;
+  ctx.source = source;
+  ctx.format = format;
+  ctx.frames_sent = 0;
+  ctx.audio_frames_sent = 0;
+
+  // one second of a 440Hz tone
+  ctx.audio_buf.resize(kAudioRate * kAudioChannels);
+  for (int i = 0; i < kAudioRate; i++) {
+    auto sample = static_cast<int16_t>(sin(2.0 * M_PI * 440.0 * i / kAudioRate) * 8000.0);
+    for (int c = 0; c < kAudioChannels; c++) {
+      ctx.audio_buf[i * kAudioChannels + c] = sample;
+    }
+  }
+
+  std::vector<encoder::OutputSettings> outputs;
+  if (bargs->outputs) {
+    encoder::ParseOutputs(bargs->outputs, outputs);
+  }
+
+  encoder::Params params;
+  memset(&params, 0, sizeof(params));
+  params.private_data = &ctx;
+  params.receive_video_format = reinterpret_cast<encoder::VideoFormatReceiver>(ReceiveVideoFormat);
+  params.receive_video_frame = reinterpret_cast<encoder::VideoFrameReceiver>(ReceiveVideoFrame);
+  if (bargs->audio) {
+    params.has_audio = true;
+    params.receive_audio_format = reinterpret_cast<encoder::AudioFormatReceiver>(ReceiveAudioFormat);
+    params.receive_audio_frames = reinterpret_cast<encoder::AudioFramesReceiver>(ReceiveAudioFrames);
+  }
+  params.num_outputs = static_cast<int>(outputs.size());
+  params.outputs = outputs.data();
+
+  encoder::Run(&args, &params);
+
+  // includes flushing delayed frames and writing the trailer
+  auto end_time = std::chrono::steady_clock::now();
+  double wall_secs = std::chrono::duration<double>(end_time - ctx.start_time).count();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(LAB_MACOS)
+  // bytes on macOS, kilobytes on Linux
+  long peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+  long peak_rss_kb = usage.ru_maxrss;
+#endif
+
+  std::ostringstream row;
+  row << config.preset << "\t" << config.threads << "\t" << config.pix_fmt
+    << "\t" << bargs->width << "x" << bargs->height
+    << "\t" << bargs->pattern << "\t" << bargs->frames
+    << "\t" << wall_secs << "\t" << (bargs->frames / wall_secs);
+  for (int i = 0; i < kNumStages; i++) {
+    row << "\t" << Percentile(ctx.stage_samples[i], 0.5)
+      << "\t" << Percentile(ctx.stage_samples[i], 0.99);
+  }
+  row << "\t" << peak_rss_kb << "\n";
+
+  auto str = row.str();
+  if (write(out_fd, str.c_str(), str.size()) != static_cast<ssize_t>(str.size())) {
+    Log("Could not report results");
+    exit(1);
+  }
+}
+
+static void PrintHeader() {
+  printf("preset\tthreads\tpix_fmt\tsize\tpattern\tframes\twall_s\tfps");
+  for (int i = 0; i < kNumStages; i++) {
+    printf("\t%s_p50_ms\t%s_p99_ms", kStages[i], kStages[i]);
+  }
+  printf("\tpeak_rss_kb\n");
+  fflush(stdout);
+}
+
+} // namespace bench
+} // namespace capsule
+
+using namespace capsule;
+using namespace capsule::bench;
+
+int main(int argc, char **argv) {
+  BenchArgs args;
+  memset(&args, 0, sizeof(args));
+  args.width = 1280;
+  args.height = 720;
+  args.fps = 60;
+  args.frames = 600;
+  args.warmup = 30;
+  args.ring = 8;
+  args.pattern = "gradient";
+  args.format = "bgra";
+  args.presets = "ultrafast";
+  args.threads = "1";
+  args.pix_fmts = "yuv420p";
+  args.dir = ".";
+
+  struct argparse_option options[] = {
+    OPT_HELP(),
+    OPT_GROUP("Input options"),
+    OPT_INTEGER('W', "width", &args.width, "frame width (default: 1280)"),
+    OPT_INTEGER('H', "height", &args.height, "frame height (default: 720)"),
+    OPT_INTEGER('r', "fps", &args.fps, "frames per second, used for timestamps (default: 60)"),
+    OPT_INTEGER('n', "frames", &args.frames, "frames measured per configuration (default: 600)"),
+    OPT_INTEGER(0, "warmup", &args.warmup, "frames encoded before measuring (default: 30)"),
+    OPT_STRING(0, "pattern", &args.pattern, "gradient, noise or text (default: gradient)"),
+    OPT_STRING(0, "format", &args.format, "input pixel format: bgra or rgba (default: bgra)"),
+    OPT_INTEGER(0, "ring", &args.ring, "number of distinct pre-generated frames (default: 8)"),
+    OPT_BOOLEAN(0, "audio", &args.audio, "also encode a synthetic stereo tone"),
+    OPT_GROUP("Sweep options (comma-separated lists)"),
+    OPT_STRING(0, "presets", &args.presets, "x264 presets (default: ultrafast)"),
+    OPT_STRING(0, "threads", &args.threads, "encoder thread counts (default: 1)"),
+    OPT_STRING(0, "pix-fmts", &args.pix_fmts, "output pixel formats (default: yuv420p)"),
+    OPT_STRING(0, "outputs", &args.outputs, "output ladder, same syntax as capsulerun --outputs"),
+    OPT_GROUP("Output options"),
+    OPT_STRING('d', "dir", &args.dir, "where encoded files are written (default: current directory)"),
+    OPT_END(),
+  };
+  struct argparse argparse;
+  argparse_init(&argparse, options, usage, 0);
+  argparse_describe(
+    &argparse,
+    // header
+    "\ncapsule-bench measures encoder throughput with synthetic frames.",
+    // footer
+    "\nResults are printed to stdout as tab-separated values, logs go to stderr."
+  );
+  argc = argparse_parse(&argparse, argc, (const char **) argv);
+
+  Pattern pattern;
+  if (!ParsePattern(args.pattern, &pattern)) {
+    Log("Unknown pattern '%s'", args.pattern);
+    exit(1);
+  }
+
+  messages::PixFmt format;
+  if (0 == strcmp(args.format, "bgra")) {
+    format = messages::PixFmt_BGRA;
+  } else if (0 == strcmp(args.format, "rgba")) {
+    format = messages::PixFmt_RGBA;
+  } else {
+    Log("Unknown input format '%s', expected bgra or rgba", args.format);
+    exit(1);
+  }
+
+  if (args.width <= 0 || args.height <= 0 || args.fps <= 0 || args.frames <= 0 || args.ring <= 0) {
+    Log("width, height, fps, frames and ring must be positive");
+    exit(1);
+  }
+
+  if (args.outputs) {
+    std::vector<encoder::OutputSettings> outputs;
+    if (!encoder::ParseOutputs(args.outputs, outputs)) {
+      Log("Invalid --outputs value '%s'", args.outputs);
+      exit(1);
+    }
+  }
+
+  if (chdir(args.dir) != 0) {
+    Log("Could not change to directory '%s'", args.dir);
+    exit(1);
+  }
+
+  std::vector<Config> configs;
+  for (auto &preset: SplitList(args.presets)) {
+    for (auto &threads: SplitList(args.threads)) {
+      for (auto &pix_fmt: SplitList(args.pix_fmts)) {
+        configs.push_back(Config{preset, atoi(threads.c_str()), pix_fmt});
+      }
+    }
+  }
+
+  Log("Generating %d %s frames at %dx%d", args.ring, args.pattern, args.width, args.height);
+  SyntheticSource source(pattern, args.width, args.height, args.ring);
+
+  PrintHeader();
+
+  int failures = 0;
+  for (auto &config: configs) {
+    Log("Running preset %s, %d threads, %s", config.preset.c_str(), config.threads, config.pix_fmt.c_str());
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+      Log("Could not create pipe");
+      exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      Log("Could not fork");
+      exit(1);
+    }
+
+    if (pid == 0) {
+      close(fds[0]);
+      RunConfig(&args, &source, format, config, fds[1]);
+      close(fds[1]);
+      _exit(0);
+    }
+
+    close(fds[1]);
+    std::string row;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+      row.append(buf, n);
+    }
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || row.empty()) {
+      Log("Configuration failed (status %d)", status);
+      failures++;
+      continue;
+    }
+
+    fputs(row.c_str(), stdout);
+    fflush(stdout);
+  }
+
+  return failures > 0 ? 1 : 0;
+}
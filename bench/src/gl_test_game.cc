@@ -0,0 +1,313 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+/**
+ * capsule-gl-test-game renders a configurable load through glXSwapBuffers
+ * and reports its own frame times, so the cost of libcapsule to a game
+ * can be measured by running it plain, injected, and while capturing.
+ *
+ * With --egl, it renders to an EGL pbuffer through eglSwapBuffers instead,
+ * on Mesa's surfaceless platform when available, so no X server is needed.
+ *
+ * Prints a single tab-separated row: label, frames, then frame time
+ * percentiles in milliseconds.
+ */
+
+#include <X11/Xlib.h>
+#include <GL/gl.h>
+#include <GL/glx.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "argparse.h"
+
+static const char *const usage[] = {
+  "capsule-gl-test-game [options]",
+  NULL
+};
+
+struct GameArgs {
+  int width;
+  int height;
+  int frames;
+  int warmup;
+  int load;
+  int header;
+  int egl;
+  const char *label;
+};
+
+static double Percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+// each unit of load is one blended full-window pass of small quads,
+// which keeps a software rasterizer like llvmpipe busy on fill rate.
+static void DrawScene(int frame, int load) {
+  glClearColor(0.1f, 0.1f, 0.15f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  const int grid = 16;
+  const float cell = 2.0f / grid;
+  float phase = static_cast<float>(frame % 120) / 120.0f;
+
+  for (int pass = 0; pass < load; pass++) {
+    glBegin(GL_QUADS);
+    for (int y = 0; y < grid; y++) {
+      for (int x = 0; x < grid; x++) {
+        float r = static_cast<float>(x) / grid;
+        float g = static_cast<float>(y) / grid;
+        float b = phase + static_cast<float>(pass) / (load + 1);
+        glColor4f(r, g, b - static_cast<int>(b), 0.5f);
+
+        float x0 = -1.0f + x * cell;
+        float y0 = -1.0f + y * cell;
+        float wobble = cell * 0.25f * phase;
+        glVertex2f(x0 + wobble, y0);
+        glVertex2f(x0 + cell, y0 + wobble);
+        glVertex2f(x0 + cell - wobble, y0 + cell);
+        glVertex2f(x0, y0 + cell - wobble);
+      }
+    }
+    glEnd();
+  }
+}
+
+// renders warmup + measured frames, swap presents each one
+template <typename Swap>
+static void RunFrames(const GameArgs &args, std::vector<double> &frame_times, Swap swap) {
+  fprintf(stderr, "capsule-gl-test-game: %dx%d, load %d, renderer %s\n",
+    args.width, args.height, args.load, glGetString(GL_RENDERER));
+
+  frame_times.reserve(args.frames);
+
+  int total_frames = args.warmup + args.frames;
+  auto last = std::chrono::steady_clock::now();
+
+  for (int frame = 0; frame < total_frames; frame++) {
+    DrawScene(frame, args.load);
+    swap();
+
+    auto now = std::chrono::steady_clock::now();
+    if (frame >= args.warmup) {
+      frame_times.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+    }
+    last = now;
+  }
+}
+
+static void Report(const GameArgs &args, std::vector<double> &frame_times) {
+  double total_ms = 0.0;
+  for (double t: frame_times) {
+    total_ms += t;
+  }
+  std::sort(frame_times.begin(), frame_times.end());
+
+  if (args.header) {
+    printf("mode\tframes\tfps\tp50_ms\tp90_ms\tp99_ms\tmax_ms\n");
+  }
+  printf("%s\t%d\t%.2f\t%.3f\t%.3f\t%.3f\t%.3f\n",
+    args.label,
+    static_cast<int>(frame_times.size()),
+    frame_times.size() * 1000.0 / total_ms,
+    Percentile(frame_times, 0.50),
+    Percentile(frame_times, 0.90),
+    Percentile(frame_times, 0.99),
+    frame_times.back());
+  fflush(stdout);
+}
+
+// a desktop GL context on a pbuffer, so DrawScene works unchanged
+static int RunEgl(const GameArgs &args) {
+  EGLDisplay dpy = EGL_NO_DISPLAY;
+  auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+    eglGetProcAddress("eglGetPlatformDisplayEXT"));
+  if (get_platform_display) {
+    dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (dpy == EGL_NO_DISPLAY) {
+    dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, NULL, NULL)) {
+    fprintf(stderr, "Could not initialize EGL\n");
+    return 1;
+  }
+
+  EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint num_configs = 0;
+  if (!eglChooseConfig(dpy, config_attribs, &config, 1, &num_configs) || num_configs < 1) {
+    fprintf(stderr, "No suitable EGL config\n");
+    return 1;
+  }
+
+  EGLint surface_attribs[] = {
+    EGL_WIDTH, args.width,
+    EGL_HEIGHT, args.height,
+    EGL_NONE
+  };
+  EGLSurface surface = eglCreatePbufferSurface(dpy, config, surface_attribs);
+  eglBindAPI(EGL_OPENGL_API);
+  EGLContext ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, NULL);
+  if (surface == EGL_NO_SURFACE || ctx == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(dpy, surface, surface, ctx)) {
+    fprintf(stderr, "Could not create EGL pbuffer context\n");
+    return 1;
+  }
+  glViewport(0, 0, args.width, args.height);
+
+  std::vector<double> frame_times;
+  RunFrames(args, frame_times, [&]() {
+    eglSwapBuffers(dpy, surface);
+  });
+
+  eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(dpy, ctx);
+  eglDestroySurface(dpy, surface);
+  eglTerminate(dpy);
+
+  Report(args, frame_times);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  GameArgs args;
+  memset(&args, 0, sizeof(args));
+  args.width = 1280;
+  args.height = 720;
+  args.frames = 600;
+  args.warmup = 60;
+  args.load = 4;
+  args.label = "game";
+
+  struct argparse_option options[] = {
+    OPT_HELP(),
+    OPT_INTEGER('W', "width", &args.width, "window width (default: 1280)"),
+    OPT_INTEGER('H', "height", &args.height, "window height (default: 720)"),
+    OPT_INTEGER('n', "frames", &args.frames, "frames measured (default: 600)"),
+    OPT_INTEGER(0, "warmup", &args.warmup, "frames rendered before measuring (default: 60)"),
+    OPT_INTEGER('l', "load", &args.load, "blended full-window passes per frame (default: 4)"),
+    OPT_STRING(0, "label", &args.label, "first column of the result row (default: game)"),
+    OPT_BOOLEAN(0, "header", &args.header, "print a header row first"),
+    OPT_BOOLEAN(0, "egl", &args.egl, "render to an EGL pbuffer instead of a GLX window"),
+    OPT_END(),
+  };
+  struct argparse argparse;
+  argparse_init(&argparse, options, usage, 0);
+  argparse_describe(
+    &argparse,
+    "\ncapsule-gl-test-game renders a synthetic load and reports its frame times.",
+    "\nRun it with and without capsulerun to measure what capture costs a game."
+  );
+  argc = argparse_parse(&argparse, argc, (const char **) argv);
+
+  if (args.width <= 0 || args.height <= 0 || args.frames <= 0 || args.load < 0) {
+    fprintf(stderr, "width, height and frames must be positive\n");
+    return 1;
+  }
+
+  if (args.egl) {
+    return RunEgl(args);
+  }
+
+  Display *dpy = XOpenDisplay(NULL);
+  if (!dpy) {
+    fprintf(stderr, "Could not open X display\n");
+    return 1;
+  }
+
+  int attribs[] = {
+    GLX_RGBA,
+    GLX_DOUBLEBUFFER,
+    GLX_RED_SIZE, 8,
+    GLX_GREEN_SIZE, 8,
+    GLX_BLUE_SIZE, 8,
+    None
+  };
+  XVisualInfo *vi = glXChooseVisual(dpy, DefaultScreen(dpy), attribs);
+  if (!vi) {
+    fprintf(stderr, "No suitable GLX visual\n");
+    return 1;
+  }
+
+  Window root = RootWindow(dpy, vi->screen);
+  XSetWindowAttributes swa;
+  memset(&swa, 0, sizeof(swa));
+  swa.colormap = XCreateColormap(dpy, root, vi->visual, AllocNone);
+  swa.event_mask = StructureNotifyMask;
+
+  Window win = XCreateWindow(dpy, root, 0, 0, args.width, args.height, 0,
+    vi->depth, InputOutput, vi->visual, CWColormap | CWEventMask, &swa);
+  XStoreName(dpy, win, "capsule-gl-test-game");
+  XMapWindow(dpy, win);
+
+  // wait until the window is actually mapped
+  XEvent ev;
+  do {
+    XNextEvent(dpy, &ev);
+  } while (ev.type != MapNotify);
+
+  GLXContext ctx = glXCreateContext(dpy, vi, NULL, True);
+  if (!ctx) {
+    fprintf(stderr, "Could not create GLX context\n");
+    return 1;
+  }
+  glXMakeCurrent(dpy, win, ctx);
+  glViewport(0, 0, args.width, args.height);
+
+  std::vector<double> frame_times;
+  RunFrames(args, frame_times, [&]() {
+    glXSwapBuffers(dpy, win);
+    while (XPending(dpy)) {
+      XNextEvent(dpy, &ev);
+    }
+  });
+
+  glXMakeCurrent(dpy, None, NULL);
+  glXDestroyContext(dpy, ctx);
+  XDestroyWindow(dpy, win);
+  XCloseDisplay(dpy);
+
+  Report(args, frame_times);
+  return 0;
+}
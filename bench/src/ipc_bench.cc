@@ -0,0 +1,537 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+/**
+ * capsule-ipc-bench measures the primitives every captured frame goes
+ * through: lab::packet framing over the FIFO Connection pair, the shm
+ * control ring that replaces it for frame commits, shoom::Shm mapping,
+ * and LockingQueue / MpscQueue hand-off between threads.
+ *
+ * Prints one tab-separated row per measurement to stdout:
+ * case, parameter, operations, operations per second, p50 and p99
+ * latency in microseconds ("-" when latency isn't measured per operation).
+ */
+
+#include <lab/packet.h>
+#include <lab/paths.h>
+#include <capsule/messages_generated.h>
+#include <capsule/frame_ring.h>
+#include <shoom.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "argparse.h"
+#include "connection.h"
+#include "locking_queue.h"
+#include "mpsc_queue.h"
+#include "logging.h"
+#include "memory.h"
+
+static const char *const usage[] = {
+  "capsule-ipc-bench [options]",
+  NULL
+};
+
+namespace capsule {
+namespace bench {
+
+typedef std::chrono::steady_clock Clock;
+
+struct IpcArgs {
+  int roundtrips;
+  int burst;
+  int shm_mb;
+  int queue_items;
+  int max_producers;
+  const char *only;
+};
+
+static double Micros(Clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+static double Percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+static void PrintRow(const char *name, const std::string &param, int64_t ops, double secs, std::vector<double> *latencies) {
+  printf("%s\t%s\t%" PRId64 "\t%.0f", name, param.c_str(), ops, ops / secs);
+  if (latencies) {
+    std::sort(latencies->begin(), latencies->end());
+    printf("\t%.2f\t%.2f\n", Percentile(*latencies, 0.5), Percentile(*latencies, 0.99));
+  } else {
+    printf("\t-\t-\n");
+  }
+  fflush(stdout);
+}
+
+/**
+ * FIFO transport: capsulerun's Connection on one side, the same framing
+ * libcapsule uses on the other, both in this process.
+ */
+
+struct FifoClient {
+  int fd_w = -1;
+  int fd_r = -1;
+};
+
+// mirrors what libcapsule does: write to .runread, read from .runwrite
+static void ConnectClient(const std::string &pipe_name, FifoClient *client) {
+  auto w_path = lab::paths::PipePath(pipe_name + ".runread");
+  auto r_path = lab::paths::PipePath(pipe_name + ".runwrite");
+  client->fd_w = open(w_path.c_str(), O_WRONLY);
+  client->fd_r = open(r_path.c_str(), O_RDONLY);
+  if (client->fd_w < 0 || client->fd_r < 0) {
+    Log("Could not open client side of %s", pipe_name.c_str());
+    exit(1);
+  }
+}
+
+static std::string UniquePipeName(const char *purpose) {
+  std::ostringstream oss;
+  oss << "capsule-bench-" << purpose << "-" << getpid();
+  return oss.str();
+}
+
+static void BenchFifoRoundTrip(IpcArgs *args) {
+  auto pipe_name = UniquePipeName("rtt");
+  Connection server(pipe_name);
+  FifoClient client;
+
+  std::thread client_thread(ConnectClient, pipe_name, &client);
+  server.Connect();
+  client_thread.join();
+
+  // server: answer every VideoFrameCommitted with a VideoFrameProcessed,
+  // like VideoReceiver does
+  std::thread server_thread([&server, args]() {
+    for (int i = 0; i < args->roundtrips; i++) {
+      char *buf = server.Read();
+      if (!buf) {
+        break;
+      }
+      auto pkt = messages::GetPacket(buf);
+      auto vfc = pkt->message_as_VideoFrameCommitted();
+
+      flatbuffers::FlatBufferBuilder builder(1024);
+      auto vfp = messages::CreateVideoFrameProcessed(builder, vfc->index());
+      auto opkt = messages::CreatePacket(builder, messages::Message_VideoFrameProcessed, vfp.Union());
+      builder.Finish(opkt);
+      server.Write(builder);
+      server.Release(buf);
+    }
+  });
+
+  std::vector<double> latencies;
+  latencies.reserve(args->roundtrips);
+
+  auto start = Clock::now();
+  for (int i = 0; i < args->roundtrips; i++) {
+    auto before = Clock::now();
+
+    flatbuffers::FlatBufferBuilder builder(1024);
+    auto vfc = messages::CreateVideoFrameCommitted(builder, i, i % 3);
+    auto pkt = messages::CreatePacket(builder, messages::Message_VideoFrameCommitted, vfc.Union());
+    builder.Finish(pkt);
+    lab::packet::Write(builder, client.fd_w);
+
+    char *reply = lab::packet::Read(client.fd_r);
+    if (!reply) {
+      Log("Server hung up");
+      exit(1);
+    }
+    delete[] reply;
+
+    latencies.push_back(Micros(Clock::now() - before));
+  }
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+  server_thread.join();
+  close(client.fd_w);
+  close(client.fd_r);
+  server.Close();
+
+  PrintRow("fifo_roundtrip", "VideoFrameCommitted", args->roundtrips, secs, &latencies);
+}
+
+#if defined(LAB_LINUX)
+
+static void BenchRingRoundTrip(IpcArgs *args) {
+  auto header = new ring::FrameRingHeader();
+  ring::InitHeader(header);
+
+  // server: answer every commit with a release, like VideoReceiver does,
+  // except the release rings a doorbell too so the client can block on it
+  std::thread server_thread([header, args]() {
+    ring::FrameDescriptor desc;
+    for (int i = 0; i < args->roundtrips; i++) {
+      while (!ring::Pop(&header->commit, &desc)) {
+        ring::Wait(&header->commit, 100);
+      }
+      ring::Push(&header->release, desc);
+      ring::Ring(&header->release);
+    }
+  });
+
+  std::vector<double> latencies;
+  latencies.reserve(args->roundtrips);
+
+  auto start = Clock::now();
+  for (int i = 0; i < args->roundtrips; i++) {
+    auto before = Clock::now();
+
+    ring::FrameDescriptor desc = {};
+    desc.timestamp = i;
+    desc.index = static_cast<uint32_t>(i % 3);
+    ring::Push(&header->commit, desc);
+    ring::Ring(&header->commit);
+
+    while (!ring::Pop(&header->release, &desc)) {
+      ring::Wait(&header->release, 100);
+    }
+
+    latencies.push_back(Micros(Clock::now() - before));
+  }
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+  server_thread.join();
+  delete header;
+
+  PrintRow("ring_roundtrip", "FrameDescriptor", args->roundtrips, secs, &latencies);
+}
+
+#endif // LAB_LINUX
+
+static void BenchAudioBurst(IpcArgs *args) {
+  auto pipe_name = UniquePipeName("burst");
+  Connection server(pipe_name);
+  FifoClient client;
+
+  std::thread client_thread(ConnectClient, pipe_name, &client);
+  server.Connect();
+  client_thread.join();
+
+  std::atomic<int64_t> frames_seen(0);
+  std::thread server_thread([&server, &frames_seen, args]() {
+    for (int i = 0; i < args->burst; i++) {
+      char *buf = server.Read();
+      if (!buf) {
+        break;
+      }
+      auto afc = messages::GetPacket(buf)->message_as_AudioFramesCommitted();
+      frames_seen += afc->frames();
+      server.Release(buf);
+    }
+  });
+
+  // libcapsule's ALSA hooks send one message per small period
+  const int64_t frames_per_message = 64;
+
+  auto start = Clock::now();
+  for (int i = 0; i < args->burst; i++) {
+    flatbuffers::FlatBufferBuilder builder(1024);
+    auto afc = messages::CreateAudioFramesCommitted(builder, i * frames_per_message, frames_per_message);
+    auto pkt = messages::CreatePacket(builder, messages::Message_AudioFramesCommitted, afc.Union());
+    builder.Finish(pkt);
+    lab::packet::Write(builder, client.fd_w);
+  }
+  server_thread.join();
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+  if (frames_seen != args->burst * frames_per_message) {
+    Log("Audio burst: expected %" PRId64 " frames, got %" PRId64,
+      args->burst * frames_per_message, (int64_t) frames_seen);
+  }
+
+  close(client.fd_w);
+  close(client.fd_r);
+  server.Close();
+
+  PrintRow("audio_burst", "AudioFramesCommitted", args->burst, secs, nullptr);
+}
+
+/**
+ * shm: cost of creating/opening a segment, and of faulting its pages in.
+ */
+
+struct ShmVariant {
+  const char *name;
+  int map_flags;
+};
+
+static void BenchShmVariant(IpcArgs *args, const ShmVariant &variant) {
+  size_t size = static_cast<size_t>(args->shm_mb) * 1024 * 1024;
+  size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  int64_t num_pages = static_cast<int64_t>(size / page_size);
+  std::ostringstream param;
+  param << args->shm_mb << "MB/" << variant.name;
+
+  std::ostringstream path;
+  path << "capsule-bench-shm-" << getpid();
+
+  // create/open include prefaulting when it's asked for
+  auto start = Clock::now();
+  shoom::Shm writer(path.str(), size);
+  writer.SetMapFlags(variant.map_flags);
+  if (writer.Create() != shoom::kOK) {
+    Log("Could not create shm");
+    exit(1);
+  }
+  PrintRow("shm_create", param.str(), 1, std::chrono::duration<double>(Clock::now() - start).count(), nullptr);
+  if ((variant.map_flags & shoom::kMapHugePages) && !writer.HugePages()) {
+    Log("shm: huge pages were not granted, see /sys/kernel/mm/transparent_hugepage/shmem_enabled");
+  }
+
+  start = Clock::now();
+  shoom::Shm reader(path.str(), size);
+  reader.SetMapFlags(variant.map_flags);
+  if (reader.Open() != shoom::kOK) {
+    Log("Could not open shm");
+    exit(1);
+  }
+  PrintRow("shm_open", param.str(), 1, std::chrono::duration<double>(Clock::now() - start).count(), nullptr);
+
+  // writer side, like libcapsule copying its first frames in
+  for (int pass = 0; pass < 2; pass++) {
+    start = Clock::now();
+    memset(writer.Data(), pass + 1, size);
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    PrintRow(pass == 0 ? "shm_write_first_touch" : "shm_write_warm", param.str(), num_pages, secs, nullptr);
+  }
+
+  // reader side, like VideoReceiver copying frames out
+  std::vector<uint8_t> dst(size);
+  memset(dst.data(), 0, size);
+  for (int pass = 0; pass < 2; pass++) {
+    start = Clock::now();
+    memcpy(dst.data(), reader.Data(), size);
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    PrintRow(pass == 0 ? "shm_read_first_touch" : "shm_read_warm", param.str(), num_pages, secs, nullptr);
+  }
+}
+
+// VideoReceiver's own frame buffer: calloc vs memory::Allocate
+static void BenchFrameBuffer(IpcArgs *args, bool prefault) {
+  size_t size = static_cast<size_t>(args->shm_mb) * 1024 * 1024;
+  size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  int64_t num_pages = static_cast<int64_t>(size / page_size);
+  std::ostringstream param;
+  param << args->shm_mb << "MB/" << (prefault ? "allocate" : "calloc");
+
+  auto start = Clock::now();
+  void *buffer = prefault ? capsule::memory::Allocate(size) : calloc(1, size);
+  PrintRow("buffer_alloc", param.str(), 1, std::chrono::duration<double>(Clock::now() - start).count(), nullptr);
+
+  for (int pass = 0; pass < 2; pass++) {
+    start = Clock::now();
+    memset(buffer, pass + 1, size);
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+    PrintRow(pass == 0 ? "buffer_write_first_touch" : "buffer_write_warm", param.str(), num_pages, secs, nullptr);
+  }
+
+  if (prefault) {
+    capsule::memory::Free(buffer);
+  } else {
+    free(buffer);
+  }
+}
+
+static void BenchShm(IpcArgs *args) {
+  const ShmVariant variants[] = {
+    {"plain", shoom::kMapDefault},
+    {"populate", shoom::kMapPopulate},
+    {"huge", shoom::kMapPopulate | shoom::kMapHugePages},
+  };
+  for (const auto &variant : variants) {
+    BenchShmVariant(args, variant);
+  }
+
+  capsule::memory::Configure(true, 0);
+  BenchFrameBuffer(args, false);
+  BenchFrameBuffer(args, true);
+}
+
+/**
+ * LockingQueue vs MpscQueue: N producers (connection threads) and one
+ * consumer (main loop), which pops one at a time or in batches.
+ */
+
+struct QueueItem {
+  Clock::time_point pushed;
+  int producer;
+};
+
+static const size_t kQueueBatch = 64;
+
+static void PopOne(LockingQueue<QueueItem> &queue, QueueItem *items, size_t *count) {
+  queue.WaitAndPop(items[0]);
+  *count = 1;
+}
+
+template <size_t Capacity>
+static void PopOne(MpscQueue<QueueItem, Capacity> &queue, QueueItem *items, size_t *count) {
+  queue.WaitAndPop(items[0]);
+  *count = 1;
+}
+
+template <size_t Capacity>
+static void PopBatch(MpscQueue<QueueItem, Capacity> &queue, QueueItem *items, size_t *count) {
+  *count = queue.TryWaitAndPopBatch(items, kQueueBatch, -1);
+}
+
+template <typename Queue, typename Pop>
+static void BenchQueueImpl(IpcArgs *args, const char *name, Pop pop) {
+  for (int producers = 1; producers <= args->max_producers; producers *= 2) {
+    std::unique_ptr<Queue> queue(new Queue());
+    int per_producer = args->queue_items / producers;
+    int total = per_producer * producers;
+
+    std::vector<double> latencies;
+    latencies.reserve(total);
+
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (int p = 0; p < producers; p++) {
+      Queue *q = queue.get();
+      threads.push_back(std::thread([q, per_producer, p]() {
+        for (int i = 0; i < per_producer; i++) {
+          q->Push(QueueItem{Clock::now(), p});
+        }
+      }));
+    }
+
+    QueueItem items[kQueueBatch];
+    int received = 0;
+    while (received < total) {
+      size_t count = 0;
+      pop(*queue, items, &count);
+      auto now = Clock::now();
+      for (size_t i = 0; i < count; i++) {
+        latencies.push_back(Micros(now - items[i].pushed));
+      }
+      received += static_cast<int>(count);
+    }
+    double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+    for (auto &t: threads) {
+      t.join();
+    }
+
+    std::ostringstream param;
+    param << producers << "_producers";
+    PrintRow(name, param.str(), total, secs, &latencies);
+  }
+}
+
+static void BenchQueue(IpcArgs *args) {
+  // same capacity as the main loop's
+  typedef MpscQueue<QueueItem, 4096> Mpsc;
+
+  BenchQueueImpl<LockingQueue<QueueItem>>(args, "locking_queue",
+    static_cast<void (*)(LockingQueue<QueueItem> &, QueueItem *, size_t *)>(PopOne));
+  BenchQueueImpl<Mpsc>(args, "mpsc_queue",
+    static_cast<void (*)(Mpsc &, QueueItem *, size_t *)>(PopOne<4096>));
+  BenchQueueImpl<Mpsc>(args, "mpsc_queue_batch",
+    static_cast<void (*)(Mpsc &, QueueItem *, size_t *)>(PopBatch<4096>));
+}
+
+static bool ShouldRun(IpcArgs *args, const char *name) {
+  return !args->only || strstr(args->only, name) != nullptr;
+}
+
+} // namespace bench
+} // namespace capsule
+
+using namespace capsule;
+using namespace capsule::bench;
+
+int main(int argc, char **argv) {
+  IpcArgs args;
+  memset(&args, 0, sizeof(args));
+  args.roundtrips = 10000;
+  args.burst = 100000;
+  args.shm_mb = 64;
+  args.queue_items = 1000000;
+  args.max_producers = 8;
+
+  struct argparse_option options[] = {
+    OPT_HELP(),
+    OPT_INTEGER(0, "roundtrips", &args.roundtrips, "FIFO and control ring round-trips (default: 10000)"),
+    OPT_INTEGER(0, "burst", &args.burst, "AudioFramesCommitted messages in a burst (default: 100000)"),
+    OPT_INTEGER(0, "shm-mb", &args.shm_mb, "shm segment size in megabytes (default: 64)"),
+    OPT_INTEGER(0, "queue-items", &args.queue_items, "items pushed through the queue per run (default: 1000000)"),
+    OPT_INTEGER(0, "max-producers", &args.max_producers, "queue producers go 1, 2, 4... up to this (default: 8)"),
+    OPT_STRING(0, "only", &args.only, "comma-separated subset of fifo,ring,burst,shm,queue"),
+    OPT_END(),
+  };
+  struct argparse argparse;
+  argparse_init(&argparse, options, usage, 0);
+  argparse_describe(
+    &argparse,
+    "\ncapsule-ipc-bench measures the IPC, shm and queue primitives used for every frame.",
+    "\nResults are printed to stdout as tab-separated values, logs go to stderr."
+  );
+  argc = argparse_parse(&argparse, argc, (const char **) argv);
+
+  if (args.roundtrips <= 0 || args.burst <= 0 || args.shm_mb <= 0 || args.queue_items <= 0 || args.max_producers <= 0) {
+    Log("All counts must be positive");
+    exit(1);
+  }
+
+  printf("case\tparam\tops\tops_per_s\tp50_us\tp99_us\n");
+
+  if (ShouldRun(&args, "fifo")) {
+    BenchFifoRoundTrip(&args);
+  }
+#if defined(LAB_LINUX)
+  if (ShouldRun(&args, "ring")) {
+    BenchRingRoundTrip(&args);
+  }
+#endif // LAB_LINUX
+  if (ShouldRun(&args, "burst")) {
+    BenchAudioBurst(&args);
+  }
+  if (ShouldRun(&args, "shm")) {
+    BenchShm(&args);
+  }
+  if (ShouldRun(&args, "queue")) {
+    BenchQueue(&args);
+  }
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "synthetic_source.h"
+
+#include <string.h>
+
+namespace capsule {
+namespace bench {
+
+static const char *kPatternNames[] = {
+  "gradient",
+  "noise",
+  "text",
+};
+
+bool ParsePattern(const char *name, Pattern *pattern) {
+  for (int i = 0; i <= kPatternText; i++) {
+    if (0 == strcmp(name, kPatternNames[i])) {
+      *pattern = static_cast<Pattern>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *PatternName(Pattern pattern) {
+  return kPatternNames[pattern];
+}
+
+static inline uint32_t XorShift(uint32_t &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+SyntheticSource::SyntheticSource(Pattern pattern, int width, int height, int ring_size) :
+  pattern_(pattern),
+  width_(width),
+  height_(height) {
+  frame_size_ = static_cast<int64_t>(width) * height * 4;
+
+  ring_.resize(ring_size);
+  for (int i = 0; i < ring_size; i++) {
+    ring_[i].resize(frame_size_);
+    auto frame = ring_[i].data();
+
+    switch (pattern_) {
+      case kPatternGradient:
+        DrawGradient(i, frame);
+        break;
+      case kPatternNoise:
+        DrawNoise(i, frame);
+        break;
+      case kPatternText:
+        DrawText(i, frame);
+        break;
+    }
+  }
+}
+
+void SyntheticSource::CopyFrame(int64_t index, uint8_t *buffer) {
+  auto &frame = ring_[index % ring_.size()];
+  memcpy(buffer, frame.data(), frame_size_);
+}
+
+void SyntheticSource::DrawGradient(int index, uint8_t *frame) {
+  for (int y = 0; y < height_; y++) {
+    uint8_t *p = frame + static_cast<int64_t>(y) * width_ * 4;
+    for (int x = 0; x < width_; x++) {
+      p[0] = static_cast<uint8_t>((x + index * 4) * 255 / width_);
+      p[1] = static_cast<uint8_t>(y * 255 / height_);
+      p[2] = static_cast<uint8_t>(index * 8);
+      p[3] = 255;
+      p += 4;
+    }
+  }
+}
+
+void SyntheticSource::DrawNoise(int index, uint8_t *frame) {
+  uint32_t state = 0x9e3779b9 ^ static_cast<uint32_t>(index + 1);
+  uint32_t *p = reinterpret_cast<uint32_t *>(frame);
+  int64_t num_pixels = static_cast<int64_t>(width_) * height_;
+  for (int64_t i = 0; i < num_pixels; i++) {
+    p[i] = XorShift(state) | 0xff000000;
+  }
+}
+
+void SyntheticSource::DrawText(int index, uint8_t *frame) {
+  const int line_height = 16;
+  const int glyph_height = 10;
+  const int glyph_width = 8;
+  const int scroll_speed = 2;
+
+  // light background
+  memset(frame, 0xee, frame_size_);
+
+  int scroll = index * scroll_speed;
+  for (int y = 0; y < height_; y++) {
+    int virtual_y = y + scroll;
+    int line = virtual_y / line_height;
+    int line_y = virtual_y % line_height;
+    if (line_y >= glyph_height) {
+      continue;
+    }
+
+    // glyph shapes only depend on the line they're on, so they scroll
+    uint32_t state = 0x2545f491 ^ static_cast<uint32_t>(line * 7919 + 1);
+    int line_length = static_cast<int>(XorShift(state) % static_cast<uint32_t>(width_ / glyph_width));
+
+    uint8_t *p = frame + static_cast<int64_t>(y) * width_ * 4;
+    for (int glyph = 0; glyph < line_length; glyph++) {
+      uint32_t bits = XorShift(state);
+      // spaces between words
+      if ((bits & 0x7) == 0) {
+        continue;
+      }
+
+      int row_bits = (bits >> (line_y % 3 * 8)) & 0xff;
+      for (int gx = 0; gx < glyph_width - 1; gx++) {
+        if (row_bits & (1 << gx)) {
+          uint8_t *px = p + (glyph * glyph_width + gx) * 4;
+          px[0] = 0x20;
+          px[1] = 0x20;
+          px[2] = 0x20;
+          px[3] = 0xff;
+        }
+      }
+    }
+  }
+}
+
+} // namespace bench
+} // namespace capsule
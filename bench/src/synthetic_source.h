@@ -0,0 +1,71 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+namespace capsule {
+namespace bench {
+
+enum Pattern {
+  // slowly shifting colour gradient: cheap to encode
+  kPatternGradient = 0,
+  // per-pixel noise: worst case for the encoder
+  kPatternNoise,
+  // lines of glyph-like blocks scrolling upwards, like a terminal or a chat log
+  kPatternText,
+};
+
+// returns false if name is unknown
+bool ParsePattern(const char *name, Pattern *pattern);
+const char *PatternName(Pattern pattern);
+
+/**
+ * Generates BGRA/RGBA frames ahead of time so that producing a frame
+ * during the benchmark is a single memcpy, like receiving one from shm.
+ */
+class SyntheticSource {
+  public:
+    SyntheticSource(Pattern pattern, int width, int height, int ring_size);
+
+    // fills buffer with frame number `index`
+    void CopyFrame(int64_t index, uint8_t *buffer);
+
+    int64_t frame_size() { return frame_size_; }
+
+  private:
+    void DrawGradient(int index, uint8_t *frame);
+    void DrawNoise(int index, uint8_t *frame);
+    void DrawText(int index, uint8_t *frame);
+
+    Pattern pattern_;
+    int width_;
+    int height_;
+    int64_t frame_size_;
+    std::vector<std::vector<uint8_t>> ring_;
+};
+
+} // namespace bench
+} // namespace capsule
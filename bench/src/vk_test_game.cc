@@ -0,0 +1,474 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+/**
+ * capsule-vk-test-game is capsule-gl-test-game for Vulkan: it renders a
+ * configurable load to a headless swapchain (VK_EXT_headless_surface, no
+ * window system needed, so it runs on Mesa's lavapipe anywhere) and
+ * reports its own frame times.
+ *
+ * Prints a single tab-separated row: label, frames, then frame time
+ * percentiles in milliseconds.
+ */
+
+#include <vulkan/vulkan.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "argparse.h"
+
+static const char *const usage[] = {
+  "capsule-vk-test-game [options]",
+  NULL
+};
+
+// frames the CPU may record ahead of the GPU
+static const int kFramesInFlight = 2;
+
+struct GameArgs {
+  int width;
+  int height;
+  int frames;
+  int warmup;
+  int load;
+  int header;
+  const char *label;
+};
+
+static double Percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+#define VKCHECK(call) do { \
+  VkResult res_ = (call); \
+  if (res_ != VK_SUCCESS) { \
+    fprintf(stderr, "%s failed: %d\n", #call, res_); \
+    exit(1); \
+  } \
+} while (false)
+
+static uint32_t FindMemoryType(VkPhysicalDevice gpu, uint32_t type_bits, VkMemoryPropertyFlags flags) {
+  VkPhysicalDeviceMemoryProperties props;
+  vkGetPhysicalDeviceMemoryProperties(gpu, &props);
+  for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+    if ((type_bits & (1u << i)) && (props.memoryTypes[i].propertyFlags & flags) == flags) {
+      return i;
+    }
+  }
+  fprintf(stderr, "No suitable memory type\n");
+  exit(1);
+}
+
+static void Barrier(VkCommandBuffer cmd, VkImage image, VkImageLayout from, VkImageLayout to,
+                    VkAccessFlags src_access, VkAccessFlags dst_access,
+                    VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage) {
+  VkImageMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  barrier.srcAccessMask = src_access;
+  barrier.dstAccessMask = dst_access;
+  barrier.oldLayout = from;
+  barrier.newLayout = to;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.image = image;
+  barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  barrier.subresourceRange.levelCount = 1;
+  barrier.subresourceRange.layerCount = 1;
+  vkCmdPipelineBarrier(cmd, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+// each unit of load is one full-window linear blit from a half-size
+// image, which keeps a software rasterizer like lavapipe busy on fill rate.
+static void DrawScene(VkCommandBuffer cmd, VkImage source, VkImage target,
+                      const GameArgs &args, int frame) {
+  float phase = static_cast<float>(frame % 120) / 120.0f;
+
+  Barrier(cmd, source, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+  VkClearColorValue color = {{0.1f + phase * 0.5f, 0.1f, 0.15f, 1.0f}};
+  VkImageSubresourceRange range = {};
+  range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  range.levelCount = 1;
+  range.layerCount = 1;
+  vkCmdClearColorImage(cmd, source, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+  Barrier(cmd, source, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+    VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+  Barrier(cmd, target, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+    0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+  vkCmdClearColorImage(cmd, target, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+
+  for (int pass = 0; pass < args.load; pass++) {
+    int wobble = static_cast<int>(args.width / 16 * phase) + pass;
+
+    VkImageBlit blit = {};
+    blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    blit.srcSubresource.layerCount = 1;
+    blit.srcOffsets[1].x = args.width / 2;
+    blit.srcOffsets[1].y = args.height / 2;
+    blit.srcOffsets[1].z = 1;
+    blit.dstSubresource = blit.srcSubresource;
+    blit.dstOffsets[0].x = wobble % args.width;
+    blit.dstOffsets[1].x = args.width;
+    blit.dstOffsets[1].y = args.height;
+    blit.dstOffsets[1].z = 1;
+
+    Barrier(cmd, target, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+    vkCmdBlitImage(cmd, source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      target, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+  }
+
+  Barrier(cmd, target, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+    VK_ACCESS_TRANSFER_WRITE_BIT, 0,
+    VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+}
+
+int main(int argc, char **argv) {
+  GameArgs args;
+  memset(&args, 0, sizeof(args));
+  args.width = 1280;
+  args.height = 720;
+  args.frames = 600;
+  args.warmup = 60;
+  args.load = 4;
+  args.label = "game";
+
+  struct argparse_option options[] = {
+    OPT_HELP(),
+    OPT_INTEGER('W', "width", &args.width, "swapchain width (default: 1280)"),
+    OPT_INTEGER('H', "height", &args.height, "swapchain height (default: 720)"),
+    OPT_INTEGER('n', "frames", &args.frames, "frames measured (default: 600)"),
+    OPT_INTEGER(0, "warmup", &args.warmup, "frames rendered before measuring (default: 60)"),
+    OPT_INTEGER('l', "load", &args.load, "full-window blits per frame (default: 4)"),
+    OPT_STRING(0, "label", &args.label, "first column of the result row (default: game)"),
+    OPT_BOOLEAN(0, "header", &args.header, "print a header row first"),
+    OPT_END(),
+  };
+  struct argparse argparse;
+  argparse_init(&argparse, options, usage, 0);
+  argparse_describe(
+    &argparse,
+    "\ncapsule-vk-test-game renders a synthetic load and reports its frame times.",
+    "\nRun it with and without capsulerun to measure what capture costs a game."
+  );
+  argc = argparse_parse(&argparse, argc, (const char **) argv);
+
+  if (args.width < 2 || args.height < 2 || args.frames <= 0 || args.load < 0) {
+    fprintf(stderr, "width, height and frames must be positive\n");
+    return 1;
+  }
+
+  // instance, with a surface that needs no window system
+  const char *instance_extensions[] = {
+    VK_KHR_SURFACE_EXTENSION_NAME,
+    VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME,
+  };
+  VkApplicationInfo app_info = {};
+  app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  app_info.pApplicationName = "capsule-vk-test-game";
+  app_info.apiVersion = VK_API_VERSION_1_0;
+  VkInstanceCreateInfo instance_info = {};
+  instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  instance_info.pApplicationInfo = &app_info;
+  instance_info.enabledExtensionCount = 2;
+  instance_info.ppEnabledExtensionNames = instance_extensions;
+  VkInstance instance;
+  VKCHECK(vkCreateInstance(&instance_info, nullptr, &instance));
+
+  auto create_headless_surface = reinterpret_cast<PFN_vkCreateHeadlessSurfaceEXT>(
+    vkGetInstanceProcAddr(instance, "vkCreateHeadlessSurfaceEXT"));
+  if (!create_headless_surface) {
+    fprintf(stderr, "VK_EXT_headless_surface not available\n");
+    return 1;
+  }
+  VkHeadlessSurfaceCreateInfoEXT surface_info = {};
+  surface_info.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT;
+  VkSurfaceKHR surface;
+  VKCHECK(create_headless_surface(instance, &surface_info, nullptr, &surface));
+
+  // first device with a queue that can draw & present
+  uint32_t num_gpus = 0;
+  VKCHECK(vkEnumeratePhysicalDevices(instance, &num_gpus, nullptr));
+  std::vector<VkPhysicalDevice> gpus(num_gpus);
+  VKCHECK(vkEnumeratePhysicalDevices(instance, &num_gpus, gpus.data()));
+
+  VkPhysicalDevice gpu = VK_NULL_HANDLE;
+  uint32_t family = 0;
+  for (auto candidate : gpus) {
+    uint32_t num_families = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(candidate, &num_families, nullptr);
+    std::vector<VkQueueFamilyProperties> families(num_families);
+    vkGetPhysicalDeviceQueueFamilyProperties(candidate, &num_families, families.data());
+    for (uint32_t i = 0; i < num_families && !gpu; i++) {
+      VkBool32 can_present = VK_FALSE;
+      vkGetPhysicalDeviceSurfaceSupportKHR(candidate, i, surface, &can_present);
+      if (can_present && (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+        gpu = candidate;
+        family = i;
+      }
+    }
+    if (gpu) {
+      break;
+    }
+  }
+  if (!gpu) {
+    fprintf(stderr, "No Vulkan device can present to a headless surface\n");
+    return 1;
+  }
+
+  VkPhysicalDeviceProperties gpu_props;
+  vkGetPhysicalDeviceProperties(gpu, &gpu_props);
+
+  float priority = 1.0f;
+  VkDeviceQueueCreateInfo queue_info = {};
+  queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+  queue_info.queueFamilyIndex = family;
+  queue_info.queueCount = 1;
+  queue_info.pQueuePriorities = &priority;
+  const char *device_extensions[] = {
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+  };
+  VkDeviceCreateInfo device_info = {};
+  device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  device_info.queueCreateInfoCount = 1;
+  device_info.pQueueCreateInfos = &queue_info;
+  device_info.enabledExtensionCount = 1;
+  device_info.ppEnabledExtensionNames = device_extensions;
+  VkDevice device;
+  VKCHECK(vkCreateDevice(gpu, &device_info, nullptr, &device));
+  VkQueue queue;
+  vkGetDeviceQueue(device, family, 0, &queue);
+
+  // swapchain: 8-bit BGRA/RGBA, never waiting for vblank if we can help it
+  uint32_t num_formats = 0;
+  VKCHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, surface, &num_formats, nullptr));
+  std::vector<VkSurfaceFormatKHR> formats(num_formats);
+  VKCHECK(vkGetPhysicalDeviceSurfaceFormatsKHR(gpu, surface, &num_formats, formats.data()));
+  VkSurfaceFormatKHR format = formats[0];
+  for (auto &candidate : formats) {
+    if (candidate.format == VK_FORMAT_B8G8R8A8_UNORM || candidate.format == VK_FORMAT_R8G8B8A8_UNORM) {
+      format = candidate;
+      break;
+    }
+  }
+
+  uint32_t num_modes = 0;
+  VKCHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(gpu, surface, &num_modes, nullptr));
+  std::vector<VkPresentModeKHR> modes(num_modes);
+  VKCHECK(vkGetPhysicalDeviceSurfacePresentModesKHR(gpu, surface, &num_modes, modes.data()));
+  VkPresentModeKHR present_mode = VK_PRESENT_MODE_FIFO_KHR;
+  if (std::find(modes.begin(), modes.end(), VK_PRESENT_MODE_IMMEDIATE_KHR) != modes.end()) {
+    present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  } else if (std::find(modes.begin(), modes.end(), VK_PRESENT_MODE_MAILBOX_KHR) != modes.end()) {
+    present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+  }
+
+  VkSurfaceCapabilitiesKHR caps;
+  VKCHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(gpu, surface, &caps));
+  if (!(caps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+    fprintf(stderr, "Swapchain images can't be blitted to\n");
+    return 1;
+  }
+  uint32_t num_images = std::max(caps.minImageCount, 3u);
+  if (caps.maxImageCount && num_images > caps.maxImageCount) {
+    num_images = caps.maxImageCount;
+  }
+
+  VkSwapchainCreateInfoKHR swapchain_info = {};
+  swapchain_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+  swapchain_info.surface = surface;
+  swapchain_info.minImageCount = num_images;
+  swapchain_info.imageFormat = format.format;
+  swapchain_info.imageColorSpace = format.colorSpace;
+  swapchain_info.imageExtent.width = static_cast<uint32_t>(args.width);
+  swapchain_info.imageExtent.height = static_cast<uint32_t>(args.height);
+  swapchain_info.imageArrayLayers = 1;
+  swapchain_info.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  swapchain_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  swapchain_info.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+  swapchain_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+  swapchain_info.presentMode = present_mode;
+  swapchain_info.clipped = VK_TRUE;
+  VkSwapchainKHR swapchain;
+  VKCHECK(vkCreateSwapchainKHR(device, &swapchain_info, nullptr, &swapchain));
+
+  VKCHECK(vkGetSwapchainImagesKHR(device, swapchain, &num_images, nullptr));
+  std::vector<VkImage> images(num_images);
+  VKCHECK(vkGetSwapchainImagesKHR(device, swapchain, &num_images, images.data()));
+
+  // the half-size image every pass is blitted from
+  VkImageCreateInfo source_info = {};
+  source_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  source_info.imageType = VK_IMAGE_TYPE_2D;
+  source_info.format = format.format;
+  source_info.extent.width = static_cast<uint32_t>(args.width / 2);
+  source_info.extent.height = static_cast<uint32_t>(args.height / 2);
+  source_info.extent.depth = 1;
+  source_info.mipLevels = 1;
+  source_info.arrayLayers = 1;
+  source_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  source_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  source_info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  source_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  source_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkImage sources[kFramesInFlight];
+  VkDeviceMemory source_memory[kFramesInFlight];
+  for (int i = 0; i < kFramesInFlight; i++) {
+    VKCHECK(vkCreateImage(device, &source_info, nullptr, &sources[i]));
+    VkMemoryRequirements reqs;
+    vkGetImageMemoryRequirements(device, sources[i], &reqs);
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = reqs.size;
+    alloc_info.memoryTypeIndex = FindMemoryType(gpu, reqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VKCHECK(vkAllocateMemory(device, &alloc_info, nullptr, &source_memory[i]));
+    VKCHECK(vkBindImageMemory(device, sources[i], source_memory[i], 0));
+  }
+
+  VkCommandPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = family;
+  VkCommandPool pool;
+  VKCHECK(vkCreateCommandPool(device, &pool_info, nullptr, &pool));
+
+  VkCommandBuffer cmds[kFramesInFlight];
+  VkCommandBufferAllocateInfo cmd_info = {};
+  cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cmd_info.commandPool = pool;
+  cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cmd_info.commandBufferCount = kFramesInFlight;
+  VKCHECK(vkAllocateCommandBuffers(device, &cmd_info, cmds));
+
+  VkSemaphore acquired[kFramesInFlight];
+  VkSemaphore rendered[kFramesInFlight];
+  VkFence fences[kFramesInFlight];
+  VkSemaphoreCreateInfo semaphore_info = {};
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+  for (int i = 0; i < kFramesInFlight; i++) {
+    VKCHECK(vkCreateSemaphore(device, &semaphore_info, nullptr, &acquired[i]));
+    VKCHECK(vkCreateSemaphore(device, &semaphore_info, nullptr, &rendered[i]));
+    VKCHECK(vkCreateFence(device, &fence_info, nullptr, &fences[i]));
+  }
+
+  fprintf(stderr, "capsule-vk-test-game: %dx%d, load %d, device %s, present mode %d\n",
+    args.width, args.height, args.load, gpu_props.deviceName, present_mode);
+
+  std::vector<double> frame_times;
+  frame_times.reserve(args.frames);
+
+  int total_frames = args.warmup + args.frames;
+  auto last = std::chrono::steady_clock::now();
+
+  for (int frame = 0; frame < total_frames; frame++) {
+    int slot = frame % kFramesInFlight;
+    VKCHECK(vkWaitForFences(device, 1, &fences[slot], VK_TRUE, UINT64_MAX));
+    VKCHECK(vkResetFences(device, 1, &fences[slot]));
+
+    uint32_t image_index;
+    VKCHECK(vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, acquired[slot], VK_NULL_HANDLE, &image_index));
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VKCHECK(vkBeginCommandBuffer(cmds[slot], &begin_info));
+    DrawScene(cmds[slot], sources[slot], images[image_index], args, frame);
+    VKCHECK(vkEndCommandBuffer(cmds[slot]));
+
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkSubmitInfo submit = {};
+    submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit.waitSemaphoreCount = 1;
+    submit.pWaitSemaphores = &acquired[slot];
+    submit.pWaitDstStageMask = &wait_stage;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &cmds[slot];
+    submit.signalSemaphoreCount = 1;
+    submit.pSignalSemaphores = &rendered[slot];
+    VKCHECK(vkQueueSubmit(queue, 1, &submit, fences[slot]));
+
+    VkPresentInfoKHR present = {};
+    present.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    present.waitSemaphoreCount = 1;
+    present.pWaitSemaphores = &rendered[slot];
+    present.swapchainCount = 1;
+    present.pSwapchains = &swapchain;
+    present.pImageIndices = &image_index;
+    VKCHECK(vkQueuePresentKHR(queue, &present));
+
+    auto now = std::chrono::steady_clock::now();
+    if (frame >= args.warmup) {
+      frame_times.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+    }
+    last = now;
+  }
+
+  VKCHECK(vkDeviceWaitIdle(device));
+  for (int i = 0; i < kFramesInFlight; i++) {
+    vkDestroyFence(device, fences[i], nullptr);
+    vkDestroySemaphore(device, rendered[i], nullptr);
+    vkDestroySemaphore(device, acquired[i], nullptr);
+    vkDestroyImage(device, sources[i], nullptr);
+    vkFreeMemory(device, source_memory[i], nullptr);
+  }
+  vkDestroyCommandPool(device, pool, nullptr);
+  vkDestroySwapchainKHR(device, swapchain, nullptr);
+  vkDestroyDevice(device, nullptr);
+  vkDestroySurfaceKHR(instance, surface, nullptr);
+  vkDestroyInstance(instance, nullptr);
+
+  double total_ms = 0.0;
+  for (double t: frame_times) {
+    total_ms += t;
+  }
+  std::sort(frame_times.begin(), frame_times.end());
+
+  if (args.header) {
+    printf("mode\tframes\tfps\tp50_ms\tp90_ms\tp99_ms\tmax_ms\n");
+  }
+  printf("%s\t%d\t%.2f\t%.3f\t%.3f\t%.3f\t%.3f\n",
+    args.label,
+    static_cast<int>(frame_times.size()),
+    frame_times.size() * 1000.0 / total_ms,
+    Percentile(frame_times, 0.50),
+    Percentile(frame_times, 0.90),
+    Percentile(frame_times, 0.99),
+    frame_times.back());
+  fflush(stdout);
+
+  return 0;
+}
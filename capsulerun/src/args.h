@@ -23,6 +23,10 @@
 
 namespace capsule {
 
+namespace encoder {
+struct OutputSettings;
+}
+
 // all strings are UTF-8, even on windows
 struct MainArgs {
   // positional arguments
@@ -40,15 +44,27 @@ struct MainArgs {
   int fps;
   bool gpu_color_conv;
   int threads;
+  int thread_budget;
   int debug_av;
   int gop_size;
   int max_b_frames;
   int buffered_frames;
+  int no_huge_pages;
+  int mlock_limit;
   const char *priority;
   const char *x264_preset;
+  const char *outputs;
+  // --outputs, parsed by main
+  int num_output_settings;
+  encoder::OutputSettings *output_settings;
 
   const char *pipe;
   int headless;
+  int autostart;
+
+  const char *record;
+  const char *replay;
+  int replay_max_speed;
 };
 
 }
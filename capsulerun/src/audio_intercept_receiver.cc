@@ -25,6 +25,7 @@
 #include <capsule/audio_math.h>
 
 #include "logging.h"
+#include "memory.h"
 
 #include <string.h> // memset, memcpy
 
@@ -34,7 +35,7 @@
 namespace capsule {
 namespace audio {
 
-AudioInterceptReceiver::AudioInterceptReceiver(Connection *conn, const messages::AudioSetup &as) {
+AudioInterceptReceiver::AudioInterceptReceiver(Connection *conn, const messages::AudioSetup &as, shoom::Shm *shm) {
   memset(&afmt_, 0, sizeof(afmt_));
 
   conn_ = conn;
@@ -49,11 +50,11 @@ AudioInterceptReceiver::AudioInterceptReceiver(Connection *conn, const messages:
   afmt_.rate = as.rate();
   afmt_.format = as.format();
 
-  auto shm_path = as.shmem()->path()->str();  
-  auto shm = new shoom::Shm(shm_path, static_cast<size_t>(as.shmem()->size()));
-  int ret = shm->Open();
+  // with a ring, the read cursor is written back into the shm
+  int ret = as.control_ring() ? shm->OpenWritable() : shm->Open();
   if (ret != shoom::kOK) {
     Log("AudioInterceptReceiver: Could not open shared memory area: code %d", ret);
+    delete shm;
     return;
   }
 
@@ -62,10 +63,24 @@ AudioInterceptReceiver::AudioInterceptReceiver(Connection *conn, const messages:
   int64_t sample_size = (SampleWidth(afmt_.format) / 8);
   frame_size_ = afmt_.channels * sample_size;
 
+  if (as.control_ring()) {
+    auto header = reinterpret_cast<audio_ring::AudioRingHeader*>(shm_->Data());
+    if (!audio_ring::IsValidHeader(header) || frame_size_ == 0) {
+      Log("AudioInterceptReceiver: invalid audio ring header");
+      return;
+    }
+    ring_ = header;
+    shm_data_offset_ = audio_ring::kHeaderSize;
+    shm_num_frames_ = (as.shmem()->size() - shm_data_offset_) / frame_size_;
+    Log("AudioInterceptReceiver: receiving frames through the shm ring");
+  }
+
   int64_t buffered_seconds = 4;
   num_frames_ = afmt_.rate * buffered_seconds;
 
-  buffer_ = (char*) calloc(num_frames_, frame_size_);
+  size_t buffer_size = static_cast<size_t>(num_frames_ * frame_size_);
+  buffer_ = (char*) memory::Allocate(buffer_size);
+  frames_ = new SpscRing<char>(buffer_size, buffer_);
 
   initialized_ = true;
 }
@@ -74,6 +89,10 @@ AudioInterceptReceiver::~AudioInterceptReceiver() {
   if (shm_) {
     delete shm_;
   }
+  if (buffer_) {
+    delete frames_;
+    memory::Free(buffer_);
+  }
 }
 
 int AudioInterceptReceiver::ReceiveFormat(encoder::AudioFormat *afmt) {
@@ -88,72 +107,107 @@ int AudioInterceptReceiver::ReceiveFormat(encoder::AudioFormat *afmt) {
 
 void AudioInterceptReceiver::FramesCommitted(int64_t offset, int64_t frames) {
   DebugLog("AudioInterceptReceiver: frames committed: %d offset, %d frames", offset, frames);
-  std::lock_guard<std::mutex> lock(buffer_mutex_);
-
-  int64_t remain_frames = frames;
-  while (remain_frames > 0) {
-    int64_t write_frames = remain_frames;
-    int64_t avail_frames = num_frames_ - commit_index_;
+  if (!initialized_) {
+    return;
+  }
 
-    if (write_frames > avail_frames) {
-      write_frames = avail_frames;
+  const char *src = (char*) shm_->Data() + shm_data_offset_ + (offset * frame_size_);
+  size_t remain_size = static_cast<size_t>(frames * frame_size_);
+
+  while (remain_size > 0) {
+    // the ring is a whole number of frames, so runs never split one
+    char *dst;
+    size_t write_size = frames_->Reserve(remain_size, &dst);
+    if (write_size == 0) {
+      // the encoder is behind, drop the newest frames rather than
+      // overwrite ones it hasn't seen
+      frames_->Overrun(remain_size);
+      break;
     }
 
-    DebugLog("AudioInterceptReceiver: storing %d frames at %d", write_frames, commit_index_);
-    char *src = (char*) shm_->Data() + (offset * frame_size_);
-    char *dst = buffer_ + (commit_index_ * frame_size_);
-    memcpy(dst, src, write_frames * frame_size_);
+    DebugLog("AudioInterceptReceiver: storing %d frames", write_size / frame_size_);
+    memcpy(dst, src, write_size);
+    frames_->Commit(write_size);
 
-    commit_index_ += write_frames;
-    remain_frames -= write_frames;
-    offset += write_frames;
+    src += write_size;
+    remain_size -= write_size;
+  }
 
-    if (commit_index_ == num_frames_) {
-      // wrap around!
-      DebugLog("AudioInterceptReceiver: commit wrap!");
-      commit_index_ = 0;
+  uint64_t overrun_frames = frames_->Overruns() / static_cast<uint64_t>(frame_size_);
+  if (overrun_frames - overrun_logged_ >= static_cast<uint64_t>(afmt_.rate)) {
+    Log("AudioInterceptReceiver: buffer overrun, %" PRId64 " frames lost so far", static_cast<int64_t>(overrun_frames));
+    overrun_logged_ = overrun_frames;
+  }
+}
+
+void AudioInterceptReceiver::PullRing() {
+  uint64_t read = 0;
+  int64_t avail = audio_ring::Available(ring_, &read);
+
+  // leave frames in the shm rather than overrun ours here,
+  // libcapsule will see the ring fill up and count what it drops.
+  int64_t room = static_cast<int64_t>((frames_->Capacity() - frames_->Size()) / frame_size_);
+  if (avail > room) {
+    avail = room;
+  }
+
+  if (avail > 0) {
+    int64_t offset = static_cast<int64_t>(read % static_cast<uint64_t>(shm_num_frames_));
+    int64_t first = avail;
+    if (first > shm_num_frames_ - offset) {
+      first = shm_num_frames_ - offset;
+    }
+    FramesCommitted(offset, first);
+    if (avail > first) {
+      FramesCommitted(0, avail - first);
     }
+    audio_ring::Consume(ring_, avail);
+  }
+
+  uint64_t dropped = ring_->dropped_frames.load(std::memory_order_relaxed);
+  if (dropped - dropped_logged_ >= static_cast<uint64_t>(afmt_.rate)) {
+    Log("AudioInterceptReceiver: libcapsule dropped %" PRId64 " frames so far", static_cast<int64_t>(dropped));
+    dropped_logged_ = dropped;
   }
 }
 
 void *AudioInterceptReceiver::ReceiveFrames(int64_t *frames_received) {
-  std::lock_guard<std::mutex> lock(buffer_mutex_);
-
   *frames_received = 0;
-
-  if (sent_index_ == num_frames_) {
-    // wrap!
-    DebugLog("AudioInterceptReceiver: sent wrap! sent_index = %" PRId64
-      ", num_frames = %" PRId64 ", commit_index = %" PRId64,
-        sent_index_, num_frames_, commit_index_);
-    sent_index_ = 0;
+  if (!initialized_) {
+    return nullptr;
   }
 
-  if (sent_index_ != commit_index_) {
-    int64_t avail_frames;
-    if (commit_index_ < sent_index_) {
-      // commit_index_ has wrapped around, send everything till the end of the buffer
-      avail_frames = num_frames_ - sent_index_;
-      DebugLog("AudioInterceptReceiver: sent clear, %d frames available", avail_frames);
-    } else {
-      avail_frames = commit_index_ - sent_index_;
-    }
+  // the encoder is done with what it got last time
+  frames_->Release(held_size_);
+  held_size_ = 0;
 
-    *frames_received = avail_frames;
-    DebugLog("AudioInterceptReceiver: received %" PRId64 " frames from %" PRId64,
-      avail_frames, sent_index_);
+  if (ring_) {
+    PullRing();
+  }
 
-    char *ret = buffer_ + (sent_index_ * frame_size_);
-    sent_index_ += avail_frames;
-    return ret;
+  char *ret;
+  held_size_ = frames_->Peek(frames_->Capacity(), &ret);
+  if (held_size_ == 0) {
+    return nullptr;
   }
+  *frames_received = static_cast<int64_t>(held_size_) / frame_size_;
 
-  return nullptr;
+  DebugLog("AudioInterceptReceiver: received %" PRId64 " frames", *frames_received);
+  return ret;
 }
 
 void AudioInterceptReceiver::Stop() {
   // stub
 }
 
+const char *AudioInterceptReceiver::SharedFrames(int64_t offset, int64_t frames, size_t *size) {
+  if (!shm_) {
+    return nullptr;
+  }
+
+  *size = static_cast<size_t>(frames * frame_size_);
+  return (char*) shm_->Data() + shm_data_offset_ + (offset * frame_size_);
+}
+
 }
 }
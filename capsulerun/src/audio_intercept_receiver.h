@@ -22,12 +22,12 @@
 #pragma once
 
 #include <capsule/messages_generated.h>
-
-#include <mutex>
+#include <capsule/audio_ring.h>
 
 #include "audio_receiver.h"
 #include "connection.h"
 #include "encoder.h"
+#include "spsc_ring.h"
 #include <shoom.h>
 
 namespace capsule {
@@ -35,27 +35,38 @@ namespace audio {
 
 class AudioInterceptReceiver : public AudioReceiver {
   public:
-    AudioInterceptReceiver(Connection *conn, const messages::AudioSetup &as);
+    // takes ownership of shm, which isn't opened yet
+    AudioInterceptReceiver(Connection *conn, const messages::AudioSetup &as, shoom::Shm *shm);
     virtual ~AudioInterceptReceiver() override;
 
     virtual void FramesCommitted(int64_t offset, int64_t frames) override;
     virtual int ReceiveFormat(encoder::AudioFormat *afmt) override;
     virtual void *ReceiveFrames(int64_t *frames_received) override;
     virtual void Stop() override;
+    virtual const char *SharedFrames(int64_t offset, int64_t frames, size_t *size) override;
 
   private:
+    void PullRing();
+
     Connection *conn_ = nullptr;
     encoder::AudioFormat afmt_;
     shoom::Shm *shm_ = nullptr;
 
+    // non-null if libcapsule writes frames to a ring instead of
+    // sending AudioFramesCommitted
+    audio_ring::AudioRingHeader *ring_ = nullptr;
+    int64_t shm_data_offset_ = 0;
+    int64_t shm_num_frames_ = 0;
+    uint64_t dropped_logged_ = 0;
+
     int num_frames_ = 0;
     int64_t frame_size_ = 0;
-    int64_t commit_index_ = 0;
-    int64_t sent_index_ = 0;
-    int64_t processed_index_ = 0;
     char *buffer_ = nullptr;
-
-    std::mutex buffer_mutex_;
+    // bytes of buffer_, always moved a whole number of frames at a time
+    SpscRing<char> *frames_ = nullptr;
+    // handed to the encoder, released on its next ReceiveFrames
+    size_t held_size_ = 0;
+    uint64_t overrun_logged_ = 0;
 
     bool initialized_ = false;
 };
@@ -36,6 +36,12 @@ class AudioReceiver {
       // muffin
     };
     virtual void Stop() = 0;
+
+    // for recording traces: the shm contents a FramesCommitted refers to,
+    // or null if this receiver doesn't get its frames from shm
+    virtual const char *SharedFrames(int64_t, int64_t, size_t *) {
+      return nullptr;
+    };
 };
 
 } // namespace audio
@@ -0,0 +1,38 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace capsule {
+
+/**
+ * What the lock-free queues and rings pad their cursors to, so the
+ * producer and consumer sides never share a line.
+ *
+ * Padded members rather than alignas: those structures are heap-allocated
+ * (receivers, MainLoop), and C++11 new ignores over-alignment. Padding
+ * keeps the cursors a full line apart wherever the object lands.
+ */
+static const size_t kCacheLine = 64;
+
+} // namespace capsule
@@ -26,6 +26,11 @@
 #include <fcntl.h>    // for O_* constants
 #include <unistd.h>   // unlink
 #include <signal.h>   // signal, SIGPIPE
+#include <string.h>   // strncpy
+#include <sys/socket.h> // socket, bind, listen, accept
+#include <sys/un.h>     // sockaddr_un
+#include <sys/ioctl.h>  // ioctl, FIONREAD
+#include <errno.h>      // errno
 #elif defined(LAB_MACOS)
 #include <sys/stat.h> // for mode constants
 #include <fcntl.h>    // for O_* constants
@@ -86,6 +91,50 @@ static int OpenFifo (
   return open(path.c_str(), flags);
 }
 
+#if defined(LAB_LINUX)
+
+static int OpenFifoNonBlocking (
+  std::string path,
+  int flags
+) {
+  int fd = OpenFifo(path, flags | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // only open() shouldn't wait, reads and writes still do
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  return fd;
+}
+
+static int ListenSocket (
+  std::string sock_path
+) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (sock_path.size() >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strncpy(addr.sun_path, sock_path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+
+  // remove previous socket if any
+  unlink(sock_path.c_str());
+  if (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      listen(sock, 1) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+#endif // LAB_LINUX
+
 #endif // !LAB_WINDOWS
 
 Connection::Connection(std::string pipe_name) {
@@ -121,6 +170,19 @@ Connection::Connection(std::string pipe_name) {
     exit(1);
   }
 #endif // !LAB_WINDOWS
+
+#if defined(LAB_LINUX)
+  // not fatal: libcapsule falls back to named shm segments
+  sock_path_ = lab::paths::PipePath(pipe_name + ".sock");
+  sock_listen_ = ListenSocket(sock_path_);
+  if (sock_listen_ < 0) {
+    Log("Could not listen on %s, anonymous shm unavailable", sock_path_.c_str());
+  }
+#endif // LAB_LINUX
+}
+
+Connection::Connection() {
+  pipe_name_ = "(unconnected)";
 }
 
 // TODO: error reporting
@@ -160,8 +222,104 @@ void Connection::Close() {
   close(fifo_r_);
   close(fifo_w_);
 #endif
+
+#if defined(LAB_LINUX)
+  if (sock_ >= 0) {
+    close(sock_);
+    sock_ = -1;
+  }
+  if (sock_listen_ >= 0) {
+    close(sock_listen_);
+    sock_listen_ = -1;
+    unlink(sock_path_.c_str());
+  }
+#endif // LAB_LINUX
 }
 
+#if defined(LAB_LINUX)
+
+int Connection::ReceiveFds(int *fds, int max_fds) {
+  if (sock_ < 0) {
+    if (sock_listen_ < 0) {
+      return -1;
+    }
+
+    // libcapsule connects right before sending its first batch,
+    // so this doesn't block for long.
+    sock_ = accept4(sock_listen_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock_ < 0) {
+      Log("Could not accept fd socket connection on %s", sock_path_.c_str());
+      return -1;
+    }
+  }
+
+  return lab::packet::ReceiveFds(sock_, fds, max_fds);
+}
+
+bool Connection::Open() {
+  // libcapsule opens its write end first, then blocks opening its read
+  // end until there's a writer: a read-write end is a writer that never
+  // waits for a reader, so neither side sits in open().
+  fifo_r_ = OpenFifoNonBlocking(r_path_, O_RDONLY);
+  if (fifo_r_ < 0) {
+    Log("Could not open read fifo %s (errno %d)", r_path_.c_str(), errno);
+    return false;
+  }
+
+  fifo_w_ = OpenFifoNonBlocking(w_path_, O_RDWR);
+  if (fifo_w_ < 0) {
+    Log("Could not open write fifo %s (errno %d)", w_path_.c_str(), errno);
+    close(fifo_r_);
+    fifo_r_ = -1;
+    return false;
+  }
+
+  connected_ = true;
+  return true;
+}
+
+bool Connection::Pending() {
+  int available = 0;
+  if (ioctl(fifo_r_, FIONREAD, &available) != 0) {
+    return false;
+  }
+  return available > 0;
+}
+
+void Connection::Established() {
+  if (!connected_ || established_) {
+    return;
+  }
+  established_ = true;
+
+  // as long as we hold a read-write end, writes never fail with EPIPE
+  // and a game that went away would fill the fifo until we block.
+  int fd = OpenFifoNonBlocking(w_path_, O_WRONLY);
+  if (fd < 0) {
+    Log("Could not reopen write fifo %s (errno %d), keeping read-write end", w_path_.c_str(), errno);
+    return;
+  }
+
+  // same fd number, so receivers writing from other threads
+  // go from one end to the other atomically
+  dup3(fd, fifo_w_, O_CLOEXEC);
+  close(fd);
+}
+
+bool Connection::ReopenRead() {
+  int fd = OpenFifoNonBlocking(r_path_, O_RDONLY);
+  if (fd < 0) {
+    Log("Could not reopen read fifo %s (errno %d)", r_path_.c_str(), errno);
+    return false;
+  }
+
+  dup3(fd, fifo_r_, O_CLOEXEC);
+  close(fd);
+  return true;
+}
+
+#endif // LAB_LINUX
+
 void Connection::Write(const flatbuffers::FlatBufferBuilder &builder) {
   if (!connected_) {
     return;
@@ -174,7 +332,7 @@ void Connection::Write(const flatbuffers::FlatBufferBuilder &builder) {
 #endif // !LAB_WINDOWS
 }
 
-char *Connection::Read() {
+char *Connection::Read(uint32_t *pkt_size) {
   if (!connected_) {
     return nullptr;
   }
@@ -182,9 +340,9 @@ char *Connection::Read() {
   char *result;
 
 #if defined(LAB_WINDOWS)
-  result = lab::packet::Hread(pipe_r_);
+  result = lab::packet::Hread(pipe_r_, &pool_, pkt_size);
 #else // LAB_WINDOWS
-  result = lab::packet::Read(fifo_r_);
+  result = lab::packet::Read(fifo_r_, &pool_, pkt_size);
 #endif // !LAB_WINDOWS
 
   if (!result) {
@@ -28,11 +28,34 @@ namespace capsule {
 class Connection {
   public:
     Connection(std::string pipe_name);
+    // a connection that never connects: writes are dropped, reads
+    // return null. Used when replaying traces.
+    Connection();
     void Connect();
     void Close();
 
     void Write(const flatbuffers::FlatBufferBuilder &builder);
-    char *Read();
+    // the returned packet must be given back with Release,
+    // from any thread.
+    char *Read(uint32_t *pkt_size = nullptr);
+    void Release(char *buf) { pool_.Release(buf); };
+
+#if defined(LAB_LINUX)
+    // receives the fds of anonymous shm segments, sent by libcapsule
+    // right before the message that refers to them. -1 on error.
+    int ReceiveFds(int *fds, int max_fds);
+
+    // like Connect, but doesn't wait for libcapsule: watch ReadFd
+    // for its Hello instead. Read only blocks once Pending is true.
+    bool Open();
+    int ReadFd() { return fifo_r_; };
+    bool Pending();
+    // libcapsule said Hello, so its read end is open
+    void Established();
+    // once every writer hung up, the read end stays readable (EOF)
+    // forever: reopen it to wait for the next one. Unwatch it first.
+    bool ReopenRead();
+#endif // LAB_LINUX
 
     bool IsConnected() { return connected_; };
     std::string GetPipeName() { return pipe_name_; };
@@ -49,6 +72,15 @@ class Connection {
     int fifo_w_ = 0;
 #endif // !LAB_WINDOWS
 
+#if defined(LAB_LINUX)
+    std::string sock_path_;
+    int sock_listen_ = -1;
+    int sock_ = -1;
+    bool established_ = false;
+#endif // LAB_LINUX
+
+    lab::packet::Pool pool_;
+
     bool connected_ = false;
 };
 
@@ -50,6 +50,11 @@ extern "C" {
 
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <string>
+#include <sstream>
 
 #include "fps_counter.h"
 #include "logging.h"
@@ -62,6 +67,7 @@ MICROPROFILE_DEFINE(EncoderScale, "Encoder", "VScale", MP_THISTLE3);
 MICROPROFILE_DEFINE(EncoderSendVideoFrame, "Encoder", "VEncode", MP_AZURE3);
 MICROPROFILE_DEFINE(EncoderRecvVideoPkt, "Encoder", "VMux1", MP_BURLYWOOD3);
 MICROPROFILE_DEFINE(EncoderWriteVideoPkt, "Encoder", "VMux2", MP_BROWN3);
+MICROPROFILE_DEFINE(EncoderWaitOutputs, "Encoder", "VWaitOutputs", MP_GRAY);
 
 MICROPROFILE_DEFINE(EncoderReceiveAudioFrames, "Encoder", "ARecv", MP_AQUAMARINE4);
 MICROPROFILE_DEFINE(EncoderResample, "Encoder", "AResample", MP_THISTLE4);
@@ -72,6 +78,43 @@ MICROPROFILE_DEFINE(EncoderWriteAudioPkt, "Encoder", "AMux2", MP_BROWN4);
 namespace capsule {
 namespace encoder {
 
+/**
+ * Everything needed to produce one output file of the ladder.
+ */
+struct VideoOutput {
+  OutputSettings settings;
+  std::string path;
+  // codec threads, after --threads and the session's budget
+  int threads = 1;
+
+  int width = 0;
+  int height = 0;
+
+  AVFormatContext *oc = nullptr;
+  AVStream *video_st = nullptr;
+  AVStream *audio_st = nullptr;
+  AVCodecContext *vc = nullptr;
+  AVFrame *vframe = nullptr;
+
+  // where pixels come from: nullptr = the captured frame,
+  // otherwise the next-larger output (hierarchical downscale)
+  VideoOutput *source = nullptr;
+  struct SwsContext *sws = nullptr;
+  // vframe planes point into the input buffer or the source's vframe
+  bool borrowed_planes = false;
+  bool owns_frame_buffer = false;
+
+  // packets are muxed from this output's worker and from the audio path
+  std::mutex mux_mutex;
+
+  // parallel encoding, only used when there's more than one output
+  std::thread *thread = nullptr;
+  std::mutex work_mutex;
+  std::condition_variable work_cond;
+  bool has_work = false;
+  bool quit = false;
+};
+
 AVSampleFormat SampleFormatToAv(messages::SampleFmt fmt) {
   switch (fmt) {
     case messages::SampleFmt_U8:
@@ -90,174 +133,286 @@ AVSampleFormat SampleFormatToAv(messages::SampleFmt fmt) {
   }
 }
 
-void Run(MainArgs *args, Params *params) {
-  MicroProfileOnThreadCreate("encoder");
-  MICROPROFILE_SCOPE(EncoderMain);
+bool ParseOutputs(const char *spec, std::vector<OutputSettings> &outputs) {
+  std::istringstream rungs(spec);
+  std::string rung;
+
+  while (std::getline(rungs, rung, ',')) {
+    OutputSettings os;
+    memset(&os, 0, sizeof(os));
+    os.crf = -1;
+
+    std::istringstream fields(rung);
+    std::string field;
+    int index = 0;
+    while (std::getline(fields, field, ':')) {
+      switch (index) {
+        case 0:
+          os.divider = atoi(field.c_str());
+          break;
+        case 1:
+          if (!field.empty()) {
+            os.crf = atoi(field.c_str());
+          }
+          break;
+        case 2:
+          if (field.size() >= sizeof(os.preset)) {
+            Log("Invalid output spec '%s': preset too long", rung.c_str());
+            return false;
+          }
+          strcpy(os.preset, field.c_str());
+          break;
+        default:
+          Log("Invalid output spec '%s': expected divider[:crf[:preset]]", rung.c_str());
+          return false;
+      }
+      index++;
+    }
 
-  int ret;
+    if (os.divider < 1) {
+      Log("Invalid output spec '%s': divider must be a positive integer", rung.c_str());
+      return false;
+    }
+    for (auto &other : outputs) {
+      if (other.divider == os.divider) {
+        // same size, same file name
+        Log("Invalid output spec '%s': divider %d given twice", rung.c_str(), os.divider);
+        return false;
+      }
+    }
+    outputs.push_back(os);
+  }
 
-  av_register_all();
+  return !outputs.empty();
+}
 
-  if (args->debug_av) {
-    av_log_set_level(AV_LOG_DEBUG);
+static int ValidateCrf(int crf) {
+  if (crf >= 0 && crf <= 51) {
+    if (crf < 18 || crf > 28) {
+      Log("Warning: sane crf values lie within 18-28, using crf %d at your own risks", crf);
+    }
+    return crf;
   }
 
-  // receive video format info
-  VideoFormat vfmt_in;
-  ret = params->receive_video_format(params->private_data, &vfmt_in);
-  if (ret != 0) {
-    printf("could not receive video format");
-    exit(1);
+  Log("Invalid crf value %d (must be in the 0-51 range), ignoring", crf);
+  return -1;
+}
+
+std::vector<messages::PixFmt> IngestFormats(const MainArgs *args) {
+  std::vector<messages::PixFmt> formats;
+  // YUV444P switches the output to yuv444p, and I420/NV12 to yuv420p,
+  // so only take them when that's what was asked for (or forced with
+  // --gpu-color-conv)
+  bool yuv444p_out = args->pix_fmt && 0 == strcmp(args->pix_fmt, "yuv444p");
+  if (yuv444p_out) {
+    formats.push_back(messages::PixFmt_YUV444P);
+  } else if (args->gpu_color_conv) {
+    formats.push_back(messages::PixFmt_I420);
+    formats.push_back(messages::PixFmt_NV12);
+    formats.push_back(messages::PixFmt_YUV444P);
   }
-  int width = (int) vfmt_in.width;
-  int height = (int) vfmt_in.height;
-  int components = 4;
-  int linesize = vfmt_in.pitch;
+  formats.push_back(messages::PixFmt_BGRA);
+  formats.push_back(messages::PixFmt_RGBA);
+  return formats;
+}
+
+int IngestPasses(messages::PixFmt format) {
+  switch (format) {
+    case messages::PixFmt_YUV444P:
+    case messages::PixFmt_I420:
+      // the first output borrows the captured planes
+      return 0;
+    case messages::PixFmt_NV12:
+      // sws_scale only has to split the chroma plane
+    case messages::PixFmt_RGBA:
+    case messages::PixFmt_BGRA:
+      // one sws_scale colour conversion
+      return 1;
+    default:
+      return -1;
+  }
+}
 
-  Log("video resolution: %dx%d, format %d, vflip %d, pitch %d (%d computed)",
-    width, height, (int) vfmt_in.format, (int) vfmt_in.vflip,
-    (int) linesize, (int) (width * components));
+static void WriteVideoPackets(VideoOutput *out) {
+  int ret = 0;
 
-  const int64_t buffer_size = height * linesize;
-  uint8_t *buffer = (uint8_t*) malloc(buffer_size);
-  if (!buffer) {
-    Log("could not allocate buffer");
+  while (ret >= 0) {
+    AVPacket vpkt;
+    av_init_packet(&vpkt);
+
+    {
+      MICROPROFILE_SCOPE(EncoderRecvVideoPkt);
+      ret = avcodec_receive_packet(out->vc, &vpkt);
+    }
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        Log("Error encoding a video frame");
+        exit(1);
+    } else if (ret >= 0) {
+        av_packet_rescale_ts(&vpkt, out->vc->time_base, out->video_st->time_base);
+        vpkt.stream_index = out->video_st->index;
+
+        /* Write the compressed frame to the media file. */
+        {
+          MICROPROFILE_SCOPE(EncoderWriteVideoPkt);
+          std::lock_guard<std::mutex> lock(out->mux_mutex);
+          ret = av_interleaved_write_frame(out->oc, &vpkt);
+        }
+        if (ret < 0) {
+            Log("Error while writing video frame");
+            exit(1);
+        }
+    }
+  }
+}
+
+// pass a null frame to flush delayed frames
+static void EncodeVideoFrame(VideoOutput *out, AVFrame *frame) {
+  int ret;
+  {
+    MICROPROFILE_SCOPE(EncoderSendVideoFrame);
+    ret = avcodec_send_frame(out->vc, frame);
+  }
+  if (ret < 0) {
+    Log("Error encoding video frame for %s", out->path.c_str());
     exit(1);
   }
 
-  // receive audio format info
-  AudioFormat afmt_in;
-  memset(&afmt_in, 0, sizeof(afmt_in));
-  if (params->has_audio) {
-    ret = params->receive_audio_format(params->private_data, &afmt_in);
-    if (ret != 0) {
-      Log("could not receive audio format, disabling audio");
-      params->has_audio = false;
-    } else {
-      Log("audio format: %d channels, %d rate, %s format",
-        afmt_in.channels, afmt_in.rate, messages::EnumNameSampleFmt(afmt_in.format));
+  WriteVideoPackets(out);
+}
+
+static void EncodeWorker(VideoOutput *out) {
+  MicroProfileOnThreadCreate("encoder-output");
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(out->work_mutex);
+      while (!out->has_work && !out->quit) {
+        out->work_cond.wait(lock);
+      }
+      if (out->quit) {
+        break;
+      }
+    }
+
+    EncodeVideoFrame(out, out->vframe);
+
+    {
+      std::lock_guard<std::mutex> lock(out->work_mutex);
+      out->has_work = false;
     }
+    out->work_cond.notify_all();
   }
+}
 
-  AVFormatContext *oc = nullptr;
-  AVOutputFormat *fmt = nullptr;
+// sends one audio packet to every output, each muxer gets its own reference
+static void WriteAudioPacket(AVCodecContext *ac, AVPacket *apkt, std::vector<VideoOutput *> &outputs) {
+  for (auto out: outputs) {
+    AVPacket opkt;
+    av_init_packet(&opkt);
+    int ret = av_packet_ref(&opkt, apkt);
+    if (ret < 0) {
+      Log("Could not reference audio packet");
+      exit(1);
+    }
 
-  AVStream *video_st = nullptr;
-  AVStream *audio_st = nullptr;
+    av_packet_rescale_ts(&opkt, ac->time_base, out->audio_st->time_base);
+    opkt.stream_index = out->audio_st->index;
+    /* Write the compressed audio frame to the media file. */
+    {
+      MICROPROFILE_SCOPE(EncoderWriteAudioPkt);
+      std::lock_guard<std::mutex> lock(out->mux_mutex);
+      ret = av_interleaved_write_frame(out->oc, &opkt);
+    }
+    if (ret < 0) {
+        Log("Error while writing audio frame");
+        exit(1);
+    }
+  }
+  av_packet_unref(apkt);
+}
 
-  AVCodecID vcodec_id = AV_CODEC_ID_H264;
-  AVCodecID acodec_id = AV_CODEC_ID_AAC;
-  AVCodec *vcodec = nullptr;
-  AVCodec *acodec = nullptr;
-  AVCodecContext *vc = nullptr;
-  AVCodecContext *ac = nullptr;
+static void WriteAudioPackets(AVCodecContext *ac, std::vector<VideoOutput *> &outputs) {
+  int ret = 0;
 
-  AVFrame *vframe, *aframe;
+  while (ret >= 0) {
+    AVPacket apkt;
+    av_init_packet(&apkt);
+    {
+      MICROPROFILE_SCOPE(EncoderRecvAudioPkt);
+      ret = avcodec_receive_packet(ac, &apkt);
+    }
 
-  struct SwsContext *sws;
-  struct SwrContext *swr;
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        Log("Error encoding an audio frame");
+        exit(1);
+    } else if (ret >= 0) {
+        WriteAudioPacket(ac, &apkt, outputs);
+    }
+  }
+}
 
-  const char *output_path = "capsule.mp4";
+static void OpenVideoOutput(MainArgs *args, VideoOutput *out, AVPixelFormat pix_fmt, bool has_audio) {
+  int ret;
 
-  fmt = av_guess_format("mp4", NULL, NULL);
+  AVOutputFormat *fmt = av_guess_format("mp4", NULL, NULL);
 
   // allocate output media context
-  avformat_alloc_output_context2(&oc, fmt, NULL, NULL);
-  if (!oc) {
+  avformat_alloc_output_context2(&out->oc, fmt, NULL, NULL);
+  if (!out->oc) {
       Log("could not allocate output context");
       exit(1);
   }
-  oc->oformat = fmt;
+  out->oc->oformat = fmt;
 
   /* open the output file, if needed */
-  ret = avio_open(&oc->pb, output_path, AVIO_FLAG_WRITE);
+  ret = avio_open(&out->oc->pb, out->path.c_str(), AVIO_FLAG_WRITE);
   if (ret < 0) {
-      Log("Could not open '%s'", output_path);
+      Log("Could not open '%s'", out->path.c_str());
       exit(1);
   }
 
   // video stream
-  video_st = avformat_new_stream(oc, NULL);
-  if (!video_st) {
+  out->video_st = avformat_new_stream(out->oc, NULL);
+  if (!out->video_st) {
       Log("could not allocate video stream");
       exit(1);
   }
-  video_st->id = oc->nb_streams - 1;
+  out->video_st->id = out->oc->nb_streams - 1;
 
   // audio stream
-  if (params->has_audio) {
-    audio_st = avformat_new_stream(oc, NULL);
-    if (!audio_st) {
+  if (has_audio) {
+    out->audio_st = avformat_new_stream(out->oc, NULL);
+    if (!out->audio_st) {
         Log("could not allocate audio stream");
         exit(1);
     }
-    audio_st->id = oc->nb_streams - 1;
+    out->audio_st->id = out->oc->nb_streams - 1;
   }
 
   // video codec
-  vcodec = avcodec_find_encoder(vcodec_id);
+  AVCodecID vcodec_id = AV_CODEC_ID_H264;
+  AVCodec *vcodec = avcodec_find_encoder(vcodec_id);
   if (!vcodec) {
     Log("could not find video codec");
     exit(1);
   }
 
-  Log("found video codec");
-
-  vc = avcodec_alloc_context3(vcodec);
+  AVCodecContext *vc = avcodec_alloc_context3(vcodec);
   if (!vc) {
       Log("could not allocate video codec context");
       exit(1);
   }
+  out->vc = vc;
 
   vc->codec_id = vcodec_id;
   vc->codec_type = AVMEDIA_TYPE_VIDEO;
-  vc->pix_fmt = AV_PIX_FMT_YUV420P;
+  vc->pix_fmt = pix_fmt;
 
-  if (args->pix_fmt) {
-    if (0 == strcmp(args->pix_fmt, "yuv420p")) {
-      vc->pix_fmt = AV_PIX_FMT_YUV420P;
-    } else if (0 == strcmp(args->pix_fmt, "yuv444p")) {
-      vc->pix_fmt = AV_PIX_FMT_YUV444P;
-    } else {
-      Log("Unknown pix_fmt specified: %s - using default", args->pix_fmt);
-    }
-  }
-
-  bool do_swscale = true;
-  if (vfmt_in.format == messages::PixFmt_YUV444P) {
-    Log("GPU color conversion enabled, ignoring user output settings and picking yuv444p");
-    vc->pix_fmt = AV_PIX_FMT_YUV444P;
-    do_swscale = false;
-  }
-
-  // temporarily disabled codepath as we're going to try gpu scalign or nothing
-  int divider = 1;
-  // if (args->divider != 0) {
-  //   if (args->divider == 2 || args->divider == 4) {
-  //     divider = args->divider;
-  //   } else {
-  //     Log("Invalid size divider %d: must be 2 or 4. Ignoring...", args->divider);
-  //   }
-  // }
-
-  int out_width = width / divider;
-  int out_height = height / divider;
-
-  // resolution must be a multiple of two
-  if (out_width % 2 != 0) {
-    out_width++;
-  }
-  if (out_height % 2 != 0) {
-    out_height++;
-  }
-
-  Log("output resolution: %dx%d", out_width, out_height);
-
-  vc->width = out_width;
-  vc->height = out_height;
+  vc->width = out->width;
+  vc->height = out->height;
   // frames per second - pts is in microseconds
-  video_st->time_base = AVRational{1,1000000};
-  vc->time_base = video_st->time_base;
+  out->video_st->time_base = AVRational{1,1000000};
+  vc->time_base = out->video_st->time_base;
 
   vc->gop_size = 120;
   if (args->gop_size) {
@@ -272,30 +427,11 @@ void Run(MainArgs *args, Params *params) {
   vc->rc_buffer_size = 0;
 
   // H264
-  int crf = 20;
-  if (args->crf != -1) {
-    if (args->crf >= 0 && args->crf <= 51) {
-      if (args->crf < 18 || args->crf > 28) {
-        Log("Warning: sane crf values lie within 18-28, using crf %d at your own risks", args->crf);
-      }
-      crf = args->crf;
-    } else {
-      Log("Invalid crf value %d (must be in the 0-51 range), ignoring", args->crf);
-    }
-  }
-
-  vc->qmin = crf;
-  vc->qmax = crf;
+  vc->qmin = out->settings.crf;
+  vc->qmax = out->settings.crf;
 
   // multithreading
-  vc->thread_count = 1;
-  if (args->threads) {
-    if (args->threads > 0 && args->threads <= 32) {
-      vc->thread_count = args->threads;
-    } else {
-      Log("Invalid threads parameter %d, ignoring", args->threads);
-    }
-  }
+  vc->thread_count = out->threads;
 
   if (vc->thread_count > 1) {
     Log("Activating frame-level threading with %d threads", vc->thread_count);
@@ -310,11 +446,7 @@ void Run(MainArgs *args, Params *params) {
     vc->profile = FF_PROFILE_H264_BASELINE;
   }
 
-  const char *preset = "ultrafast";
-  if (args->x264_preset) {
-    preset = args->x264_preset;
-  }
-  av_opt_set(vc->priv_data, "preset", preset, AV_OPT_SEARCH_CHILDREN);
+  av_opt_set(vc->priv_data, "preset", out->settings.preset, AV_OPT_SEARCH_CHILDREN);
 
   ret = avcodec_open2(vc, vcodec, NULL);
   if (ret < 0) {
@@ -322,13 +454,230 @@ void Run(MainArgs *args, Params *params) {
     exit(1);
   }
 
-  ret = avcodec_parameters_from_context(video_st->codecpar, vc);
+  ret = avcodec_parameters_from_context(out->video_st->codecpar, vc);
   if (ret < 0) {
     Log("could not copy video codec parameters");
     exit(1);
   }
 
-  // audio codec 
+  // video frame
+  out->vframe = av_frame_alloc();
+  if (!out->vframe) {
+    Log("could not allocate video frame");
+    exit(1);
+  }
+  out->vframe->format = vc->pix_fmt;
+  out->vframe->width = vc->width;
+  out->vframe->height = vc->height;
+}
+
+void Run(MainArgs *args, Params *params) {
+  MicroProfileOnThreadCreate("encoder");
+  MICROPROFILE_SCOPE(EncoderMain);
+
+  int ret;
+
+  av_register_all();
+
+  if (args->debug_av) {
+    av_log_set_level(AV_LOG_DEBUG);
+  }
+
+  // receive video format info
+  VideoFormat vfmt_in;
+  ret = params->receive_video_format(params->private_data, &vfmt_in);
+  if (ret != 0) {
+    printf("could not receive video format");
+    exit(1);
+  }
+  int width = (int) vfmt_in.width;
+  int height = (int) vfmt_in.height;
+  int linesize = (int) vfmt_in.linesize[0];
+
+  Log("video resolution: %dx%d, format %s, vflip %d, %d planes, linesize %d, %d bytes per frame",
+    width, height, messages::EnumNamePixFmt(vfmt_in.format), (int) vfmt_in.vflip,
+    vfmt_in.num_planes, linesize, (int) vfmt_in.frame_size);
+
+  const int64_t buffer_size = vfmt_in.frame_size;
+  uint8_t *buffer = (uint8_t*) malloc(buffer_size);
+  if (!buffer) {
+    Log("could not allocate buffer");
+    exit(1);
+  }
+
+  // receive audio format info
+  AudioFormat afmt_in;
+  memset(&afmt_in, 0, sizeof(afmt_in));
+  if (params->has_audio) {
+    ret = params->receive_audio_format(params->private_data, &afmt_in);
+    if (ret != 0) {
+      Log("could not receive audio format, disabling audio");
+      params->has_audio = false;
+    } else {
+      Log("audio format: %d channels, %d rate, %s format",
+        afmt_in.channels, afmt_in.rate, messages::EnumNameSampleFmt(afmt_in.format));
+    }
+  }
+
+  AVPixelFormat out_pix_fmt = AV_PIX_FMT_YUV420P;
+  if (args->pix_fmt) {
+    if (0 == strcmp(args->pix_fmt, "yuv420p")) {
+      out_pix_fmt = AV_PIX_FMT_YUV420P;
+    } else if (0 == strcmp(args->pix_fmt, "yuv444p")) {
+      out_pix_fmt = AV_PIX_FMT_YUV444P;
+    } else {
+      Log("Unknown pix_fmt specified: %s - using default", args->pix_fmt);
+    }
+  }
+
+  if (vfmt_in.format == messages::PixFmt_YUV444P) {
+    Log("GPU color conversion enabled, ignoring user output settings and picking yuv444p");
+    out_pix_fmt = AV_PIX_FMT_YUV444P;
+  } else if (vfmt_in.format == messages::PixFmt_I420 || vfmt_in.format == messages::PixFmt_NV12) {
+    Log("GPU color conversion enabled, ignoring user output settings and picking yuv420p");
+    out_pix_fmt = AV_PIX_FMT_YUV420P;
+  }
+
+  AVPixelFormat vpix_fmt;
+  switch (vfmt_in.format) {
+    case messages::PixFmt_RGBA:
+      vpix_fmt = AV_PIX_FMT_RGBA;
+      break;
+    case messages::PixFmt_BGRA:
+      vpix_fmt = AV_PIX_FMT_BGRA;
+      break;
+    case messages::PixFmt_YUV444P:
+      // no conversion actually required
+      vpix_fmt = AV_PIX_FMT_YUV444P;
+      break;
+    case messages::PixFmt_I420:
+      vpix_fmt = AV_PIX_FMT_YUV420P;
+      break;
+    case messages::PixFmt_NV12:
+      vpix_fmt = AV_PIX_FMT_NV12;
+      break;
+    default:
+      Log("Unknown/unsupported video format %d, bailing out", vfmt_in.format);
+      exit(1);
+  }
+
+  // describe the captured frame's planes
+  const uint8_t *in_data[4] = {0};
+  int in_linesize[4] = {0};
+  if (vfmt_in.num_planes > 1) {
+    // planar formats come from GPU conversion, already top-down
+    for (int i = 0; i < vfmt_in.num_planes; i++) {
+      in_data[i] = buffer + vfmt_in.offset[i];
+      in_linesize[i] = (int) vfmt_in.linesize[i];
+    }
+  } else if (vfmt_in.vflip) {
+    // specify negative stride to flip
+    in_data[0] = buffer + linesize*(height-1);
+    in_linesize[0] = -linesize;
+  } else {
+    in_data[0] = buffer;
+    in_linesize[0] = linesize;
+  }
+
+  // global defaults for output settings
+  int default_crf = 20;
+  if (args->crf != -1) {
+    int crf = ValidateCrf(args->crf);
+    if (crf != -1) {
+      default_crf = crf;
+    }
+  }
+
+  const char *default_preset = "ultrafast";
+  if (args->x264_preset) {
+    default_preset = args->x264_preset;
+  }
+
+  std::vector<OutputSettings> settings;
+  if (params->num_outputs > 0) {
+    settings.assign(params->outputs, params->outputs + params->num_outputs);
+  } else {
+    OutputSettings os;
+    memset(&os, 0, sizeof(os));
+    os.divider = 1;
+    os.crf = -1;
+    settings.push_back(os);
+  }
+
+  // largest first, so that each output can be downscaled from the previous one
+  std::stable_sort(settings.begin(), settings.end(), [](const OutputSettings &a, const OutputSettings &b) {
+    return a.divider < b.divider;
+  });
+
+  int threads = 1;
+  if (args->threads) {
+    if (args->threads > 0 && args->threads <= 32) {
+      threads = args->threads;
+    } else {
+      Log("Invalid threads parameter %d, ignoring", args->threads);
+    }
+  }
+  if (params->thread_budget > 0) {
+    // other sessions may be encoding too, stay within our share
+    int share = std::max(1, params->thread_budget / static_cast<int>(settings.size()));
+    if (threads > share) {
+      Log("Limiting codec threads from %d to %d per output (%d for this session)", threads, share, params->thread_budget);
+      threads = share;
+    }
+  }
+
+  std::string name = params->name ? params->name : "capsule";
+  std::string dir = args->dir ? args->dir : ".";
+
+  std::vector<VideoOutput *> outputs;
+  for (size_t i = 0; i < settings.size(); i++) {
+    auto out = new VideoOutput();
+    out->settings = settings[i];
+    out->threads = threads;
+
+    if (out->settings.crf == -1) {
+      out->settings.crf = default_crf;
+    } else if (ValidateCrf(out->settings.crf) == -1) {
+      out->settings.crf = default_crf;
+    }
+    if (out->settings.preset[0] == '\0') {
+      strncpy(out->settings.preset, default_preset, sizeof(out->settings.preset) - 1);
+    }
+
+    out->width = width / out->settings.divider;
+    out->height = height / out->settings.divider;
+
+    // resolution must be a multiple of two
+    if (out->width % 2 != 0) {
+      out->width++;
+    }
+    if (out->height % 2 != 0) {
+      out->height++;
+    }
+
+    std::ostringstream oss;
+    oss << dir << "/" << name;
+    if (i > 0) {
+      oss << "-" << out->width << "x" << out->height;
+      out->source = outputs.back();
+    }
+    oss << ".mp4";
+    out->path = oss.str();
+
+    Log("output %d: %s, %dx%d, crf %d, preset %s", (int) i, out->path.c_str(),
+      out->width, out->height, out->settings.crf, out->settings.preset);
+
+    OpenVideoOutput(args, out, out_pix_fmt, params->has_audio);
+    outputs.push_back(out);
+  }
+
+  // audio codec, shared by all outputs: samples are only encoded once
+  AVCodecID acodec_id = AV_CODEC_ID_AAC;
+  AVCodec *acodec = nullptr;
+  AVCodecContext *ac = nullptr;
+  AVFrame *aframe = nullptr;
+  struct SwrContext *swr = nullptr;
+
   if (params->has_audio) {
     acodec = avcodec_find_encoder(acodec_id);
     if (!acodec) {
@@ -348,8 +697,7 @@ void Run(MainArgs *args, Params *params) {
     ac->channels = afmt_in.channels;
     ac->channel_layout = AV_CH_LAYOUT_STEREO;
 
-    audio_st->time_base = AVRational{1,ac->sample_rate};
-    ac->time_base = audio_st->time_base;
+    ac->time_base = AVRational{1,ac->sample_rate};
 
     ret = avcodec_open2(ac, acodec, NULL);
     if (ret < 0) {
@@ -357,40 +705,16 @@ void Run(MainArgs *args, Params *params) {
       exit(1);
     }
 
-    ret = avcodec_parameters_from_context(audio_st->codecpar, ac);
-    if (ret < 0) {
-      Log("could not copy audio codec parameters");
-      exit(1);
+    for (auto out: outputs) {
+      out->audio_st->time_base = ac->time_base;
+      ret = avcodec_parameters_from_context(out->audio_st->codecpar, ac);
+      if (ret < 0) {
+        Log("could not copy audio codec parameters");
+        exit(1);
+      }
     }
   }
 
-  // video frame
-  vframe = av_frame_alloc();
-  if (!vframe) {
-    Log("could not allocate video frame");
-    exit(1);
-  }
-  vframe->format = vc->pix_fmt;
-  vframe->width = vc->width;
-  vframe->height = vc->height;
-
-  AVPixelFormat vpix_fmt;
-  switch (vfmt_in.format) {
-    case messages::PixFmt_RGBA:
-      vpix_fmt = AV_PIX_FMT_RGBA;
-      break;
-    case messages::PixFmt_BGRA:
-      vpix_fmt = AV_PIX_FMT_BGRA;
-      break;
-    case messages::PixFmt_YUV444P:
-      // no conversion actually required
-      vpix_fmt = AV_PIX_FMT_YUV444P;
-      break;
-    default:
-      Log("Unknown/unsupported video format %d, bailing out", vfmt_in.format);
-      exit(1);
-  }
-
   // audio frame
   if (params->has_audio) {
     aframe = av_frame_alloc();
@@ -411,69 +735,77 @@ void Run(MainArgs *args, Params *params) {
     }
   }
 
-  // TODO: just use vfmt specs instead of handling vflip here
-  int sws_linesize[1];
-  uint8_t *sws_in[1];
+  // set up the scaling chain: the first output converts from the
+  // captured frame, the others downscale from the previous output.
+  for (auto out: outputs) {
+    auto vframe = out->vframe;
+
+    int src_width = width;
+    int src_height = height;
+    AVPixelFormat src_pix_fmt = vpix_fmt;
+    if (out->source) {
+      src_width = out->source->width;
+      src_height = out->source->height;
+      src_pix_fmt = out->source->vc->pix_fmt;
+    }
 
-  if (do_swscale) {
-    // initialize swscale context
-    sws = sws_getContext(
+    if (src_width == out->width && src_height == out->height && src_pix_fmt == out->vc->pix_fmt) {
+      // no conversion required, just point to the source's planes
+      out->borrowed_planes = true;
+      for (int i = 0; i < 4; i++) {
+        if (out->source) {
+          vframe->data[i] = out->source->vframe->data[i];
+          vframe->linesize[i] = out->source->vframe->linesize[i];
+        } else {
+          vframe->data[i] = const_cast<uint8_t *>(in_data[i]);
+          vframe->linesize[i] = in_linesize[i];
+        }
+      }
+      continue;
+    }
+
+    out->sws = sws_getContext(
       // input
-      width, height, vpix_fmt,
+      src_width, src_height, src_pix_fmt,
       // output
-      vframe->width, vframe->height, vc->pix_fmt,
-      // ???
-      0, 0, 0, 0
+      vframe->width, vframe->height, out->vc->pix_fmt,
+      // downscaling from a same-colorspace frame can afford area averaging
+      out->source ? SWS_AREA : 0, 0, 0, 0
     );
-
-    int vflip = vfmt_in.vflip;
-
-    if (vflip) {
-      sws_in[0] = buffer + linesize*(height-1);
-      sws_linesize[0] = -linesize;
-    } else {
-      // specify negative stride to flip
-      sws_in[0] = buffer;
-      sws_linesize[0] = linesize;
+    if (!out->sws) {
+      Log("Could not initialize scaling context for %s", out->path.c_str());
+      exit(1);
     }
 
     // FIXME: just messing around
-    bool misalign_planes = lab::env::Get("MISALIGN_PLANES") == "1";
+    bool misalign_planes = !out->source && lab::env::Get("MISALIGN_PLANES") == "1";
     if (misalign_planes) {
       Log("Purposefully misaligning planes to confirm suspicions about x264 performance");
-      size_t frame_buffer_size = vc->width * 4 * vc->height;
+      size_t frame_buffer_size = out->width * 4 * out->height;
       uint8_t *frame_buffer = (uint8_t *) malloc(frame_buffer_size);
       vframe->data[0] = frame_buffer;
-      vframe->data[1] = frame_buffer + vc->width;
-      vframe->data[2] = frame_buffer + vc->width * 2;
-      vframe->linesize[0] = vc->width * 4;
-      vframe->linesize[1] = vc->width * 4;
-      vframe->linesize[2] = vc->width * 4;
+      vframe->data[1] = frame_buffer + out->width;
+      vframe->data[2] = frame_buffer + out->width * 2;
+      vframe->linesize[0] = out->width * 4;
+      vframe->linesize[1] = out->width * 4;
+      vframe->linesize[2] = out->width * 4;
     } else {
       /* the image can be allocated by any means and av_image_alloc() is
       * just the most convenient way if av_malloc() is to be used */
       ret = av_image_alloc(
           vframe->data,
           vframe->linesize,
-          vc->width,
-          vc->height,
-          vc->pix_fmt,
+          out->width,
+          out->height,
+          out->vc->pix_fmt,
           32 /* alignment */
       );
       if (ret < 0) {
         Log("Could not allocate raw picture buffer");
         exit(1);
       }
+      out->owns_frame_buffer = true;
     }
-  } else {
-    // FIXME: use vfmt offsets & linesizes instead of computing them here
-    // this assumes a horizontal format, see https://twitter.com/fasterthanlime/status/839086194919161857
-    vframe->data[0] = buffer;
-    vframe->data[1] = buffer + width;
-    vframe->data[2] = buffer + width * 2;
-    vframe->linesize[0] = width * 4;
-    vframe->linesize[1] = width * 4;
-    vframe->linesize[2] = width * 4;
   }
 
   // initialize swrescale context
@@ -512,18 +844,25 @@ void Run(MainArgs *args, Params *params) {
     Log("resampling context initialized");
   }
 
+  for (auto out: outputs) {
+    av_dump_format(out->oc, 0, out->path.c_str(), 1);
 
-  av_dump_format(oc, 0, output_path, 1);
+    // write stream header, if any
+    ret = avformat_write_header(out->oc, NULL);
+    if (ret < 0) {
+      printf("Error occured when opening output file\n");
+      exit(1);
+    }
+  }
 
-  // write stream header, if any
-  ret = avformat_write_header(oc, NULL);
-  if (ret < 0) {
-    printf("Error occured when opening output file\n");
-    exit(1);
+  // with a ladder, each output's codec runs on its own thread
+  bool parallel = outputs.size() > 1;
+  if (parallel) {
+    for (auto out: outputs) {
+      out->thread = new std::thread(EncodeWorker, out);
+    }
   }
 
-  vframe->pts = 0;
-  int vnext_pts = 0;
   int anext_pts = 0;
 
   int last_frame = 0;
@@ -575,53 +914,43 @@ void Run(MainArgs *args, Params *params) {
 
       {
         MICROPROFILE_SCOPE(EncoderScale);
-        if (do_swscale) {
-          sws_scale(sws, sws_in, sws_linesize, 0, height, vframe->data, vframe->linesize);
-        } else {
-          // muffin
+        for (auto out: outputs) {
+          if (!out->sws) {
+            continue;
+          }
+
+          if (out->source) {
+            auto src = out->source->vframe;
+            sws_scale(out->sws, src->data, src->linesize, 0, out->source->height, out->vframe->data, out->vframe->linesize);
+          } else {
+            sws_scale(out->sws, in_data, in_linesize, 0, height, out->vframe->data, out->vframe->linesize);
+          }
         }
       }
 
-      vnext_pts = timestamp;
-      vframe->pts = vnext_pts;
-
-      // write video frame
-      {
-        MICROPROFILE_SCOPE(EncoderSendVideoFrame);
-        ret = avcodec_send_frame(vc, vframe);
+      for (auto out: outputs) {
+        out->vframe->pts = timestamp;
       }
-      if (ret < 0) {
-          Log("Error encoding video frame");
-          exit(1);
-      }
-
-      while (ret >= 0) {
-        AVPacket vpkt;
-        av_init_packet(&vpkt);
 
-        {
-          MICROPROFILE_SCOPE(EncoderRecvVideoPkt);
-          ret = avcodec_receive_packet(vc, &vpkt);
+      // write video frame
+      if (parallel) {
+        for (auto out: outputs) {
+          {
+            std::lock_guard<std::mutex> lock(out->work_mutex);
+            out->has_work = true;
+          }
+          out->work_cond.notify_all();
         }
-        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-            Log("Error encoding a video frame");
-            exit(1);
-        } else if (ret >= 0) {
-            // printf(">> vpkt timestamp before rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-            av_packet_rescale_ts(&vpkt, vc->time_base, video_st->time_base);
-            // printf(">>                after  rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-            vpkt.stream_index = video_st->index;
 
-            /* Write the compressed frame to the media file. */
-            {
-              MICROPROFILE_SCOPE(EncoderWriteVideoPkt);
-              ret = av_interleaved_write_frame(oc, &vpkt);
-            }
-            if (ret < 0) {
-                Log("Error while writing video frame");
-                exit(1);
-            }
+        MICROPROFILE_SCOPE(EncoderWaitOutputs);
+        for (auto out: outputs) {
+          std::unique_lock<std::mutex> lock(out->work_mutex);
+          while (out->has_work) {
+            out->work_cond.wait(lock);
+          }
         }
+      } else {
+        EncodeVideoFrame(outputs[0], outputs[0]->vframe);
       }
     }
 
@@ -706,60 +1035,10 @@ void Run(MainArgs *args, Params *params) {
           exit(1);
         }
 
-        while (ret >= 0) {
-          AVPacket apkt;
-          av_init_packet(&apkt);
-          {
-            MICROPROFILE_SCOPE(EncoderRecvAudioPkt);
-            ret = avcodec_receive_packet(ac, &apkt);
-          }
-
-          if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-              Log("Error encoding an audio frame");
-              exit(1);
-          } else if (ret >= 0) {
-              av_packet_rescale_ts(&apkt, ac->time_base, audio_st->time_base);
-              apkt.stream_index = audio_st->index;
-              /* Write the compressed audio frame to the media file. */
-              {
-                MICROPROFILE_SCOPE(EncoderWriteAudioPkt);
-                ret = av_interleaved_write_frame(oc, &apkt);
-              }
-              if (ret < 0) {
-                  Log("Error while writing audio frame");
-                  exit(1);
-              }
-          }
-        }
+        WriteAudioPackets(ac, outputs);
       }
 
-      // printf("Copied %d audio frames\n", audio_frames_copied);
-
-      while (ret >= 0) {
-        AVPacket apkt;
-        av_init_packet(&apkt);
-        {
-          MICROPROFILE_SCOPE(EncoderRecvAudioPkt);
-          ret = avcodec_receive_packet(ac, &apkt);
-        }
-
-        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-            Log("Error encoding an audio frame");
-            exit(1);
-        } else if (ret >= 0) {
-            av_packet_rescale_ts(&apkt, ac->time_base, audio_st->time_base);
-            apkt.stream_index = audio_st->index;
-            /* Write the compressed audio frame to the media file. */
-            {
-              MICROPROFILE_SCOPE(EncoderWriteAudioPkt);
-              ret = av_interleaved_write_frame(oc, &apkt);
-            }
-            if (ret < 0) {
-                Log("Error while writing audio frame\n");
-                exit(1);
-            }
-        }
-      }
+      WriteAudioPackets(ac, outputs);
     }
 
     if (last_frame) {
@@ -767,33 +1046,22 @@ void Run(MainArgs *args, Params *params) {
     }
   }
 
-  // delayed video frames
-  ret = avcodec_send_frame(vc, NULL);
-  if (ret < 0) {
-    Log("couldn't flush video codec\n");
-    exit(1);
+  if (parallel) {
+    for (auto out: outputs) {
+      {
+        std::lock_guard<std::mutex> lock(out->work_mutex);
+        out->quit = true;
+      }
+      out->work_cond.notify_all();
+      out->thread->join();
+      delete out->thread;
+      out->thread = nullptr;
+    }
   }
 
-  while (ret >= 0) {
-    AVPacket vpkt;
-    av_init_packet(&vpkt);
-    ret = avcodec_receive_packet(vc, &vpkt);
-
-    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-        Log("Error encoding a video frame\n");
-        exit(1);
-    } else if (ret >= 0) {
-        // printf(">> vpkt timestamp before rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-        av_packet_rescale_ts(&vpkt, vc->time_base, video_st->time_base);
-        // printf(">>                after  rescaling = %d, %.4f secs\n", (int) vpkt.pts, ((double) vpkt.pts) / 1000000.0);
-        vpkt.stream_index = video_st->index;
-        /* Write the compressed frame to the media file. */
-        ret = av_interleaved_write_frame(oc, &vpkt);
-        if (ret < 0) {
-            Log("Error while writing video frame\n");
-            exit(1);
-        }
-    }
+  // delayed video frames
+  for (auto out: outputs) {
+    EncodeVideoFrame(out, NULL);
   }
 
   // delayed audio frames
@@ -804,49 +1072,41 @@ void Run(MainArgs *args, Params *params) {
       exit(1);
     }
 
-    while (ret >= 0) {
-      AVPacket apkt;
-      av_init_packet(&apkt);
-      ret = avcodec_receive_packet(ac, &apkt);
+    WriteAudioPackets(ac, outputs);
+  }
 
-      if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-          Log("Error encoding a audio frame\n");
-          exit(1);
-      } else if (ret >= 0) {
-          av_packet_rescale_ts(&apkt, ac->time_base, audio_st->time_base);
-          apkt.stream_index = audio_st->index;
-          /* Write the compressed frame to the media file. */
-          ret = av_interleaved_write_frame(oc, &apkt);
-          if (ret < 0) {
-              Log("Error while writing audio frame\n");
-              exit(1);
-          }
-      }
+  for (auto out: outputs) {
+    // Write format trailer if any
+    ret = av_write_trailer(out->oc);
+    if (ret < 0) {
+      printf("failed to write trailer\n");
+      exit(1);
     }
-  }
 
-  // Write format trailer if any
-  ret = av_write_trailer(oc);
-  if (ret < 0) {
-    printf("failed to write trailer\n");
-    exit(1);
-  }
+    avcodec_close(out->vc);
+    if (out->owns_frame_buffer) {
+      av_freep(&out->vframe->data[0]);
+    } else {
+      // don't free, we're just messing with avframe buffers
+    }
+    av_frame_free(&out->vframe);
+    if (out->sws) {
+      sws_freeContext(out->sws);
+    }
 
-  avcodec_close(vc);
-  if (do_swscale) {
-    av_freep(&vframe->data[0]);
-  } else {
-    // don't free, we're just messing with avframe buffers
+    avio_close(out->oc->pb);
+    avformat_free_context(out->oc);
+    delete out;
   }
-  av_frame_free(&vframe);
 
   if (params->has_audio) {
     avcodec_close(ac);
     av_frame_free(&aframe);
+    swr_free(&swr);
+    free(sample_buf);
   }
 
-  avio_close(oc->pb);
-  avformat_free_context(oc);
+  free(buffer);
 
   // FIXME: seems to crash atm.
   // MicroProfileOnThreadExit();
@@ -26,15 +26,25 @@
 
 #include "args.h"
 
+#include <vector>
+
 namespace capsule {
 namespace encoder {
 
+static const int kMaxPlanes = 4;
+
 struct VideoFormat {
   int width;
   int height;
   messages::PixFmt format;
   bool vflip;
-  int64_t pitch;
+  // where each plane starts in a frame, and its row length, in bytes.
+  // packed formats only use the first plane.
+  int num_planes;
+  int64_t offset[kMaxPlanes];
+  int64_t linesize[kMaxPlanes];
+  // bytes per frame, all planes included
+  int64_t frame_size;
 };
 
 struct AudioFormat {
@@ -43,6 +53,22 @@ struct AudioFormat {
   messages::SampleFmt format;
 };
 
+static const int kMaxPresetLength = 32;
+
+/**
+ * One rung of the output ladder: all outputs share a single
+ * capture and colour conversion, smaller ones are downscaled
+ * from the next-larger one.
+ */
+struct OutputSettings {
+  // output size is the input size divided by this (1, 2, 4...)
+  int divider;
+  // -1 = use the global --crf setting
+  int crf;
+  // empty = use the global --x264-preset setting
+  char preset[kMaxPresetLength];
+};
+
 typedef int (*VideoFormatReceiver)(void *private_data, VideoFormat *vfmt);
 typedef int64_t (*VideoFrameReceiver)(void *private_data, uint8_t *buffer, size_t buffer_size, int64_t *timestamp);
 
@@ -58,8 +84,30 @@ struct Params {
   bool has_audio;
   AudioFormatReceiver receive_audio_format;
   AudioFramesReceiver receive_audio_frames;
+
+  // if 0, a single full-resolution output is produced
+  int num_outputs;
+  OutputSettings *outputs;
+
+  // output files are <name>.mp4, then <name>-WxH.mp4 for smaller rungs
+  const char *name;
+  // codec threads this session may use across all its outputs,
+  // 0 = no limit besides --threads
+  int thread_budget;
 };
 
+// parses an output ladder spec like "1:20:veryfast,2:23,4"
+// (divider[:crf[:preset]], comma-separated, each divider at most once)
+bool ParseOutputs(const char *spec, std::vector<OutputSettings> &outputs);
+
+// formats Run can encode from with these args, fewest CPU passes first:
+// what capsulerun offers libcapsule in CaptureStart
+std::vector<messages::PixFmt> IngestFormats(const MainArgs *args);
+
+// CPU conversion passes between a captured frame and the codec's
+// input, -1 if Run can't encode from that format at all
+int IngestPasses(messages::PixFmt format);
+
 void Run(MainArgs *args, Params *params);
 
 } // namespace encoder
@@ -82,6 +82,20 @@ ProcessInterface *Executor::LaunchProcess(MainArgs *args) {
     return nullptr;
   }
 
+  // the Vulkan loader looks for implicit layer manifests in
+  // $XDG_DATA_DIRS/vulkan/implicit_layer.d, ours sits next to libcapsule.
+  // The layer is opt-in: its manifest only enables it when CAPSULE_VULKAN=1
+  // is in our own environment, which the game inherits.
+  std::string xdg_data_dirs_orig = lab::env::Get("XDG_DATA_DIRS");
+  if (xdg_data_dirs_orig == "") {
+    // the spec's default, which we'd otherwise hide
+    xdg_data_dirs_orig = "/usr/local/share:/usr/share";
+  }
+  std::string xdg_data_dirs_var = std::string(args->libpath) + ":" + xdg_data_dirs_orig;
+  if (!lab::env::Set("XDG_DATA_DIRS", xdg_data_dirs_var)) {
+    Log("Couldn't set up Vulkan layer, Vulkan games won't be captured");
+  }
+
   std::string pipe_var = "CAPSULE_PIPE_PATH=" + std::string(args->pipe);
   char *env_additions[] = {
     const_cast<char *>(pipe_var.c_str()),
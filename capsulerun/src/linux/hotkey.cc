@@ -20,22 +20,22 @@
  */
 
 #include "../hotkey.h"
+#include "../logging.h"
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 
-#include <thread>
-
 namespace capsule {
 namespace hotkey {
 
 Display *capsule_x11_dpy;
 Window capsule_x11_root;
 
+// called by the main loop whenever the X connection is readable
 static void Poll (MainLoop *ml) {
     XEvent ev;
 
-    while(1) {
+    while (XPending(capsule_x11_dpy)) {
         XNextEvent(capsule_x11_dpy, &ev);
 
         switch (ev.type) {
@@ -50,6 +50,10 @@ static void Poll (MainLoop *ml) {
 void Init (MainLoop *ml) {
     // XSetErrorHandler(capsule_x11_error_handler);
     capsule_x11_dpy = XOpenDisplay(0);
+    if (!capsule_x11_dpy) {
+        Log("hotkey: could not open X display, no hotkey");
+        return;
+    }
     capsule_x11_root = DefaultRootWindow(capsule_x11_dpy);
 
     int num_modifiers = 4;
@@ -78,9 +82,12 @@ void Init (MainLoop *ml) {
         );
     }
     XSelectInput(capsule_x11_dpy, capsule_x11_root, KeyPressMask);
+    // nobody's blocking in XNextEvent to flush those for us
+    XFlush(capsule_x11_dpy);
 
-    std::thread poll_thread(Poll, ml);
-    poll_thread.detach();
+    ml->Watch(ConnectionNumber(capsule_x11_dpy), [ml](uint32_t /* events */) {
+        Poll(ml);
+    });
 }
 
 } // namespace hotkey
@@ -79,16 +79,11 @@ PulseReceiver::PulseReceiver() {
   afmt_.rate = ss.rate;
   afmt_.format = messages::SampleFmt_F32;
   auto sample_size = audio::SampleWidth(afmt_.format) / 8;
-  buffer_size_ = kAudioNbSamples * afmt_.channels * sample_size;
+  frame_size_ = afmt_.channels * sample_size;
+  buffer_size_ = kAudioNbSamples * frame_size_;
   in_buffer_ = reinterpret_cast<uint8_t *>(calloc(1, buffer_size_));
   buffers_ = reinterpret_cast<uint8_t *>(calloc(kAudioNbBuffers, buffer_size_));
-
-  for (int i = 0; i < kAudioNbBuffers; i++) {
-    buffer_state_[i] = kBufferStateAvailable;
-  }
-
-  commit_index_ = 0;
-  process_index_ = 0;
+  frames_ = new SpscRing<uint8_t>(kAudioNbBuffers * buffer_size_, buffers_);
 
   // start reading
   pa_thread_ = new std::thread(&PulseReceiver::ReadLoop, this);
@@ -105,6 +100,14 @@ void PulseReceiver::ReadLoop() {
 }
 
 bool PulseReceiver::ReadFromPa() {
+  // the ring is a whole number of buffers, so a free one is always contiguous
+  uint8_t *target;
+  bool overrun = frames_->Reserve(buffer_size_, &target) < buffer_size_;
+  if (overrun) {
+    // no room for it, read it anyway to keep up with pulse and skip it
+    target = in_buffer_;
+  }
+
   {
     std::lock_guard<std::mutex> lock(pa_mutex_);
 
@@ -114,7 +117,7 @@ bool PulseReceiver::ReadFromPa() {
     }
 
     int pa_err;
-    int ret = pulse::SimpleRead(ctx_, in_buffer_, buffer_size_, &pa_err);
+    int ret = pulse::SimpleRead(ctx_, target, buffer_size_, &pa_err);
     if (ret < 0) {
       fprintf(stderr, "Could not read from pulseaudio, error %d (%x)\n", pa_err,
               pa_err);
@@ -122,29 +125,19 @@ bool PulseReceiver::ReadFromPa() {
     }
   }
 
-  // cool, so we got a buffer, now let's find room for it.
-  {
-    std::lock_guard<std::mutex> lock(buffer_mutex_);
-
-    if (buffer_state_[commit_index_] != kBufferStateAvailable) {
-      // no room for it, just skip those then
-      if (!overrun_) {
-        overrun_ = true;
-        capsule::Log("PulseReceiver: buffer overrun (captured audio but "
-                   "nowhere to place it)\n");
-      }
-      // keep trying tho
-      return true;
+  if (overrun) {
+    if (!overrun_) {
+      overrun_ = true;
+      capsule::Log("PulseReceiver: buffer overrun (captured audio but "
+                 "nowhere to place it)\n");
     }
-
-    overrun_ = false;
-
-    uint8_t *target = buffers_ + (commit_index_ * buffer_size_);
-    memcpy(target, in_buffer_, buffer_size_);
-    buffer_state_[commit_index_] = kBufferStateCommitted;
-    commit_index_ = (commit_index_ + 1) % kAudioNbBuffers;
+    frames_->Overrun(buffer_size_);
+    // keep trying tho
+    return true;
   }
 
+  overrun_ = false;
+  frames_->Commit(buffer_size_);
   return true;
 }
 
@@ -158,28 +151,23 @@ int PulseReceiver::ReceiveFormat(encoder::AudioFormat *afmt) {
 }
 
 void *PulseReceiver::ReceiveFrames(int64_t *frames_received) {
-  std::lock_guard<std::mutex> lock(buffer_mutex_);
+  *frames_received = 0;
+  if (!initialized_) {
+    return NULL;
+  }
+
+  // the encoder is done with what it got last time
+  frames_->Release(held_size_);
 
-  if (buffer_state_[process_index_] != kBufferStateCommitted) {
+  uint8_t *source;
+  held_size_ = frames_->Peek(frames_->Capacity(), &source);
+  if (held_size_ == 0) {
     // nothing to receive
-    *frames_received = 0;
     return NULL;
-  } else {
-    // there's a buffer ready!
-
-    // if the previous one was processing, that means we've processed it.
-    auto prev_process_index =
-        (process_index_ == 0) ? (kAudioNbBuffers - 1) : (process_index_ - 1);
-    if (buffer_state_[prev_process_index] == kBufferStateProcessing) {
-      buffer_state_[prev_process_index] = kBufferStateAvailable;
-    }
-
-    uint8_t *source = buffers_ + (process_index_ * buffer_size_);
-    *frames_received = kAudioNbSamples;
-    buffer_state_[process_index_] = kBufferStateProcessing;
-    process_index_ = (process_index_ + 1) % kAudioNbBuffers;
-    return source;
   }
+
+  *frames_received = static_cast<int64_t>(held_size_ / frame_size_);
+  return source;
 }
 
 void PulseReceiver::Stop() {
@@ -201,6 +189,7 @@ PulseReceiver::~PulseReceiver() {
     free(in_buffer_);
   }
   if (buffers_) {
+    delete frames_;
     free(buffers_);
   }
 }
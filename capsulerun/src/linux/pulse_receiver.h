@@ -26,6 +26,7 @@
 
 #include "../audio_receiver.h"
 #include "../encoder.h"
+#include "../spsc_ring.h"
 #include "pulse_dynamic.h"
 
 namespace capsule {
@@ -34,12 +35,6 @@ namespace audio {
 static const int kAudioNbBuffers = 64;
 static const int kAudioNbSamples = 128;
 
-enum BufferState {
-  kBufferStateAvailable = 0,
-  kBufferStateCommitted,
-  kBufferStateProcessing,
-};
-
 class PulseReceiver : public AudioReceiver {
   public:
     PulseReceiver();
@@ -60,12 +55,13 @@ class PulseReceiver : public AudioReceiver {
 
     uint8_t *buffers_ = nullptr;
     size_t buffer_size_;
-    int buffer_state_[kAudioNbBuffers];
-    int commit_index_ = 0;
-    int process_index_ = 0;
+    size_t frame_size_;
+    // bytes of buffers_, filled one buffer at a time by ReadLoop
+    SpscRing<uint8_t> *frames_ = nullptr;
+    // handed to the encoder, released on its next ReceiveFrames
+    size_t held_size_ = 0;
 
     std::thread *pa_thread_ = nullptr;
-    std::mutex buffer_mutex_;
     std::mutex pa_mutex_;
 
     bool overrun_ = false;
@@ -0,0 +1,154 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "reactor.h"
+
+#include <sys/epoll.h>   // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/eventfd.h> // eventfd
+#include <unistd.h>      // read, write, close
+#include <errno.h>       // errno, EINTR
+#include <stdlib.h>      // exit
+
+#include "../logging.h"
+
+namespace capsule {
+namespace reactor {
+
+static const int kMaxEvents = 32;
+
+Reactor::Reactor() {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    Log("Reactor: could not create epoll instance (errno %d), bailing out", errno);
+    exit(1);
+  }
+
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ < 0) {
+    Log("Reactor: could not create eventfd (errno %d), bailing out", errno);
+    exit(1);
+  }
+
+  Add(wake_fd_, [this](uint32_t /* events */) {
+    uint64_t count;
+    while (read(wake_fd_, &count, sizeof(count)) == sizeof(count)) {
+      // drained
+    }
+    RunPosted();
+  });
+}
+
+Reactor::~Reactor() {
+  close(wake_fd_);
+  close(epoll_fd_);
+}
+
+bool Reactor::Add(int fd, Callback callback) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    Log("Reactor: could not watch fd %d (errno %d)", fd, errno);
+    return false;
+  }
+  callbacks_[fd] = callback;
+  return true;
+}
+
+void Reactor::Remove(int fd) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  // callers may be running that very callback: let the
+  // dispatch loop drop it once it returns
+  auto it = callbacks_.find(fd);
+  if (it != callbacks_.end()) {
+    it->second = nullptr;
+  }
+}
+
+void Reactor::Run() {
+  struct epoll_event events[kMaxEvents];
+
+  while (!stopped_) {
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Log("Reactor: epoll_wait failed (errno %d), stopping", errno);
+      break;
+    }
+
+    for (int i = 0; i < n && !stopped_; i++) {
+      int fd = events[i].data.fd;
+      auto it = callbacks_.find(fd);
+      if (it == callbacks_.end() || !it->second) {
+        // removed by an earlier callback of this batch
+        continue;
+      }
+      // copy: the callback may remove itself
+      Callback callback = it->second;
+      callback(events[i].events);
+    }
+
+    // forget removed fds, now that no callback can be running
+    for (auto it = callbacks_.begin(); it != callbacks_.end();) {
+      if (!it->second) {
+        it = callbacks_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+void Reactor::Stop() {
+  stopped_ = true;
+  Wake();
+}
+
+void Reactor::Post(Task task) {
+  {
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    posted_.push_back(task);
+  }
+  Wake();
+}
+
+void Reactor::Wake() {
+  uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) != sizeof(one)) {
+    // counter's already non-zero, the loop is awake anyway
+  }
+}
+
+void Reactor::RunPosted() {
+  std::vector<Task> tasks;
+  {
+    std::lock_guard<std::mutex> lock(posted_mutex_);
+    tasks.swap(posted_);
+  }
+  for (auto &task: tasks) {
+    task();
+  }
+}
+
+} // namespace reactor
+} // namespace capsule
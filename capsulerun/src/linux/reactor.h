@@ -0,0 +1,75 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace capsule {
+namespace reactor {
+
+/**
+ * Single-threaded epoll loop: fds are level-triggered, their callbacks
+ * run on the thread that called Run. Post and Stop are the only
+ * methods that may be called from other threads.
+ */
+class Reactor {
+  public:
+    // events are EPOLLIN, EPOLLHUP, EPOLLERR
+    typedef std::function<void(uint32_t events)> Callback;
+    typedef std::function<void()> Task;
+
+    Reactor();
+    ~Reactor();
+
+    bool Add(int fd, Callback callback);
+    // safe from within a callback, including fd's own
+    void Remove(int fd);
+
+    // dispatches until Stop is called
+    void Run();
+    void Stop();
+    // runs task on the reactor thread, as soon as it's done
+    // with the current callback
+    void Post(Task task);
+
+  private:
+    void Wake();
+    void RunPosted();
+
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::atomic<bool> stopped_{false};
+
+    std::unordered_map<int, Callback> callbacks_;
+
+    std::mutex posted_mutex_;
+    std::vector<Task> posted_;
+};
+
+} // namespace reactor
+} // namespace capsule
@@ -23,6 +23,7 @@
 
 #include <queue>
 #include <mutex>
+#include <chrono>
 #include <condition_variable>
 
 namespace capsule {
@@ -65,8 +66,8 @@ public:
 
   bool TryWaitAndPop(T &value, int milli) {
     std::unique_lock<std::mutex> lock(guard_);
-    while (queue_.empty()) {
-      signal_.wait_for(lock, std::chrono::milliseconds(milli));
+    auto ready = [this]() { return !queue_.empty(); };
+    if (!signal_.wait_for(lock, std::chrono::milliseconds(milli), ready)) {
       return false;
     }
 
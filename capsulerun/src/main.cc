@@ -37,6 +37,8 @@
 #include "argparse.h"
 #include "runner.h"
 #include "logging.h"
+#include "encoder.h"
+#include "memory.h"
 
 #if defined(LAB_WINDOWS)
 #include "windows/executor.h"
@@ -92,19 +94,28 @@ int main (int argc, char **argv) {
     OPT_STRING('d', "dir", &args.dir, "where to output .mp4 videos (defaults to current directory)"),
     OPT_STRING(0, "pipe", &args.pipe, "named pipe to listen on (defaults to unique name)"),
     OPT_BOOLEAN(0, "headless", &args.headless, "do not launch a process, just connect to pipe and behave as an encoder"),
+    OPT_BOOLEAN(0, "autostart", &args.autostart, "start capturing as soon as the game draws, without waiting for the hotkey"),
     OPT_GROUP("Video options"),
     OPT_INTEGER(0, "crf", &args.crf, "output quality. sane values range from 18 (~visually lossless) to 28 (fast but looks bad)"),
     OPT_INTEGER(0, "size_divider", &args.size_divider, "size divider: default 1, accepted values 2 or 4"),
     OPT_INTEGER('r', "fps", &args.fps, "maximum frames per second (default: 60)"),
+    OPT_STRING(0, "outputs", &args.outputs, "output ladder, e.g. 1:20:veryfast,2:23,4 (divider[:crf[:preset]], each divider once, default: single full-size output)"),
     OPT_GROUP("Audio options"),
     OPT_BOOLEAN(0, "no-audio", &args.no_audio, "don't record audio"),
+    OPT_GROUP("Trace options"),
+    OPT_STRING(0, "record", &args.record, "record everything received from the game to a trace file"),
+    OPT_STRING(0, "replay", &args.replay, "encode a trace recorded with --record instead of launching a process"),
+    OPT_BOOLEAN(0, "replay-max-speed", &args.replay_max_speed, "replay as fast as the encoder allows instead of at original speed"),
     OPT_GROUP("Advanced options"),
     OPT_STRING(0, "pix_fmt", &args.pix_fmt, "pixel format: yuv420p (default, compatible), or yuv444p"),
     OPT_INTEGER(0, "threads", &args.threads, "number of threads used to encode video"),
+    OPT_INTEGER(0, "thread-budget", &args.thread_budget, "encoding threads shared by all concurrent captures (default: number of cores), split evenly and at most half per capture, each capture gets at least one per output even once it is used up"),
     OPT_BOOLEAN(0, "debug-av", &args.debug_av, "let video encoder be verbose"),
     OPT_INTEGER(0, "gop-size", &args.gop_size, "default: 120"),
     OPT_INTEGER(0, "max-b-frames", &args.max_b_frames, "default: 16"),
     OPT_INTEGER(0, "buffered-frames", &args.buffered_frames, "default: 60"),
+    OPT_BOOLEAN(0, "no-huge-pages", &args.no_huge_pages, "don't ask for huge pages for frame buffers and shared memory"),
+    OPT_INTEGER(0, "mlock-limit", &args.mlock_limit, "lock up to that many megabytes of frame buffers in RAM (default: 0)"),
     OPT_BOOLEAN(0, "gpu-color-conv", &args.gpu_color_conv, "do color conversion on the GPU (experimental)"),
     OPT_STRING(0, "priority", &args.priority, "above-normal or high (windows only)"),
     OPT_STRING(0, "x264-preset", &args.x264_preset, "slower, slow, medium, fast, faster, veryfast, ultrafast (default ultrafast)"),
@@ -123,7 +134,7 @@ int main (int argc, char **argv) {
 
   const int num_positional_args = 1;
   if (argc < num_positional_args) {
-    if (!args.headless) {
+    if (!args.headless && !args.replay) {
       argparse_usage(&argparse);
       exit(1);
     } else {
@@ -149,6 +160,23 @@ int main (int argc, char **argv) {
 
   capsule::Log("thanks for flying capsule on %s", lab::kPlatform);
 
+  // every session encodes to these, for as long as capsulerun runs
+  static std::vector<capsule::encoder::OutputSettings> output_settings;
+  if (args.outputs) {
+    if (!capsule::encoder::ParseOutputs(args.outputs, output_settings)) {
+      capsule::Log("Invalid --outputs value '%s'", args.outputs);
+      exit(1);
+    }
+    args.num_output_settings = static_cast<int>(output_settings.size());
+    args.output_settings = output_settings.data();
+  }
+
+  if (args.mlock_limit < 0) {
+    capsule::Log("Invalid --mlock-limit value %d", args.mlock_limit);
+    exit(1);
+  }
+  capsule::memory::Configure(!args.no_huge_pages, static_cast<int64_t>(args.mlock_limit) * 1024 * 1024);
+
   if (args.priority) {
 #if defined(LAB_WINDOWS)
     HANDLE hProcess = GetCurrentProcess();
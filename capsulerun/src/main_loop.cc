@@ -25,9 +25,25 @@
 
 #include "logging.h"
 #include "audio_intercept_receiver.h"
+#include "memory.h"
+#include "thread_budget.h"
+
+#include <capsule/audio_math.h>
 
 #include <thread>
+#include <chrono>
 #include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if !defined(LAB_WINDOWS)
+#include <unistd.h> // close
+#endif // !LAB_WINDOWS
+
+#if defined(LAB_LINUX)
+#include <sys/epoll.h> // EPOLLHUP, EPOLLERR
+#endif // LAB_LINUX
 
 MICROPROFILE_DEFINE(MainLoopMain, "MainLoop", "Main", 0xff0000);
 MICROPROFILE_DEFINE(MainLoopCycle, "MainLoop", "Cycle", 0xff00ff38);
@@ -36,53 +52,117 @@ MICROPROFILE_DEFINE(MainLoopProcess, "MainLoop", "Process", 0xff773744);
 
 namespace capsule {
 
+MainLoop::MainLoop (MainArgs *args) :
+  args_(args) {
+  thread_budget_ = args_->thread_budget;
+  if (thread_budget_ <= 0) {
+    thread_budget_ = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+}
+
 void MainLoop::AddConnection (Connection *conn) {
   Log("MainLoop::AddConnection - adding %s", conn->GetPipeName().c_str());
+#if defined(LAB_LINUX)
+  if (!conn->Open()) {
+    Log("MainLoop::AddConnection - could not open %s, bailing out", conn->GetPipeName().c_str());
+    return;
+  }
+#endif // LAB_LINUX
   {
     std::lock_guard<std::mutex> lock(conns_mutex_);
     conns_.push_back(conn);
   }
+#if defined(LAB_LINUX)
+  reactor_.Add(conn->ReadFd(), [this, conn](uint32_t events) { OnConnectionEvents(conn, events); });
+#else // LAB_LINUX
   new std::thread(&MainLoop::PollConnection, this, conn);
+#endif // !LAB_LINUX
 }
 
+#if defined(LAB_LINUX)
+
+void MainLoop::OnConnectionEvents (Connection *conn, uint32_t events) {
+  MICROPROFILE_SCOPE(MainLoopCycle);
+  MicroProfileFlip(0);
+
+  while (conn->Pending()) {
+    uint32_t size = 0;
+    char *buf = conn->Read(&size);
+    if (!buf) {
+      break;
+    }
+
+    LoopMessage msg{conn, buf, size};
+    Dispatch(msg);
+  }
+
+  if ((events & (EPOLLHUP | EPOLLERR)) && !conn->Pending()) {
+    // not closed: receivers may still write to it from their threads
+    reactor_.Remove(conn->ReadFd());
+
+    LoopMessage msg{conn, nullptr, 0};
+    Dispatch(msg);
+  }
+}
+
+#else // LAB_LINUX
+
 void MainLoop::PollConnection (Connection *conn) {
   Log("MainLoop::PollConnection - opening...");
   conn->Connect();
 
   if (conn->IsConnected()) {
     while (true) {
-      char *buf = conn->Read();
+      uint32_t size = 0;
+      char *buf = conn->Read(&size);
       if (!buf) {
         // done polling queue!
         break;
       }
 
-      LoopMessage msg{conn, buf};
+      LoopMessage msg{conn, buf, size};
       queue_.Push(msg);
     }
   } else {
     Log("MainLoop::PollConnection - could not open %s, bailing out", conn->GetPipeName().c_str());
   }
 
-  {
-    Log("MainLoop::PollConnection - culling %s", conn->GetPipeName().c_str());
-    std::lock_guard<std::mutex> lock(conns_mutex_);
-    conns_.erase(std::remove(conns_.begin(), conns_.end(), conn), conns_.end());
-  }
+  // the main loop ends its session and culls it
+  LoopMessage msg{conn, nullptr, 0};
+  queue_.Push(msg);
 }
 
+#endif // !LAB_LINUX
+
 void MainLoop::Run () {
   MICROPROFILE_SCOPE(MainLoopCycle);
   Log("In MainLoop::Run, exec is %s", args_->exec);
 
-  LoopMessage msg;
+  if (args_->record) {
+    recorder_ = new trace::Recorder(args_->record);
+    if (recorder_->Open()) {
+      Log("MainLoop::Run: recording trace to %s", args_->record);
+    } else {
+      Log("MainLoop::Run: could not open %s for recording, continuing without", args_->record);
+      delete recorder_;
+      recorder_ = nullptr;
+    }
+  }
+
+#if defined(LAB_LINUX)
+  // returns once the last connection is gone
+  reactor_.Run();
+#else // LAB_LINUX
+  LoopMessage msgs[kBatchSize];
 
-  while (true) {
+  while (!quit_) {
     MICROPROFILE_SCOPE(MainLoopCycle);
     MicroProfileFlip(0);
 
-    auto didPop = queue_.TryWaitAndPop(msg, 200);
-    if (!didPop) {
+    ReapSessions(false);
+
+    size_t count = queue_.TryWaitAndPopBatch(msgs, kBatchSize, 200);
+    if (count == 0) {
       std::lock_guard<std::mutex> lock(conns_mutex_);
       if (conns_.empty()) {
         Log("MainLoop::Run: no conns left, quitting");
@@ -92,64 +172,254 @@ void MainLoop::Run () {
       }
     }
 
-    auto conn = msg.conn;
-    char *buf = msg.buf;
+    for (size_t i = 0; i < count; i++) {
+      Dispatch(msgs[i]);
+    }
+  }
+#endif // !LAB_LINUX
+
+  Log("MainLoop::Run: ending sessions...");
+  EndSessions();
+  Log("MainLoop::Run: joining sessions...");
+  ReapSessions(true);
+
+  if (recorder_) {
+    delete recorder_;
+    recorder_ = nullptr;
+  }
+}
+
+void MainLoop::Dispatch (const LoopMessage &msg) {
+  if (!msg.buf) {
+    ConnectionClosed(msg.conn);
+    return;
+  }
 
-    {
-      MICROPROFILE_SCOPE(MainLoopProcess);
-      auto pkt = messages::GetPacket(buf);
-      switch (pkt->message_type()) {
-        case messages::Message_HotkeyPressed: {
-          CaptureFlip();
-          break;
+  if (recorder_) {
+    // before processing: shm contents are only valid until
+    // the receivers tell libcapsule they're done with them.
+    RecordMessage(msg);
+  }
+
+  ProcessMessage(msg.conn, msg.buf);
+  msg.conn->Release(msg.buf);
+}
+
+void MainLoop::ProcessMessage (Connection *conn, const char *buf) {
+  MICROPROFILE_SCOPE(MainLoopProcess);
+  auto pkt = messages::GetPacket(buf);
+  switch (pkt->message_type()) {
+    case messages::Message_Hello: {
+      Log("MainLoop::Run: Hello from pid %d at %s", pkt->message_as_Hello()->pid(), conn->GetPipeName().c_str());
+#if defined(LAB_LINUX)
+      conn->Established();
+#endif // LAB_LINUX
+      break;
+    }
+    case messages::Message_HotkeyPressed: {
+      CaptureFlip();
+      break;
+    }
+    case messages::Message_CaptureStop: {
+      CaptureStop();
+      break;
+    }
+    case messages::Message_VideoSetup: {
+      auto vs = pkt->message_as_VideoSetup();
+      StartSession(vs, conn);
+      break;
+    }
+    case messages::Message_VideoFrameCommitted: {
+      auto vfc = pkt->message_as_VideoFrameCommitted();
+      auto session = FindSession(conn);
+      if (session && session->video_) {
+        session->video_->FrameCommitted(vfc->index(), vfc->timestamp());
+      }
+      break;
+    }
+    case messages::Message_AudioFramesCommitted: {
+      auto afc = pkt->message_as_AudioFramesCommitted();
+      auto session = FindSession(conn);
+      if (session && session->audio_) {
+        session->audio_->FramesCommitted(afc->offset(), afc->frames());
+      }
+      break;
+    }
+    case messages::Message_SawBackend: {
+      auto sb = pkt->message_as_SawBackend();
+      Log("MainLoop::Run: saw backend %s at %s", EnumNameBackend(sb->backend()), conn->GetPipeName().c_str());
+      bool known = std::find(backend_conns_.begin(), backend_conns_.end(), conn) != backend_conns_.end();
+      if (!known) {
+        backend_conns_.push_back(conn);
+        // every process gets captured, not just the first one
+        if (args_->autostart && !FindSession(conn)) {
+          Log("MainLoop::Run: autostarting capture for %s", conn->GetPipeName().c_str());
+          CaptureStart(conn);
         }
-        case messages::Message_CaptureStop: {
-          CaptureStop();
-          break;
+      }
+      break;
+    }
+    default: {
+      Log("MainLoop::Run: received %s - not sure what to do", messages::EnumNameMessage(pkt->message_type()));
+      break;
+    }
+  }
+}
+
+void MainLoop::ConnectionClosed (Connection *conn) {
+  Log("MainLoop::ConnectionClosed: %s", conn->GetPipeName().c_str());
+  EndSession(conn);
+  backend_conns_.erase(std::remove(backend_conns_.begin(), backend_conns_.end(), conn), backend_conns_.end());
+
+  std::lock_guard<std::mutex> lock(conns_mutex_);
+  conns_.erase(std::remove(conns_.begin(), conns_.end(), conn), conns_.end());
+  if (conns_.empty()) {
+    Log("MainLoop::ConnectionClosed: no conns left, quitting");
+#if defined(LAB_LINUX)
+    reactor_.Stop();
+#else // LAB_LINUX
+    quit_ = true;
+#endif // !LAB_LINUX
+  }
+}
+
+void MainLoop::RecordMessage (const LoopMessage &msg) {
+  recorder_->Packet(msg.buf, msg.size);
+
+  auto session = FindSession(msg.conn);
+  auto pkt = messages::GetPacket(msg.buf);
+  switch (pkt->message_type()) {
+    case messages::Message_VideoFrameCommitted: {
+      auto vfc = pkt->message_as_VideoFrameCommitted();
+      if (session && session->video_) {
+        auto video = session->video_;
+        recorder_->VideoFrame(video->SharedFrame(vfc->index()), video->FrameSize());
+      }
+      break;
+    }
+    case messages::Message_AudioFramesCommitted: {
+      auto afc = pkt->message_as_AudioFramesCommitted();
+      if (session && session->audio_) {
+        size_t size = 0;
+        auto data = session->audio_->SharedFrames(afc->offset(), afc->frames(), &size);
+        if (data) {
+          recorder_->AudioFrames(data, size);
         }
-        case messages::Message_VideoSetup: {
-          auto vs = pkt->message_as_VideoSetup();
-          StartSession(vs, conn);
-          break;
+      }
+      break;
+    }
+    default: {
+      // packet alone is enough
+      break;
+    }
+  }
+}
+
+bool MainLoop::Replay (const char *path, bool max_speed) {
+  trace::Player player(path);
+  if (!player.Open()) {
+    Log("MainLoop::Replay: could not open trace %s", path);
+    return false;
+  }
+
+  Log("MainLoop::Replay: replaying %s at %s speed", path, max_speed ? "maximum" : "original");
+
+  // nobody's on the other end: VideoFrameProcessed & co. go nowhere
+  Connection conn;
+
+  // shm areas libcapsule would have created, filled from the trace
+  shoom::Shm *video_shm = nullptr;
+  shoom::Shm *audio_shm = nullptr;
+  int64_t audio_frame_size = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  int64_t num_packets = 0;
+
+  trace::Record record;
+  while (player.Next(&record)) {
+    if (record.type != trace::kRecordPacket) {
+      Log("MainLoop::Replay: skipping orphan record of type %d", (int) record.type);
+      continue;
+    }
+
+    if (!max_speed) {
+      std::this_thread::sleep_until(start + std::chrono::microseconds(record.timestamp));
+    }
+
+    auto pkt = messages::GetPacket(record.data.data());
+    switch (pkt->message_type()) {
+      case messages::Message_VideoSetup: {
+        auto vs = pkt->message_as_VideoSetup();
+
+        delete video_shm;
+        video_shm = new shoom::Shm(vs->shmem()->path()->str(), static_cast<size_t>(vs->shmem()->size()));
+        if (video_shm->Create() != shoom::kOK) {
+          Log("MainLoop::Replay: could not create video shm");
+          exit(1);
         }
-        case messages::Message_VideoFrameCommitted: {
-          auto vfc = pkt->message_as_VideoFrameCommitted();
-          if (session_ && session_->video_) {
-            session_->video_->FrameCommitted(vfc->index(), vfc->timestamp());
+
+        delete audio_shm;
+        audio_shm = nullptr;
+        auto as = vs->audio();
+        if (as) {
+          audio_shm = new shoom::Shm(as->shmem()->path()->str(), static_cast<size_t>(as->shmem()->size()));
+          if (audio_shm->Create() != shoom::kOK) {
+            Log("MainLoop::Replay: could not create audio shm");
+            exit(1);
           }
-          break;
+          audio_frame_size = as->channels() * audio::SampleWidth(as->format()) / 8;
         }
-        case messages::Message_AudioFramesCommitted: {
-          auto afc = pkt->message_as_AudioFramesCommitted();
-          if (session_ && session_->audio_) {
-            session_->audio_->FramesCommitted(afc->offset(), afc->frames());
-          }
-          break;
+        break;
+      }
+      case messages::Message_VideoFrameCommitted: {
+        auto vfc = pkt->message_as_VideoFrameCommitted();
+        trace::Record frame;
+        if (video_shm && player.NextOfType(trace::kRecordVideoFrame, &frame)) {
+          memcpy(video_shm->Data() + frame.data.size() * vfc->index(), frame.data.data(), frame.data.size());
         }
-        case messages::Message_SawBackend: {
-          auto sb = pkt->message_as_SawBackend();
-          Log("MainLoop::Run: saw backend %s at %s", EnumNameBackend(sb->backend()), conn->GetPipeName().c_str());
-          best_conn_ = conn;
-          break;
+
+        if (max_speed) {
+          // libcapsule waits for VideoFrameProcessed before reusing a
+          // buffer, wait for the receiver instead of dropping frames.
+          auto session = FindSession(&conn);
+          while (session && session->video_ && !session->video_->HasRoom()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
         }
-        default: {
-          Log("MainLoop::Run: received %s - not sure what to do", messages::EnumNameMessage(pkt->message_type()));
-          break;
+        break;
+      }
+      case messages::Message_AudioFramesCommitted: {
+        auto afc = pkt->message_as_AudioFramesCommitted();
+        trace::Record frames;
+        if (audio_shm && player.NextOfType(trace::kRecordAudioFrames, &frames)) {
+          memcpy(audio_shm->Data() + afc->offset() * audio_frame_size, frames.data.data(), frames.data.size());
         }
+        break;
+      }
+      default: {
+        break;
       }
     }
-    delete[] buf;
+
+    ProcessMessage(&conn, record.data.data());
+    num_packets++;
   }
 
-  Log("MainLoop::Run: ending session...");
-  EndSession();  
-  Log("MainLoop::Run: joining session...");
-  JoinSessions();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  Log("MainLoop::Replay: replayed %" PRId64 " packets in %.2fs, waiting for encoder...",
+    num_packets, std::chrono::duration<double>(elapsed).count());
+
+  EndSessions();
+  ReapSessions(true);
+
+  delete video_shm;
+  delete audio_shm;
+  return true;
 }
 
 void MainLoop::CaptureFlip () {
   Log("MainLoop::CaptureFlip");
-  if (session_) {
+  if (!sessions_.empty()) {
     CaptureStop();
   } else {
     CaptureStart();
@@ -157,62 +427,236 @@ void MainLoop::CaptureFlip () {
 }
 
 void MainLoop::CaptureStart () {
-  flatbuffers::FlatBufferBuilder builder(1024);
-  auto cps = messages::CreateCaptureStart(builder, args_->fps, args_->size_divider, args_->gpu_color_conv);
-  auto opkt = messages::CreatePacket(builder, messages::Message_CaptureStart, cps.Union());
-  builder.Finish(opkt);
+  if (!backend_conns_.empty()) {
+    for (Connection *conn: backend_conns_) {
+      CaptureStart(conn);
+    }
+    return;
+  }
 
-  auto conn = best_conn_;
+  // nobody saw a backend yet: pick the first one, it'll give us DC capture on windows
+  Connection *conn = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(conns_mutex_);
+    if (!conns_.empty()) {
+      conn = conns_.front();
+    }
+  }
   if (!conn) {
-    // pick the first one, it'll give us DC capture on windows
-    conn = conns_.front();
+    Log("MainLoop::CaptureStart: no connections");
+    return;
+  }
+  CaptureStart(conn);
+}
+
+void MainLoop::CaptureStart (Connection *conn) {
+  flatbuffers::FlatBufferBuilder builder(1024);
+  // traces only capture the FIFO, so keep commits on it when recording
+#if defined(LAB_LINUX)
+  bool control_ring = !args_->record;
+#else
+  bool control_ring = false;
+#endif // LAB_LINUX
+  // the audio ring is polled, it needs no doorbell
+  bool audio_ring = !args_->record;
+
+  std::vector<int32_t> pix_fmts;
+  std::string pix_fmt_names;
+  for (auto pix_fmt : encoder::IngestFormats(args_)) {
+    pix_fmts.push_back(pix_fmt);
+    pix_fmt_names += std::string(" ") + messages::EnumNamePixFmt(pix_fmt);
   }
 
-  Log("MainLoop::CaptureStart: sending to connection %s", conn->GetPipeName().c_str());
+  auto cps = messages::CreateCaptureStartDirect(builder, args_->fps, args_->size_divider, args_->gpu_color_conv, control_ring, !args_->no_huge_pages, &pix_fmts, audio_ring);
+  auto opkt = messages::CreatePacket(builder, messages::Message_CaptureStart, cps.Union());
+  builder.Finish(opkt);
+
+  Log("MainLoop::CaptureStart: sending to connection %s, offering%s", conn->GetPipeName().c_str(), pix_fmt_names.c_str());
   conn->Write(builder);
 }
 
-void MainLoop::EndSession () {
-  if (!session_) {
-    Log("MainLoop::end_session: no session to end");
+Session *MainLoop::FindSession (Connection *conn) {
+  auto it = sessions_.find(conn);
+  if (it == sessions_.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+void MainLoop::EndSession (Connection *conn) {
+  auto session = FindSession(conn);
+  if (!session) {
     return;
   }
 
-  Log("MainLoop::end_session: ending %p", session_);
-  auto old_session = session_;
-  session_ = nullptr;
-  old_session->Stop();
-  old_sessions_.push_back(old_session);
+  Log("MainLoop::EndSession: ending %p (%s)", session, conn->GetPipeName().c_str());
+  sessions_.erase(conn);
+  session->Stop();
+  stopped_sessions_.push_back(session);
 }
 
-void MainLoop::JoinSessions () {
-  Log("MainLoop::join_sessions: joining %" PRIdS " sessions", old_sessions_.size());
+void MainLoop::EndSessions () {
+  Log("MainLoop::EndSessions: ending %" PRIdS " sessions", sessions_.size());
+  for (auto &it: sessions_) {
+    it.second->Stop();
+    stopped_sessions_.push_back(it.second);
+  }
+  sessions_.clear();
+}
+
+void MainLoop::ReapSessions (bool wait) {
+  auto it = stopped_sessions_.begin();
+  while (it != stopped_sessions_.end()) {
+    auto session = *it;
+    if (!wait && !session->Finished()) {
+      ++it;
+      continue;
+    }
 
-  for (Session *session: old_sessions_) {
-    Log("MainLoop::join_sessions: joining session_ %p", session);
     session->Join();
+    threads_in_use_ -= session->Threads();
+    Log("MainLoop::ReapSessions: freed %p, %d/%d encoder threads in use", session, threads_in_use_, thread_budget_);
+    delete session;
+    it = stopped_sessions_.erase(it);
   }
-
-  Log("MainLoop::join_sessions: joined all sessions!");
 }
 
 void MainLoop::CaptureStop () {
-  EndSession();
+  EndSessions();
 
   flatbuffers::FlatBufferBuilder builder(1024);
   auto cps = messages::CreateCaptureStop(builder);
   auto opkt = messages::CreatePacket(builder, messages::Message_CaptureStop, cps.Union());
   builder.Finish(opkt);
 
+  std::lock_guard<std::mutex> lock(conns_mutex_);
   for (Connection *conn: conns_) {
     Log("MainLoop::CaptureStop: sending to connection %s", conn->GetPipeName().c_str());
     conn->Write(builder);
   }
 }
 
+int MainLoop::ThreadShare () {
+  // what the encoder would use without a budget: --threads per output
+  int outputs = std::max(1, args_->num_output_settings);
+  int per_output = 1;
+  if (args_->threads > 0 && args_->threads <= 32) {
+    per_output = args_->threads;
+  }
+
+  int running = static_cast<int>(sessions_.size());
+  int share = thread_budget::Share(thread_budget_, running, threads_in_use_, per_output * outputs, outputs);
+  if (threads_in_use_ + share > thread_budget_) {
+    Log("MainLoop::ThreadShare: encoder thread budget used up, now %d threads over", threads_in_use_ + share - thread_budget_);
+  }
+  return share;
+}
+
+std::string MainLoop::SessionName () {
+  // the first capture keeps the historical name
+  num_sessions_++;
+  if (num_sessions_ == 1) {
+    return "capsule";
+  }
+  std::ostringstream oss;
+  oss << "capsule-" << num_sessions_;
+  return oss.str();
+}
+
+// fds of anonymous shm segments that came along with a VideoSetup,
+// the ones nobody claims are closed.
+class ReceivedFds {
+  public:
+    ReceivedFds(const messages::VideoSetup *vs, Connection *conn) {
+      bool expected = vs->shmem()->fd_index() >= 0 ||
+                      (vs->audio() && vs->audio()->shmem()->fd_index() >= 0);
+      if (!expected) {
+        return;
+      }
+
+#if defined(LAB_LINUX)
+      int fds[kMaxFds];
+      int num_fds = conn->ReceiveFds(fds, kMaxFds);
+      if (num_fds < 0) {
+        // e.g. replaying a trace: segments are named after all
+        Log("Could not receive shm fds from %s, opening by path", conn->GetPipeName().c_str());
+        return;
+      }
+      fds_.assign(fds, fds + num_fds);
+#endif // LAB_LINUX
+    }
+
+    ~ReceivedFds() {
+#if !defined(LAB_WINDOWS)
+      for (int fd: fds_) {
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+#endif // !LAB_WINDOWS
+    }
+
+    // an unopened shm for the segment, by fd if we got one, by path otherwise
+    shoom::Shm *NewShm(const messages::Shmem *shmem) {
+      auto size = static_cast<size_t>(shmem->size());
+      shoom::Shm *shm = nullptr;
+#if !defined(LAB_WINDOWS)
+      int index = shmem->fd_index();
+      if (index >= 0 && index < static_cast<int>(fds_.size()) && fds_[index] >= 0) {
+        int fd = fds_[index];
+        fds_[index] = -1;
+        shm = new shoom::Shm(fd, size);
+      }
+#endif // !LAB_WINDOWS
+      if (!shm) {
+        shm = new shoom::Shm(shmem->path()->str(), size);
+      }
+      shm->SetMapFlags(memory::ShmFlags());
+      return shm;
+    }
+
+  private:
+    static const int kMaxFds = 8;
+    std::vector<int> fds_;
+};
+
+void MainLoop::LogPixFmt (const messages::VideoSetup *vs) {
+  auto pix_fmt = vs->pix_fmt();
+  int passes = encoder::IngestPasses(pix_fmt);
+  if (passes < 0) {
+    Log("Video format: %s, which the encoder can't take", messages::EnumNamePixFmt(pix_fmt));
+    return;
+  }
+  Log("Video format: %s, %d CPU conversion pass(es)", messages::EnumNamePixFmt(pix_fmt), passes);
+
+  auto backend_pix_fmts = vs->backend_pix_fmts();
+  if (!backend_pix_fmts) {
+    Log("Video format: libcapsule didn't negotiate, it picked on its own");
+    return;
+  }
+
+  std::string backend_names;
+  for (auto backend_pix_fmt : *backend_pix_fmts) {
+    backend_names += std::string(" ") + messages::EnumNamePixFmt(static_cast<messages::PixFmt>(backend_pix_fmt));
+  }
+  Log("Video format: backend could produce%s", backend_names.c_str());
+
+  // anything we offered that's cheaper is something the backend lacks
+  for (auto offered : encoder::IngestFormats(args_)) {
+    if (encoder::IngestPasses(offered) >= passes) {
+      break;
+    }
+    Log("Video format: slow path, backend can't produce %s (%d pass(es))",
+      messages::EnumNamePixFmt(offered), encoder::IngestPasses(offered));
+  }
+}
+
 void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
-  if (session_) {
-    Log("Already got a session, ignoring request from %s", conn->GetPipeName().c_str());
+  // before bailing out, so they don't get mixed up with the next batch
+  ReceivedFds fds(vs, conn);
+
+  if (FindSession(conn)) {
+    Log("Already got a session for %s, ignoring request", conn->GetPipeName().c_str());
     return;
   }
 
@@ -223,23 +667,54 @@ void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
 
   Log("Setting up encoder for %s", conn->GetPipeName().c_str());
 
+  LogPixFmt(vs);
+
   encoder::VideoFormat vfmt;
   vfmt.width = vs->width();
   vfmt.height = vs->height();
   vfmt.format = vs->pix_fmt();
   vfmt.vflip = vs->vflip();
-  
-  // TODO: support offset (for planar formats)
 
-  // TODO: support multiple linesizes (for planar formats)
+  auto offset_vec = vs->offset();
   auto linesize_vec = vs->linesize();
-  vfmt.pitch = linesize_vec->Get(0);
+  if (!linesize_vec || linesize_vec->size() == 0) {
+    Log("No linesize, ignoring request from %s", conn->GetPipeName().c_str());
+    return;
+  }
+
+  // older capture libraries send a single linesize and no offsets
+  int num_planes = static_cast<int>(linesize_vec->size());
+  if (num_planes > encoder::kMaxPlanes) {
+    num_planes = encoder::kMaxPlanes;
+  }
+  vfmt.num_planes = num_planes;
+  vfmt.frame_size = 0;
+  for (int i = 0; i < encoder::kMaxPlanes; i++) {
+    vfmt.offset[i] = 0;
+    vfmt.linesize[i] = 0;
+  }
+  for (int i = 0; i < num_planes; i++) {
+    vfmt.offset[i] = (offset_vec && i < static_cast<int>(offset_vec->size())) ? offset_vec->Get(i) : 0;
+    vfmt.linesize[i] = linesize_vec->Get(i);
+
+    int64_t rows = vfmt.height;
+    bool subsampled = (vfmt.format == messages::PixFmt_I420 || vfmt.format == messages::PixFmt_NV12);
+    if (i > 0 && subsampled) {
+      rows = vfmt.height / 2;
+    }
+    int64_t plane_end = vfmt.offset[i] + vfmt.linesize[i] * rows;
+    if (plane_end > vfmt.frame_size) {
+      vfmt.frame_size = plane_end;
+    }
+  }
 
-  auto shm_path = vs->shmem()->path()->str();  
-  auto shm = new shoom::Shm(shm_path, static_cast<size_t>(vs->shmem()->size()));
-  int ret = shm->Open();
+  auto shm = fds.NewShm(vs->shmem());
+  // with a control ring, frame releases are written back into the shm
+  bool control_ring = vs->control_ring();
+  int ret = control_ring ? shm->OpenWritable() : shm->Open();
   if (ret != shoom::kOK) {
     Log("Could not open shared memory area: code %d", ret);
+    delete shm;
     return;
   }
 
@@ -248,7 +723,7 @@ void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
     num_buffered_frames = args_->buffered_frames;
   }
 
-  auto video = new video::VideoReceiver(conn, vfmt, shm, num_buffered_frames);
+  auto video = new video::VideoReceiver(conn, vfmt, shm, num_buffered_frames, control_ring);
 
   audio::AudioReceiver *audio = nullptr;
   if (args_->no_audio) {
@@ -256,7 +731,7 @@ void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
   } else {
     auto as = vs->audio();
     if (as) {
-      audio = new audio::AudioInterceptReceiver(conn, *as);
+      audio = new audio::AudioInterceptReceiver(conn, *as, fds.NewShm(as->shmem()));
     } else if (audio_receiver_factory_) {
       Log("No audio intercept (or disabled), trying factory");
       audio = audio_receiver_factory_();
@@ -265,8 +740,20 @@ void MainLoop::StartSession (const messages::VideoSetup *vs, Connection *conn) {
     }
   }
 
-  session_ = new Session(args_, video, audio);
-  session_->Start();
+  auto session = new Session(args_, video, audio);
+#if defined(LAB_LINUX)
+  // free it as soon as it's done rather than on the next message
+  session->on_finished_ = [this]() {
+    reactor_.Post([this]() { ReapSessions(false); });
+  };
+#endif // LAB_LINUX
+  int threads = ThreadShare();
+  threads_in_use_ += threads;
+  auto name = SessionName();
+  Log("Starting session %s for %s, %d/%d encoder threads (%" PRIdS " other sessions)",
+    name.c_str(), conn->GetPipeName().c_str(), threads, thread_budget_, sessions_.size());
+  sessions_[conn] = session;
+  session->Start(name, threads);
 }
 
 } // namespace capsule
@@ -31,51 +31,104 @@
 #include "audio_receiver.h"
 #include "session.h"
 #include "connection.h"
-#include "locking_queue.h"
+#include "mpsc_queue.h"
+#include "trace.h"
+
+#if defined(LAB_LINUX)
+#include "linux/reactor.h"
+#endif // LAB_LINUX
 
 #include <thread>
 #include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace capsule {
 
 typedef audio::AudioReceiver * (*AudioReceiverFactory)();
 
+// buf is nullptr when conn was closed
 struct LoopMessage {
   Connection *conn;
   char *buf;
+  uint32_t size;
 };
 
 class MainLoop {
   public:
-    MainLoop(MainArgs *args) :
-      args_(args) {};
+    MainLoop(MainArgs *args);
     void Run(void);
+    // feeds a trace recorded with --record through the loop, then
+    // waits for the encoder to finish. Returns false if it couldn't be read.
+    bool Replay(const char *path, bool max_speed);
     void CaptureFlip();
 
     void AddConnection(Connection *conn);
 
+#if defined(LAB_LINUX)
+    // fds the main loop watches along with the connections,
+    // callbacks run on its thread
+    bool Watch(int fd, reactor::Reactor::Callback callback) { return reactor_.Add(fd, callback); };
+    void Unwatch(int fd) { reactor_.Remove(fd); };
+#endif // LAB_LINUX
+
     AudioReceiverFactory audio_receiver_factory_ = nullptr;
 
   private:
-    void EndSession();
-    void JoinSessions();
+    // a few seconds' worth of commits from a handful of games
+    static const size_t kQueueCapacity = 4096;
+    static const size_t kBatchSize = 64;
+
+    Session *FindSession(Connection *conn);
+    void EndSession(Connection *conn);
+    void EndSessions();
+    // joins and frees stopped sessions whose encoder is done,
+    // or all of them when wait is true
+    void ReapSessions(bool wait);
     void PollConnection(Connection *conn);
+#if defined(LAB_LINUX)
+    void OnConnectionEvents(Connection *conn, uint32_t events);
+#endif // LAB_LINUX
+    void Dispatch(const LoopMessage &msg);
+    void ProcessMessage(Connection *conn, const char *buf);
+    void RecordMessage(const LoopMessage &msg);
+    void ConnectionClosed(Connection *conn);
 
     void CaptureStart();
+    void CaptureStart(Connection *conn);
     void CaptureStop();
     void StartSession(const messages::VideoSetup *vs, Connection *conn);
+    // says why a session captures in the format it does
+    void LogPixFmt(const messages::VideoSetup *vs);
+    int ThreadShare();
+    std::string SessionName();
 
     MainArgs *args_;
-    LockingQueue<LoopMessage> queue_;
+#if defined(LAB_LINUX)
+    reactor::Reactor reactor_;
+#else // LAB_LINUX
+    MpscQueue<LoopMessage, kQueueCapacity> queue_;
+    bool quit_ = false;
+#endif // !LAB_LINUX
 
     std::vector<Connection *> conns_;
     std::mutex conns_mutex_;
 
-    Session *session_ = nullptr;
-    std::vector<Session *> old_sessions_;
+    // one per capturing connection, each with its own receivers & outputs
+    std::unordered_map<Connection *, Session *> sessions_;
+    // stopped, waiting for their encoder to flush
+    std::vector<Session *> stopped_sessions_;
+    int num_sessions_ = 0;
+
+    // codec threads shared by all sessions encoding at the same time
+    int thread_budget_ = 1;
+    int threads_in_use_ = 0;
+
+    // connections that saw a graphics backend, in order
+    std::vector<Connection *> backend_conns_;
 
-    Connection *best_conn_ = nullptr;
+    trace::Recorder *recorder_ = nullptr;
 };
 
 } // namespace capsule
@@ -0,0 +1,216 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "memory.h"
+
+#include <lab/platform.h>
+
+#include <shoom.h>
+
+#include <map>
+#include <mutex>
+
+#if defined(LAB_WINDOWS)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h> // VirtualAlloc, VirtualLock
+#undef WIN32_LEAN_AND_MEAN
+#else // LAB_WINDOWS
+#include <sys/mman.h> // mmap, madvise, mlock
+#include <unistd.h>   // getpagesize
+#endif // !LAB_WINDOWS
+
+#include "logging.h"
+
+#if defined(LAB_LINUX) && !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace capsule {
+namespace memory {
+
+struct Allocation {
+  size_t size;
+  bool locked;
+};
+
+static std::mutex mutex;
+static bool huge_pages = false;
+static int64_t mlock_limit = 0;
+static int64_t mlock_used = 0;
+static std::map<void *, Allocation> allocations;
+
+void Configure(bool huge_pages_in, int64_t mlock_limit_in) {
+  std::lock_guard<std::mutex> lock(mutex);
+  huge_pages = huge_pages_in;
+  mlock_limit = mlock_limit_in;
+}
+
+int ShmFlags() {
+  std::lock_guard<std::mutex> lock(mutex);
+  int flags = shoom::kMapPopulate;
+  if (huge_pages) {
+    flags |= shoom::kMapHugePages;
+  }
+  return flags;
+}
+
+#if defined(LAB_WINDOWS)
+
+static void *Map(size_t size) {
+  // committed pages come zeroed. Large pages (MEM_LARGE_PAGES) would need
+  // SeLockMemoryPrivilege, which isn't granted by default, so --no-huge-pages
+  // makes no difference here.
+  return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void Unmap(void *ptr, size_t /* size */) {
+  VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+static size_t PageSize() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return static_cast<size_t>(info.dwPageSize);
+}
+
+static bool Lock(void *ptr, size_t size) {
+  // VirtualLock can't lock more than the minimum working set, grow it first
+  HANDLE process = GetCurrentProcess();
+  SIZE_T min_size = 0;
+  SIZE_T max_size = 0;
+  if (!GetProcessWorkingSetSize(process, &min_size, &max_size) ||
+      !SetProcessWorkingSetSize(process, min_size + size, max_size + size)) {
+    Log("memory::Allocate: could not grow the working set by %" PRIdS " bytes to lock them", size);
+    return false;
+  }
+  if (!VirtualLock(ptr, size)) {
+    Log("memory::Allocate: could not lock %" PRIdS " bytes (error %lu)", size, GetLastError());
+    return false;
+  }
+  return true;
+}
+
+static void Unlock(void *ptr, size_t size) {
+  VirtualUnlock(ptr, size);
+}
+
+#else // LAB_WINDOWS
+
+static void *Map(size_t size) {
+  void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return nullptr;
+  }
+
+#if defined(LAB_LINUX)
+  if (huge_pages) {
+    // transparent huge pages, before faulting anything in: that way
+    // faults get whole huge pages rather than waiting for khugepaged
+    madvise(ptr, size, MADV_HUGEPAGE);
+  }
+#endif // LAB_LINUX
+  return ptr;
+}
+
+static void Unmap(void *ptr, size_t size) {
+  munmap(ptr, size);
+}
+
+static size_t PageSize() {
+  return static_cast<size_t>(getpagesize());
+}
+
+static bool Lock(void *ptr, size_t size) {
+  if (mlock(ptr, size) != 0) {
+    Log("memory::Allocate: could not lock %" PRIdS " bytes, check ulimit -l", size);
+    return false;
+  }
+  return true;
+}
+
+static void Unlock(void * /* ptr */, size_t /* size */) {
+  // munmap unlocks
+}
+
+#endif // !LAB_WINDOWS
+
+#if defined(LAB_LINUX)
+static bool Populate(void *ptr, size_t size) {
+  // linux 5.14+, one syscall instead of a fault per page
+  return madvise(ptr, size, MADV_POPULATE_WRITE) == 0;
+}
+#else // LAB_LINUX
+static bool Populate(void * /* ptr */, size_t /* size */) {
+  return false;
+}
+#endif // !LAB_LINUX
+
+void *Allocate(size_t size) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  void *ptr = Map(size);
+  if (!ptr) {
+    Log("memory::Allocate: could not map %" PRIdS " bytes", size);
+    return nullptr;
+  }
+
+  if (!Populate(ptr, size)) {
+    // prefault with writes, reads would only map the shared zero page
+    size_t page_size = PageSize();
+    for (size_t i = 0; i < size; i += page_size) {
+      static_cast<volatile char *>(ptr)[i] = 0;
+    }
+  }
+
+  Allocation allocation{size, false};
+  if (mlock_used + static_cast<int64_t>(size) <= mlock_limit) {
+    if (Lock(ptr, size)) {
+      allocation.locked = true;
+      mlock_used += static_cast<int64_t>(size);
+    }
+  }
+
+  allocations[ptr] = allocation;
+  return ptr;
+}
+
+void Free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = allocations.find(ptr);
+  if (it == allocations.end()) {
+    Log("memory::Free: unknown pointer %p", ptr);
+    return;
+  }
+
+  if (it->second.locked) {
+    Unlock(ptr, it->second.size);
+    mlock_used -= static_cast<int64_t>(it->second.size);
+  }
+  Unmap(ptr, it->second.size);
+  allocations.erase(it);
+}
+
+} // namespace memory
+} // namespace capsule
@@ -0,0 +1,48 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace capsule {
+namespace memory {
+
+/**
+ * Large, long-lived buffers (frame and sample rings): a 4K BGRA frame is
+ * over 30MB, and touching fresh 4KB pages during the first seconds of a
+ * capture shows up as stalls.
+ */
+
+// process-wide, set once from the command line before any capture
+void Configure(bool huge_pages, int64_t mlock_limit);
+
+// flags for shoom::Shm::SetMapFlags: prefaulted, huge pages if enabled
+int ShmFlags();
+
+// zeroed memory, prefaulted, on huge pages if enabled, and locked if it
+// fits in what's left of the mlock budget. Must be given back with Free.
+void *Allocate(size_t size);
+void Free(void *ptr);
+
+} // namespace memory
+} // namespace capsule
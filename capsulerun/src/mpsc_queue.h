@@ -0,0 +1,242 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <lab/platform.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#if defined(LAB_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#else // LAB_LINUX
+#include <condition_variable>
+#include <mutex>
+#endif // !LAB_LINUX
+
+#include "cache_line.h"
+
+namespace capsule {
+
+/**
+ * Bounded multi-producer, single-consumer queue (Vyukov's array queue).
+ * Producers claim a cell with a CAS and never wait for each other or
+ * for the consumer, unless the queue is full. The consumer only sleeps
+ * when it's empty, and producers only pay for a wakeup when it does.
+ *
+ * Pop* methods must only ever be called from one thread at a time.
+ */
+template <typename T, size_t Capacity = 1024> class MpscQueue {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                "MpscQueue capacity must be a power of two");
+
+public:
+  MpscQueue() : cells_(new Cell[Capacity]) {
+    for (size_t i = 0; i < Capacity; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  // false if the queue is full
+  bool TryPush(T const &data) {
+    Cell *cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & kMask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = data;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    Notify();
+    return true;
+  }
+
+  // yields until there's room: the consumer is behind, slowing
+  // producers down is the only sensible thing to do.
+  void Push(T const &data) {
+    while (!TryPush(data)) {
+      std::this_thread::yield();
+    }
+  }
+
+  bool TryPop(T &value) {
+    Cell *cell = &cells_[dequeue_pos_ & kMask];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(dequeue_pos_ + 1) < 0) {
+      return false;
+    }
+
+    value = cell->data;
+    cell->sequence.store(dequeue_pos_ + Capacity, std::memory_order_release);
+    dequeue_pos_++;
+    return true;
+  }
+
+  // pops up to max_values without waiting, returns how many
+  size_t TryPopBatch(T *values, size_t max_values) {
+    size_t count = 0;
+    while (count < max_values && TryPop(values[count])) {
+      count++;
+    }
+    return count;
+  }
+
+  void WaitAndPop(T &value) {
+    while (!TryWaitAndPop(value, -1)) {
+      // spurious wakeup
+    }
+  }
+
+  // false if nothing came in within milli milliseconds (-1 = no limit)
+  bool TryWaitAndPop(T &value, int milli) {
+    return TryWaitAndPopBatch(&value, 1, milli) == 1;
+  }
+
+  // at least one value unless milli elapses, at most max_values
+  size_t TryWaitAndPopBatch(T *values, size_t max_values, int milli) {
+    size_t count = TryPopBatch(values, max_values);
+    if (count > 0) {
+      return count;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milli);
+    while (true) {
+      int remaining = milli;
+      if (milli >= 0) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+          return 0;
+        }
+        remaining = static_cast<int>(left.count());
+      }
+
+      Sleep(remaining);
+      count = TryPopBatch(values, max_values);
+      if (count > 0) {
+        return count;
+      }
+    }
+  }
+
+  bool Empty() const {
+    const Cell *cell = &cells_[dequeue_pos_ & kMask];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    return static_cast<intptr_t>(seq) - static_cast<intptr_t>(dequeue_pos_ + 1) < 0;
+  }
+
+private:
+  static const size_t kMask = Capacity - 1;
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  // producers: publish, then check whether the consumer sleeps.
+  // consumer: say it sleeps, then check for data. The fences make sure
+  // at least one of them sees the other.
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    if (sleeping_.exchange(0, std::memory_order_relaxed) == 1) {
+#if defined(LAB_LINUX)
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&sleeping_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else // LAB_LINUX
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      sleep_cond_.notify_one();
+#endif // !LAB_LINUX
+    }
+  }
+
+  void Sleep(int milli) {
+    sleeping_.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!Empty()) {
+      sleeping_.store(0, std::memory_order_relaxed);
+      return;
+    }
+
+#if defined(LAB_LINUX)
+    struct timespec timeout;
+    struct timespec *timeout_ptr = nullptr;
+    if (milli >= 0) {
+      timeout.tv_sec = milli / 1000;
+      timeout.tv_nsec = (milli % 1000) * 1000000L;
+      timeout_ptr = &timeout;
+    }
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&sleeping_), FUTEX_WAIT_PRIVATE, 1, timeout_ptr, nullptr, 0);
+#else // LAB_LINUX
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    auto woken = [this]() { return sleeping_.load(std::memory_order_relaxed) == 0; };
+    if (milli >= 0) {
+      sleep_cond_.wait_for(lock, std::chrono::milliseconds(milli), woken);
+    } else {
+      sleep_cond_.wait(lock, woken);
+    }
+#endif // !LAB_LINUX
+    sleeping_.store(0, std::memory_order_relaxed);
+  }
+
+  // producers and the consumer each get their own cache line, see cache_line.h
+  std::unique_ptr<Cell[]> cells_;
+  char pad0_[kCacheLine];
+
+  std::atomic<size_t> enqueue_pos_{0};
+  char pad1_[kCacheLine - sizeof(size_t)];
+
+  size_t dequeue_pos_ = 0;
+  char pad2_[kCacheLine - sizeof(size_t)];
+
+  std::atomic<uint32_t> sleeping_{0};
+  char pad3_[kCacheLine - sizeof(uint32_t)];
+
+#if !defined(LAB_LINUX)
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cond_;
+#endif // !LAB_LINUX
+};
+
+} // namespace capsule
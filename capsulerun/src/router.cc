@@ -29,6 +29,10 @@
 #include <thread>
 #include <sstream>
 
+#if defined(LAB_LINUX)
+#include <sys/epoll.h> // EPOLLHUP, EPOLLERR
+#endif // LAB_LINUX
+
 namespace capsule {
 
 Router::~Router() {
@@ -36,9 +40,50 @@ Router::~Router() {
 }
 
 void Router::Start() {
+#if defined(LAB_LINUX)
+  conn_ = new Connection(pipe_path_);
+  if (!conn_->Open()) {
+    Log("Router: Failed to open %s, bailing out", pipe_path_.c_str());
+    exit(127);
+  }
+  loop_->Watch(conn_->ReadFd(), [this](uint32_t events) { OnEvents(events); });
+#else // LAB_LINUX
   new std::thread(&Router::Run, this);
+#endif // !LAB_LINUX
+}
+
+#if defined(LAB_LINUX)
+
+void Router::OnEvents(uint32_t events) {
+  // one Hello per libcapsule, several may have piled up
+  while (conn_->Pending()) {
+    char *buf = conn_->Read();
+    if (!buf) {
+      break;
+    }
+
+    auto pkt = messages::GetPacket(buf);
+    if (pkt->message_type() == messages::Message_Hello) {
+      Log("Router: Hello from pid %d", pkt->message_as_Hello()->pid());
+      Dispatch(conn_);
+    } else {
+      Log("Router: expected Hello, got %s", messages::EnumNameMessage(pkt->message_type()));
+    }
+    conn_->Release(buf);
+  }
+
+  if ((events & (EPOLLHUP | EPOLLERR)) && !conn_->Pending()) {
+    int fd = conn_->ReadFd();
+    loop_->Unwatch(fd);
+    if (!conn_->ReopenRead()) {
+      exit(127);
+    }
+    loop_->Watch(fd, [this](uint32_t events) { OnEvents(events); });
+  }
 }
 
+#endif // LAB_LINUX
+
 void Router::Run() {
   while (true) {
     auto conn = new Connection(pipe_path_);
@@ -51,33 +96,37 @@ void Router::Run() {
       exit(127);
     }
 
-    had_connections_ = true;
+    Dispatch(conn);
 
-    std::ostringstream oss;    
-    oss << "capsule" << seed_++;
-    auto new_conn_name = oss.str();
+    conn->Close();
+    delete conn;
+  }
+}
 
-    Log("Router: dispatching connection to %s", new_conn_name.c_str());
-    loop_->AddConnection(new Connection(new_conn_name));
+void Router::Dispatch(Connection *conn) {
+  had_connections_ = true;
 
-    {
-      flatbuffers::FlatBufferBuilder builder(32);
+  std::ostringstream oss;    
+  oss << "capsule" << seed_++;
+  auto new_conn_name = oss.str();
 
-      auto pipe = builder.CreateString(new_conn_name);
-      auto hkp = messages::CreateReadyForYou(builder, pipe);
-      auto pkt = messages::CreatePacket(
-          builder,
-          messages::Message_ReadyForYou,
-          hkp.Union()
-      );
+  Log("Router: dispatching connection to %s", new_conn_name.c_str());
+  loop_->AddConnection(new Connection(new_conn_name));
 
-      builder.Finish(pkt);
-      Log("Router: sending ReadyForYou");
-      conn->Write(builder);
-    }
+  {
+    flatbuffers::FlatBufferBuilder builder(32);
 
-    conn->Close();
-    delete conn;
+    auto pipe = builder.CreateString(new_conn_name);
+    auto hkp = messages::CreateReadyForYou(builder, pipe);
+    auto pkt = messages::CreatePacket(
+        builder,
+        messages::Message_ReadyForYou,
+        hkp.Union()
+    );
+
+    builder.Finish(pkt);
+    Log("Router: sending ReadyForYou");
+    conn->Write(builder);
   }
 }
 
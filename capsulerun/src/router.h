@@ -38,6 +38,12 @@ class Router {
 
   private:
     void Run();
+    // gives the libcapsule on the other end of conn a pipe of its own
+    void Dispatch(Connection *conn);
+#if defined(LAB_LINUX)
+    void OnEvents(uint32_t events);
+    Connection *conn_ = nullptr;
+#endif // LAB_LINUX
 
     std::string pipe_path_;
     MainLoop *loop_ = nullptr;
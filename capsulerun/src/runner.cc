@@ -30,6 +30,12 @@
 namespace capsule {
 
 void Runner::Run () {
+  if (args_->replay) {
+    loop_ = new MainLoop(args_);
+    bool success = loop_->Replay(args_->replay, args_->replay_max_speed);
+    Exit(success ? 0 : 1);
+  }
+
   if (args_->exec) {
     process_ = executor_->LaunchProcess(args_);
     if (!process_) {
@@ -44,9 +44,14 @@ static void *ReceiveAudioFrames(Session *s, int64_t *frames_received) {
   return s->audio_->ReceiveFrames(frames_received);
 }
 
-void Session::Start () {
+void Session::Start (const std::string &name, int threads) {
+  name_ = name;
+  threads_ = threads;
+
   memset(&encoder_params_, 0, sizeof(encoder_params_));
   encoder_params_.private_data = this;
+  encoder_params_.name = name_.c_str();
+  encoder_params_.thread_budget = threads_;
   encoder_params_.receive_video_format = reinterpret_cast<encoder::VideoFormatReceiver>(ReceiveVideoFormat);
   encoder_params_.receive_video_frame  = reinterpret_cast<encoder::VideoFrameReceiver>(ReceiveVideoFrame);
 
@@ -58,7 +63,18 @@ void Session::Start () {
     encoder_params_.has_audio = 0;  
   }
 
-  encoder_thread_ = new std::thread(encoder::Run, args_, &encoder_params_);
+  encoder_params_.num_outputs = args_->num_output_settings;
+  encoder_params_.outputs = args_->output_settings;
+
+  encoder_thread_ = new std::thread(&Session::Encode, this);
+}
+
+void Session::Encode () {
+  encoder::Run(args_, &encoder_params_);
+  finished_ = true;
+  if (on_finished_) {
+    on_finished_();
+  }
 }
 
 void Session::Stop () {
@@ -72,7 +88,7 @@ void Session::Stop () {
 }
 
 void Session::Join () {
-  Log("Waiting for encoder thread...");
+  Log("Waiting for encoder thread of %s...", name_.c_str());
   encoder_thread_->join();
 }
 
@@ -24,6 +24,9 @@
 #include "audio_receiver.h"
 #include "video_receiver.h"
 
+#include <atomic>
+#include <functional>
+#include <string>
 #include <thread>
 
 namespace capsule {
@@ -35,15 +38,27 @@ class Session {
       video_(video),
       audio_(audio) {};
     ~Session();
-    void Start();
+    // name is the output file prefix (before .mp4 or -WxH.mp4),
+    // threads this session's share of the encoder thread budget.
+    void Start(const std::string &name, int threads);
     void Stop();
     void Join();
+    // true once the encoder has written everything out, Join won't block
+    bool Finished() { return finished_; };
+    int Threads() { return threads_; };
 
     encoder::Params encoder_params_;
+    // called from the encoder thread once Finished is true
+    std::function<void()> on_finished_;
 
   private:
-    std::thread *encoder_thread_;
+    void Encode();
+
+    std::thread *encoder_thread_ = nullptr;
     MainArgs *args_;
+    std::string name_;
+    int threads_ = 0;
+    std::atomic<bool> finished_{false};
 
   public:
     // these need to be public for the C callbacks (to avoid
@@ -0,0 +1,128 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "cache_line.h"
+
+namespace capsule {
+
+/**
+ * Single-producer, single-consumer ring of T. Each side owns one cursor
+ * and only reads the other's, so neither ever waits on a lock. Reserve
+ * and Peek hand out contiguous runs, which callers fill or read in place
+ * before Commit or Release.
+ *
+ * Cursors only ever grow: the fill level is their difference, readable
+ * from either side without scanning slot states.
+ */
+template <typename T> class SpscRing {
+public:
+  // storage holds capacity elements and outlives the ring,
+  // or is nullptr to have the ring allocate its own
+  explicit SpscRing(size_t capacity, T *storage = nullptr) :
+    capacity_(capacity),
+    storage_(storage ? storage : new T[capacity]()),
+    owns_storage_(storage == nullptr) {}
+
+  ~SpscRing() {
+    if (owns_storage_) {
+      delete[] storage_;
+    }
+  }
+
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  size_t Capacity() const { return capacity_; }
+
+  // producer: up to max free contiguous elements, 0 if full
+  size_t Reserve(size_t max, T **out) {
+    uint64_t write = write_.load(std::memory_order_relaxed);
+    uint64_t read = read_.load(std::memory_order_acquire);
+    size_t free_count = capacity_ - static_cast<size_t>(write - read);
+    size_t offset = static_cast<size_t>(write % capacity_);
+    size_t count = std::min(max, std::min(free_count, capacity_ - offset));
+    *out = storage_ + offset;
+    return count;
+  }
+
+  // producer: publishes count elements of the last Reserve
+  void Commit(size_t count) {
+    write_.store(write_.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+
+  // producer: count elements were dropped for lack of room
+  void Overrun(size_t count) {
+    overruns_.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  // consumer: up to max committed contiguous elements, 0 if empty
+  size_t Peek(size_t max, T **out) {
+    uint64_t read = read_.load(std::memory_order_relaxed);
+    uint64_t write = write_.load(std::memory_order_acquire);
+    size_t offset = static_cast<size_t>(read % capacity_);
+    size_t count = std::min(max, std::min(static_cast<size_t>(write - read), capacity_ - offset));
+    *out = storage_ + offset;
+    return count;
+  }
+
+  // consumer: gives back count elements of the last Peek
+  void Release(size_t count) {
+    read_.store(read_.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+
+  // committed and not released yet, from either side
+  size_t Size() const {
+    uint64_t read = read_.load(std::memory_order_acquire);
+    uint64_t write = write_.load(std::memory_order_acquire);
+    // read first: write can only have grown since
+    return static_cast<size_t>(write - read);
+  }
+
+  bool Full() const { return Size() >= capacity_; }
+
+  uint64_t Overruns() const { return overruns_.load(std::memory_order_relaxed); }
+
+private:
+  // each side's cursors get their own cache line, see cache_line.h
+  const size_t capacity_;
+  T *const storage_;
+  const bool owns_storage_;
+  char pad0_[kCacheLine];
+
+  // written by the producer only
+  std::atomic<uint64_t> write_{0};
+  std::atomic<uint64_t> overruns_{0};
+  char pad1_[kCacheLine - 2 * sizeof(uint64_t)];
+
+  // written by the consumer only
+  std::atomic<uint64_t> read_{0};
+  char pad2_[kCacheLine - sizeof(uint64_t)];
+};
+
+} // namespace capsule
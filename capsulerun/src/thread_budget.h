@@ -0,0 +1,51 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <algorithm>
+
+namespace capsule {
+namespace thread_budget {
+
+/**
+ * Codec threads for a new session that could use `wanted` of them
+ * across `outputs` outputs, when `running` sessions already hold `in_use`
+ * of `budget`. They can't give any back (codec thread counts are fixed
+ * once an encoder is open), so the share is clamped to what's left.
+ *
+ * It's also capped at a fair slice: the budget split evenly between the
+ * running sessions and this one, and never more than half of it. That
+ * way the first recording doesn't take everything, and a second one
+ * started later still gets as many threads as it.
+ *
+ * The one exception: each output needs at least one thread, so once the
+ * budget is used up new sessions still encode, single-threaded, and go
+ * over it by one thread per output.
+ */
+inline int Share(int budget, int running, int in_use, int wanted, int outputs) {
+  int slice = budget / std::max(2, running + 1);
+  int left = budget - in_use;
+  return std::max(outputs, std::min(wanted, std::min(slice, left)));
+}
+
+} // namespace thread_budget
+} // namespace capsule
@@ -0,0 +1,202 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "trace.h"
+
+#include <string.h>
+
+#include "logging.h"
+
+namespace capsule {
+namespace trace {
+
+TraceFile::~TraceFile() {
+  Close();
+}
+
+bool TraceFile::Open(const char *mode) {
+#if defined(CAPSULE_HAS_ZLIB)
+  // gzread transparently reads uncompressed files too
+  file_ = gzopen(path_.c_str(), mode);
+#else // CAPSULE_HAS_ZLIB
+  file_ = fopen(path_.c_str(), mode);
+#endif // !CAPSULE_HAS_ZLIB
+  return file_ != nullptr;
+}
+
+bool TraceFile::Write(const void *data, size_t size) {
+  if (size == 0) {
+    return true;
+  }
+#if defined(CAPSULE_HAS_ZLIB)
+  return gzwrite(file_, data, static_cast<unsigned int>(size)) == static_cast<int>(size);
+#else // CAPSULE_HAS_ZLIB
+  return fwrite(data, size, 1, file_) == 1;
+#endif // !CAPSULE_HAS_ZLIB
+}
+
+bool TraceFile::Read(void *data, size_t size) {
+  if (size == 0) {
+    return true;
+  }
+#if defined(CAPSULE_HAS_ZLIB)
+  return gzread(file_, data, static_cast<unsigned int>(size)) == static_cast<int>(size);
+#else // CAPSULE_HAS_ZLIB
+  return fread(data, size, 1, file_) == 1;
+#endif // !CAPSULE_HAS_ZLIB
+}
+
+void TraceFile::Close() {
+  if (!file_) {
+    return;
+  }
+#if defined(CAPSULE_HAS_ZLIB)
+  gzclose(file_);
+#else // CAPSULE_HAS_ZLIB
+  fclose(file_);
+#endif // !CAPSULE_HAS_ZLIB
+  file_ = nullptr;
+}
+
+/**
+ * Recorder
+ */
+
+bool Recorder::Open() {
+#if defined(CAPSULE_HAS_ZLIB)
+  // fast compression: we're recording while the game runs
+  open_ = file_.Open("wb1");
+#else // CAPSULE_HAS_ZLIB
+  open_ = file_.Open("wb");
+#endif // !CAPSULE_HAS_ZLIB
+  if (!open_) {
+    return false;
+  }
+
+  start_ = std::chrono::steady_clock::now();
+  open_ = file_.Write(kMagic, sizeof(kMagic));
+  return open_;
+}
+
+Recorder::~Recorder() {
+  file_.Close();
+}
+
+void Recorder::Packet(const char *buf, uint32_t size) {
+  Write(kRecordPacket, buf, size);
+}
+
+void Recorder::VideoFrame(const char *data, size_t size) {
+  Write(kRecordVideoFrame, data, size);
+}
+
+void Recorder::AudioFrames(const char *data, size_t size) {
+  Write(kRecordAudioFrames, data, size);
+}
+
+void Recorder::Write(RecordType type, const char *data, size_t size) {
+  if (!open_) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  int64_t timestamp = std::chrono::duration_cast<std::chrono::microseconds>(now - start_).count();
+  uint8_t type_byte = static_cast<uint8_t>(type);
+  uint32_t size32 = static_cast<uint32_t>(size);
+
+  bool ok = file_.Write(&type_byte, sizeof(type_byte)) &&
+    file_.Write(&timestamp, sizeof(timestamp)) &&
+    file_.Write(&size32, sizeof(size32)) &&
+    file_.Write(data, size);
+  if (!ok) {
+    Log("Recorder: write failed, stopping recording");
+    open_ = false;
+  }
+}
+
+/**
+ * Player
+ */
+
+bool Player::Open() {
+  if (!file_.Open("rb")) {
+    return false;
+  }
+
+  char magic[sizeof(kMagic)];
+  if (!file_.Read(magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+    Log("Player: not a capsule trace (or unsupported version)");
+    return false;
+  }
+  return true;
+}
+
+bool Player::Next(Record *record) {
+  if (has_peeked_) {
+    has_peeked_ = false;
+    record->type = peeked_.type;
+    record->timestamp = peeked_.timestamp;
+    record->data.swap(peeked_.data);
+    return true;
+  }
+  return ReadRecord(record);
+}
+
+bool Player::NextOfType(RecordType type, Record *record) {
+  if (!has_peeked_) {
+    if (!ReadRecord(&peeked_)) {
+      return false;
+    }
+    has_peeked_ = true;
+  }
+
+  if (peeked_.type != type) {
+    return false;
+  }
+  return Next(record);
+}
+
+bool Player::ReadRecord(Record *record) {
+  uint8_t type_byte;
+  uint32_t size;
+
+  if (!file_.Read(&type_byte, sizeof(type_byte))) {
+    // end of trace
+    return false;
+  }
+
+  if (!file_.Read(&record->timestamp, sizeof(record->timestamp)) ||
+      !file_.Read(&size, sizeof(size))) {
+    Log("Player: truncated record header");
+    return false;
+  }
+
+  record->type = static_cast<RecordType>(type_byte);
+  record->data.resize(size);
+  if (!file_.Read(record->data.data(), size)) {
+    Log("Player: truncated record (expected %u bytes)", size);
+    return false;
+  }
+  return true;
+}
+
+} // namespace trace
+} // namespace capsule
@@ -0,0 +1,127 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <lab/types.h>
+
+#include <stdio.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#if defined(CAPSULE_HAS_ZLIB)
+#include <zlib.h>
+#endif // CAPSULE_HAS_ZLIB
+
+namespace capsule {
+namespace trace {
+
+/**
+ * A trace is a recording of everything libcapsule sent to capsulerun
+ * during a session, so it can be replayed without the game.
+ *
+ * Layout: the kMagic string, then a sequence of records, each being
+ *   uint8 type, int64 timestamp (microseconds since recording started),
+ *   uint32 size, then size bytes of payload.
+ *
+ * Traces are gzip-compressed when capsulerun is built with zlib.
+ */
+
+static const char kMagic[] = "capsule-trace-1";
+
+enum RecordType {
+  // a packet as received from libcapsule
+  kRecordPacket = 1,
+  // contents of the video shm frame referenced by the previous packet
+  kRecordVideoFrame = 2,
+  // contents of the audio shm frames referenced by the previous packet
+  kRecordAudioFrames = 3,
+};
+
+struct Record {
+  RecordType type;
+  int64_t timestamp;
+  std::vector<char> data;
+};
+
+class TraceFile {
+  public:
+    TraceFile(std::string path) :
+      path_(path) {};
+    ~TraceFile();
+
+    bool Open(const char *mode);
+    bool Write(const void *data, size_t size);
+    bool Read(void *data, size_t size);
+    void Close();
+
+  private:
+    std::string path_;
+#if defined(CAPSULE_HAS_ZLIB)
+    gzFile file_ = nullptr;
+#else // CAPSULE_HAS_ZLIB
+    FILE *file_ = nullptr;
+#endif // !CAPSULE_HAS_ZLIB
+};
+
+class Recorder {
+  public:
+    Recorder(std::string path) :
+      file_(path) {};
+    ~Recorder();
+
+    bool Open();
+    void Packet(const char *buf, uint32_t size);
+    void VideoFrame(const char *data, size_t size);
+    void AudioFrames(const char *data, size_t size);
+
+  private:
+    void Write(RecordType type, const char *data, size_t size);
+
+    TraceFile file_;
+    bool open_ = false;
+    std::chrono::steady_clock::time_point start_;
+};
+
+class Player {
+  public:
+    Player(std::string path) :
+      file_(path) {};
+
+    bool Open();
+    // returns false at the end of the trace
+    bool Next(Record *record);
+    // returns false if the next record isn't of the given type,
+    // in which case it'll be returned by the next call to Next
+    bool NextOfType(RecordType type, Record *record);
+
+  private:
+    bool ReadRecord(Record *record);
+
+    TraceFile file_;
+    bool has_peeked_ = false;
+    Record peeked_;
+};
+
+} // namespace trace
+} // namespace capsule
@@ -26,6 +26,7 @@
 
 #include "video_receiver.h"
 #include "logging.h"
+#include "memory.h"
 
 MICROPROFILE_DEFINE(VideoReceiverWait, "VideoReceiver", "VWait", MP_CHOCOLATE3);
 MICROPROFILE_DEFINE(VideoReceiverCopy1, "VideoReceiver", "VCopy1", MP_CORNSILK3);
@@ -34,24 +35,66 @@ MICROPROFILE_DEFINE(VideoReceiverCopy2, "VideoReceiver", "VCopy2", MP_PINK3);
 namespace capsule {
 namespace video {
 
-VideoReceiver::VideoReceiver (Connection *conn, encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames) {
+VideoReceiver::VideoReceiver (Connection *conn, encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames, bool control_ring) {
   conn_ = conn;
   vfmt_ = vfmt;
   shm_ = shm;
 
   num_frames_ = num_frames;
-  frame_size_ = static_cast<size_t>(vfmt_.pitch * vfmt_.height);
+  frame_size_ = static_cast<size_t>(vfmt_.frame_size);
   Log("VideoReceiver: initializing, buffer of %d frames", num_frames_);
   Log("VideoReceiver: total buffer size in RAM: %.2f MB", (float) (frame_size_ * num_frames_) / 1024.0f / 1024.0f);
-  buffer_ = (char *) calloc(num_frames_, frame_size_);
+  buffer_ = (char *) memory::Allocate(num_frames_ * frame_size_);
+
+  frames_ = new SpscRing<FrameSlot>(static_cast<size_t>(num_frames_));
+  // nothing committed yet, reserving the whole ring just points slots at their frames
+  FrameSlot *slots;
+  frames_->Reserve(frames_->Capacity(), &slots);
+  for (int i = 0; i < num_frames_; i++) {
+    slots[i].data = buffer_ + (frame_size_ * i);
+  }
 
-  buffer_state_ = (int *) calloc(num_frames_, sizeof(int));
-  for (int i = 0; i < num_frames; i++) {
-    buffer_state_[i] = kFrameStateAvailable;
+#if defined(LAB_LINUX)
+  if (control_ring) {
+    auto header = reinterpret_cast<ring::FrameRingHeader*>(shm_->Data());
+    if (ring::IsValidHeader(header)) {
+      ring_ = header;
+      frames_offset_ = ring::kHeaderSize;
+      ring_thread_ = new std::thread(&VideoReceiver::PollRing, this);
+      Log("VideoReceiver: receiving frames through the shm control ring");
+    } else {
+      Log("VideoReceiver: invalid control ring header, no frames will be received");
+    }
+  }
+#else
+  if (control_ring) {
+    Log("VideoReceiver: control ring unsupported on this platform, no frames will be received");
+  }
+#endif // LAB_LINUX
+}
+
+#if defined(LAB_LINUX)
+
+void VideoReceiver::PollRing() {
+  ring::FrameDescriptor desc;
+
+  while (!stopped_) {
+    if (ring::Pop(&ring_->commit, &desc)) {
+      FrameCommitted(static_cast<int>(desc.index), desc.timestamp);
+    } else {
+      MICROPROFILE_SCOPE(VideoReceiverWait);
+      // wake up once in a while to notice Stop()
+      ring::Wait(&ring_->commit, 100);
+    }
   }
-  commit_index_ = 0;
 }
 
+#else
+
+void VideoReceiver::PollRing() {}
+
+#endif // LAB_LINUX
+
 int VideoReceiver::ReceiveFormat(encoder::VideoFormat *vfmt) {
   memcpy(vfmt, &vfmt_, sizeof(*vfmt));
   return 0;
@@ -60,109 +103,70 @@ int VideoReceiver::ReceiveFormat(encoder::VideoFormat *vfmt) {
 int64_t VideoReceiver::ReceiveFrame(uint8_t *buffer_out, size_t buffer_size_out, int64_t *timestamp_out) {
   if (frame_size_ != buffer_size_out) {
     Log("internal error: expected frame_size (%" PRIdS ") and buffer_size_out (%" PRIdS ") to match, but they didn't\n", frame_size_, buffer_size_out);
-    {
-      std::lock_guard<std::mutex> lock(stopped_mutex_);
-      stopped_ = true;
-    }
+    stopped_ = true;
     return -1;
   }
 
-  FrameInfo info {};
-
-  if (!queue_.TryPop(info)) {
+  FrameSlot *slot;
+  if (!frames_->Peek(1, &slot)) {
     // no frame waiting, oh well
-
     // are we stopped though?
-    {
-      std::lock_guard<std::mutex> lock(stopped_mutex_);
-      if (stopped_) {
-        return -1;
-      }
-    }
-    return 0;
+    return stopped_ ? -1 : 0;
   }
 
-  *timestamp_out = info.timestamp;
-
-  char *src = buffer_ + (info.index * frame_size_);
-  char *dst = (char *) buffer_out;
+  *timestamp_out = slot->timestamp;
   {
     MICROPROFILE_SCOPE(VideoReceiverCopy2);
-    memcpy(dst, src, frame_size_);
+    memcpy(buffer_out, slot->data, frame_size_);
   }
+  frames_->Release(1);
 
-  {
-    std::lock_guard<std::mutex> lock(buffer_mutex_);
-
-    buffer_state_[info.index] = kFrameStateProcessing;
-    int prev_index = (info.index == 0) ? (num_frames_ - 1) : (info.index - 1);
-    if (buffer_state_[prev_index] == kFrameStateProcessing) {
-      buffer_state_[prev_index] = kFrameStateAvailable;
-    }
-
-    /////////////////////////////////
-    // <poor man's profiling>
-    /////////////////////////////////
-    if ((info.index % 10) == 0) {
-      int committed_frames = 0;
-      for (int i = 0; i < num_frames_; i++) {
-        if (buffer_state_[i] == kFrameStateCommitted) {
-          committed_frames++;
-        }
-      }
-      Log("buffer fill: %d/%d, skipped %d", committed_frames, num_frames_, overrun_);
-    }
-    /////////////////////////////////
-    // </poor man's profiling>
-    /////////////////////////////////
+  /////////////////////////////////
+  // <poor man's profiling>
+  /////////////////////////////////
+  if ((received_++ % 10) == 0) {
+    Log("buffer fill: %" PRIdS "/%d, skipped %" PRIu64, frames_->Size(), num_frames_, frames_->Overruns());
   }
+  /////////////////////////////////
+  // </poor man's profiling>
+  /////////////////////////////////
 
   return buffer_size_out;
 }
 
 void VideoReceiver::FrameCommitted(int index, int64_t timestamp) {
-  {
-    std::lock_guard<std::mutex> lock(stopped_mutex_);
-    if (stopped_) {
-      // just ignore
-      return;
-    }
+  if (stopped_) {
+    // just ignore
+    return;
   }
 
-  int commit = 0;
-
-  {
-    std::lock_guard<std::mutex> lock(buffer_mutex_);
-
-    if (buffer_state_[commit_index_] != kFrameStateAvailable) {
-      // no room, just skip it
-      overrun_++;
-    } else {
-      commit = 1;
+  FrameSlot *slot;
+  if (frames_->Reserve(1, &slot)) {
+    // got room, copy it
+    {
+      MICROPROFILE_SCOPE(VideoReceiverCopy1);
+      memcpy(slot->data, SharedFrame(index), frame_size_);
     }
+    slot->timestamp = timestamp;
+    frames_->Commit(1);
+  } else {
+    // no room, just skip it
+    frames_->Overrun(1);
   }
 
-  if (commit) {
-      // got room, copy it
-      char *src = reinterpret_cast<char*>(shm_->Data()) + (frame_size_ * index);
-      char *dst = buffer_ + (frame_size_ * commit_index_);
-      {
-        MICROPROFILE_SCOPE(VideoReceiverCopy1);
-        memcpy(dst, src, frame_size_);
-      }
-
-      FrameInfo info {commit_index_, timestamp};
-      queue_.Push(info);
-
-      {
-        std::lock_guard<std::mutex> lock(buffer_mutex_);
+  // in both cases, free up that index for the sender
+  FrameProcessed(index);
+}
 
-        buffer_state_[commit_index_] = kFrameStateCommitted;
-        commit_index_ = (commit_index_ + 1) % num_frames_;
-      }
+void VideoReceiver::FrameProcessed(int index) {
+  if (ring_) {
+    ring::FrameDescriptor desc = {};
+    desc.index = static_cast<uint32_t>(index);
+    // libcapsule has at most a few frames in flight, this can't fill up
+    ring::Push(&ring_->release, desc);
+    return;
   }
 
-  // in both cases, free up that index for the sender
   flatbuffers::FlatBufferBuilder builder(1024);
   auto vfp = messages::CreateVideoFrameProcessed(builder, index); 
   auto opkt = messages::CreatePacket(builder, messages::Message_VideoFrameProcessed, vfp.Union());
@@ -170,14 +174,28 @@ void VideoReceiver::FrameCommitted(int index, int64_t timestamp) {
   conn_->Write(builder);
 }
 
+const char *VideoReceiver::SharedFrame(int index) {
+  return reinterpret_cast<char*>(shm_->Data()) + frames_offset_ + (frame_size_ * index);
+}
+
+bool VideoReceiver::HasRoom() {
+  // frames are ignored anyway once stopped
+  return stopped_ || !frames_->Full();
+}
+
 void VideoReceiver::Stop() {
-  std::lock_guard<std::mutex> lock(stopped_mutex_);
   stopped_ = true;
 }
 
 VideoReceiver::~VideoReceiver () {
-  free(buffer_state_);
-  free(buffer_);
+  if (ring_thread_) {
+    Stop();
+    ring_thread_->join();
+    delete ring_thread_;
+  }
+
+  delete frames_;
+  memory::Free(buffer_);
   delete shm_;
 }
 
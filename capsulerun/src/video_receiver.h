@@ -21,55 +21,62 @@
 
 #pragma once
 
-#include <mutex>
+#include <atomic>
+#include <thread>
 
 #include <shoom.h>
 
-#include "locking_queue.h"
+#include <capsule/frame_ring.h>
+
+#include "spsc_ring.h"
 #include "connection.h"
 #include "encoder.h"
 
 namespace capsule {
 namespace video {
 
-enum FrameState {
-  kFrameStateAvailable = 0,
-  kFrameStateCommitted,
-  kFrameStateProcessing,
-};
-
-struct FrameInfo {
-  int index;
+// one slot of the receive ring, data points into the receiver's buffer
+struct FrameSlot {
+  char *data;
   int64_t timestamp;
 };
 
 class VideoReceiver {
   public:
-    VideoReceiver(Connection *conn, encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames);
+    VideoReceiver(Connection *conn, encoder::VideoFormat vfmt, shoom::Shm *shm, int num_frames, bool control_ring);
     ~VideoReceiver();
     void FrameCommitted(int index, int64_t timestamp);
     int ReceiveFormat(encoder::VideoFormat *vfmt);
     int64_t ReceiveFrame(uint8_t *buffer, size_t buffer_size, int64_t *timestamp);
     void Stop();
 
+    // for recording traces: the shm frame a FrameCommitted refers to
+    const char *SharedFrame(int index);
+    size_t FrameSize() { return frame_size_; };
+    // false if the next committed frame would be dropped
+    bool HasRoom();
+
   private:
+    void PollRing();
+    void FrameProcessed(int index);
+
     Connection *conn_ = nullptr;
     encoder::VideoFormat vfmt_;
     shoom::Shm *shm_ = nullptr;
 
-    LockingQueue<FrameInfo> queue_;
+    // non-null if frame commits & releases go through the shm
+    ring::FrameRingHeader *ring_ = nullptr;
+    std::thread *ring_thread_ = nullptr;
+    int64_t frames_offset_ = 0;
 
     int num_frames_ = 0;
     size_t frame_size_ = 0;
-    int commit_index_ = 0;
     char *buffer_ = nullptr;
-    int *buffer_state_ = nullptr;
-    std::mutex buffer_mutex_;
-
-    bool stopped_ = false;
-    std::mutex stopped_mutex_;
+    // produced by FrameCommitted, consumed by ReceiveFrame
+    SpscRing<FrameSlot> *frames_ = nullptr;
+    int64_t received_ = 0;
 
-    int overrun_ = 0;
+    std::atomic<bool> stopped_{false};
 };
 
 } // namespace video
@@ -0,0 +1,264 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "mpsc_queue.h"
+#include "spsc_ring.h"
+#include "thread_budget.h"
+
+#include <thread>
+#include <vector>
+
+#include "lest.hpp"
+
+using namespace capsule;
+
+// starts sessions wanting `wanted` threads over `outputs` outputs each,
+// returns their shares
+static std::vector<int> StartSessions(int budget, int num_sessions, int wanted, int outputs) {
+  std::vector<int> shares;
+  int in_use = 0;
+  for (int i = 0; i < num_sessions; i++) {
+    int share = thread_budget::Share(budget, i, in_use, wanted, outputs);
+    in_use += share;
+    shares.push_back(share);
+  }
+  return shares;
+}
+
+const lest::test specification[] = {
+  CASE("thread_budget::Share stays within the budget while any is left") {
+    for (int budget = 1; budget <= 16; budget++) {
+      for (int outputs = 1; outputs <= 3; outputs++) {
+        for (int wanted = outputs; wanted <= 4 * outputs; wanted++) {
+          int in_use = 0;
+          for (int n = 0; n < 20; n++) {
+            int left = budget - in_use;
+            int share = thread_budget::Share(budget, n, in_use, wanted, outputs);
+            EXPECT(share >= outputs);
+            EXPECT(share <= wanted);
+            if (left >= outputs) {
+              EXPECT(in_use + share <= budget);
+            } else {
+              // used up: the documented floor, one per output
+              EXPECT(share == outputs);
+            }
+            in_use += share;
+          }
+        }
+      }
+    }
+  },
+
+  CASE("thread_budget::Share never hands out more than the budget to N sessions that fit") {
+    for (int budget = 1; budget <= 16; budget++) {
+      for (int n = 1; n <= budget; n++) {
+        int total = 0;
+        for (int share : StartSessions(budget, n, 1, 1)) {
+          total += share;
+        }
+        EXPECT(total <= budget);
+      }
+    }
+  },
+
+  CASE("thread_budget::Share doesn't let the first session starve the second") {
+    // --threads 8 --thread-budget 8: both recordings get half
+    auto shares = StartSessions(8, 2, 8, 1);
+    EXPECT(shares[0] == 4);
+    EXPECT(shares[1] == 4);
+    // same with two outputs each
+    shares = StartSessions(8, 2, 8, 2);
+    EXPECT(shares[0] == 4);
+    EXPECT(shares[1] == 4);
+  },
+
+  CASE("thread_budget::Share caps each session at an even split") {
+    EXPECT(thread_budget::Share(12, 0, 0, 12, 1) == 6);
+    EXPECT(thread_budget::Share(12, 1, 6, 12, 1) == 6);
+    EXPECT(thread_budget::Share(12, 2, 6, 12, 1) == 4);
+    // asking for less than the slice gets what was asked for
+    EXPECT(thread_budget::Share(12, 0, 0, 2, 1) == 2);
+  },
+
+  CASE("thread_budget::Share gives a late session only what's left") {
+    // the running ones already hold all 4, the next one gets the floor
+    EXPECT(thread_budget::Share(4, 2, 4, 2, 1) == 1);
+    EXPECT(thread_budget::Share(4, 1, 3, 4, 1) == 1);
+    EXPECT(thread_budget::Share(8, 2, 5, 4, 2) == 2);
+    EXPECT(thread_budget::Share(8, 2, 8, 4, 2) == 2);
+  },
+
+  CASE("thread_budget::Share gets threads back from finished sessions") {
+    auto shares = StartSessions(8, 2, 4, 1);
+    EXPECT(shares[0] == 4);
+    EXPECT(shares[1] == 4);
+    // the first one finishes
+    EXPECT(thread_budget::Share(8, 1, 8 - shares[0], 4, 1) == 4);
+  },
+
+  CASE("MpscQueue pops nothing when empty") {
+    MpscQueue<int, 4> queue;
+    int value = -1;
+    EXPECT(queue.Empty());
+    EXPECT(!queue.TryPop(value));
+    EXPECT(value == -1);
+    EXPECT(!queue.TryWaitAndPop(value, 1));
+  },
+
+  CASE("MpscQueue refuses pushes when full, takes them again once popped") {
+    MpscQueue<int, 4> queue;
+    for (int i = 0; i < 4; i++) {
+      EXPECT(queue.TryPush(i));
+    }
+    EXPECT(!queue.TryPush(4));
+
+    int value = -1;
+    EXPECT(queue.TryPop(value));
+    EXPECT(value == 0);
+    EXPECT(queue.TryPush(4));
+    EXPECT(!queue.TryPush(5));
+
+    int values[8];
+    EXPECT(queue.TryPopBatch(values, 8) == 4u);
+    for (int i = 0; i < 4; i++) {
+      EXPECT(values[i] == i + 1);
+    }
+    EXPECT(queue.Empty());
+  },
+
+  CASE("MpscQueue keeps each producer's values in order") {
+    const int kProducers = 4;
+    const int kPerProducer = 20000;
+    // small, so producers keep hitting a full queue
+    MpscQueue<int, 64> queue;
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+      producers.emplace_back([&queue, p]() {
+        for (int i = 0; i < kPerProducer; i++) {
+          queue.Push(p * kPerProducer + i);
+        }
+      });
+    }
+
+    std::vector<int> next(kProducers, 0);
+    int popped = 0;
+    bool ordered = true;
+    while (popped < kProducers * kPerProducer) {
+      int values[16];
+      size_t count = queue.TryWaitAndPopBatch(values, 16, 1000);
+      EXPECT(count > 0u);
+      if (count == 0) {
+        break;
+      }
+      for (size_t i = 0; i < count; i++) {
+        int p = values[i] / kPerProducer;
+        ordered = ordered && values[i] % kPerProducer == next[p];
+        next[p]++;
+      }
+      popped += static_cast<int>(count);
+    }
+
+    for (auto &producer : producers) {
+      producer.join();
+    }
+    EXPECT(ordered);
+    for (int p = 0; p < kProducers; p++) {
+      EXPECT(next[p] == kPerProducer);
+    }
+    EXPECT(queue.Empty());
+  },
+
+  CASE("SpscRing hands out short runs where it wraps around") {
+    SpscRing<int> ring(8);
+    int *run = nullptr;
+
+    // move both cursors to 6: the free space wraps after 2 slots
+    EXPECT(ring.Reserve(6, &run) == 6u);
+    ring.Commit(6);
+    EXPECT(ring.Peek(6, &run) == 6u);
+    ring.Release(6);
+
+    EXPECT(ring.Reserve(5, &run) == 2u);
+    run[0] = 10;
+    run[1] = 11;
+    ring.Commit(2);
+    EXPECT(ring.Reserve(5, &run) == 5u);
+    for (int i = 0; i < 5; i++) {
+      run[i] = 12 + i;
+    }
+    ring.Commit(5);
+    EXPECT(ring.Size() == 7u);
+
+    // the reader sees the same split: the 2 before the end, then the rest
+    EXPECT(ring.Peek(8, &run) == 2u);
+    EXPECT(run[0] == 10);
+    EXPECT(run[1] == 11);
+    ring.Release(2);
+    EXPECT(ring.Peek(8, &run) == 5u);
+    for (int i = 0; i < 5; i++) {
+      EXPECT(run[i] == 12 + i);
+    }
+    ring.Release(5);
+    EXPECT(ring.Size() == 0u);
+  },
+
+  CASE("SpscRing is full at capacity, with nothing left to reserve") {
+    int storage[4];
+    SpscRing<int> ring(4, storage);
+    int *run = nullptr;
+    EXPECT(ring.Capacity() == 4u);
+    EXPECT(ring.Size() == 0u);
+    EXPECT(!ring.Full());
+    EXPECT(ring.Peek(4, &run) == 0u);
+
+    EXPECT(ring.Reserve(3, &run) == 3u);
+    EXPECT(run == storage);
+    ring.Commit(3);
+    EXPECT(ring.Size() == 3u);
+    EXPECT(!ring.Full());
+
+    EXPECT(ring.Reserve(3, &run) == 1u);
+    ring.Commit(1);
+    EXPECT(ring.Size() == 4u);
+    EXPECT(ring.Full());
+    EXPECT(ring.Reserve(1, &run) == 0u);
+
+    EXPECT(ring.Peek(1, &run) == 1u);
+    ring.Release(1);
+    EXPECT(!ring.Full());
+    EXPECT(ring.Size() == 3u);
+  },
+
+  CASE("SpscRing counts overruns") {
+    SpscRing<int> ring(2);
+    EXPECT(ring.Overruns() == 0u);
+    ring.Overrun(3);
+    ring.Overrun(1);
+    EXPECT(ring.Overruns() == 4u);
+    // dropped elements never count towards the fill level
+    EXPECT(ring.Size() == 0u);
+  },
+};
+
+int main (int argc, char *argv[]) {
+  return lest::run(specification, argc, argv);
+}
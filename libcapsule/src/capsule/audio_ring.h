@@ -0,0 +1,133 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+namespace capsule {
+namespace audio_ring {
+
+/**
+ * Audio frames, passed through the audio shm without any messages.
+ * The first kHeaderSize bytes of the audio shm hold an AudioRingHeader,
+ * interleaved frames follow.
+ *
+ * Cursors count frames since the start of the capture and never wrap in
+ * practice, the position in the shm is `cursor % num_frames`.
+ *
+ *   - libcapsule writes frames, then advances `write_cursor`. If the
+ *     reader is too far behind, it drops the newest frames instead of
+ *     overwriting unread ones, and adds them to `dropped_frames`.
+ *   - capsulerun copies frames out, then advances `read_cursor`. It
+ *     polls, so there's no doorbell.
+ */
+
+static const int64_t kHeaderSize = 4096;
+static const uint32_t kMagic = 0x43415544; // "CAUD"
+static const uint32_t kVersion = 1;
+
+struct AudioRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint8_t pad0[56];
+  std::atomic<uint64_t> write_cursor; // only libcapsule stores
+  uint8_t pad1[56];
+  std::atomic<uint64_t> read_cursor; // only capsulerun stores
+  uint8_t pad2[56];
+  std::atomic<uint64_t> dropped_frames; // only libcapsule stores
+  uint8_t pad3[56];
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == 8, "atomic cursors must be plain 64-bit words");
+static_assert(sizeof(AudioRingHeader) == 256, "AudioRingHeader layout must not depend on bitness");
+static_assert(sizeof(AudioRingHeader) <= kHeaderSize, "AudioRingHeader must fit in the shm header");
+
+// called by the creator of the shm (libcapsule), before announcing it
+inline void InitHeader(AudioRingHeader *header) {
+  header->write_cursor.store(0);
+  header->read_cursor.store(0);
+  header->dropped_frames.store(0);
+  header->version = kVersion;
+  header->magic = kMagic;
+}
+
+inline bool IsValidHeader(const AudioRingHeader *header) {
+  return header->magic == kMagic && header->version == kVersion;
+}
+
+// copies frames out of (or into) the ring, in two parts if they wrap around
+inline void Copy(char *ring_data, int64_t num_frames, int64_t frame_size,
+                 uint64_t cursor, char *data, int64_t frames, bool to_ring) {
+  int64_t pos = static_cast<int64_t>(cursor % static_cast<uint64_t>(num_frames));
+  int64_t first = frames;
+  if (first > num_frames - pos) {
+    first = num_frames - pos;
+  }
+
+  char *ring_pos = ring_data + pos * frame_size;
+  if (to_ring) {
+    memcpy(ring_pos, data, first * frame_size);
+    memcpy(ring_data, data + first * frame_size, (frames - first) * frame_size);
+  } else {
+    memcpy(data, ring_pos, first * frame_size);
+    memcpy(data + first * frame_size, ring_data, (frames - first) * frame_size);
+  }
+}
+
+// producer side: returns how many of the frames made it in
+inline int64_t Write(AudioRingHeader *header, char *ring_data, int64_t num_frames,
+                     int64_t frame_size, const char *src, int64_t frames) {
+  uint64_t write = header->write_cursor.load(std::memory_order_relaxed);
+  uint64_t read = header->read_cursor.load(std::memory_order_acquire);
+  int64_t room = num_frames - static_cast<int64_t>(write - read);
+
+  int64_t accepted = frames < room ? frames : room;
+  if (accepted < frames) {
+    header->dropped_frames.fetch_add(static_cast<uint64_t>(frames - accepted), std::memory_order_relaxed);
+  }
+  if (accepted <= 0) {
+    return 0;
+  }
+
+  Copy(ring_data, num_frames, frame_size, write, const_cast<char *>(src), accepted, true);
+  header->write_cursor.store(write + static_cast<uint64_t>(accepted), std::memory_order_release);
+  return accepted;
+}
+
+// consumer side: frames written but not read yet
+inline int64_t Available(AudioRingHeader *header, uint64_t *read_out) {
+  uint64_t read = header->read_cursor.load(std::memory_order_relaxed);
+  uint64_t write = header->write_cursor.load(std::memory_order_acquire);
+  *read_out = read;
+  return static_cast<int64_t>(write - read);
+}
+
+// consumer side: hands frames back to the producer
+inline void Consume(AudioRingHeader *header, int64_t frames) {
+  header->read_cursor.fetch_add(static_cast<uint64_t>(frames), std::memory_order_release);
+}
+
+} // namespace audio_ring
+} // namespace capsule
@@ -0,0 +1,167 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <lab/platform.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+#if defined(LAB_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif // LAB_LINUX
+
+namespace capsule {
+namespace ring {
+
+/**
+ * Frame commits and releases, passed through the video shm instead of
+ * the FIFO. The first kHeaderSize bytes of the video shm hold a
+ * FrameRingHeader, frames follow.
+ *
+ *   - libcapsule pushes to `commit` after copying a frame in, and rings
+ *     the doorbell only if capsulerun is asleep
+ *   - capsulerun pushes to `release` once it's done with a frame;
+ *     libcapsule drains it before writing the next frame, no doorbell
+ *
+ * Both processes may have different bitness, so everything in here has
+ * a fixed size and layout.
+ */
+
+static const int64_t kHeaderSize = 4096;
+static const uint32_t kMagic = 0x43524e47; // "CRNG"
+static const uint32_t kVersion = 1;
+
+// must be a power of two, and larger than the number of frame buffers
+static const uint32_t kNumSlots = 16;
+
+struct FrameDescriptor {
+  int64_t timestamp;
+  uint32_t index;
+  uint32_t reserved;
+};
+
+// producer and consumer cursors live on separate cache lines
+struct DescriptorRing {
+  std::atomic<uint32_t> head; // next slot the producer writes, only it stores
+  uint8_t pad0[60];
+  std::atomic<uint32_t> tail; // next slot the consumer reads, only it stores
+  uint8_t pad1[60];
+  std::atomic<uint32_t> sleeping; // 1 while the consumer waits on the doorbell
+  uint8_t pad2[60];
+  FrameDescriptor slots[kNumSlots];
+};
+
+struct FrameRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint8_t pad0[56];
+  DescriptorRing commit;  // libcapsule -> capsulerun
+  DescriptorRing release; // capsulerun -> libcapsule
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == 4, "atomic cursors must be plain 32-bit words");
+static_assert(sizeof(FrameDescriptor) == 16, "FrameDescriptor layout must not depend on bitness");
+static_assert(sizeof(DescriptorRing) == 192 + 16 * kNumSlots, "DescriptorRing layout must not depend on bitness");
+static_assert(sizeof(FrameRingHeader) <= kHeaderSize, "FrameRingHeader must fit in the shm header");
+
+// called by the creator of the shm (libcapsule), before announcing it
+inline void InitHeader(FrameRingHeader *header) {
+  header->commit.head.store(0);
+  header->commit.tail.store(0);
+  header->commit.sleeping.store(0);
+  header->release.head.store(0);
+  header->release.tail.store(0);
+  header->release.sleeping.store(0);
+  header->version = kVersion;
+  header->magic = kMagic;
+}
+
+inline bool IsValidHeader(const FrameRingHeader *header) {
+  return header->magic == kMagic && header->version == kVersion;
+}
+
+// producer side, returns false if the ring is full
+inline bool Push(DescriptorRing *ring, const FrameDescriptor &desc) {
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+  uint32_t tail = ring->tail.load(std::memory_order_acquire);
+  if (head - tail >= kNumSlots) {
+    return false;
+  }
+
+  ring->slots[head & (kNumSlots - 1)] = desc;
+  // seq_cst so the doorbell's read of `sleeping` can't move above it
+  ring->head.store(head + 1, std::memory_order_seq_cst);
+  return true;
+}
+
+// consumer side, returns false if the ring is empty
+inline bool Pop(DescriptorRing *ring, FrameDescriptor *desc) {
+  uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint32_t head = ring->head.load(std::memory_order_acquire);
+  if (tail == head) {
+    return false;
+  }
+
+  *desc = ring->slots[tail & (kNumSlots - 1)];
+  ring->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+inline bool IsEmpty(DescriptorRing *ring) {
+  return ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_seq_cst);
+}
+
+#if defined(LAB_LINUX)
+
+// the futex word is shared between processes, so no FUTEX_PRIVATE_FLAG
+inline void Ring(DescriptorRing *ring) {
+  if (ring->sleeping.exchange(0, std::memory_order_seq_cst) == 1) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&ring->sleeping), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+  }
+}
+
+// consumer side: sleeps until something is pushed or timeout_ms elapses
+inline void Wait(DescriptorRing *ring, int timeout_ms) {
+  ring->sleeping.store(1, std::memory_order_seq_cst);
+  if (!IsEmpty(ring)) {
+    ring->sleeping.store(0, std::memory_order_relaxed);
+    return;
+  }
+
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  // returns right away if the producer already cleared `sleeping`
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&ring->sleeping), FUTEX_WAIT, 1, &timeout, nullptr, 0);
+  ring->sleeping.store(0, std::memory_order_relaxed);
+}
+
+#endif // LAB_LINUX
+
+} // namespace ring
+} // namespace capsule
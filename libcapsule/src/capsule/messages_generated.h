@@ -13,6 +13,8 @@ struct Packet;
 
 struct ReadyForYou;
 
+struct Hello;
+
 struct SawBackend;
 
 struct HotkeyPressed;
@@ -41,8 +43,10 @@ enum PixFmt {
   PixFmt_BGRA = 2,
   PixFmt_RGB10_A2 = 3,
   PixFmt_YUV444P = 4,
+  PixFmt_I420 = 5,
+  PixFmt_NV12 = 6,
   PixFmt_MIN = PixFmt_UNKNOWN,
-  PixFmt_MAX = PixFmt_YUV444P
+  PixFmt_MAX = PixFmt_NV12
 };
 
 inline const char **EnumNamesPixFmt() {
@@ -52,6 +56,8 @@ inline const char **EnumNamesPixFmt() {
     "BGRA",
     "RGB10_A2",
     "YUV444P",
+    "I420",
+    "NV12",
     nullptr
   };
   return names;
@@ -96,8 +102,9 @@ enum Backend {
   Backend_GL = 1,
   Backend_D3D9 = 2,
   Backend_DXGI = 3,
+  Backend_Vulkan = 4,
   Backend_MIN = Backend_UNKNOWN,
-  Backend_MAX = Backend_DXGI
+  Backend_MAX = Backend_Vulkan
 };
 
 inline const char **EnumNamesBackend() {
@@ -106,6 +113,7 @@ inline const char **EnumNamesBackend() {
     "GL",
     "D3D9",
     "DXGI",
+    "Vulkan",
     nullptr
   };
   return names;
@@ -128,8 +136,9 @@ enum Message {
   Message_AudioFramesCommitted = 8,
   Message_AudioFramesProcessed = 9,
   Message_SawBackend = 10,
+  Message_Hello = 11,
   Message_MIN = Message_NONE,
-  Message_MAX = Message_SawBackend
+  Message_MAX = Message_Hello
 };
 
 inline const char **EnumNamesMessage() {
@@ -145,6 +154,7 @@ inline const char **EnumNamesMessage() {
     "AudioFramesCommitted",
     "AudioFramesProcessed",
     "SawBackend",
+    "Hello",
     nullptr
   };
   return names;
@@ -199,6 +209,10 @@ template<> struct MessageTraits<SawBackend> {
   static const Message enum_value = Message_SawBackend;
 };
 
+template<> struct MessageTraits<Hello> {
+  static const Message enum_value = Message_Hello;
+};
+
 bool VerifyMessage(flatbuffers::Verifier &verifier, const void *obj, Message type);
 bool VerifyMessageVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
@@ -244,6 +258,9 @@ struct Packet FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const SawBackend *message_as_SawBackend() const {
     return (message_type() == Message_SawBackend)? static_cast<const SawBackend *>(message()) : nullptr;
   }
+  const Hello *message_as_Hello() const {
+    return (message_type() == Message_Hello)? static_cast<const Hello *>(message()) : nullptr;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_MESSAGE_TYPE) &&
@@ -293,6 +310,10 @@ template<> inline const SawBackend *Packet::message_as<SawBackend>() const {
   return message_as_SawBackend();
 }
 
+template<> inline const Hello *Packet::message_as<Hello>() const {
+  return message_as_Hello();
+}
+
 struct PacketBuilder {
   flatbuffers::FlatBufferBuilder &fbb_;
   flatbuffers::uoffset_t start_;
@@ -373,6 +394,46 @@ inline flatbuffers::Offset<ReadyForYou> CreateReadyForYouDirect(
       pipe ? _fbb.CreateString(pipe) : 0);
 }
 
+struct Hello FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_PID = 4
+  };
+  int32_t pid() const {
+    return GetField<int32_t>(VT_PID, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_PID) &&
+           verifier.EndTable();
+  }
+};
+
+struct HelloBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_pid(int32_t pid) {
+    fbb_.AddElement<int32_t>(Hello::VT_PID, pid, 0);
+  }
+  HelloBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  HelloBuilder &operator=(const HelloBuilder &);
+  flatbuffers::Offset<Hello> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<Hello>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<Hello> CreateHello(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t pid = 0) {
+  HelloBuilder builder_(_fbb);
+  builder_.add_pid(pid);
+  return builder_.Finish();
+}
+
 struct SawBackend FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_BACKEND = 4
@@ -445,7 +506,11 @@ struct CaptureStart FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_FPS = 4,
     VT_SIZE_DIVIDER = 6,
-    VT_GPU_COLOR_CONV = 8
+    VT_GPU_COLOR_CONV = 8,
+    VT_CONTROL_RING = 10,
+    VT_HUGE_PAGES = 12,
+    VT_PIX_FMTS = 14,
+    VT_AUDIO_RING = 16
   };
   uint32_t fps() const {
     return GetField<uint32_t>(VT_FPS, 0);
@@ -456,11 +521,28 @@ struct CaptureStart FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   bool gpu_color_conv() const {
     return GetField<uint8_t>(VT_GPU_COLOR_CONV, 0) != 0;
   }
+  bool control_ring() const {
+    return GetField<uint8_t>(VT_CONTROL_RING, 0) != 0;
+  }
+  bool huge_pages() const {
+    return GetField<uint8_t>(VT_HUGE_PAGES, 0) != 0;
+  }
+  const flatbuffers::Vector<int32_t> *pix_fmts() const {
+    return GetPointer<const flatbuffers::Vector<int32_t> *>(VT_PIX_FMTS);
+  }
+  bool audio_ring() const {
+    return GetField<uint8_t>(VT_AUDIO_RING, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint32_t>(verifier, VT_FPS) &&
            VerifyField<uint32_t>(verifier, VT_SIZE_DIVIDER) &&
            VerifyField<uint8_t>(verifier, VT_GPU_COLOR_CONV) &&
+           VerifyField<uint8_t>(verifier, VT_CONTROL_RING) &&
+           VerifyField<uint8_t>(verifier, VT_HUGE_PAGES) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_PIX_FMTS) &&
+           verifier.Verify(pix_fmts()) &&
+           VerifyField<uint8_t>(verifier, VT_AUDIO_RING) &&
            verifier.EndTable();
   }
 };
@@ -477,13 +559,25 @@ struct CaptureStartBuilder {
   void add_gpu_color_conv(bool gpu_color_conv) {
     fbb_.AddElement<uint8_t>(CaptureStart::VT_GPU_COLOR_CONV, static_cast<uint8_t>(gpu_color_conv), 0);
   }
+  void add_control_ring(bool control_ring) {
+    fbb_.AddElement<uint8_t>(CaptureStart::VT_CONTROL_RING, static_cast<uint8_t>(control_ring), 0);
+  }
+  void add_huge_pages(bool huge_pages) {
+    fbb_.AddElement<uint8_t>(CaptureStart::VT_HUGE_PAGES, static_cast<uint8_t>(huge_pages), 0);
+  }
+  void add_pix_fmts(flatbuffers::Offset<flatbuffers::Vector<int32_t>> pix_fmts) {
+    fbb_.AddOffset(CaptureStart::VT_PIX_FMTS, pix_fmts);
+  }
+  void add_audio_ring(bool audio_ring) {
+    fbb_.AddElement<uint8_t>(CaptureStart::VT_AUDIO_RING, static_cast<uint8_t>(audio_ring), 0);
+  }
   CaptureStartBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   CaptureStartBuilder &operator=(const CaptureStartBuilder &);
   flatbuffers::Offset<CaptureStart> Finish() {
-    const auto end = fbb_.EndTable(start_, 3);
+    const auto end = fbb_.EndTable(start_, 7);
     auto o = flatbuffers::Offset<CaptureStart>(end);
     return o;
   }
@@ -493,14 +587,42 @@ inline flatbuffers::Offset<CaptureStart> CreateCaptureStart(
     flatbuffers::FlatBufferBuilder &_fbb,
     uint32_t fps = 0,
     uint32_t size_divider = 0,
-    bool gpu_color_conv = false) {
+    bool gpu_color_conv = false,
+    bool control_ring = false,
+    bool huge_pages = false,
+    flatbuffers::Offset<flatbuffers::Vector<int32_t>> pix_fmts = 0,
+    bool audio_ring = false) {
   CaptureStartBuilder builder_(_fbb);
+  builder_.add_pix_fmts(pix_fmts);
   builder_.add_size_divider(size_divider);
   builder_.add_fps(fps);
+  builder_.add_audio_ring(audio_ring);
+  builder_.add_huge_pages(huge_pages);
+  builder_.add_control_ring(control_ring);
   builder_.add_gpu_color_conv(gpu_color_conv);
   return builder_.Finish();
 }
 
+inline flatbuffers::Offset<CaptureStart> CreateCaptureStartDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint32_t fps = 0,
+    uint32_t size_divider = 0,
+    bool gpu_color_conv = false,
+    bool control_ring = false,
+    bool huge_pages = false,
+    const std::vector<int32_t> *pix_fmts = nullptr,
+    bool audio_ring = false) {
+  return capsule::messages::CreateCaptureStart(
+      _fbb,
+      fps,
+      size_divider,
+      gpu_color_conv,
+      control_ring,
+      huge_pages,
+      pix_fmts ? _fbb.CreateVector<int32_t>(*pix_fmts) : 0,
+      audio_ring);
+}
+
 struct CaptureStop FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
@@ -538,7 +660,9 @@ struct VideoSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
     VT_OFFSET = 12,
     VT_LINESIZE = 14,
     VT_SHMEM = 16,
-    VT_AUDIO = 18
+    VT_AUDIO = 18,
+    VT_CONTROL_RING = 20,
+    VT_BACKEND_PIX_FMTS = 22
   };
   uint32_t width() const {
     return GetField<uint32_t>(VT_WIDTH, 0);
@@ -564,6 +688,12 @@ struct VideoSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const AudioSetup *audio() const {
     return GetPointer<const AudioSetup *>(VT_AUDIO);
   }
+  bool control_ring() const {
+    return GetField<uint8_t>(VT_CONTROL_RING, 0) != 0;
+  }
+  const flatbuffers::Vector<int32_t> *backend_pix_fmts() const {
+    return GetPointer<const flatbuffers::Vector<int32_t> *>(VT_BACKEND_PIX_FMTS);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint32_t>(verifier, VT_WIDTH) &&
@@ -578,6 +708,9 @@ struct VideoSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            verifier.VerifyTable(shmem()) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_AUDIO) &&
            verifier.VerifyTable(audio()) &&
+           VerifyField<uint8_t>(verifier, VT_CONTROL_RING) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_BACKEND_PIX_FMTS) &&
+           verifier.Verify(backend_pix_fmts()) &&
            verifier.EndTable();
   }
 };
@@ -609,13 +742,19 @@ struct VideoSetupBuilder {
   void add_audio(flatbuffers::Offset<AudioSetup> audio) {
     fbb_.AddOffset(VideoSetup::VT_AUDIO, audio);
   }
+  void add_control_ring(bool control_ring) {
+    fbb_.AddElement<uint8_t>(VideoSetup::VT_CONTROL_RING, static_cast<uint8_t>(control_ring), 0);
+  }
+  void add_backend_pix_fmts(flatbuffers::Offset<flatbuffers::Vector<int32_t>> backend_pix_fmts) {
+    fbb_.AddOffset(VideoSetup::VT_BACKEND_PIX_FMTS, backend_pix_fmts);
+  }
   VideoSetupBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   VideoSetupBuilder &operator=(const VideoSetupBuilder &);
   flatbuffers::Offset<VideoSetup> Finish() {
-    const auto end = fbb_.EndTable(start_, 8);
+    const auto end = fbb_.EndTable(start_, 10);
     auto o = flatbuffers::Offset<VideoSetup>(end);
     return o;
   }
@@ -630,8 +769,11 @@ inline flatbuffers::Offset<VideoSetup> CreateVideoSetup(
     flatbuffers::Offset<flatbuffers::Vector<int64_t>> offset = 0,
     flatbuffers::Offset<flatbuffers::Vector<int64_t>> linesize = 0,
     flatbuffers::Offset<Shmem> shmem = 0,
-    flatbuffers::Offset<AudioSetup> audio = 0) {
+    flatbuffers::Offset<AudioSetup> audio = 0,
+    bool control_ring = false,
+    flatbuffers::Offset<flatbuffers::Vector<int32_t>> backend_pix_fmts = 0) {
   VideoSetupBuilder builder_(_fbb);
+  builder_.add_backend_pix_fmts(backend_pix_fmts);
   builder_.add_audio(audio);
   builder_.add_shmem(shmem);
   builder_.add_linesize(linesize);
@@ -639,6 +781,7 @@ inline flatbuffers::Offset<VideoSetup> CreateVideoSetup(
   builder_.add_pix_fmt(pix_fmt);
   builder_.add_height(height);
   builder_.add_width(width);
+  builder_.add_control_ring(control_ring);
   builder_.add_vflip(vflip);
   return builder_.Finish();
 }
@@ -652,7 +795,9 @@ inline flatbuffers::Offset<VideoSetup> CreateVideoSetupDirect(
     const std::vector<int64_t> *offset = nullptr,
     const std::vector<int64_t> *linesize = nullptr,
     flatbuffers::Offset<Shmem> shmem = 0,
-    flatbuffers::Offset<AudioSetup> audio = 0) {
+    flatbuffers::Offset<AudioSetup> audio = 0,
+    bool control_ring = false,
+    const std::vector<int32_t> *backend_pix_fmts = nullptr) {
   return capsule::messages::CreateVideoSetup(
       _fbb,
       width,
@@ -662,7 +807,9 @@ inline flatbuffers::Offset<VideoSetup> CreateVideoSetupDirect(
       offset ? _fbb.CreateVector<int64_t>(*offset) : 0,
       linesize ? _fbb.CreateVector<int64_t>(*linesize) : 0,
       shmem,
-      audio);
+      audio,
+      control_ring,
+      backend_pix_fmts ? _fbb.CreateVector<int32_t>(*backend_pix_fmts) : 0);
 }
 
 struct AudioSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -670,7 +817,8 @@ struct AudioSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
     VT_CHANNELS = 4,
     VT_FORMAT = 6,
     VT_RATE = 8,
-    VT_SHMEM = 10
+    VT_SHMEM = 10,
+    VT_CONTROL_RING = 12
   };
   uint32_t channels() const {
     return GetField<uint32_t>(VT_CHANNELS, 0);
@@ -684,6 +832,9 @@ struct AudioSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const Shmem *shmem() const {
     return GetPointer<const Shmem *>(VT_SHMEM);
   }
+  bool control_ring() const {
+    return GetField<uint8_t>(VT_CONTROL_RING, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint32_t>(verifier, VT_CHANNELS) &&
@@ -691,6 +842,7 @@ struct AudioSetup FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            VerifyField<uint32_t>(verifier, VT_RATE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_SHMEM) &&
            verifier.VerifyTable(shmem()) &&
+           VerifyField<uint8_t>(verifier, VT_CONTROL_RING) &&
            verifier.EndTable();
   }
 };
@@ -710,13 +862,16 @@ struct AudioSetupBuilder {
   void add_shmem(flatbuffers::Offset<Shmem> shmem) {
     fbb_.AddOffset(AudioSetup::VT_SHMEM, shmem);
   }
+  void add_control_ring(bool control_ring) {
+    fbb_.AddElement<uint8_t>(AudioSetup::VT_CONTROL_RING, static_cast<uint8_t>(control_ring), 0);
+  }
   AudioSetupBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   AudioSetupBuilder &operator=(const AudioSetupBuilder &);
   flatbuffers::Offset<AudioSetup> Finish() {
-    const auto end = fbb_.EndTable(start_, 4);
+    const auto end = fbb_.EndTable(start_, 5);
     auto o = flatbuffers::Offset<AudioSetup>(end);
     return o;
   }
@@ -727,19 +882,22 @@ inline flatbuffers::Offset<AudioSetup> CreateAudioSetup(
     uint32_t channels = 0,
     SampleFmt format = SampleFmt_UNKNOWN,
     uint32_t rate = 0,
-    flatbuffers::Offset<Shmem> shmem = 0) {
+    flatbuffers::Offset<Shmem> shmem = 0,
+    bool control_ring = false) {
   AudioSetupBuilder builder_(_fbb);
   builder_.add_shmem(shmem);
   builder_.add_rate(rate);
   builder_.add_format(format);
   builder_.add_channels(channels);
+  builder_.add_control_ring(control_ring);
   return builder_.Finish();
 }
 
 struct Shmem FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_PATH = 4,
-    VT_SIZE = 6
+    VT_SIZE = 6,
+    VT_FD_INDEX = 8
   };
   const flatbuffers::String *path() const {
     return GetPointer<const flatbuffers::String *>(VT_PATH);
@@ -747,11 +905,15 @@ struct Shmem FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   uint64_t size() const {
     return GetField<uint64_t>(VT_SIZE, 0);
   }
+  int32_t fd_index() const {
+    return GetField<int32_t>(VT_FD_INDEX, -1);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
            verifier.Verify(path()) &&
            VerifyField<uint64_t>(verifier, VT_SIZE) &&
+           VerifyField<int32_t>(verifier, VT_FD_INDEX) &&
            verifier.EndTable();
   }
 };
@@ -765,13 +927,16 @@ struct ShmemBuilder {
   void add_size(uint64_t size) {
     fbb_.AddElement<uint64_t>(Shmem::VT_SIZE, size, 0);
   }
+  void add_fd_index(int32_t fd_index) {
+    fbb_.AddElement<int32_t>(Shmem::VT_FD_INDEX, fd_index, -1);
+  }
   ShmemBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   ShmemBuilder &operator=(const ShmemBuilder &);
   flatbuffers::Offset<Shmem> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<Shmem>(end);
     return o;
   }
@@ -780,9 +945,11 @@ struct ShmemBuilder {
 inline flatbuffers::Offset<Shmem> CreateShmem(
     flatbuffers::FlatBufferBuilder &_fbb,
     flatbuffers::Offset<flatbuffers::String> path = 0,
-    uint64_t size = 0) {
+    uint64_t size = 0,
+    int32_t fd_index = -1) {
   ShmemBuilder builder_(_fbb);
   builder_.add_size(size);
+  builder_.add_fd_index(fd_index);
   builder_.add_path(path);
   return builder_.Finish();
 }
@@ -790,11 +957,13 @@ inline flatbuffers::Offset<Shmem> CreateShmem(
 inline flatbuffers::Offset<Shmem> CreateShmemDirect(
     flatbuffers::FlatBufferBuilder &_fbb,
     const char *path = nullptr,
-    uint64_t size = 0) {
+    uint64_t size = 0,
+    int32_t fd_index = -1) {
   return capsule::messages::CreateShmem(
       _fbb,
       path ? _fbb.CreateString(path) : 0,
-      size);
+      size,
+      fd_index);
 }
 
 struct AudioFramesCommitted FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -1032,6 +1201,10 @@ inline bool VerifyMessage(flatbuffers::Verifier &verifier, const void *obj, Mess
       auto ptr = reinterpret_cast<const SawBackend *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case Message_Hello: {
+      auto ptr = reinterpret_cast<const Hello *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
@@ -125,6 +125,29 @@ bool Ready () {
   return FrameReady();
 }
 
+messages::PixFmt NegotiatePixFmt(const messages::PixFmt *backend_pix_fmts, int num_backend_pix_fmts) {
+  const Settings &settings = state.settings;
+
+  for (int i = 0; i < settings.num_pix_fmts; i++) {
+    for (int j = 0; j < num_backend_pix_fmts; j++) {
+      if (settings.pix_fmts[i] == backend_pix_fmts[j]) {
+        Log("NegotiatePixFmt: capturing in %s, capsulerun's choice %d of %d",
+          messages::EnumNamePixFmt(backend_pix_fmts[j]), i + 1, settings.num_pix_fmts);
+        return backend_pix_fmts[j];
+      }
+    }
+  }
+
+  if (settings.num_pix_fmts == 0) {
+    Log("NegotiatePixFmt: capsulerun didn't list formats, capturing in %s",
+      messages::EnumNamePixFmt(backend_pix_fmts[0]));
+  } else {
+    Log("NegotiatePixFmt: capsulerun takes none of our %d formats, capturing in %s anyway",
+      num_backend_pix_fmts, messages::EnumNamePixFmt(backend_pix_fmts[0]));
+  }
+  return backend_pix_fmts[0];
+}
+
 void SawBackend(Backend backend) {
   switch (backend) {
     case kBackendGL: {
@@ -151,6 +174,14 @@ void SawBackend(Backend backend) {
       }
       break;
     }
+    case kBackendVulkan: {
+      if (!state.saw_vulkan) {
+        Log("Saw Vulkan backend!");
+        state.saw_vulkan = true;
+        io::WriteSawBackend(messages::Backend_Vulkan);
+      }
+      break;
+    }
     default: {
       Log("Saw unknown backend %d", backend);
     }
@@ -200,10 +231,10 @@ void Start (Settings *settings) {
 
 #else // LAB_WINDOWS
 
-    if (state.saw_gl) {
-        // cool, it'll initialize on next swapbuffers
+    if (state.saw_gl || state.saw_vulkan) {
+        // cool, it'll initialize on next swapbuffers/present
         if (TryStart(settings)) {
-            Log("Started GL capture");
+            Log("Started GL/Vulkan capture");
             return;
         }
     }
@@ -30,16 +30,27 @@ namespace capture {
 // numbers of buffers used for async GPU download
 static const int kNumBuffers = 3;
 
+// longest pixel format list either side sends
+static const int kMaxPixFmts = 8;
+
 struct Settings {
   int fps;
   int size_divider;
   bool gpu_color_conv;
+  bool control_ring;
+  bool audio_ring;
+  bool huge_pages;
+  // what capsulerun encodes from, fewest CPU passes first.
+  // empty if capsulerun doesn't negotiate.
+  messages::PixFmt pix_fmts[kMaxPixFmts];
+  int num_pix_fmts;
 };
 
 struct State {
   bool saw_gl;
   bool saw_d3d9;
   bool saw_dxgi;
+  bool saw_vulkan;
 
   bool has_audio_intercept;
   messages::SampleFmt audio_intercept_format;
@@ -55,6 +66,7 @@ enum Backend {
   kBackendGL,
   kBackendD3D9,
   kBackendDXGI,
+  kBackendVulkan,
 };
 
 bool Ready();
@@ -64,6 +76,10 @@ void Stop();
 
 int64_t FrameTimestamp();
 
+// picks the first of capsulerun's formats the backend can produce,
+// or the backend's first one (its native/preferred format) if none match
+messages::PixFmt NegotiatePixFmt(const messages::PixFmt *backend_pix_fmts, int num_backend_pix_fmts);
+
 void SawBackend(Backend backend);
 void HasAudioIntercept(messages::SampleFmt format, int rate, int channels);
 State *GetState();
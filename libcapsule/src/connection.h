@@ -33,7 +33,17 @@ class Connection {
     void Close();
 
     void Write(const flatbuffers::FlatBufferBuilder &builder);
+    // the returned packet must be given back with Release
     char *Read();
+    void Release(char *buf) { pool_.Release(buf); };
+
+#if defined(LAB_LINUX)
+    // connects the socket used to pass fds, if capsulerun listens on it
+    bool OpenFdChannel();
+    // passes fds of anonymous shm segments to capsulerun, must be
+    // called right before writing the message that refers to them.
+    bool SendFds(const int *fds, int num_fds);
+#endif // LAB_LINUX
 
     bool IsConnected() { return connected_; };
     std::string GetPipeName() { return pipe_name_; };
@@ -46,10 +56,17 @@ class Connection {
     HANDLE pipe_r_ = INVALID_HANDLE_VALUE;
     HANDLE pipe_w_ = INVALID_HANDLE_VALUE;
 #else // LAB_WINDOWS
-    FILE *fifo_r_ = nullptr;
-    FILE *fifo_w_ = nullptr;
+    int fifo_r_ = -1;
+    int fifo_w_ = -1;
 #endif // !LAB_WINDOWS
 
+#if defined(LAB_LINUX)
+    std::string sock_path_;
+    int sock_ = -1;
+#endif // LAB_LINUX
+
+    lab::packet::Pool pool_;
+
     bool connected_ = false;
 };
 
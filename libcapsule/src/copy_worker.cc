@@ -0,0 +1,88 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "copy_worker.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "io.h"
+#include "logging.h"
+
+namespace capsule {
+namespace copy_worker {
+
+// never destroyed, like the thread: glibc's condition variable destructor
+// waits for the worker, still blocked on it at exit, forever
+static std::mutex *jobs_mutex = new std::mutex();
+static std::condition_variable *jobs_cond = new std::condition_variable();
+// a job's done flag got set, under jobs_mutex
+static std::condition_variable *done_cond = new std::condition_variable();
+static std::deque<Job> *jobs = new std::deque<Job>();
+static std::thread *worker = nullptr;
+
+static void Run() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(*jobs_mutex);
+      jobs_cond->wait(lock, [] { return !jobs->empty(); });
+      job = jobs->front();
+      jobs->pop_front();
+    }
+
+    io::WriteVideoFrame(job.timestamp, job.data, job.size);
+    {
+      // under the lock, so Wait can't miss the notification
+      std::lock_guard<std::mutex> lock(*jobs_mutex);
+      job.done->store(true, std::memory_order_release);
+    }
+    done_cond->notify_all();
+  }
+}
+
+void Submit(const Job &job) {
+  job.done->store(false, std::memory_order_relaxed);
+
+  {
+    std::lock_guard<std::mutex> lock(*jobs_mutex);
+    if (!worker) {
+      Log("copy_worker: starting");
+      // lives as long as the game does, like the infile poller
+      worker = new std::thread(Run);
+    }
+    jobs->push_back(job);
+  }
+  jobs_cond->notify_one();
+}
+
+void Wait(std::atomic<bool> *done) {
+  if (done->load(std::memory_order_acquire)) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(*jobs_mutex);
+  done_cond->wait(lock, [done] { return done->load(std::memory_order_acquire); });
+}
+
+} // namespace copy_worker
+} // namespace capsule
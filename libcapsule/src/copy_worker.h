@@ -0,0 +1,51 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <lab/types.h>
+
+#include <atomic>
+
+namespace capsule {
+namespace copy_worker {
+
+/**
+ * A frame for the worker to hand to io::WriteVideoFrame, so the
+ * copy into shm happens off the game's render thread. data must stay
+ * valid (mapped) until done is set.
+ */
+struct Job {
+  int64_t timestamp;
+  char *data;
+  size_t size;
+  std::atomic<bool> *done;
+};
+
+// queues a copy, starting the worker on first use. Clears *done
+// right away, the worker sets it once data can be reused.
+void Submit(const Job &job);
+
+// blocks until *done is set
+void Wait(std::atomic<bool> *done);
+
+} // namespace copy_worker
+} // namespace capsule
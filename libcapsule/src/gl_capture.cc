@@ -21,13 +21,21 @@
 
 #include "gl_capture.h"
 
-#include <string.h> // memset
+#include <string.h> // memset, strncmp
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
 
 #include <lab/strings.h>
+#include <lab/env.h>
 
 #include "dynlib.h"
 #include "io.h"
 #include "capture.h"
+#include "copy_worker.h"
+#include "gl_shadow.h"
 
 #include "gl_shaders.h"
 
@@ -45,19 +53,90 @@ const char *kDefaultOpengl = "/System/Library/Frameworks/OpenGL.framework/Librar
 const char *kDefaultOpengl = "libGL.so.1";
 #endif
 
+
+// readback ring depth: starts at capture::kNumBuffers, grows up to this
+// whenever every buffer is still in flight when a frame comes in
+static const int kMaxBuffers = 6;
+
+// render thread waits on readbacks (at full depth) between two log lines
+static const int64_t kBlockedLogInterval = 100;
+
+// how long each wait on a fence lasts when the ring is full, in nanoseconds
+static const GLuint64 kBlockTimeout = 100 * 1000 * 1000;
+
+// surfaces' swap rates are counted over this, see PickTarget
+static const std::chrono::seconds kActivityPeriod(1);
+// surfaces that haven't swapped in that long are dropped
+static const std::chrono::seconds kForgetTimeout(10);
+
+// intermediate halvings when downscaling, see InitScale
+static const int kMaxScaleLevels = 4;
+
+// capabilities that would get in the way of the conversion draw
+static const GLenum kConvertCaps[] = {
+  GL_BLEND,
+  GL_SCISSOR_TEST,
+  GL_CULL_FACE,
+  GL_RASTERIZER_DISCARD,
+};
+static const int kNumConvertCaps = sizeof(kConvertCaps) / sizeof(kConvertCaps[0]);
+
 struct State {
-  int                     cx;
+  int                     src_cx; // back buffer size
+  int                     src_cy;
+  int                     cx; // captured size, src over size_divider
   int                     cy;
-  int64_t                 pitch;
+  io::FrameLayout         layout;
   GLuint                  fbo;
-
-  int                     cur_tex;
-  int                     copy_wait;
-  GLuint                  pbos[capture::kNumBuffers];
-  GLuint                  textures[capture::kNumBuffers];
-  bool                    texture_ready[capture::kNumBuffers];
-  bool                    texture_mapped[capture::kNumBuffers];
-  int64_t                 timestamps[capture::kNumBuffers];
+  // downscaling: each level is half the previous one (the back buffer
+  // first), the last blit goes from the smallest level to cx x cy.
+  // A multisampled back buffer is resolved into a full size level first
+  int                     num_scale_levels;
+  int                     scale_cx[kMaxScaleLevels];
+  int                     scale_cy[kMaxScaleLevels];
+  GLuint                  scale_textures[kMaxScaleLevels];
+  GLuint                  scale_fbos[kMaxScaleLevels];
+  messages::PixFmt        pix_fmts[4]; // what we can capture in, packed first
+  int                     num_pix_fmts;
+  messages::PixFmt        pix_fmt;
+  GLenum                  read_format; // matches pix_fmt
+  // glReadPixels from the back buffer straight into the pbo, rather
+  // than blitting it into a texture first
+  bool                    direct_read;
+  // OpenGL ES 3 context (EGL): RGBA direct reads only, no overlay
+  bool                    gles;
+
+  // converting to I420/NV12 on the GPU: the frame is blitted into
+  // convert_src, then drawn through the conversion shader into
+  // convert_tex, which holds every plane, see gl_shaders.h
+  bool                    convert;
+  GLuint                  convert_program;
+  GLuint                  convert_vertex_shader;
+  GLuint                  convert_fragment_shader;
+  GLuint                  convert_vao;
+  GLuint                  convert_src;
+  GLuint                  convert_tex;
+  GLuint                  convert_fbo;
+  int                     convert_cx; // row length, a multiple of 8
+  int                     convert_cy; // cy luma rows, then cy/2 chroma rows
+  GLint                   convert_src_loc;
+  GLint                   convert_unit; // texture unit src points at
+
+  int                     num_buffers;
+  GLuint                  pbos[kMaxBuffers];
+  GLuint                  textures[kMaxBuffers];
+  GLsync                  fences[kMaxBuffers]; // null without ARB_sync
+  GLvoid                  *maps[kMaxBuffers]; // mapped for good with ARB_buffer_storage
+  bool                    persistent; // new buffers get persistent maps
+  bool                    in_flight[kMaxBuffers];
+  bool                    copying[kMaxBuffers]; // handed to the copy worker
+  int64_t                 timestamps[kMaxBuffers];
+  // buffers with a readback in flight, oldest first
+  int                     queue[kMaxBuffers];
+  int                     queue_start;
+  int                     queue_length;
+  // times the render thread had to wait for a readback anyway
+  int64_t                 blocked;
 
   int                     overlay_width;  
   int                     overlay_height;  
@@ -71,9 +150,58 @@ struct State {
   GLuint                  overlay_pbo;
 
   int 			  avoid_apple_gl;
+
+  bool                    format_sent;
 };
 
-static State state = {0};
+// every context & drawable pair that swaps gets one, see Capture
+struct Surface {
+  void                    *ctx;
+  void                    *drawable;
+  int                     width; // as last seen, 0 when unknown
+  int                     height;
+  std::chrono::steady_clock::time_point period_start;
+  std::chrono::steady_clock::time_point last_swap;
+  int64_t                 swaps; // in the current period
+  int64_t                 rate; // swaps in the last full period
+  // only for the surface we capture (or did, until freed on its own
+  // context), null for the others
+  State                   *state;
+  // Capture calls working on it, see Done. Guarded by surfaces_mutex,
+  // like forgotten.
+  int                     users;
+  // its context was destroyed while in use: no longer in surfaces,
+  // the last user deletes it
+  bool                    forgotten;
+  // set by the copy worker, outside State so Free's memset leaves them be
+  std::atomic<bool>       copy_done[kMaxBuffers];
+};
+
+struct SurfaceKey {
+  void *ctx;
+  void *drawable;
+
+  bool operator==(const SurfaceKey &other) const {
+    return ctx == other.ctx && drawable == other.drawable;
+  }
+};
+
+struct SurfaceKeyHash {
+  size_t operator()(const SurfaceKey &key) const {
+    return std::hash<void*>()(key.ctx) ^ (std::hash<void*>()(key.drawable) << 1);
+  }
+};
+
+static std::mutex surfaces_mutex;
+static std::unordered_map<SurfaceKey, Surface*, SurfaceKeyHash> surfaces;
+// what this capture is of, picked when it starts, see PickTarget
+static Surface *target = nullptr;
+// the target went away mid-capture, nothing else is captured until it stops
+static bool target_lost = false;
+
+// the surface being worked on by this thread, set by Capture
+static thread_local State *state = nullptr;
+static thread_local std::atomic<bool> *copy_done = nullptr;
 
 LibHandle handle;
 
@@ -110,32 +238,44 @@ bool InitFunctions() {
   GLSYM(glGetError)
   GLSYM(glGetIntegerv)
   GLSYM(glGetString)
+  GLSYM_OPTIONAL(glGetStringi)
 
   GLSYM(glGenTextures)
   GLSYM(glBindTexture)
   GLSYM(glTexParameteri)
   GLSYM(glTexImage2D)
   GLSYM(glTexSubImage2D)
-  GLSYM(glGetTexImage)
+  // desktop GL only, Init checks for them outside of OpenGL ES
+  GLSYM_OPTIONAL(glGetTexImage)
   GLSYM(glDeleteTextures)
 
   GLSYM(glGenVertexArrays)
   GLSYM(glBindVertexArray)
+  GLSYM(glDeleteVertexArrays)
 
 #if defined(LAB_MACOS)
   GLSYM(glGenVertexArraysAPPLE)
   GLSYM(glBindVertexArrayAPPLE)
+  GLSYM(glDeleteVertexArraysAPPLE)
 #endif
 
   GLSYM(glGenBuffers)
   GLSYM(glBindBuffer)
   GLSYM(glReadBuffer)
-  GLSYM(glDrawBuffer)
+  GLSYM(glReadPixels)
+  GLSYM_OPTIONAL(glDrawBuffer)
   GLSYM(glBufferData)
-  GLSYM(glMapBuffer)
+  GLSYM_OPTIONAL(glMapBuffer)
   GLSYM(glUnmapBuffer)
   GLSYM(glDeleteBuffers)
 
+  GLSYM_OPTIONAL(glFenceSync)
+  GLSYM_OPTIONAL(glClientWaitSync)
+  GLSYM_OPTIONAL(glDeleteSync)
+
+  GLSYM_OPTIONAL(glBufferStorage)
+  GLSYM_OPTIONAL(glMapBufferRange)
+
   GLSYM(glGenFramebuffers)
   GLSYM(glBindFramebuffer)
   GLSYM(glBlitFramebuffer)
@@ -147,6 +287,7 @@ bool InitFunctions() {
   GLSYM(glCompileShader)
   GLSYM(glGetShaderiv)
   GLSYM(glGetShaderInfoLog)
+  GLSYM(glDeleteShader)
   GLSYM(glCreateProgram)
   GLSYM(glAttachShader)
   GLSYM(glLinkProgram)
@@ -154,13 +295,18 @@ bool InitFunctions() {
   GLSYM(glGetProgramiv)
   GLSYM(glGetProgramInfoLog)
   GLSYM(glUseProgram)
+  GLSYM(glDeleteProgram)
   GLSYM(glGetAttribLocation)
-  GLSYM(glBindFragDataLocation);
+  GLSYM_OPTIONAL(glBindFragDataLocation);
   GLSYM(glEnableVertexAttribArray)
   GLSYM(glVertexAttribPointer)
   GLSYM(glGetUniformLocation)
   GLSYM(glUniform1i)
 
+  GLSYM(glViewport)
+  GLSYM(glEnable)
+  GLSYM(glDisable)
+  GLSYM(glIsEnabled)
   GLSYM(glDrawArrays)
   GLSYM(glClearColor)
   GLSYM(glClear)
@@ -168,55 +314,276 @@ bool InitFunctions() {
   return true;
 }
 
-static void Free() {
-  for (size_t i = 0; i < capture::kNumBuffers; i++) {
-    if (state.pbos[i]) {
-      if (state.texture_mapped[i]) {
-        _glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[i]);
-        _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-        _glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+static inline bool HasFences() {
+  return _glFenceSync && _glClientWaitSync && _glDeleteSync;
+}
+
+static bool HasExtension(const char *name) {
+  if (_glGetStringi) {
+    GLint num_extensions = 0;
+    _glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+    if (!Error("HasExtension", "failed to count extensions") && num_extensions > 0) {
+      for (GLint i = 0; i < num_extensions; i++) {
+        const char *extension = _glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i));
+        if (extension && 0 == strcmp(extension, name)) {
+          return true;
+        }
       }
+      return false;
+    }
+  }
+
+  // before GL 3.0, it's one space-separated string
+  const char *extensions = _glGetString(GL_EXTENSIONS);
+  if (Error("HasExtension", "failed to get extensions") || !extensions) {
+    return false;
+  }
+
+  size_t name_length = strlen(name);
+  for (const char *p = strstr(extensions, name); p; p = strstr(p + name_length, name)) {
+    bool starts = (p == extensions || p[-1] == ' ');
+    bool ends = (p[name_length] == ' ' || p[name_length] == '\0');
+    if (starts && ends) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline void safeGlGenVertexArrays(GLsizei n, GLuint *buffers) {
+#if defined(LAB_MACOS)
+  if (!state->avoid_apple_gl) {
+    _glGenVertexArrays(n, buffers);
+  } else {
+    _glGenVertexArraysAPPLE(n, buffers);
+    GLenum error = _glGetError();
+    if (error != 0) {
+      Log("Avoiding Apple GL: %d for glGenVertexArraysAPPLE", error);
+      state->avoid_apple_gl = 1;
+      safeGlGenVertexArrays(n, buffers);
+    }
+  }
+#else
+  _glGenVertexArrays(n, buffers);
+#endif // LAB_MACOS
+}
+
+static inline void safeGlBindVertexArray(GLuint buffer) {
+#if defined(LAB_MACOS)
+  if (state->avoid_apple_gl) {
+    _glBindVertexArray(buffer);
+  } else {
+    _glBindVertexArrayAPPLE(buffer);
+    GLenum error = _glGetError();
+    if (error != 0) {
+      Log("Avoiding Apple GL: %d for glBindVertexArrayAPPLE", error);
+      state->avoid_apple_gl = 1;
+      safeGlBindVertexArray(buffer);
+    }
+  }
+#else
+  _glBindVertexArray(buffer);
+#endif // LAB_MACOS
+}
+
+static inline void safeGlDeleteVertexArrays(GLsizei n, const GLuint *buffers) {
+#if defined(LAB_MACOS)
+  if (state->avoid_apple_gl) {
+    _glDeleteVertexArrays(n, buffers);
+  } else {
+    _glDeleteVertexArraysAPPLE(n, buffers);
+  }
+#else
+  _glDeleteVertexArrays(n, buffers);
+#endif // LAB_MACOS
+}
+
+static void Free() {
+  if (state->num_buffers) {
+    Log("GL: readback ring ended at %d buffers, render thread blocked %" PRId64 " times",
+      state->num_buffers, state->blocked);
+  }
+
+  for (int i = 0; i < kMaxBuffers; i++) {
+    if (state->copying[i]) {
+      // the worker may still be reading from it
+      copy_worker::Wait(&copy_done[i]);
+    }
 
-      _glDeleteBuffers(1, &state.pbos[i]);
+    if (state->fences[i]) {
+      _glDeleteSync(state->fences[i]);
     }
 
-    if (state.textures[i])
-      _glDeleteTextures(1, &state.textures[i]);
+    if (state->pbos[i]) {
+      _glDeleteBuffers(1, &state->pbos[i]);
+    }
+
+    if (state->textures[i])
+      _glDeleteTextures(1, &state->textures[i]);
+  }
+
+  if (state->fbo) {
+		_glDeleteFramebuffers(1, &state->fbo);
+  }
+
+  if (state->convert_fbo) {
+    _glDeleteFramebuffers(1, &state->convert_fbo);
+  }
+  if (state->convert_tex) {
+    _glDeleteTextures(1, &state->convert_tex);
+  }
+  if (state->convert_src) {
+    _glDeleteTextures(1, &state->convert_src);
+  }
+  if (state->convert_program) {
+    _glDeleteProgram(state->convert_program);
+  }
+  if (state->convert_vertex_shader) {
+    _glDeleteShader(state->convert_vertex_shader);
+  }
+  if (state->convert_fragment_shader) {
+    _glDeleteShader(state->convert_fragment_shader);
+  }
+  if (state->convert_vao) {
+    safeGlDeleteVertexArrays(1, &state->convert_vao);
   }
 
-  if (state.fbo) {
-		_glDeleteFramebuffers(1, &state.fbo);
+  for (int i = 0; i < state->num_scale_levels; i++) {
+    if (state->scale_fbos[i]) {
+      _glDeleteFramebuffers(1, &state->scale_fbos[i]);
+    }
+    if (state->scale_textures[i]) {
+      _glDeleteTextures(1, &state->scale_textures[i]);
+    }
   }
 
 	Error("Free", "GL error occurred on free");
 
-  memset(&state, 0, sizeof(state));
+  memset(state, 0, sizeof(*state));
 
   Log("----------------------- gl capture freed ----------------------");
 }
 
 static inline bool InitFbo(void) {
-	_glGenFramebuffers(1, &state.fbo);
+	_glGenFramebuffers(1, &state->fbo);
 	return !Error("InitFbo", "failed to initialize FBO");
 }
 
+// whether the default framebuffer is multisampled, blits from it
+// can't scale then
+static bool Multisampled(void) {
+	GLint last_fbo;
+	shadow::GetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_fbo);
+	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	GLint sample_buffers = 0;
+	_glGetIntegerv(GL_SAMPLE_BUFFERS, &sample_buffers);
+	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, last_fbo);
+	return !Error("Multisampled", "failed to query sample buffers") && sample_buffers > 0;
+}
+
+// a linear blit at exactly half size averages each 2x2 block, so halving
+// down to the last level then blitting to cx x cy is a box filter for
+// power-of-two dividers, without shaders
+static bool InitScale(void) {
+	int cx = state->src_cx;
+	int cy = state->src_cy;
+	bool scaled = state->cx != cx || state->cy != cy;
+	if (scaled && Multisampled()) {
+		// a same size blit resolves it, the halvings read from that
+		Log("GL: multisampled back buffer, resolving it before downscaling");
+		state->scale_cx[state->num_scale_levels] = cx;
+		state->scale_cy[state->num_scale_levels] = cy;
+		state->num_scale_levels++;
+	}
+	while (state->num_scale_levels < kMaxScaleLevels && cx / 2 >= state->cx * 2 && cy / 2 >= state->cy * 2) {
+		cx /= 2;
+		cy /= 2;
+		state->scale_cx[state->num_scale_levels] = cx;
+		state->scale_cy[state->num_scale_levels] = cy;
+		state->num_scale_levels++;
+	}
+
+	if (state->num_scale_levels == 0) {
+		return true;
+	}
+
+	GLint last_tex;
+	GLint last_fbo;
+	shadow::GetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+	shadow::GetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_fbo);
+
+	bool success = true;
+	for (int i = 0; i < state->num_scale_levels && success; i++) {
+		_glGenTextures(1, &state->scale_textures[i]);
+		_glBindTexture(GL_TEXTURE_2D, state->scale_textures[i]);
+		_glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, state->scale_cx[i], state->scale_cy[i],
+				0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+
+		_glGenFramebuffers(1, &state->scale_fbos[i]);
+		_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state->scale_fbos[i]);
+		_glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				GL_TEXTURE_2D, state->scale_textures[i], 0);
+		success = !Error("InitScale", "failed to set up scale level");
+	}
+
+	_glBindTexture(GL_TEXTURE_2D, last_tex);
+	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, last_fbo);
+
+	if (success) {
+		Log("GL: downscaling %dx%d to %dx%d in %d levels then a blit",
+			state->src_cx, state->src_cy, state->cx, state->cy, state->num_scale_levels);
+	}
+	return success;
+}
+
 static inline bool ShmemInitData(size_t idx, size_t size) {
-	_glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[idx]);
+	_glBindBuffer(GL_PIXEL_PACK_BUFFER, state->pbos[idx]);
 	if (Error("ShmemInitData", "failed to bind pbo")) {
 		return false;
 	}
 
-	_glBufferData(GL_PIXEL_PACK_BUFFER, size, 0, GL_STREAM_READ);
-	if (Error("ShmemInitData", "failed to set pbo data")) {
-		return false;
+	state->maps[idx] = nullptr;
+	if (state->persistent) {
+		// readbacks land straight in client memory, mapped once for good:
+		// fences tell when each one is safe to read
+		const GLbitfield map_flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		_glBufferStorage(GL_PIXEL_PACK_BUFFER, size, 0, map_flags | GL_CLIENT_STORAGE_BIT);
+		if (!Error("ShmemInitData", "failed to allocate pbo storage")) {
+			state->maps[idx] = _glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, map_flags);
+			Error("ShmemInitData", "failed to map pbo storage");
+		}
+
+		if (!state->maps[idx]) {
+			Log("GL: persistent pbo mapping failed, mapping every frame from now on");
+			state->persistent = false;
+			// storage is immutable once set, start over with a fresh buffer
+			_glDeleteBuffers(1, &state->pbos[idx]);
+			_glGenBuffers(1, &state->pbos[idx]);
+			_glBindBuffer(GL_PIXEL_PACK_BUFFER, state->pbos[idx]);
+			if (Error("ShmemInitData", "failed to replace pbo")) {
+				return false;
+			}
+		}
 	}
 
-	_glBindTexture(GL_TEXTURE_2D, state.textures[idx]);
+	if (!state->maps[idx]) {
+		_glBufferData(GL_PIXEL_PACK_BUFFER, size, 0, GL_STREAM_READ);
+		if (Error("ShmemInitData", "failed to set pbo data")) {
+			return false;
+		}
+	}
+
+	if (state->direct_read || state->convert) {
+		// no intermediate texture
+		return true;
+	}
+
+	_glBindTexture(GL_TEXTURE_2D, state->textures[idx]);
 	if (Error("ShmemInitData", "failed to set bind texture")) {
 		return false;
 	}
 
-	_glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, state.cx, state.cy,
+	_glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, state->cx, state->cy,
 			0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
 	if (Error("ShmemInitData", "failed to set texture data")) {
 		return false;
@@ -226,12 +593,12 @@ static inline bool ShmemInitData(size_t idx, size_t size) {
 }
 
 static bool InitOverlayTexture(void) {
-  state.overlay_width = 256;
-  state.overlay_height = 128;
-  size_t pixels_size = state.overlay_width * 4 * state.overlay_height;
-  state.overlay_pixels = (unsigned char*) malloc(pixels_size);
+  state->overlay_width = 256;
+  state->overlay_height = 128;
+  size_t pixels_size = state->overlay_width * 4 * state->overlay_height;
+  state->overlay_pixels = (unsigned char*) malloc(pixels_size);
   for (size_t i = 0; i < pixels_size; i++) {
-    state.overlay_pixels[i] = 255;
+    state->overlay_pixels[i] = 255;
   }
 
 #define GLCHECK(msg) if (Error("InitOverlayVbo", msg)) { break; }
@@ -242,10 +609,10 @@ static bool InitOverlayTexture(void) {
   // save the state we change
   auto success = false;
   do {
-    _glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+    shadow::GetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
     GLCHECK("get last tex");
 
-    _glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &last_unpack_pbo);
+    shadow::GetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &last_unpack_pbo);
     GLCHECK("get last unpack pbo");
 
     success = true;
@@ -257,19 +624,19 @@ static bool InitOverlayTexture(void) {
 
   success = false;
   do {
-    _glGenBuffers(1, &state.overlay_pbo);
+    _glGenBuffers(1, &state->overlay_pbo);
     GLCHECK("gen pbo");
 
-    _glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state.overlay_pbo);
+    _glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state->overlay_pbo);
     GLCHECK("bind pbo");
 
-    _glBufferData(GL_PIXEL_UNPACK_BUFFER, state.overlay_width * state.overlay_height * 4, nullptr, GL_STREAM_DRAW);
+    _glBufferData(GL_PIXEL_UNPACK_BUFFER, state->overlay_width * state->overlay_height * 4, nullptr, GL_STREAM_DRAW);
     GLCHECK("bind pbo");
 
-    _glGenTextures(1, &state.overlay_tex);
+    _glGenTextures(1, &state->overlay_tex);
     GLCHECK("gen texture");
 
-    _glBindTexture(GL_TEXTURE_2D, state.overlay_tex);
+    _glBindTexture(GL_TEXTURE_2D, state->overlay_tex);
     GLCHECK("bind texture");
 
     _glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
@@ -279,7 +646,7 @@ static bool InitOverlayTexture(void) {
     GLCHECK("set texture max level");
 
     _glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8,
-    state.overlay_width, state.overlay_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    state->overlay_width, state->overlay_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
     GLCHECK("tex image 2d");
 
     success = true;
@@ -293,40 +660,115 @@ static bool InitOverlayTexture(void) {
   return success;
 }
 
-static inline void safeGlGenVertexArrays(GLsizei n, GLuint *buffers) {
-#if defined(LAB_MACOS)
-  if (!state.avoid_apple_gl) {
-    _glGenVertexArrays(n, buffers);
-  } else {
-    _glGenVertexArraysAPPLE(n, buffers);
-    GLenum error = _glGetError();
-    if (error != 0) {
-      Log("Avoiding Apple GL: %d for glGenVertexArraysAPPLE", error);
-      state.avoid_apple_gl = 1;
-      safeGlGenVertexArrays(n, buffers);
-    }
-  }
-#else
-  _glGenVertexArrays(n, buffers);
-#endif // LAB_MACOS
+static bool CompileShader(GLenum type, const char *source, GLuint *shader) {
+	*shader = _glCreateShader(type);
+	_glShaderSource(*shader, 1, &source, nullptr);
+	_glCompileShader(*shader);
+
+	GLint status = GL_FALSE;
+	_glGetShaderiv(*shader, GL_COMPILE_STATUS, &status);
+	if (status == GL_FALSE) {
+		GLint log_size = 0;
+		_glGetShaderiv(*shader, GL_INFO_LOG_LENGTH, &log_size);
+		if (log_size > 0) {
+			auto log = new char[log_size];
+			_glGetShaderInfoLog(*shader, log_size, nullptr, log);
+			Log("gl: shader compilation log:\n%s", log);
+			delete[] log;
+		}
+		return false;
+	}
+	return !Error("CompileShader", "failed to compile shader");
 }
 
-static inline void safeGlBindVertexArray(GLuint buffer) {
-#if defined(LAB_MACOS)
-  if (state.avoid_apple_gl) {
-    _glBindVertexArray(buffer);
-  } else {
-    _glBindVertexArrayAPPLE(buffer);
-    GLenum error = _glGetError();
-    if (error != 0) {
-      Log("Avoiding Apple GL: %d for glBindVertexArrayAPPLE", error);
-      state.avoid_apple_gl = 1;
-      safeGlBindVertexArray(buffer);
-    }
-  }
-#else
-  _glBindVertexArray(buffer);
-#endif // LAB_MACOS
+// builds the RGB to I420/NV12 program, so we know whether to offer
+// those. Needs GLSL 1.30 (GL 3.0).
+static bool InitConvertProgram(void) {
+	if (!CompileShader(GL_VERTEX_SHADER, kConvertVertexSource, &state->convert_vertex_shader) ||
+			!CompileShader(GL_FRAGMENT_SHADER, kConvertFragmentSource, &state->convert_fragment_shader)) {
+		Log("GL: conversion shaders don't compile here, no I420/NV12");
+		return false;
+	}
+
+	state->convert_program = _glCreateProgram();
+	_glAttachShader(state->convert_program, state->convert_vertex_shader);
+	_glAttachShader(state->convert_program, state->convert_fragment_shader);
+	_glBindFragDataLocation(state->convert_program, 0, "outColor");
+	_glLinkProgram(state->convert_program);
+
+	GLint status = GL_FALSE;
+	_glGetProgramiv(state->convert_program, GL_LINK_STATUS, &status);
+	if (Error("InitConvertProgram", "failed to link program") || status == GL_FALSE) {
+		Log("GL: conversion program doesn't link here, no I420/NV12");
+		return false;
+	}
+
+	state->convert_src_loc = _glGetUniformLocation(state->convert_program, "src");
+	return true;
+}
+
+// the textures & fbo the conversion goes through, once pix_fmt is known
+static bool InitConvertTarget(void) {
+	GLint last_tex;
+	GLint last_fbo;
+	GLint last_program;
+	shadow::GetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+	shadow::GetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_fbo);
+	shadow::GetIntegerv(GL_CURRENT_PROGRAM, &last_program);
+
+	bool success = false;
+	do {
+		_glGenTextures(1, &state->convert_src);
+		_glBindTexture(GL_TEXTURE_2D, state->convert_src);
+		_glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, state->cx, state->cy,
+				0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+		// complete without mipmaps, whatever sampler the game left bound
+		_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		if (Error("InitConvertTarget", "failed to set up source texture")) {
+			break;
+		}
+
+		_glGenTextures(1, &state->convert_tex);
+		_glBindTexture(GL_TEXTURE_2D, state->convert_tex);
+		_glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, state->convert_cx, state->convert_cy,
+				0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+		_glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+		if (Error("InitConvertTarget", "failed to set up plane texture")) {
+			break;
+		}
+
+		_glGenFramebuffers(1, &state->convert_fbo);
+		_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state->convert_fbo);
+		_glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				GL_TEXTURE_2D, state->convert_tex, 0);
+		if (Error("InitConvertTarget", "failed to set up plane fbo")) {
+			break;
+		}
+
+		// core profiles won't draw without a vertex array, even with no attributes
+		safeGlGenVertexArrays(1, &state->convert_vao);
+
+		_glUseProgram(state->convert_program);
+		_glUniform1i(_glGetUniformLocation(state->convert_program, "nv12"),
+				state->pix_fmt == messages::PixFmt_NV12 ? 1 : 0);
+		_glUniform1i(state->convert_src_loc, 0);
+		state->convert_unit = 0;
+		if (Error("InitConvertTarget", "failed to set uniforms")) {
+			break;
+		}
+
+		success = true;
+	} while (false);
+
+	_glUseProgram(last_program);
+	_glBindTexture(GL_TEXTURE_2D, last_tex);
+	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, last_fbo);
+
+	if (success) {
+		Log("GL: converting to %s on the GPU, %dx%d planes texture",
+			messages::EnumNamePixFmt(state->pix_fmt), state->convert_cx, state->convert_cy);
+	}
+	return success;
 }
 
 static bool InitOverlayVbo(void) {
@@ -336,10 +778,10 @@ static bool InitOverlayVbo(void) {
   Log("OpenGL shading language version: %s", _glGetString(GL_SHADING_LANGUAGE_VERSION));
 
   // gl coordinate system: (0, 0) = bottom-left
-  float cx = (float) state.cx;
-  float cy = (float) state.cy;
-  float width = (float) state.overlay_width;
-  float height = (float) state.overlay_height;
+  float cx = (float) state->src_cx;
+  float cy = (float) state->src_cy;
+  float width = (float) state->overlay_width;
+  float height = (float) state->overlay_height;
   float x = cx - width;
   float y = 0;
 
@@ -417,13 +859,13 @@ static bool InitOverlayVbo(void) {
   // save the state we change
   auto success = false;
   do {
-    _glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vao);
+    shadow::GetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vao);
     GLCHECK("get last vao");
 
-    _glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &last_vbo);
+    shadow::GetIntegerv(GL_ARRAY_BUFFER_BINDING, &last_vbo);
     GLCHECK("get last vbo");
 
-    _glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
+    shadow::GetIntegerv(GL_CURRENT_PROGRAM, &last_program);
     GLCHECK("get last program");
 
     success = true;
@@ -435,73 +877,73 @@ static bool InitOverlayVbo(void) {
   success = false;
   do {
     DebugLog("Creating overlay vao...");
-    safeGlGenVertexArrays(1, &state.overlay_vao);
+    safeGlGenVertexArrays(1, &state->overlay_vao);
     GLCHECK("vao gen");
-    safeGlBindVertexArray(state.overlay_vao);
+    safeGlBindVertexArray(state->overlay_vao);
     GLCHECK("vao bind");
 
     DebugLog("Creating overlay vbo...");
-    _glGenBuffers(1, &state.overlay_vbo);
+    _glGenBuffers(1, &state->overlay_vbo);
     GLCHECK("vbo gen");
-    _glBindBuffer(GL_ARRAY_BUFFER, state.overlay_vbo);
+    _glBindBuffer(GL_ARRAY_BUFFER, state->overlay_vbo);
     GLCHECK("vbo bind");
 
     _glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
     GLCHECK("vbo upload");
 
     DebugLog("Creating overlay vertex shader...");
-    state.overlay_vertex_shader = _glCreateShader(GL_VERTEX_SHADER);
+    state->overlay_vertex_shader = _glCreateShader(GL_VERTEX_SHADER);
     GLCHECK("vshader create");
-    _glShaderSource(state.overlay_vertex_shader, 1, &kVertexSource, nullptr);
+    _glShaderSource(state->overlay_vertex_shader, 1, &kVertexSource, nullptr);
     GLCHECK("vshader source");
-    _glCompileShader(state.overlay_vertex_shader);
+    _glCompileShader(state->overlay_vertex_shader);
     GLCHECK("vshader compile");
-    GLSHADERCHECK(state.overlay_vertex_shader);
+    GLSHADERCHECK(state->overlay_vertex_shader);
     DebugLog("Vertex shader compiled!");
 
     DebugLog("Creating overlay fragment shader...");
-    state.overlay_fragment_shader = _glCreateShader(GL_FRAGMENT_SHADER);
+    state->overlay_fragment_shader = _glCreateShader(GL_FRAGMENT_SHADER);
     GLCHECK("fshader create");
-    _glShaderSource(state.overlay_fragment_shader, 1, &kFragmentSource, nullptr);
+    _glShaderSource(state->overlay_fragment_shader, 1, &kFragmentSource, nullptr);
     GLCHECK("fshader source");
-    _glCompileShader(state.overlay_fragment_shader);
+    _glCompileShader(state->overlay_fragment_shader);
     GLCHECK("fshader compile");
-    GLSHADERCHECK(state.overlay_fragment_shader);
+    GLSHADERCHECK(state->overlay_fragment_shader);
     DebugLog("Fragment shader compiled!");
 
     DebugLog("Creating shader program...");
-    state.overlay_shader_program = _glCreateProgram();
+    state->overlay_shader_program = _glCreateProgram();
     GLCHECK("program create");
-    _glAttachShader(state.overlay_shader_program, state.overlay_vertex_shader);
+    _glAttachShader(state->overlay_shader_program, state->overlay_vertex_shader);
     GLCHECK("vshader attach");
-    _glAttachShader(state.overlay_shader_program, state.overlay_fragment_shader);
+    _glAttachShader(state->overlay_shader_program, state->overlay_fragment_shader);
     GLCHECK("fshader attach");
-    _glBindFragDataLocation(state.overlay_shader_program, 0, "outColor");
+    _glBindFragDataLocation(state->overlay_shader_program, 0, "outColor");
     GLCHECK("bind frag data location");
-    _glLinkProgram(state.overlay_shader_program);
+    _glLinkProgram(state->overlay_shader_program);
     GLCHECK("program link");
-    GLPROGRAMCHECK(state.overlay_shader_program);
+    GLPROGRAMCHECK(state->overlay_shader_program);
     DebugLog("Program linked & validated!");
-    _glUseProgram(state.overlay_shader_program);
+    _glUseProgram(state->overlay_shader_program);
     GLCHECK("program use");
 
     DebugLog("Specifying vertex data layout");
 
-    GLint pos_attrib = _glGetAttribLocation(state.overlay_shader_program, "position");
+    GLint pos_attrib = _glGetAttribLocation(state->overlay_shader_program, "position");
     GLCHECK("pos attrib: get location");
     _glEnableVertexAttribArray(pos_attrib);
     GLCHECK("pos attrib: enable");
     _glVertexAttribPointer(pos_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
     GLCHECK("pos attrib: pointer");
 
-    GLint tex_attrib = _glGetAttribLocation(state.overlay_shader_program, "texcoord");
+    GLint tex_attrib = _glGetAttribLocation(state->overlay_shader_program, "texcoord");
     GLCHECK("tex attrib: get location");
     _glEnableVertexAttribArray(tex_attrib);
     GLCHECK("tex attrib: enable");
     _glVertexAttribPointer(tex_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (void*)(2 * sizeof(GLfloat)));
     GLCHECK("tex attrib: pointer");
 
-    GLint tex_loc = _glGetUniformLocation(state.overlay_shader_program, "diffuse");
+    GLint tex_loc = _glGetUniformLocation(state->overlay_shader_program, "diffuse");
     GLCHECK("tex loc");
     _glUniform1i(tex_loc, 0);
     GLCHECK("tex uniform");
@@ -520,38 +962,68 @@ static bool InitOverlayVbo(void) {
   return success;
 }
 
+// adds one buffer to the readback ring, bindings must be saved by the caller
+static bool ShmemAddBuffer(void) {
+  if (state->num_buffers == kMaxBuffers) {
+    return false;
+  }
+
+  int idx = state->num_buffers;
+  size_t size = static_cast<size_t>(state->layout.size);
+
+  _glGenBuffers(1, &state->pbos[idx]);
+  if (Error("ShmemAddBuffer", "failed to generate buffer")) {
+    return false;
+  }
+
+  if (!state->direct_read && !state->convert) {
+    _glGenTextures(1, &state->textures[idx]);
+    if (Error("ShmemAddBuffer", "failed to generate texture")) {
+      return false;
+    }
+  }
+
+  if (!ShmemInitData(idx, size)) {
+    return false;
+  }
+
+  state->num_buffers++;
+  return true;
+}
+
 static inline bool ShmemInitBuffers(void) {
-	size_t size = state.cx * state.cy * 4;
 	GLint last_pbo;
 	GLint last_tex;
 
-	_glGenBuffers(capture::kNumBuffers, state.pbos);
-	if (Error("ShmemInitBuffers", "failed to generate buffers")) {
-		return false;
-	}
-
-	_glGenTextures(capture::kNumBuffers, state.textures);
-	if (Error("ShmemInitBuffers", "failed to generate textures")) {
-		return false;
-	}
-
-	_glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
+	shadow::GetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
 	if (Error("ShmemInitBuffers",
 				"failed to save pixel pack buffer")) {
 		return false;
 	}
 
-	_glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+	shadow::GetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
 	if (Error("ShmemInitBuffers", "failed to save texture")) {
 		return false;
 	}
 
+	// persistent maps are only safe to read with fences
+	state->persistent = HasFences() && _glBufferStorage && _glMapBufferRange &&
+		HasExtension("GL_ARB_buffer_storage");
+
 	for (size_t i = 0; i < capture::kNumBuffers; i++) {
-		if (!ShmemInitData(i, size)) {
+		if (!ShmemAddBuffer()) {
 			return false;
 		}
 	}
 
+	const char *mode = "no sync objects, fixed delay";
+	if (state->persistent) {
+		mode = "fence-synchronized, persistently mapped";
+	} else if (HasFences()) {
+		mode = "fence-synchronized";
+	}
+	Log("GL: readback ring of %d buffers, %s", state->num_buffers, mode);
+
 	_glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
 	_glBindTexture(GL_TEXTURE_2D, last_tex);
 	return true;
@@ -561,7 +1033,10 @@ static bool ShmemInit() {
 	if (!ShmemInitBuffers()) {
 		return false;
 	}
-	if (!InitFbo()) {
+	if (!state->direct_read && (!InitFbo() || !InitScale())) {
+		return false;
+	}
+	if (state->convert && !InitConvertTarget()) {
 		return false;
 	}
 
@@ -595,17 +1070,182 @@ static inline void FixWidthHeight(int &width, int &height) {
   }
 }
 
+// times a glReadPixels of the back buffer into pbo, mapping waits for it
+static std::chrono::microseconds ProbeReadFormat(GLuint pbo, GLenum format) {
+  _glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+
+  auto best = std::chrono::microseconds::max();
+  // the first round may pay for lazy allocations
+  for (int round = 0; round < 2; round++) {
+    auto start = std::chrono::steady_clock::now();
+    _glReadPixels(0, 0, state->cx, state->cy, format, GL_UNSIGNED_BYTE, 0);
+    if (_glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY)) {
+      _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    best = std::min(best, elapsed);
+  }
+  return best;
+}
+
+// picks the readback path and what it can produce
+static void InitReadFormats() {
+  state->num_pix_fmts = 0;
+  if (state->gles) {
+    // RGBA is the one format OpenGL ES always reads back, and
+    // glReadPixels is all we use there
+    state->direct_read = true;
+    state->pix_fmts[state->num_pix_fmts++] = messages::PixFmt_RGBA;
+    return;
+  }
+
+  state->direct_read = lab::env::Get("CAPSULE_GL_BLIT") != "1";
+  if (state->cx != state->src_cx || state->cy != state->src_cy) {
+    // glReadPixels can't scale
+    state->direct_read = false;
+  }
+
+  if (state->direct_read) {
+    GLint last_read_fbo;
+    GLint last_read_buffer;
+    GLint last_pbo;
+    shadow::GetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &last_read_fbo);
+    shadow::GetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
+    _glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    shadow::GetIntegerv(GL_READ_BUFFER, &last_read_buffer);
+    _glReadBuffer(GL_BACK);
+
+    // only a hint: Mesa says RGBA for a BGRA back buffer, and reading
+    // that back as RGBA takes twice as long under llvmpipe
+    GLint hint_format = 0;
+    _glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &hint_format);
+    Error("InitReadFormats", "failed to query implementation read format");
+
+    GLuint pbo;
+    _glGenBuffers(1, &pbo);
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    _glBufferData(GL_PIXEL_PACK_BUFFER, state->cx * state->cy * 4, 0, GL_STREAM_READ);
+    auto bgra_time = ProbeReadFormat(pbo, GL_BGRA);
+    auto rgba_time = ProbeReadFormat(pbo, GL_RGBA);
+    _glDeleteBuffers(1, &pbo);
+
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
+    _glReadBuffer(last_read_buffer);
+    _glBindFramebuffer(GL_READ_FRAMEBUFFER, last_read_fbo);
+
+    if (Error("InitReadFormats", "failed to probe read formats")) {
+      Log("GL: can't read the back buffer directly, blitting it instead");
+      state->direct_read = false;
+    } else {
+      Log("GL: back buffer readback takes %dus as BGRA, %dus as RGBA (driver hint: %s)",
+        static_cast<int>(bgra_time.count()), static_cast<int>(rgba_time.count()),
+        hint_format == GL_BGRA ? "BGRA" : (hint_format == GL_RGBA ? "RGBA" : "none"));
+
+      // within 10% it's noise, let capsulerun pick. Otherwise the
+      // slower order is the driver swizzling every pixel, only offer the fast one.
+      auto slack = std::max(bgra_time, rgba_time) / 10;
+      if (bgra_time + slack < rgba_time) {
+        state->pix_fmts[state->num_pix_fmts++] = messages::PixFmt_BGRA;
+      } else if (rgba_time + slack < bgra_time) {
+        state->pix_fmts[state->num_pix_fmts++] = messages::PixFmt_RGBA;
+      }
+    }
+  }
+
+  if (state->num_pix_fmts == 0) {
+    // blitting, or no clear winner: either order costs the same
+    state->pix_fmts[state->num_pix_fmts++] = messages::PixFmt_BGRA;
+    state->pix_fmts[state->num_pix_fmts++] = messages::PixFmt_RGBA;
+  }
+}
+
+// tells OpenGL ES from desktop GL, and whether we have what either needs
+static bool InitApi() {
+  const char *version = _glGetString(GL_VERSION);
+  state->gles = version && strncmp(version, "OpenGL ES", 9) == 0;
+
+  if (state->gles) {
+    // pixel pack buffers & glMapBufferRange came with ES 3.0
+    if (!_glMapBufferRange || strncmp(version, "OpenGL ES 2.", 12) == 0) {
+      Log("GL: %s, need OpenGL ES 3.0 to capture", version);
+      return false;
+    }
+    Log("GL: %s, capturing with glReadPixels only", version);
+    return true;
+  }
+
+  if (!_glGetTexImage || !_glDrawBuffer || !_glMapBuffer || !_glBindFragDataLocation) {
+    Log("GL: missing desktop GL functions, can't capture");
+    return false;
+  }
+  return true;
+}
+
 static bool Init (int width, int height) {
-  FixWidthHeight(width, height);
+  if (!InitApi()) {
+    return false;
+  }
 
-  const int components = 4; // BGRA
-  const size_t pitch = width * components;
+  FixWidthHeight(width, height);
+  state->src_cx = width;
+  state->src_cy = height;
+
+  int divider = std::max(1, capture::GetState()->settings.size_divider);
+  if (state->gles && divider > 1) {
+    // downscaling reads back through glGetTexImage, which ES lacks
+    Log("GL: no downscaling on OpenGL ES, capturing full size");
+    divider = 1;
+  }
+  // still multiples of 2, for the encoder
+  state->cx = (width / divider) & ~1;
+  state->cy = (height / divider) & ~1;
+  if (state->cx < 2 || state->cy < 2) {
+    Log("GL: %dx%d too small to divide by %d, capturing full size", width, height, divider);
+    state->cx = width;
+    state->cy = height;
+  }
 
-  state.cx = width;
-  state.cy = height;
-  state.pitch = pitch;
+  InitReadFormats();
+  // like the YUV444P shader on d3d11, conversion is opt-in. Its shaders
+  // are desktop GLSL
+  if (capture::GetState()->settings.gpu_color_conv && !state->gles && InitConvertProgram()) {
+    state->pix_fmts[state->num_pix_fmts++] = messages::PixFmt_I420;
+    state->pix_fmts[state->num_pix_fmts++] = messages::PixFmt_NV12;
+  }
+  state->pix_fmt = capture::NegotiatePixFmt(state->pix_fmts, state->num_pix_fmts);
+
+  if (state->pix_fmt == messages::PixFmt_I420 || state->pix_fmt == messages::PixFmt_NV12) {
+    state->convert = true;
+    state->direct_read = false;
+
+    // R8 rows a multiple of 8 long, so readback rows are never padded
+    // whatever GL_PACK_ALIGNMENT the game left
+    state->convert_cx = (state->cx + 7) & ~7;
+    state->convert_cy = state->cy + state->cy / 2;
+
+    auto &layout = state->layout;
+    int64_t luma_size = static_cast<int64_t>(state->convert_cx) * state->cy;
+    layout.offset[0] = 0;
+    layout.linesize[0] = state->convert_cx;
+    layout.offset[1] = luma_size;
+    layout.linesize[1] = state->convert_cx;
+    if (state->pix_fmt == messages::PixFmt_I420) {
+      // U and V side by side in each chroma row
+      layout.num_planes = 3;
+      layout.offset[2] = luma_size + state->cx / 2;
+      layout.linesize[2] = state->convert_cx;
+    } else {
+      layout.num_planes = 2;
+    }
+    layout.size = static_cast<int64_t>(state->convert_cx) * state->convert_cy;
+  } else {
+    const int components = 4; // BGRA or RGBA
+    state->layout = io::PackedLayout(state->cx * components, state->cy);
+    state->read_format = (state->pix_fmt == messages::PixFmt_RGBA) ? GL_RGBA : GL_BGRA;
+  }
 
-  if (!InitOverlayTexture() || !InitOverlayVbo()) {
+  // the overlay shaders are desktop GLSL too
+  if (!state->gles && (!InitOverlayTexture() || !InitOverlayVbo())) {
     Free();
     return false;
   }
@@ -619,54 +1259,241 @@ static bool Init (int width, int height) {
   return true;
 }
 
+// blits the back buffer into dst, scaling it down to cx x cy through
+// the halving levels if any. Fbo & texture bindings must be saved by the
+// caller, and the scissor test disabled: blits honour it
 static void CopyBackbuffer(GLuint dst) {
-	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state.fbo);
-	if (Error("gl_copy_backbuffer", "failed to bind FBO")) {
+	_glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	if (Error("gl_copy_backbuffer", "failed to bind default framebuffer")) {
 		return;
 	}
 
-	_glBindTexture(GL_TEXTURE_2D, dst);
-	if (Error("gl_copy_backbuffer", "failed to bind texture")) {
-		return;
+	GLint last_read_buffer;
+	shadow::GetIntegerv(GL_READ_BUFFER, &last_read_buffer);
+	_glReadBuffer(GL_BACK);
+
+	int src_cx = state->src_cx;
+	int src_cy = state->src_cy;
+	bool success = true;
+	for (int i = 0; i < state->num_scale_levels && success; i++) {
+		_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state->scale_fbos[i]);
+		_glBlitFramebuffer(0, 0, src_cx, src_cy,
+				0, 0, state->scale_cx[i], state->scale_cy[i], GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		success = !Error("gl_copy_backbuffer", "failed to blit scale level");
+
+		_glBindFramebuffer(GL_READ_FRAMEBUFFER, state->scale_fbos[i]);
+		src_cx = state->scale_cx[i];
+		src_cy = state->scale_cy[i];
+	}
+
+	if (success) {
+		_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state->fbo);
+		_glBindTexture(GL_TEXTURE_2D, dst);
+		_glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				GL_TEXTURE_2D, dst, 0);
+		_glDrawBuffer(GL_COLOR_ATTACHMENT0);
+		if (!Error("gl_copy_backbuffer", "failed to set up FBO")) {
+			_glBlitFramebuffer(0, 0, src_cx, src_cy,
+					0, 0, state->cx, state->cy, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+			Error("gl_copy_backbuffer", "failed to blit");
+		}
 	}
 
-	_glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-			GL_TEXTURE_2D, dst, 0);
-	if (Error("gl_copy_backbuffer", "failed to set frame buffer")) {
+	// the read buffer belongs to the default framebuffer
+	_glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	_glReadBuffer(last_read_buffer);
+}
+
+// whether the oldest readback is done; never blocks
+static inline bool ShmemReadbackDone(int idx) {
+  if (!state->fences[idx]) {
+    // no sync objects: assume it's done once it's as old as the ring allows
+    return state->queue_length >= state->num_buffers - 1;
+  }
+
+  GLenum status = _glClientWaitSync(state->fences[idx], 0, 0);
+  if (status == GL_WAIT_FAILED) {
+    Error("ShmemReadbackDone", "failed to poll fence");
+    // mapping will wait if it really isn't done
+    return true;
+  }
+  return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
+// maps the oldest readback and hands it to the copy worker, pops it from the queue
+static inline void ShmemCaptureSend(void) {
+  int idx = state->queue[state->queue_start];
+  state->queue_start = (state->queue_start + 1) % kMaxBuffers;
+  state->queue_length--;
+  state->in_flight[idx] = false;
+
+  if (state->fences[idx]) {
+    _glDeleteSync(state->fences[idx]);
+    state->fences[idx] = nullptr;
+  }
+
+  char *data = (char*) state->maps[idx];
+  if (!data) {
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, state->pbos[idx]);
+    if (Error("ShmemCaptureSend", "failed to bind pbo")) {
+      return;
+    }
+
+    // stays mapped until the worker is done, see ShmemCaptureReclaim
+    if (state->gles) {
+      // OpenGL ES only maps ranges
+      data = (char*) _glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, state->layout.size, GL_MAP_READ_BIT);
+    } else {
+      data = (char*) _glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    }
+    if (!data) {
+      Error("ShmemCaptureSend", "failed to map pbo");
+      return;
+    }
+  }
+
+  state->copying[idx] = true;
+  copy_worker::Job job = {state->timestamps[idx], data, static_cast<size_t>(state->layout.size), &copy_done[idx]};
+  copy_worker::Submit(job);
+}
+
+// makes a buffer the copy worker is done with usable again
+static inline void ShmemCaptureReclaim(int idx) {
+  state->copying[idx] = false;
+  if (!state->maps[idx]) {
+    _glBindBuffer(GL_PIXEL_PACK_BUFFER, state->pbos[idx]);
+    _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    Error("ShmemCaptureReclaim", "failed to unmap pbo");
+  }
+}
+
+// reclaims every buffer the copy worker is done with
+static inline void ShmemCaptureReclaimAll(void) {
+  for (int i = 0; i < state->num_buffers; i++) {
+    if (state->copying[i] && copy_done[i].load(std::memory_order_acquire)) {
+      ShmemCaptureReclaim(i);
+    }
+  }
+}
+
+// sends every readback that's done, in order
+static inline void ShmemCaptureDrain(void) {
+  while (state->queue_length > 0 && ShmemReadbackDone(state->queue[state->queue_start])) {
+    ShmemCaptureSend();
+  }
+}
+
+// a buffer with no readback or copy in flight, growing the ring
+// or waiting on the oldest one if there's none
+static inline int ShmemCaptureFreeBuffer(void) {
+  for (int i = 0; i < state->num_buffers; i++) {
+    if (!state->in_flight[i] && !state->copying[i]) {
+      return i;
+    }
+  }
+
+  // the GPU is behind: rather add a buffer than stall the game
+  if (ShmemAddBuffer()) {
+    Log("GL: readbacks falling behind, ring grown to %d buffers", state->num_buffers);
+    return state->num_buffers - 1;
+  }
+
+  if (state->blocked % kBlockedLogInterval == 0) {
+    Log("GL: readback ring full at %d buffers, render thread blocked %" PRId64 " times",
+      state->num_buffers, state->blocked + 1);
+  }
+  state->blocked++;
+
+  // with nothing in flight on the GPU, every buffer is with the worker
+  int idx = 0;
+  if (state->queue_length > 0) {
+    idx = state->queue[state->queue_start];
+    if (state->fences[idx]) {
+      // a persistent map can't wait in glMapBuffer, so don't give up early
+      GLenum status;
+      do {
+        status = _glClientWaitSync(state->fences[idx], GL_SYNC_FLUSH_COMMANDS_BIT, kBlockTimeout);
+      } while (status == GL_TIMEOUT_EXPIRED);
+    }
+    ShmemCaptureSend();
+  }
+
+  if (state->copying[idx]) {
+    copy_worker::Wait(&copy_done[idx]);
+    ShmemCaptureReclaim(idx);
+  }
+  return idx;
+}
+
+// reads the back buffer straight into dst_pbo, bindings must be saved by the caller
+static inline void ShmemCaptureRead(GLuint dst_pbo) {
+	_glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	if (Error("ShmemCaptureRead", "failed to bind default framebuffer")) {
 		return;
 	}
 
+	GLint last_read_buffer;
+	shadow::GetIntegerv(GL_READ_BUFFER, &last_read_buffer);
 	_glReadBuffer(GL_BACK);
 
-	_glDrawBuffer(GL_COLOR_ATTACHMENT0);
-	if (Error("gl_copy_backbuffer", "failed to set draw buffer")) {
-		return;
+	_glBindBuffer(GL_PIXEL_PACK_BUFFER, dst_pbo);
+	if (!Error("ShmemCaptureRead", "failed to bind dst_pbo")) {
+		_glReadPixels(0, 0, state->cx, state->cy, state->read_format, GL_UNSIGNED_BYTE, 0);
+		Error("ShmemCaptureRead", "failed to read back buffer");
 	}
 
-	_glBlitFramebuffer(0, 0, state.cx, state.cy,
-			0, 0, state.cx, state.cy, GL_COLOR_BUFFER_BIT, GL_LINEAR);
-	Error("gl_copy_backbuffer", "failed to blit");
+	// the shadow still has the game's read buffer, keep it right
+	_glReadBuffer(last_read_buffer);
 }
 
-static inline void ShmemCaptureQueueCopy(void) {
-	for (int i = 0; i < capture::kNumBuffers; i++) {
-		if (state.texture_ready[i]) {
-			GLvoid *buffer;
-      auto timestamp = state.timestamps[i];
+// blits the back buffer into convert_src, converts it into convert_tex
+// and reads all planes into dst_pbo. Fbo, texture & pbo bindings must be
+// saved by the caller, the draw state we touch is saved here.
+static inline void ShmemCaptureConvert(GLuint dst_pbo) {
+	GLint last_viewport[4];
+	GLint last_program;
+	GLint last_vao;
+	GLint active_texture;
+	shadow::GetIntegerv(GL_VIEWPORT, last_viewport);
+	shadow::GetIntegerv(GL_CURRENT_PROGRAM, &last_program);
+	shadow::GetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vao);
+	shadow::GetIntegerv(GL_ACTIVE_TEXTURE, &active_texture);
+
+	bool last_caps[kNumConvertCaps];
+	for (int i = 0; i < kNumConvertCaps; i++) {
+		last_caps[i] = shadow::IsEnabled(kConvertCaps[i]);
+		if (last_caps[i]) {
+			_glDisable(kConvertCaps[i]);
+		}
+	}
 
-			state.texture_ready[i] = false;
+	CopyBackbuffer(state->convert_src);
 
-			_glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pbos[i]);
-			if (Error("gl_shmem_capture_queue_copy", "failed to bind pbo")) {
-				return;
-			}
+	_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state->convert_fbo);
+	_glViewport(0, 0, state->convert_cx, state->convert_cy);
+	_glUseProgram(state->convert_program);
+	GLint unit = active_texture - GL_TEXTURE0;
+	if (unit != state->convert_unit) {
+		// we bind on whichever unit the game left active
+		_glUniform1i(state->convert_src_loc, unit);
+		state->convert_unit = unit;
+	}
+	_glBindTexture(GL_TEXTURE_2D, state->convert_src);
+	safeGlBindVertexArray(state->convert_vao);
+	_glDrawArrays(GL_TRIANGLES, 0, 3);
+	if (!Error("ShmemCaptureConvert", "failed to draw planes")) {
+		_glBindFramebuffer(GL_READ_FRAMEBUFFER, state->convert_fbo);
+		_glBindBuffer(GL_PIXEL_PACK_BUFFER, dst_pbo);
+		_glReadPixels(0, 0, state->convert_cx, state->convert_cy, GL_RED, GL_UNSIGNED_BYTE, 0);
+		Error("ShmemCaptureConvert", "failed to read planes");
+	}
 
-			buffer = _glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-			if (buffer) {
-				state.texture_mapped[i] = true;
-        io::WriteVideoFrame(timestamp, (char*) buffer, state.cy * state.pitch);
-			}
-			break;
+	safeGlBindVertexArray(last_vao);
+	_glUseProgram(last_program);
+	_glViewport(last_viewport[0], last_viewport[1], last_viewport[2], last_viewport[3]);
+	for (int i = 0; i < kNumConvertCaps; i++) {
+		if (last_caps[i]) {
+			_glEnable(kConvertCaps[i]);
 		}
 	}
 }
@@ -682,74 +1509,79 @@ static inline void ShmemCaptureStage(GLuint dst_pbo, GLuint src_tex) {
 		return;
 	}
 
-	_glGetTexImage(GL_TEXTURE_2D, 0, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	_glGetTexImage(GL_TEXTURE_2D, 0, state->read_format, GL_UNSIGNED_BYTE, 0);
 	if (Error("ShmemCaptureStage", "failed to read src_tex")) {
 		return;
 	}
 }
 
 void ShmemCapture () {
-  int next_tex;
   GLint last_fbo;
+  GLint last_read_fbo;
   GLint last_tex;
+  GLint last_pbo;
 
   auto timestamp = capture::FrameTimestamp();
 
-  // save last fbo & texture to restore them after capture
-  {
-    _glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_fbo);
-    if (Error("ShmemCapture", "failed to get last fbo")) {
-      return;
-    }
-
-    _glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
-    if (Error("ShmemCapture", "failed to get last texture")) {
-      return;
-    }
-  }
-
-  // try to map & send all the textures that are ready
-  ShmemCaptureQueueCopy();
+  // save last fbos, texture & pbo to restore them after capture.
+  // shadowed: no round-trip to the driver, see gl_shadow.h
+  shadow::GetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &last_fbo);
+  shadow::GetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &last_read_fbo);
+  shadow::GetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+  shadow::GetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &last_pbo);
 
-  next_tex = (state.cur_tex + 1) % capture::kNumBuffers;
+  // unmap what the worker copied, then map & send all the readbacks that are done
+  ShmemCaptureReclaimAll();
+  ShmemCaptureDrain();
 
-  state.timestamps[next_tex] = timestamp;
-  CopyBackbuffer(state.textures[next_tex]);
+  int idx = ShmemCaptureFreeBuffer();
 
-  if (state.copy_wait < capture::kNumBuffers - 1) {
-    state.copy_wait++;
+  state->timestamps[idx] = timestamp;
+  if (state->direct_read) {
+    ShmemCaptureRead(state->pbos[idx]);
+  } else if (state->convert) {
+    ShmemCaptureConvert(state->pbos[idx]);
   } else {
-    GLuint src = state.textures[next_tex];
-    GLuint dst = state.pbos[next_tex];
-
-    // TODO: look into - obs has some locking here
-    _glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-    state.texture_mapped[next_tex] = false;
-
-    ShmemCaptureStage(dst, src);
-    state.texture_ready[next_tex] = true;
+    bool last_scissor = shadow::IsEnabled(GL_SCISSOR_TEST);
+    if (last_scissor) {
+      _glDisable(GL_SCISSOR_TEST);
+    }
+    CopyBackbuffer(state->textures[idx]);
+    if (last_scissor) {
+      _glEnable(GL_SCISSOR_TEST);
+    }
+    ShmemCaptureStage(state->pbos[idx], state->textures[idx]);
+  }
+  if (HasFences()) {
+    state->fences[idx] = _glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
   }
 
+  state->in_flight[idx] = true;
+  state->queue[(state->queue_start + state->queue_length) % kMaxBuffers] = idx;
+  state->queue_length++;
+
+  _glBindBuffer(GL_PIXEL_PACK_BUFFER, last_pbo);
   _glBindTexture(GL_TEXTURE_2D, last_tex);
   _glBindFramebuffer(GL_DRAW_FRAMEBUFFER, last_fbo);
+  _glBindFramebuffer(GL_READ_FRAMEBUFFER, last_read_fbo);
 }
 
 static inline bool UpdateOverlayTexture() {
 
 #define GLCHECK(msg) if (Error("UpdateOverlayTexture", msg)) { return false; }
 
-  size_t pixels_size = state.overlay_width * 4 * state.overlay_height;
-  for (int y = 0; y < state.overlay_height; y++) {
-    for (int x = 0; x < state.overlay_width; x++) {
-      int i = (y * state.overlay_width + x) * 4;
-      state.overlay_pixels[i]     = (state.overlay_pixels[i]     + 1) % 256;
-      state.overlay_pixels[i + 1] = (state.overlay_pixels[i + 1] + 1) % 256;
-      state.overlay_pixels[i + 2] = (state.overlay_pixels[i + 2] + 1) % 256;
-      // state.overlay_pixels[i + 3] = (state.overlay_pixels[i + 3] + 1) % 256;
+  size_t pixels_size = state->overlay_width * 4 * state->overlay_height;
+  for (int y = 0; y < state->overlay_height; y++) {
+    for (int x = 0; x < state->overlay_width; x++) {
+      int i = (y * state->overlay_width + x) * 4;
+      state->overlay_pixels[i]     = (state->overlay_pixels[i]     + 1) % 256;
+      state->overlay_pixels[i + 1] = (state->overlay_pixels[i + 1] + 1) % 256;
+      state->overlay_pixels[i + 2] = (state->overlay_pixels[i + 2] + 1) % 256;
+      // state->overlay_pixels[i + 3] = (state->overlay_pixels[i + 3] + 1) % 256;
     }
   }
 
-  _glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state.overlay_pbo);
+  _glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state->overlay_pbo);
   GLCHECK("bind buffer");
 
   _glBufferData(GL_PIXEL_UNPACK_BUFFER, pixels_size, 0, GL_STREAM_DRAW);
@@ -759,7 +1591,7 @@ static inline bool UpdateOverlayTexture() {
   GLCHECK("map buffer");
 
   if (mapped) {
-    memcpy(mapped, state.overlay_pixels, pixels_size);
+    memcpy(mapped, state->overlay_pixels, pixels_size);
     _glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
     GLCHECK("unmap buffer");
   } else {
@@ -767,7 +1599,7 @@ static inline bool UpdateOverlayTexture() {
   }
 
   _glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
-    state.overlay_width, state.overlay_height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    state->overlay_width, state->overlay_height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
   GLCHECK("tex sub image 2d");
 
 #undef GLCHECK
@@ -788,45 +1620,28 @@ void DrawOverlay() {
   GLint last_program = 0;
 
   // save the state we change
-  auto success = false;
-  do {
-    _glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
-    GLCHECK("get last tex");
-
-    _glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vao);
-    GLCHECK("get last vao");
-
-    _glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &last_vbo);
-    GLCHECK("get last vbo");
+  shadow::GetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
+  shadow::GetIntegerv(GL_VERTEX_ARRAY_BINDING, &last_vao);
+  shadow::GetIntegerv(GL_ARRAY_BUFFER_BINDING, &last_vbo);
+  shadow::GetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &last_unpack_pbo);
+  shadow::GetIntegerv(GL_CURRENT_PROGRAM, &last_program);
 
-    _glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &last_unpack_pbo);
-    GLCHECK("get last unpack pbo");
-
-    _glGetIntegerv(GL_CURRENT_PROGRAM, &last_program);
-    GLCHECK("get last program");
-
-    success = true;
-  } while(false);
-  if (!success) {
-    return;
-  }
-
-  success = false;
+  auto success = false;
   do {
     _glClear(GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
     GLCHECK("clear");
 
-    _glBindTexture(GL_TEXTURE_2D, state.overlay_tex);
+    _glBindTexture(GL_TEXTURE_2D, state->overlay_tex);
     GLCHECK("bind texture");
 
     if (!UpdateOverlayTexture()) {
       break;
     }
 
-    safeGlBindVertexArray(state.overlay_vao);
+    safeGlBindVertexArray(state->overlay_vao);
     GLCHECK("bind vao");
 
-    _glUseProgram(state.overlay_shader_program);
+    _glUseProgram(state->overlay_shader_program);
     GLCHECK("use program");
 
     _glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
@@ -852,15 +1667,187 @@ void DrawOverlay() {
   }
 }
 
+// finds (or makes) the surface for ctx & drawable and counts the swap,
+// called with surfaces_mutex held
+static Surface *Track(void *ctx, void *drawable, int width, int height,
+                      std::chrono::steady_clock::time_point now) {
+  Surface *&surface = surfaces[SurfaceKey{ctx, drawable}];
+  if (!surface) {
+    surface = new Surface();
+    surface->ctx = ctx;
+    surface->drawable = drawable;
+    surface->period_start = now;
+  }
+
+  auto elapsed = now - surface->period_start;
+  if (elapsed >= kActivityPeriod) {
+    // a whole period without swaps in between means it went idle
+    surface->rate = elapsed < 2 * kActivityPeriod ? surface->swaps : 0;
+    surface->swaps = 0;
+    surface->period_start = now;
+  }
+
+  if (width > 0 && height > 0) {
+    surface->width = width;
+    surface->height = height;
+  } else if (surface->swaps == 0) {
+    // the caller can't tell (glX, wgl): once a period, go with the
+    // viewport, which is shadowed anyway
+    GLint viewport[4] = {0, 0, 0, 0};
+    shadow::GetIntegerv(GL_VIEWPORT, viewport);
+    surface->width = viewport[2];
+    surface->height = viewport[3];
+  }
+
+  surface->swaps++;
+  surface->last_swap = now;
+  return surface;
+}
+
+static inline int64_t RateOf(const Surface *surface) {
+  // surfaces younger than a period haven't got a rate yet
+  return std::max(surface->rate, surface->swaps);
+}
+
+// the surface a new capture should be of: the largest of those that swap
+// at least half as often as the busiest one, so neither a launcher or
+// tool window nor a minimap wins over the scene. Surfaces that stopped
+// swapping a while ago are forgotten on the way.
+// Called with surfaces_mutex held.
+static Surface *PickTarget(std::chrono::steady_clock::time_point now) {
+  int64_t best_rate = 0;
+  for (auto it = surfaces.begin(); it != surfaces.end();) {
+    Surface *surface = it->second;
+    if (!surface->state && !surface->users && now - surface->last_swap > kForgetTimeout) {
+      delete surface;
+      it = surfaces.erase(it);
+      continue;
+    }
+    if (now - surface->last_swap < 2 * kActivityPeriod) {
+      best_rate = std::max(best_rate, RateOf(surface));
+    }
+    ++it;
+  }
+
+  Surface *best = nullptr;
+  for (auto &it : surfaces) {
+    Surface *surface = it.second;
+    if (now - surface->last_swap >= 2 * kActivityPeriod || RateOf(surface) * 2 < best_rate) {
+      continue;
+    }
+    if (!best || surface->width * surface->height > best->width * best->height) {
+      best = surface;
+    }
+  }
+
+  if (best && surfaces.size() > 1) {
+    Log("GL: %d surfaces swapping, capturing the %dx%d one (context %p), %" PRId64 " swaps/s",
+      static_cast<int>(surfaces.size()), best->width, best->height, best->ctx, RateOf(best));
+  }
+  return best;
+}
+
+// points this thread at surface's capture state
+static void Use(Surface *surface) {
+  if (!surface->state) {
+    surface->state = new State();
+  }
+  state = surface->state;
+  copy_done = surface->copy_done;
+}
+
+// frees what we captured surface with, its context must be current
+static void Release(Surface *surface) {
+  Use(surface);
+  _glGetError();
+  Free();
+  delete surface->state;
+  surface->state = nullptr;
+  state = nullptr;
+  copy_done = nullptr;
+}
+
+// called by Capture once it's done with surface
+static void Done(Surface *surface) {
+  bool forgotten;
+  {
+    std::lock_guard<std::mutex> lock(surfaces_mutex);
+    surface->users--;
+    forgotten = surface->forgotten && surface->users == 0;
+  }
+
+  if (forgotten) {
+    // ForgetContext left it to us: glX and EGL only destroy a context
+    // once it's no longer current anywhere, so it's still good here
+    if (surface->state) {
+      Release(surface);
+    }
+    delete surface;
+  }
+}
+
+// readback & overlay for one swap, or freeing what we had if surface
+// isn't captured (anymore)
+static void CaptureSurface(Surface *surface, bool captured, bool restart, int width, int height) {
+  if (!captured) {
+    if (surface->state) {
+      // capture stopped, or moved on to another surface
+      Release(surface);
+    }
+    return;
+  }
+
+  if (restart && surface->state) {
+    // left over from a capture that stopped before it swapped again
+    Release(surface);
+  }
+  Use(surface);
+
+  // reset error flag
+	_glGetError();
+
+  if (!capture::Ready()) {
+    return;
+  }
+
+  if (!state->cx) {
+    if (!Init(width, height)) {
+      Log("GL: initialization failed, stopping capture");
+      io::WriteCaptureStop();
+      return;
+    }
+  }
+
+  if (state->cx) {
+    if (!state->format_sent) {
+      io::WriteVideoFormat(
+        state->cx,
+        state->cy,
+        state->pix_fmt,
+        !state->convert /* planes come out top-down */,
+        state->layout,
+        state->pix_fmts,
+        state->num_pix_fmts
+      );
+      state->format_sent = true;
+    }
+
+    ShmemCapture();
+  }
+
+  if (!state->gles) {
+    DrawOverlay();
+  }
+}
+
 /**
  * Capture one OpenGL frame
  */
-void Capture(int width, int height) {
+void Capture(void *ctx, void *drawable, int width, int height) {
   capture::SawBackend(capture::kBackendGL);
 
   static bool functions_initialized = false;
   static bool critical_failure = false;
-  static bool first_frame = true;
 
   if (critical_failure) {
     return;
@@ -874,42 +1861,73 @@ void Capture(int width, int height) {
     }
   }
 
-  // reset error flag
-	_glGetError();
-
-  if (!capture::Ready()) {
-    if (!capture::Active() && !first_frame) {
-      first_frame = true;
-      Free();
+  Surface *surface;
+  bool captured;
+  bool restart = false;
+  {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(surfaces_mutex);
+    surface = Track(ctx, drawable, width, height, now);
+
+    if (!capture::Active()) {
+      target = nullptr;
+      target_lost = false;
+    } else if (!target && !target_lost) {
+      target = PickTarget(now);
+      restart = true;
     }
+    captured = surface == target;
+    // ForgetContext may run on another thread meanwhile
+    surface->users++;
+  }
 
+  CaptureSurface(surface, captured, restart, width, height);
+  Done(surface);
+}
+
+void ForgetContext(void *ctx) {
+  if (!ctx) {
     return;
   }
 
-  if (!state.cx) {
-    if (!Init(width, height)) {
-      Log("GL: initialization failed, stopping capture");
-      io::WriteCaptureStop();
-      return;
+  std::lock_guard<std::mutex> lock(surfaces_mutex);
+  for (auto it = surfaces.begin(); it != surfaces.end();) {
+    Surface *surface = it->second;
+    if (surface->ctx != ctx) {
+      ++it;
+      continue;
     }
-  }
 
-  if (state.cx) {
-    if (first_frame) {
-      io::WriteVideoFormat(
-        state.cx,
-        state.cy,
-        messages::PixFmt_BGRA,
-        true /* vflip */,
-        state.pitch
-      );
-      first_frame = false;
+    if (surface == target) {
+      target = nullptr;
+      if (capture::Active()) {
+        // the video can't switch surfaces halfway through
+        Log("GL: captured context is going away, stopping capture");
+        target_lost = true;
+        io::WriteCaptureStop();
+      }
     }
 
-    ShmemCapture();
-  }
+    it = surfaces.erase(it);
+    if (surface->users) {
+      // a swap is capturing it right now, Done frees it after
+      surface->forgotten = true;
+      continue;
+    }
 
-  DrawOverlay();
+    if (surface->state) {
+      // its GL objects go with the context, but the copy worker
+      // may still be reading from mapped buffers
+      for (int i = 0; i < kMaxBuffers; i++) {
+        if (surface->state->copying[i]) {
+          copy_worker::Wait(&surface->copy_done[i]);
+        }
+      }
+      delete surface->state;
+    }
+
+    delete surface;
+  }
 }
 
 } // namespace gl
@@ -921,6 +1939,7 @@ void Capture(int width, int height) {
 glGetError_t _glGetError;
 glGetIntegerv_t _glGetIntegerv;
 glGetString_t _glGetString;
+glGetStringi_t _glGetStringi;
 
 glGenTextures_t _glGenTextures;
 glBindTexture_t _glBindTexture;
@@ -932,21 +1951,31 @@ glDeleteTextures_t _glDeleteTextures;
 
 glGenVertexArrays_t _glGenVertexArrays;
 glBindVertexArray_t _glBindVertexArray;
+glDeleteVertexArrays_t _glDeleteVertexArrays;
 
 #if defined(LAB_MACOS)
 glGenVertexArraysAPPLE_t _glGenVertexArraysAPPLE;
 glBindVertexArrayAPPLE_t _glBindVertexArrayAPPLE;
+glDeleteVertexArraysAPPLE_t _glDeleteVertexArraysAPPLE;
 #endif
 
 glGenBuffers_t _glGenBuffers;
 glBindBuffer_t _glBindBuffer;
 glReadBuffer_t _glReadBuffer;
+glReadPixels_t _glReadPixels;
 glDrawBuffer_t _glDrawBuffer;
 glBufferData_t _glBufferData;
 glMapBuffer_t _glMapBuffer;
 glUnmapBuffer_t _glUnmapBuffer;
 glDeleteBuffers_t _glDeleteBuffers;
 
+glFenceSync_t _glFenceSync;
+glClientWaitSync_t _glClientWaitSync;
+glDeleteSync_t _glDeleteSync;
+
+glBufferStorage_t _glBufferStorage;
+glMapBufferRange_t _glMapBufferRange;
+
 glGenFramebuffers_t _glGenFramebuffers;
 glBindFramebuffer_t _glBindFramebuffer;
 glBlitFramebuffer_t _glBlitFramebuffer;
@@ -958,6 +1987,7 @@ glShaderSource_t _glShaderSource;
 glCompileShader_t _glCompileShader;
 glGetShaderiv_t _glGetShaderiv;
 glGetShaderInfoLog_t _glGetShaderInfoLog;
+glDeleteShader_t _glDeleteShader;
 glCreateProgram_t _glCreateProgram;
 glAttachShader_t _glAttachShader;
 glLinkProgram_t _glLinkProgram;
@@ -965,6 +1995,7 @@ glValidateProgram_t _glValidateProgram;
 glGetProgramiv_t _glGetProgramiv;
 glGetProgramInfoLog_t _glGetProgramInfoLog;
 glUseProgram_t _glUseProgram;
+glDeleteProgram_t _glDeleteProgram;
 glGetAttribLocation_t _glGetAttribLocation;
 glBindFragDataLocation_t _glBindFragDataLocation;
 glEnableVertexAttribArray_t _glEnableVertexAttribArray;
@@ -972,6 +2003,10 @@ glVertexAttribPointer_t _glVertexAttribPointer;
 glGetUniformLocation_t _glGetUniformLocation;
 glUniform1i_t _glUniform1i;
 
+glViewport_t _glViewport;
+glEnable_t _glEnable;
+glDisable_t _glDisable;
+glIsEnabled_t _glIsEnabled;
 glDrawArrays_t _glDrawArrays;
 glClearColor_t _glClearColor;
 glClear_t _glClear;
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <lab/platform.h>
 #include "logging.h"
@@ -47,6 +48,8 @@ typedef double GLclampd;
 typedef void GLvoid;
 typedef ptrdiff_t GLintptrARB;
 typedef ptrdiff_t GLsizeiptrARB;
+typedef uint64_t GLuint64;
+typedef struct __GLsync *GLsync;
 
 // one possible reference for these:
 // https://code.woboq.org/qt5/include/GLES2/gl2.h.html
@@ -56,6 +59,7 @@ typedef ptrdiff_t GLsizeiptrARB;
 #define GL_FRONT 0x0404
 #define GL_BACK 0x0405
 
+#define GL_TRIANGLES 0x0004
 #define GL_TRIANGLE_STRIP 0x0005
 
 #define GL_FLOAT 0x1406
@@ -64,6 +68,7 @@ typedef ptrdiff_t GLsizeiptrARB;
 
 #define GL_UNSIGNED_BYTE 0x1401
 
+#define GL_RED 0x1903
 #define GL_RGB 0x1907
 #define GL_RGBA 0x1908
 
@@ -71,6 +76,7 @@ typedef ptrdiff_t GLsizeiptrARB;
 #define GL_BGRA 0x80E1
 
 #define GL_RGBA8 0x8058
+#define GL_R8 0x8229
 
 #define GL_NEAREST 0x2600
 #define GL_LINEAR 0x2601
@@ -104,8 +110,16 @@ typedef ptrdiff_t GLsizeiptrARB;
 
 #define GL_TEXTURE_2D 0x0DE1
 #define GL_TEXTURE_BINDING_2D 0x8069
+#define GL_TEXTURE0 0x84C0
+#define GL_ACTIVE_TEXTURE 0x84E0
 #define GL_DRAW_FRAMEBUFFER_BINDING 0x8CA6
+#define GL_READ_FRAMEBUFFER_BINDING 0x8CAA
+#define GL_READ_BUFFER 0x0C02
+#define GL_IMPLEMENTATION_COLOR_READ_TYPE 0x8B9A
+#define GL_IMPLEMENTATION_COLOR_READ_FORMAT 0x8B9B
 
+#define GL_TEXTURE_MAG_FILTER 0x2800
+#define GL_TEXTURE_MIN_FILTER 0x2801
 #define GL_TEXTURE_BASE_LEVEL 0x813C
 #define GL_TEXTURE_MAX_LEVEL 0x813D
 
@@ -113,6 +127,7 @@ typedef ptrdiff_t GLsizeiptrARB;
 #define WGL_ACCESS_READ_WRITE_NV 0x0001
 #define WGL_ACCESS_WRITE_DISCARD_NV 0x0002
 
+#define GL_FRAMEBUFFER 0x8D40
 #define GL_READ_FRAMEBUFFER 0x8CA8
 #define GL_DRAW_FRAMEBUFFER 0x8CA9
 #define GL_DEPTH_BUFFER_BIT   0x00000100
@@ -122,6 +137,12 @@ typedef ptrdiff_t GLsizeiptrARB;
 #define GL_COLOR_ATTACHMENT1 0x8CE1
 
 #define GL_VIEWPORT 0x0BA2
+#define GL_SAMPLE_BUFFERS 0x80A8
+
+#define GL_CULL_FACE 0x0B44
+#define GL_BLEND 0x0BE2
+#define GL_SCISSOR_TEST 0x0C11
+#define GL_RASTERIZER_DISCARD 0x8C89
 
 #define GL_VENDOR 0x1F00
 #define GL_RENDERER 0x1F01
@@ -133,6 +154,21 @@ typedef ptrdiff_t GLsizeiptrARB;
 #define GL_VALIDATE_STATUS 0x8B83
 #define GL_INFO_LOG_LENGTH 0x8B84
 
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_ALREADY_SIGNALED 0x911A
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_CONDITION_SATISFIED 0x911C
+#define GL_WAIT_FAILED 0x911D
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+
+#define GL_EXTENSIONS 0x1F03
+#define GL_NUM_EXTENSIONS 0x821D
+
+#define GL_MAP_READ_BIT 0x0001
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#define GL_CLIENT_STORAGE_BIT 0x0200
+
 // state getters
 
 typedef GLenum(LAB_STDCALL *glGetError_t)();
@@ -144,6 +180,10 @@ extern glGetIntegerv_t _glGetIntegerv;
 typedef char *(LAB_STDCALL *glGetString_t)(GLenum pname);
 extern glGetString_t _glGetString;
 
+// GL 3.0+, may be missing
+typedef char *(LAB_STDCALL *glGetStringi_t)(GLenum pname, GLuint index);
+extern glGetStringi_t _glGetStringi;
+
 // textures
 
 typedef void(LAB_STDCALL *glGenTextures_t)(GLsizei n, GLuint *buffers);
@@ -186,12 +226,18 @@ extern glGenVertexArrays_t _glGenVertexArrays;
 typedef void(LAB_STDCALL *glBindVertexArray_t)(GLuint buffer);
 extern glBindVertexArray_t _glBindVertexArray;
 
+typedef void(LAB_STDCALL *glDeleteVertexArrays_t)(GLsizei n, const GLuint *buffers);
+extern glDeleteVertexArrays_t _glDeleteVertexArrays;
+
 #if defined(LAB_MACOS)
 typedef glGenVertexArrays_t glGenVertexArraysAPPLE_t;
 extern glGenVertexArraysAPPLE_t _glGenVertexArraysAPPLE;
 
 typedef glBindVertexArray_t glBindVertexArrayAPPLE_t;
 extern glBindVertexArrayAPPLE_t _glBindVertexArrayAPPLE;
+
+typedef glDeleteVertexArrays_t glDeleteVertexArraysAPPLE_t;
+extern glDeleteVertexArraysAPPLE_t _glDeleteVertexArraysAPPLE;
 #endif
 
 // buffers
@@ -205,6 +251,10 @@ extern glBindBuffer_t _glBindBuffer;
 typedef void(LAB_STDCALL *glReadBuffer_t)(GLenum);
 extern glReadBuffer_t _glReadBuffer;
 
+typedef void(LAB_STDCALL *glReadPixels_t)(GLint x, GLint y, GLsizei width, GLsizei height,
+                                          GLenum format, GLenum type, GLvoid *data);
+extern glReadPixels_t _glReadPixels;
+
 typedef void(LAB_STDCALL *glDrawBuffer_t)(GLenum mode);
 extern glDrawBuffer_t _glDrawBuffer;
 
@@ -222,6 +272,27 @@ typedef void(LAB_STDCALL *glDeleteBuffers_t)(GLsizei n,
                                                  const GLuint *buffers);
 extern glDeleteBuffers_t _glDeleteBuffers;
 
+// ARB_buffer_storage (GL 4.4), may be missing
+
+typedef void(LAB_STDCALL *glBufferStorage_t)(GLenum target, GLsizeiptrARB size,
+                                             const GLvoid *data, GLbitfield flags);
+extern glBufferStorage_t _glBufferStorage;
+
+typedef GLvoid *(LAB_STDCALL *glMapBufferRange_t)(GLenum target, GLintptrARB offset,
+                                                  GLsizeiptrARB length, GLbitfield access);
+extern glMapBufferRange_t _glMapBufferRange;
+
+// sync objects (GL 3.2 / ARB_sync), may be missing
+
+typedef GLsync(LAB_STDCALL *glFenceSync_t)(GLenum condition, GLbitfield flags);
+extern glFenceSync_t _glFenceSync;
+
+typedef GLenum(LAB_STDCALL *glClientWaitSync_t)(GLsync sync, GLbitfield flags, GLuint64 timeout);
+extern glClientWaitSync_t _glClientWaitSync;
+
+typedef void(LAB_STDCALL *glDeleteSync_t)(GLsync sync);
+extern glDeleteSync_t _glDeleteSync;
+
 // framebuffers
 
 typedef void(LAB_STDCALL *glGenFramebuffers_t)(GLsizei n, GLuint *buffers);
@@ -264,6 +335,9 @@ extern glGetShaderiv_t _glGetShaderiv;
 typedef void(LAB_STDCALL *glGetShaderInfoLog_t)(GLuint shader, GLsizei bufSize, GLsizei *length, GLchar *infoLog);
 extern glGetShaderInfoLog_t _glGetShaderInfoLog;
 
+typedef void(LAB_STDCALL *glDeleteShader_t)(GLuint shader);
+extern glDeleteShader_t _glDeleteShader;
+
 typedef GLuint(LAB_STDCALL *glCreateProgram_t)();
 extern glCreateProgram_t _glCreateProgram;
 
@@ -285,6 +359,9 @@ extern glGetProgramInfoLog_t _glGetProgramInfoLog;
 typedef void(LAB_STDCALL *glUseProgram_t)(GLuint program);
 extern glUseProgram_t _glUseProgram;
 
+typedef void(LAB_STDCALL *glDeleteProgram_t)(GLuint program);
+extern glDeleteProgram_t _glDeleteProgram;
+
 typedef GLint(LAB_STDCALL *glGetAttribLocation_t)(GLuint program, const GLchar *attribName);
 extern glGetAttribLocation_t _glGetAttribLocation;
 
@@ -309,6 +386,18 @@ extern glUniform1i_t _glUniform1i;
 
 // drawing stuff
 
+typedef void(LAB_STDCALL *glViewport_t)(GLint x, GLint y, GLsizei width, GLsizei height);
+extern glViewport_t _glViewport;
+
+typedef void(LAB_STDCALL *glEnable_t)(GLenum cap);
+extern glEnable_t _glEnable;
+
+typedef void(LAB_STDCALL *glDisable_t)(GLenum cap);
+extern glDisable_t _glDisable;
+
+typedef GLboolean(LAB_STDCALL *glIsEnabled_t)(GLenum cap);
+extern glIsEnabled_t _glIsEnabled;
+
 typedef void(LAB_STDCALL *glDrawArrays_t)(GLenum mode, GLint fist, GLsizei count);
 extern glDrawArrays_t _glDrawArrays;
 
@@ -329,6 +418,14 @@ namespace gl {
   } \
 }
 
+// for functions capture can do without: check for null before use
+#define GLSYM_OPTIONAL(sym) { \
+  _ ## sym = (sym ## _t) GetProcAddress(#sym);\
+  if (! _ ## sym) { \
+    Log("GL function %s not available", #sym); \
+  } \
+}
+
 extern const char *kDefaultOpengl;
 
 bool EnsureOpengl();
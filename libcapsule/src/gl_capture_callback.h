@@ -26,7 +26,12 @@ namespace gl {
 
 extern LibHandle handle;
 
-void Capture (int width, int height);
+// ctx & drawable tell apart the surfaces a game swaps, only the busiest
+// one gets captured. width & height may be 0 when unknown.
+void Capture (void *ctx, void *drawable, int width, int height);
+
+// ctx is about to be destroyed, drop what we had for it
+void ForgetContext (void *ctx);
 
 // Must have platform-specific implementation
 bool LoadOpengl (const char *path);
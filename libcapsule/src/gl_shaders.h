@@ -44,3 +44,68 @@ static const char* kFragmentSource = R"glsl(
         gl_FragColor.a = 0.4;
     }
 )glsl";
+
+// RGB to I420/NV12, drawn as one triangle over an R8 target holding
+// every plane: cy rows of Y, then cy/2 rows of chroma, either U then V
+// side by side (I420) or interleaved (NV12). Planes come out top-down.
+static const char* kConvertVertexSource = R"glsl(
+    #version 130
+
+    void main() {
+        // (-1, -1), (3, -1), (-1, 3): covers the whole viewport
+        vec2 pos = vec2(float((gl_VertexID & 1) << 2), float((gl_VertexID & 2) << 1)) - 1.0;
+        gl_Position = vec4(pos, 0.0, 1.0);
+    }
+)glsl";
+
+static const char* kConvertFragmentSource = R"glsl(
+    #version 130
+    uniform sampler2D src; // the captured frame, bottom-up
+    uniform int nv12;
+    out vec4 outColor;
+
+    // BT.601, limited range: what swscale uses for RGB to yuv420p
+    const vec3 kY = vec3(0.257, 0.504, 0.098);
+    const vec3 kU = vec3(-0.148, -0.291, 0.439);
+    const vec3 kV = vec3(0.439, -0.368, -0.071);
+
+    // texelFetch: no filtering, so no sampler state can get in the way
+    vec3 Pixel(ivec2 size, int x, int y) {
+        return texelFetch(src, ivec2(x, size.y - 1 - y), 0).rgb;
+    }
+
+    void main() {
+        ivec2 size = textureSize(src, 0);
+        ivec2 p = ivec2(gl_FragCoord.xy);
+
+        if (p.y < size.y) {
+            // rows are padded to a multiple of 8
+            float y = p.x < size.x ? dot(Pixel(size, p.x, p.y), kY) + 16.0 / 255.0 : 0.0;
+            outColor = vec4(y);
+            return;
+        }
+
+        int half_width = size.x / 2;
+        int row = p.y - size.y;
+        int col;
+        bool v;
+        if (nv12 != 0) {
+            col = p.x / 2;
+            v = (p.x & 1) == 1;
+        } else {
+            v = p.x >= half_width;
+            col = v ? p.x - half_width : p.x;
+        }
+        if (col >= half_width) {
+            outColor = vec4(0.0);
+            return;
+        }
+
+        // each chroma sample covers a 2x2 block
+        int x = col * 2;
+        int y = row * 2;
+        vec3 rgb = (Pixel(size, x, y) + Pixel(size, x + 1, y) +
+                    Pixel(size, x, y + 1) + Pixel(size, x + 1, y + 1)) * 0.25;
+        outColor = vec4(dot(rgb, v ? kV : kU) + 0.5);
+    }
+)glsl";
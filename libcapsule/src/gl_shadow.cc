@@ -0,0 +1,468 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "gl_shadow.h"
+
+#include <mutex>
+#include <vector>
+
+#include <lab/env.h>
+
+namespace capsule {
+namespace gl {
+namespace shadow {
+
+// texture units we shadow 2D bindings of, others are always queried
+static const GLint kMaxTextureUnits = 32;
+
+enum Slot {
+  kDrawFramebuffer = 0,
+  kReadFramebuffer,
+  kArrayBuffer,
+  kPackBuffer,
+  kUnpackBuffer,
+  kVertexArray,
+  kProgram,
+  kActiveTexture, // index of the unit, not GL_TEXTUREi
+  kReadBuffer, // of the default framebuffer
+  kViewport, // in Bindings::viewport
+  kNumSlots,
+};
+
+// capabilities that would get in the way of capture's own draws
+static const GLenum kCaps[] = {
+  GL_BLEND,
+  GL_SCISSOR_TEST,
+  GL_CULL_FACE,
+  GL_RASTERIZER_DISCARD,
+};
+static const int kNumCaps = sizeof(kCaps) / sizeof(kCaps[0]);
+
+struct Bindings {
+  void *ctx; // null once the context is gone
+  uint32_t valid; // one bit per Slot
+  GLint values[kNumSlots];
+  uint32_t valid_textures; // one bit per unit
+  GLint textures[kMaxTextureUnits];
+  GLint viewport[4];
+  uint32_t known_caps; // one bit per kCaps entry
+  uint32_t enabled_caps;
+};
+
+static std::mutex contexts_mutex;
+// never freed: a destroyed context's shadow goes to the next new one
+static std::vector<Bindings*> contexts;
+
+static thread_local Bindings *current = nullptr;
+
+static bool Enabled() {
+  static bool enabled = lab::env::Get("CAPSULE_GL_SHADOW") != "0";
+  return enabled;
+}
+
+static inline bool Has(const Bindings *b, Slot slot) {
+  return (b->valid & (1u << slot)) != 0;
+}
+
+static inline void Set(Bindings *b, Slot slot, GLint value) {
+  b->values[slot] = value;
+  b->valid |= (1u << slot);
+}
+
+// resets slot to 0 if it's bound to name
+static inline void Unbind(Bindings *b, Slot slot, GLuint name) {
+  if (Has(b, slot) && b->values[slot] == static_cast<GLint>(name)) {
+    b->values[slot] = 0;
+  }
+}
+
+static int CapOf(GLenum cap) {
+  for (int i = 0; i < kNumCaps; i++) {
+    if (kCaps[i] == cap) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int SlotOf(GLenum pname) {
+  switch (pname) {
+    case GL_DRAW_FRAMEBUFFER_BINDING: return kDrawFramebuffer;
+    case GL_READ_FRAMEBUFFER_BINDING: return kReadFramebuffer;
+    case GL_ARRAY_BUFFER_BINDING: return kArrayBuffer;
+    case GL_PIXEL_PACK_BUFFER_BINDING: return kPackBuffer;
+    case GL_PIXEL_UNPACK_BUFFER_BINDING: return kUnpackBuffer;
+    case GL_VERTEX_ARRAY_BINDING: return kVertexArray;
+    case GL_CURRENT_PROGRAM: return kProgram;
+    case GL_READ_BUFFER: return kReadBuffer;
+    default: return -1;
+  }
+}
+
+void MakeCurrent(void *ctx) {
+  if (!ctx || !Enabled()) {
+    current = nullptr;
+    return;
+  }
+
+  if (current && current->ctx == ctx) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(contexts_mutex);
+  Bindings *unused = nullptr;
+  for (auto b : contexts) {
+    if (b->ctx == ctx) {
+      current = b;
+      return;
+    }
+    if (!b->ctx && !unused) {
+      unused = b;
+    }
+  }
+
+  if (!unused) {
+    unused = new Bindings();
+    contexts.push_back(unused);
+  }
+  // whatever happened to it before we saw it, query it all once
+  unused->ctx = ctx;
+  unused->valid = 0;
+  unused->valid_textures = 0;
+  unused->known_caps = 0;
+  current = unused;
+}
+
+void Sync(void *ctx) {
+  if (!current || current->ctx == ctx) {
+    return;
+  }
+
+  static bool logged = false;
+  if (!logged) {
+    logged = true;
+    Log("GL: context switched without glXMakeCurrent, re-reading bindings");
+  }
+
+  // calls meant for ctx went to the other shadow
+  Forget();
+  MakeCurrent(ctx);
+  Forget();
+}
+
+void DestroyContext(void *ctx) {
+  if (!ctx) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(contexts_mutex);
+  for (auto b : contexts) {
+    if (b->ctx == ctx) {
+      b->ctx = nullptr;
+      if (current == b) {
+        current = nullptr;
+      }
+      return;
+    }
+  }
+}
+
+void BindTexture(GLenum target, GLuint texture) {
+  Bindings *b = current;
+  if (!b || target != GL_TEXTURE_2D) {
+    return;
+  }
+
+  if (!Has(b, kActiveTexture)) {
+    // can't tell which unit that was
+    b->valid_textures = 0;
+    return;
+  }
+
+  GLint unit = b->values[kActiveTexture];
+  if (unit >= 0 && unit < kMaxTextureUnits) {
+    b->textures[unit] = static_cast<GLint>(texture);
+    b->valid_textures |= (1u << unit);
+  }
+}
+
+void ActiveTexture(GLenum texture) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  Set(b, kActiveTexture, static_cast<GLint>(texture - GL_TEXTURE0));
+}
+
+void BindBuffer(GLenum target, GLuint buffer) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  switch (target) {
+    case GL_ARRAY_BUFFER:
+      Set(b, kArrayBuffer, static_cast<GLint>(buffer));
+      break;
+    case GL_PIXEL_PACK_BUFFER:
+      Set(b, kPackBuffer, static_cast<GLint>(buffer));
+      break;
+    case GL_PIXEL_UNPACK_BUFFER:
+      Set(b, kUnpackBuffer, static_cast<GLint>(buffer));
+      break;
+    default:
+      break;
+  }
+}
+
+void BindFramebuffer(GLenum target, GLuint framebuffer) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  if (target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER) {
+    Set(b, kDrawFramebuffer, static_cast<GLint>(framebuffer));
+  }
+  if (target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER) {
+    Set(b, kReadFramebuffer, static_cast<GLint>(framebuffer));
+  }
+}
+
+void BindVertexArray(GLuint array) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  Set(b, kVertexArray, static_cast<GLint>(array));
+}
+
+void UseProgram(GLuint program) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  Set(b, kProgram, static_cast<GLint>(program));
+}
+
+void ReadBuffer(GLenum mode) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  // the read buffer belongs to the read framebuffer, we only
+  // follow the default one's
+  if (!Has(b, kReadFramebuffer)) {
+    b->valid &= ~(1u << kReadBuffer);
+  } else if (b->values[kReadFramebuffer] == 0) {
+    Set(b, kReadBuffer, static_cast<GLint>(mode));
+  }
+}
+
+void Viewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  b->viewport[0] = x;
+  b->viewport[1] = y;
+  b->viewport[2] = width;
+  b->viewport[3] = height;
+  b->valid |= (1u << kViewport);
+}
+
+void Enable(GLenum cap, bool enabled) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  int i = CapOf(cap);
+  if (i < 0) {
+    return;
+  }
+
+  b->known_caps |= (1u << i);
+  if (enabled) {
+    b->enabled_caps |= (1u << i);
+  } else {
+    b->enabled_caps &= ~(1u << i);
+  }
+}
+
+void DeleteTextures(GLsizei n, const GLuint *textures) {
+  Bindings *b = current;
+  if (!b || !textures) {
+    return;
+  }
+
+  for (GLsizei i = 0; i < n; i++) {
+    for (GLint unit = 0; unit < kMaxTextureUnits; unit++) {
+      if ((b->valid_textures & (1u << unit)) && b->textures[unit] == static_cast<GLint>(textures[i])) {
+        b->textures[unit] = 0;
+      }
+    }
+  }
+}
+
+void DeleteBuffers(GLsizei n, const GLuint *buffers) {
+  Bindings *b = current;
+  if (!b || !buffers) {
+    return;
+  }
+
+  for (GLsizei i = 0; i < n; i++) {
+    Unbind(b, kArrayBuffer, buffers[i]);
+    Unbind(b, kPackBuffer, buffers[i]);
+    Unbind(b, kUnpackBuffer, buffers[i]);
+  }
+}
+
+void DeleteFramebuffers(GLsizei n, const GLuint *framebuffers) {
+  Bindings *b = current;
+  if (!b || !framebuffers) {
+    return;
+  }
+
+  for (GLsizei i = 0; i < n; i++) {
+    Unbind(b, kDrawFramebuffer, framebuffers[i]);
+    Unbind(b, kReadFramebuffer, framebuffers[i]);
+  }
+}
+
+void DeleteVertexArrays(GLsizei n, const GLuint *arrays) {
+  Bindings *b = current;
+  if (!b || !arrays) {
+    return;
+  }
+
+  for (GLsizei i = 0; i < n; i++) {
+    Unbind(b, kVertexArray, arrays[i]);
+  }
+}
+
+void ForgetTextureUnits(GLuint first, GLsizei count) {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  for (GLsizei i = 0; i < count && first + i < static_cast<GLuint>(kMaxTextureUnits); i++) {
+    b->valid_textures &= ~(1u << (first + i));
+  }
+}
+
+void Forget() {
+  Bindings *b = current;
+  if (!b) {
+    return;
+  }
+
+  b->valid = 0;
+  b->valid_textures = 0;
+  b->known_caps = 0;
+}
+
+void GetIntegerv(GLenum pname, GLint *data) {
+  Bindings *b = current;
+  if (!b) {
+    _glGetIntegerv(pname, data);
+    return;
+  }
+
+  if (pname == GL_TEXTURE_BINDING_2D) {
+    if (!Has(b, kActiveTexture)) {
+      GLint active = GL_TEXTURE0;
+      _glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+      Set(b, kActiveTexture, active - GL_TEXTURE0);
+    }
+
+    GLint unit = b->values[kActiveTexture];
+    if (unit < 0 || unit >= kMaxTextureUnits) {
+      _glGetIntegerv(pname, data);
+      return;
+    }
+
+    if (!(b->valid_textures & (1u << unit))) {
+      b->textures[unit] = 0;
+      _glGetIntegerv(pname, &b->textures[unit]);
+      b->valid_textures |= (1u << unit);
+    }
+    *data = b->textures[unit];
+    return;
+  }
+
+  if (pname == GL_VIEWPORT) {
+    if (!Has(b, kViewport)) {
+      _glGetIntegerv(pname, b->viewport);
+      b->valid |= (1u << kViewport);
+    }
+    for (int i = 0; i < 4; i++) {
+      data[i] = b->viewport[i];
+    }
+    return;
+  }
+
+  if (pname == GL_ACTIVE_TEXTURE) {
+    if (!Has(b, kActiveTexture)) {
+      GLint active = GL_TEXTURE0;
+      _glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+      Set(b, kActiveTexture, active - GL_TEXTURE0);
+    }
+    *data = GL_TEXTURE0 + b->values[kActiveTexture];
+    return;
+  }
+
+  int slot = SlotOf(pname);
+  if (slot < 0) {
+    _glGetIntegerv(pname, data);
+    return;
+  }
+
+  if (!Has(b, static_cast<Slot>(slot))) {
+    GLint value = 0;
+    _glGetIntegerv(pname, &value);
+    Set(b, static_cast<Slot>(slot), value);
+  }
+  *data = b->values[slot];
+}
+
+bool IsEnabled(GLenum cap) {
+  Bindings *b = current;
+  int i = CapOf(cap);
+  if (!b || i < 0) {
+    return _glIsEnabled(cap) == GL_TRUE;
+  }
+
+  if (!(b->known_caps & (1u << i))) {
+    Enable(cap, _glIsEnabled(cap) == GL_TRUE);
+  }
+  return (b->enabled_caps & (1u << i)) != 0;
+}
+
+} // namespace shadow
+} // namespace gl
+} // namespace capsule
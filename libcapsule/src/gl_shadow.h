@@ -0,0 +1,91 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include "gl_capture.h"
+
+namespace capsule {
+namespace gl {
+namespace shadow {
+
+/**
+ * Shadow copies of the bindings capture saves & restores around its own
+ * work, one set per context. Platform hooks feed it every call that
+ * changes them, so capture can read them back without glGetIntegerv,
+ * which stalls threaded drivers (mesa_glthread & co) on every call.
+ *
+ * A binding we haven't followed yet is queried once, then shadowed.
+ * Without hooks (no MakeCurrent seen on this thread), everything is
+ * queried, like before.
+ */
+
+// switches the calling thread to ctx's shadow (null: no context current).
+// call after the real MakeCurrent succeeded.
+void MakeCurrent(void *ctx);
+
+// call once per frame with the context that's really current: if it's
+// not the one we think, someone switched contexts behind our back and
+// neither shadow can be trusted anymore.
+void Sync(void *ctx);
+
+// the context is gone, its shadow can be reused
+void DestroyContext(void *ctx);
+
+// binding changes, call after the real function
+void BindTexture(GLenum target, GLuint texture);
+void ActiveTexture(GLenum texture);
+void BindBuffer(GLenum target, GLuint buffer);
+void BindFramebuffer(GLenum target, GLuint framebuffer);
+void BindVertexArray(GLuint array);
+void UseProgram(GLuint program);
+void ReadBuffer(GLenum mode);
+void Viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+// glEnable/glDisable, only a few capabilities are followed
+void Enable(GLenum cap, bool enabled);
+
+// deleting a bound object resets its binding to 0
+void DeleteTextures(GLsizei n, const GLuint *textures);
+void DeleteBuffers(GLsizei n, const GLuint *buffers);
+void DeleteFramebuffers(GLsizei n, const GLuint *framebuffers);
+void DeleteVertexArrays(GLsizei n, const GLuint *arrays);
+
+// texture units whose bindings changed in a way we don't follow
+// (glBindTextures, glBindTextureUnit)
+void ForgetTextureUnits(GLuint first, GLsizei count);
+
+// the current context's bindings changed in a way we don't follow
+// (glPopAttrib & co), they'll be queried again
+void Forget();
+
+// drop-in for _glGetIntegerv on the bindings above: answers from the
+// shadow when it can, queries (and remembers) otherwise. Capture must
+// put back whatever it binds through the real functions. GL_READ_BUFFER
+// is the default framebuffer's: bind it for reading before asking.
+// Also answers GL_VIEWPORT and GL_ACTIVE_TEXTURE.
+void GetIntegerv(GLenum pname, GLint *data);
+
+// drop-in for _glIsEnabled, same deal
+bool IsEnabled(GLenum cap);
+
+} // namespace shadow
+} // namespace gl
+} // namespace capsule
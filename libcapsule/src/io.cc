@@ -20,8 +20,10 @@
  */
 
 #include <string>
+#include <sstream>
 #include <thread>
 #include <mutex>
+#include <vector>
 
 #include <shoom.h>
 
@@ -32,6 +34,9 @@
 #include <lab/io.h>
 
 #include "capsule/audio_math.h"
+#include "capsule/audio_ring.h"
+#include "capsule/frame_ring.h"
+#include "io.h"
 #include "capture.h"
 #include "logging.h"
 #include "ensure.h"
@@ -50,11 +55,16 @@ std::mutex frame_locked_mutex;
 int next_frame_index = 0;
 
 shoom::Shm *shm = nullptr;
+// set when frame commits & releases go through the shm instead of the FIFO
+ring::FrameRingHeader *frame_ring = nullptr;
+int64_t frames_offset = 0;
 shoom::Shm *audio_shm = nullptr;
 int64_t audio_frame_size = 0;
 int64_t audio_shm_num_frames = 0;
 int64_t audio_shm_committed_offset = 0;
-int64_t audio_shm_processed_offset = 0;
+// set when audio frames go through the shm instead of the FIFO
+audio_ring::AudioRingHeader *audio_ring_header = nullptr;
+uint64_t audio_dropped_logged = 0;
 
 std::mutex out_mutex;
 std::mutex shm_mutex;
@@ -75,6 +85,22 @@ static void UnlockFrame(int i) {
     frame_locked[i] = false;
 }
 
+// unmaps both segments, capsulerun has its own mappings (or none yet)
+static void FreeShm() {
+    if (shm) {
+        std::lock_guard<std::mutex> lock(shm_mutex);
+        delete shm;
+        shm = nullptr;
+        frame_ring = nullptr;
+    }
+    if (audio_shm) {
+        std::lock_guard<std::mutex> lock(audio_shm_mutex);
+        delete audio_shm;
+        audio_shm = nullptr;
+        audio_ring_header = nullptr;
+    }
+}
+
 static void HandlePacket(char *buf) {
     auto pkt = messages::GetPacket(buf);
     switch (pkt->message_type()) {
@@ -85,23 +111,36 @@ static void HandlePacket(char *buf) {
             settings.fps = cps->fps();
             settings.size_divider = cps->size_divider();
             settings.gpu_color_conv = cps->gpu_color_conv();
-            Log("poll_infile: capture settings: %d fps, %d divider, %d gpu_color_conv", settings.fps, settings.size_divider, settings.gpu_color_conv);
+#if defined(LAB_LINUX)
+            settings.control_ring = cps->control_ring();
+#else
+            // no doorbell implementation, stick to the FIFO
+            settings.control_ring = false;
+#endif // LAB_LINUX
+            // polled, no doorbell needed: works everywhere
+            settings.audio_ring = cps->audio_ring();
+            settings.huge_pages = cps->huge_pages();
+            settings.num_pix_fmts = 0;
+            if (cps->pix_fmts()) {
+                for (auto pix_fmt : *cps->pix_fmts()) {
+                    if (settings.num_pix_fmts == capture::kMaxPixFmts) {
+                        break;
+                    }
+                    if (pix_fmt <= messages::PixFmt_UNKNOWN || pix_fmt > messages::PixFmt_MAX) {
+                        // newer than us, can't produce it anyway
+                        continue;
+                    }
+                    settings.pix_fmts[settings.num_pix_fmts++] = static_cast<messages::PixFmt>(pix_fmt);
+                }
+            }
+            Log("poll_infile: capture settings: %d fps, %d divider, %d gpu_color_conv, %d control_ring, %d audio_ring, %d huge_pages, %d pix_fmts", settings.fps, settings.size_divider, settings.gpu_color_conv, settings.control_ring, settings.audio_ring, settings.huge_pages, settings.num_pix_fmts);
             capture::Start(&settings);
             break;
         }
         case messages::Message_CaptureStop: {
             Log("poll_infile: received CaptureStop");
             capture::Stop();
-            if (shm) {
-                std::lock_guard<std::mutex> lock(shm_mutex);
-                delete shm;
-                shm = nullptr;
-            }
-            if (audio_shm) {
-                std::lock_guard<std::mutex> lock(audio_shm_mutex);
-                delete audio_shm;
-                audio_shm = nullptr;
-            }
+            FreeShm();
             break;
         }
         case messages::Message_VideoFrameProcessed: {
@@ -118,15 +157,71 @@ static void HandlePacket(char *buf) {
             Log("poll_infile: unknown message type %s", EnumNameMessage(pkt->message_type()));
     }
 
-    delete[] buf;
+    connection->Release(buf);
+}
+
+// per-process names, so that two games (or a 32-bit and a 64-bit
+// process from the same launcher) don't clobber each other's segments
+static std::string ShmName(const char *purpose) {
+    std::ostringstream oss;
+#if defined(LAB_WINDOWS)
+    oss << "capsule_" << purpose << "_" << GetCurrentProcessId() << ".shm";
+#else
+    oss << "capsule_" << purpose << "_" << getpid() << ".shm";
+#endif
+    return oss.str();
+}
+
+// anonymous segments don't linger in /dev/shm if the game crashes, their
+// fds are appended to fds and passed to capsulerun before the VideoSetup.
+// segments are prefaulted so the first frames don't pay for page faults.
+static shoom::Shm *CreateShm(const std::string &name, int64_t size, bool anonymous,
+                             std::vector<int> &fds, int32_t *fd_index, int *ret) {
+    auto result = new shoom::Shm(name, static_cast<size_t>(size));
+    int map_flags = shoom::kMapPopulate;
+    if (capture::GetState()->settings.huge_pages) {
+        map_flags |= shoom::kMapHugePages;
+    }
+    result->SetMapFlags(map_flags);
+    *fd_index = -1;
+#if defined(LAB_LINUX)
+    if (anonymous) {
+        *ret = result->CreateAnonymous();
+        if (*ret == shoom::kOK) {
+            *fd_index = static_cast<int32_t>(fds.size());
+            fds.push_back(result->Fd());
+        }
+        return result;
+    }
+#endif // LAB_LINUX
+    *ret = result->Create();
+    if (*ret == shoom::kOK && (map_flags & shoom::kMapHugePages)) {
+        Log("CreateShm: %s backed by huge pages: %d", name.c_str(), result->HugePages());
+    }
+    return result;
+}
+
+FrameLayout PackedLayout(int64_t pitch, int height) {
+    FrameLayout layout = {0};
+    layout.num_planes = 1;
+    layout.offset[0] = 0;
+    layout.linesize[0] = pitch;
+    layout.size = pitch * height;
+    return layout;
 }
 
-void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pitch) {
+// creates the segments and sends the VideoSetup describing them. Only
+// fails if the fds of anonymous segments couldn't be passed, in which
+// case nothing was sent.
+static bool WriteVideoSetup(int width, int height, int format, bool vflip, const FrameLayout &layout,
+                            const messages::PixFmt *backend_pix_fmts, int num_backend_pix_fmts,
+                            bool anonymous) {
     flatbuffers::FlatBufferBuilder builder(1024);
 
-    Log("Writing video format");
     auto state = capture::GetState();
 
+    std::vector<int> fds;
+
     flatbuffers::Offset<messages::AudioSetup> audio_setup;
     if (state->has_audio_intercept) {
         Log("Sending audio intercept info: %d channels, %d rate, %s format",
@@ -142,21 +237,30 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
         audio_frame_size = sample_size * (int64_t) state->audio_intercept_channels;
         audio_shm_num_frames = seconds * (int64_t) state->audio_intercept_rate;
         audio_shm_committed_offset = 0;
-        audio_shm_processed_offset = audio_shm_num_frames;
-
-        int64_t audio_shmem_size = audio_shm_num_frames * audio_frame_size;
-        std::string audio_shmem_path = "capsule_audio.shm";
-        audio_shm = new shoom::Shm(audio_shmem_path, static_cast<size_t>(audio_shmem_size));
-
-        int ret = audio_shm->Create();
+        audio_dropped_logged = 0;
+
+        bool audio_control_ring = state->settings.audio_ring;
+        int64_t audio_header_size = audio_control_ring ? audio_ring::kHeaderSize : 0;
+        int64_t audio_shmem_size = audio_header_size + audio_shm_num_frames * audio_frame_size;
+        std::string audio_shmem_path = ShmName("audio");
+        int32_t audio_fd_index = -1;
+        int ret = 0;
+        audio_shm = CreateShm(audio_shmem_path, audio_shmem_size, anonymous, fds, &audio_fd_index, &ret);
         if (ret != shoom::kOK) {
             Log("Could not create audio shared memory area: code %d", ret);
         }
 
+        audio_ring_header = nullptr;
+        if (audio_control_ring && ret == shoom::kOK) {
+            audio_ring_header = reinterpret_cast<audio_ring::AudioRingHeader*>(audio_shm->Data());
+            audio_ring::InitHeader(audio_ring_header);
+        }
+
         auto audio_shmem = messages::CreateShmem(
             builder,
             builder.CreateString(audio_shmem_path),
-            audio_shmem_size
+            audio_shmem_size,
+            audio_fd_index
         );
 
         audio_setup = messages::CreateAudioSetup(
@@ -164,7 +268,8 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
             state->audio_intercept_channels,
             state->audio_intercept_format,
             state->audio_intercept_rate,
-            audio_shmem
+            audio_shmem,
+            audio_ring_header != nullptr
         );
     }
 
@@ -172,39 +277,49 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
         frame_locked[i] = false;
     }
 
-    int64_t frame_size = height * pitch;
-    Log("Frame size: %" PRId64 " bytes", frame_size);
-    int64_t shmem_size = frame_size * capture::kNumBuffers;
+    bool control_ring = state->settings.control_ring;
+    frames_offset = control_ring ? ring::kHeaderSize : 0;
+
+    int64_t frame_size = layout.size;
+    Log("Frame size: %" PRId64 " bytes in %d plane(s)", frame_size, layout.num_planes);
+    int64_t shmem_size = frames_offset + frame_size * capture::kNumBuffers;
     Log("Should allocate %" PRId64 " bytes of shmem area", shmem_size);
 
-    std::string shmem_path = "capsule_video.shm";
-    shm = new shoom::Shm(shmem_path, static_cast<size_t>(shmem_size));
-    int ret = shm->Create();
+    std::string shmem_path = ShmName("video");
+    int32_t fd_index = -1;
+    int ret = 0;
+    shm = CreateShm(shmem_path, shmem_size, anonymous, fds, &fd_index, &ret);
     if (ret != shoom::kOK) {
         Log("Could not create video shared memory area: code %d", ret);
     }
 
+    frame_ring = nullptr;
+    if (control_ring && ret == shoom::kOK) {
+        frame_ring = reinterpret_cast<ring::FrameRingHeader*>(shm->Data());
+        ring::InitHeader(frame_ring);
+        Log("Frame commits will go through the shm control ring");
+    }
+
     auto shmem = messages::CreateShmem(
         builder,
         builder.CreateString(shmem_path),
-        shmem_size
+        shmem_size,
+        fd_index
     );
 
-    // TODO: support multiple linesizes (for planar formats)
-    int64_t linesize[1];
-    linesize[0] = pitch;
-    auto linesize_vec = builder.CreateVector(linesize, 1);
+    auto linesize_vec = builder.CreateVector(layout.linesize, layout.num_planes);
+    auto offset_vec = builder.CreateVector(layout.offset, layout.num_planes);
 
-    // TODO: support multiple offsets (for planar formats)
-    int64_t offset[1];
-    offset[0] = 0;
-    auto offset_vec = builder.CreateVector(offset, 1);
+    std::vector<int32_t> backend_pix_fmts_vec(backend_pix_fmts, backend_pix_fmts + num_backend_pix_fmts);
+    auto backend_pix_fmts_off = builder.CreateVector(backend_pix_fmts_vec);
 
     messages::VideoSetupBuilder vs_builder(builder);
     vs_builder.add_width(width);
     vs_builder.add_height(height);
     vs_builder.add_pix_fmt((messages::PixFmt) format);
     vs_builder.add_vflip(vflip);
+    vs_builder.add_control_ring(frame_ring != nullptr);
+    vs_builder.add_backend_pix_fmts(backend_pix_fmts_off);
 
     vs_builder.add_offset(offset_vec);
     vs_builder.add_linesize(linesize_vec);
@@ -222,13 +337,57 @@ void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pit
     builder.Finish(pkt);
     {
         std::lock_guard<std::mutex> lock(out_mutex);
+#if defined(LAB_LINUX)
+        if (!fds.empty() && !connection->SendFds(fds.data(), static_cast<int>(fds.size()))) {
+            return false;
+        }
+#endif // LAB_LINUX
         connection->Write(builder);
     }
+    return true;
+}
+
+void WriteVideoFormat(int width, int height, int format, bool vflip, const FrameLayout &layout,
+                      const messages::PixFmt *backend_pix_fmts, int num_backend_pix_fmts) {
+    Log("Writing video format");
+
+#if defined(LAB_LINUX)
+    bool anonymous = connection->OpenFdChannel();
+#else
+    bool anonymous = false;
+#endif // LAB_LINUX
+
+    if (WriteVideoSetup(width, height, format, vflip, layout, backend_pix_fmts, num_backend_pix_fmts, anonymous)) {
+        return;
+    }
+
+    // the backend already considers the format sent: don't leave it
+    // without a capture, use segments capsulerun can open by name instead
+    Log("Could not pass shm fds to capsulerun, falling back to named shm");
+    FreeShm();
+    WriteVideoSetup(width, height, format, vflip, layout, backend_pix_fmts, num_backend_pix_fmts, false);
 }
 
 int is_skipping;
 
+// picks up frames capsulerun is done with, must hold shm_mutex
+static void DrainReleaseRing() {
+    ring::FrameDescriptor desc;
+    while (ring::Pop(&frame_ring->release, &desc)) {
+        if (desc.index < capture::kNumBuffers) {
+            UnlockFrame(desc.index);
+        }
+    }
+}
+
 void WriteVideoFrame(int64_t timestamp, char *frame_data, size_t frame_data_size) {
+    {
+        std::lock_guard<std::mutex> lock(shm_mutex);
+        if (frame_ring) {
+            DrainReleaseRing();
+        }
+    }
+
     if (IsFrameLocked(next_frame_index)) {
         if (!is_skipping) {
             Log("frame buffer overrun (at %d)! skipping until further notice", next_frame_index);
@@ -241,9 +400,7 @@ void WriteVideoFrame(int64_t timestamp, char *frame_data, size_t frame_data_size
         is_skipping = false;
     }
 
-    flatbuffers::FlatBufferBuilder builder(64);
-
-    int64_t offset = (frame_data_size * next_frame_index);
+    int64_t offset = frames_offset + (frame_data_size * next_frame_index);
 
     {
         std::lock_guard<std::mutex> lock(shm_mutex);
@@ -254,8 +411,25 @@ void WriteVideoFrame(int64_t timestamp, char *frame_data, size_t frame_data_size
 
         char *target = reinterpret_cast<char*>(shm->Data() + offset);
         memcpy(target, frame_data, frame_data_size);
+
+#if defined(LAB_LINUX)
+        if (frame_ring) {
+            ring::FrameDescriptor desc = {};
+            desc.timestamp = timestamp;
+            desc.index = static_cast<uint32_t>(next_frame_index);
+            // a frame is only pushed once it's unlocked, and there are
+            // fewer buffers than slots, so this can't fill up
+            LockFrame(next_frame_index);
+            ring::Push(&frame_ring->commit, desc);
+            ring::Ring(&frame_ring->commit);
+
+            next_frame_index = (next_frame_index + 1) % capture::kNumBuffers;
+            return;
+        }
+#endif // LAB_LINUX
     }
 
+    flatbuffers::FlatBufferBuilder builder(64);
     auto vfc = messages::CreateVideoFrameCommitted(builder, timestamp,
                                                    next_frame_index);
     auto pkt = messages::CreatePacket(
@@ -278,6 +452,21 @@ void WriteAudioFrames(char *src_data, int64_t src_frames) {
         return;
     }
 
+    if (audio_ring_header) {
+        auto ring_data = (char*) audio_shm->Data() + audio_ring::kHeaderSize;
+        int64_t written = audio_ring::Write(audio_ring_header, ring_data, audio_shm_num_frames,
+                                            audio_frame_size, src_data, src_frames);
+        if (written < src_frames) {
+            // capsulerun is behind, log every second's worth of dropped audio
+            uint64_t dropped = audio_ring_header->dropped_frames.load(std::memory_order_relaxed);
+            if (dropped - audio_dropped_logged >= (uint64_t) (audio_shm_num_frames / 4)) {
+                Log("audio ring overrun: %" PRIu64 " frames dropped so far", dropped);
+                audio_dropped_logged = dropped;
+            }
+        }
+        return;
+    }
+
     auto dst_data = (char*) audio_shm->Data();
  
     int64_t src_offset = 0;
@@ -391,6 +580,19 @@ static void PollInfile() {
   }
 }
 
+// lets capsulerun notice us without blocking on the fifos
+static void WriteHello(Connection *conn) {
+    flatbuffers::FlatBufferBuilder builder(32);
+#if defined(LAB_WINDOWS)
+    auto hello = messages::CreateHello(builder, static_cast<int32_t>(GetCurrentProcessId()));
+#else
+    auto hello = messages::CreateHello(builder, static_cast<int32_t>(getpid()));
+#endif
+    auto pkt = messages::CreatePacket(builder, messages::Message_Hello, hello.Union());
+    builder.Finish(pkt);
+    conn->Write(builder);
+}
+
 void Init() {
     std::string pipe_path = lab::env::Get("CAPSULE_PIPE_PATH");
     Log("First pipe path is '%s'", pipe_path.c_str());
@@ -401,12 +603,13 @@ void Init() {
         Log("Error: Could not reach capsulerun router, bailing out");
         return;
     }
+    WriteHello(temp_conn);
 
     Log("Waiting for ready...");
     char *buf = temp_conn->Read();
-    temp_conn->Close();
-    delete temp_conn;
     if (!buf) {
+        temp_conn->Close();
+        delete temp_conn;
         Log("Error: Could not even get ready, bailing out");
         return;
     }
@@ -414,13 +617,18 @@ void Init() {
     auto pkt = messages::GetPacket(buf);
     if (pkt->message_type() != messages::Message_ReadyForYou) {
         Log("Error: didn't get ReadyForYou, got %s", EnumNameMessage(pkt->message_type()));
-        delete[] buf;
+        temp_conn->Release(buf);
+        temp_conn->Close();
+        delete temp_conn;
         return;
     }
 
+    pipe_path = pkt->message_as_ReadyForYou()->pipe()->str();
+    temp_conn->Release(buf);
+    temp_conn->Close();
+    delete temp_conn;
+
     {
-        auto rfy = pkt->message_as_ReadyForYou();
-        pipe_path = rfy->pipe()->str();
         Log("Second pipe path is '%s'", pipe_path.c_str());
         connection = new Connection(pipe_path);
         connection->Connect();
@@ -430,10 +638,9 @@ void Init() {
             Log("Error: could not make second connection");
             return;
         }
+        WriteHello(connection);
     }
 
-    delete[] buf;
-
     new std::thread(PollInfile);
     Log("Connection with capsulerun established!");
 }
@@ -29,9 +29,24 @@
 namespace capsule {
 namespace io {
 
+static const int kMaxPlanes = 4;
+
+// where a captured frame's planes are, in bytes
+struct FrameLayout {
+    int num_planes;
+    int64_t offset[kMaxPlanes];
+    int64_t linesize[kMaxPlanes];
+    int64_t size; // all planes
+};
+
+// a single plane of height rows, pitch bytes each
+FrameLayout PackedLayout(int64_t pitch, int height);
+
 void Init();
 void Cleanup();
-void WriteVideoFormat(int width, int height, int format, bool vflip, int64_t pitch);
+// backend_pix_fmts is what the backend could have captured in, for capsulerun's logs
+void WriteVideoFormat(int width, int height, int format, bool vflip, const FrameLayout &layout,
+                      const messages::PixFmt *backend_pix_fmts, int num_backend_pix_fmts);
 void WriteVideoFrame(int64_t timestamp, char *frame_data, size_t frame_data_size);
 void WriteAudioFrames(char *data, int64_t frames);
 void WriteHotkeyPressed();
@@ -26,6 +26,7 @@
 #include "../ensure.h"
 #include "../logging.h"
 #include "../gl_capture.h"
+#include "egl_hooks.h"
 
 namespace capsule {
 namespace dl {
@@ -52,6 +53,8 @@ extern "C" {
 void* dlopen (const char *filename, int flag) {
   static bool faked_alsa = false;
   static bool faked_gl = false;
+  static bool faked_egl = false;
+  static bool faked_gles = false;
 
   if (filename != nullptr && lab::strings::CContains(filename, "libGL.so.1")) {
     capsule::gl::LoadOpengl(filename);
@@ -71,6 +74,25 @@ void* dlopen (const char *filename, int flag) {
       capsule::Log("dlopen: loading real libGL from %s", filename);
       return capsule::dl::NakedOpen(filename, flag);
     }
+  } else if (filename != nullptr && lab::strings::CContains(filename, "libEGL.so.1")) {
+    capsule::egl::LoadEgl(filename);
+
+    // same as libGL: SDL dlopens libEGL then looks up eglSwapBuffers in it
+    capsule::dl::NakedOpen(filename, RTLD_NOW|RTLD_GLOBAL);
+    if (!faked_egl) {
+      faked_egl = true;
+      capsule::Log("dlopen: faking libEGL (for %s)", filename);
+    }
+    return capsule::dl::NakedOpen(nullptr, RTLD_NOW|RTLD_LOCAL);
+  } else if (filename != nullptr && lab::strings::CContains(filename, "libGLESv2.so.2")) {
+    // GL functions looked up in there must hit our interposers too,
+    // or the binding shadows go stale
+    capsule::dl::NakedOpen(filename, RTLD_NOW|RTLD_GLOBAL);
+    if (!faked_gles) {
+      faked_gles = true;
+      capsule::Log("dlopen: faking libGLESv2 (for %s)", filename);
+    }
+    return capsule::dl::NakedOpen(nullptr, RTLD_NOW|RTLD_LOCAL);
   } else if (filename != nullptr && lab::strings::CContains(filename, "libasound.so.2")) {
     // load libasound into our space
     capsule::dl::NakedOpen(filename, RTLD_NOW|RTLD_GLOBAL);
@@ -0,0 +1,255 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "egl_hooks.h"
+
+#include <stdint.h>
+
+#include <lab/strings.h>
+
+#include "../gl_capture.h"
+#include "../gl_shadow.h"
+#include "../ensure.h"
+#include "../logging.h"
+#include "dlopen_hooks.h"
+#include "gl_hooks.h"
+
+namespace capsule {
+namespace egl {
+
+// from EGL/egl.h, which we'd rather not depend on for two values
+static const int32_t kEglHeight = 0x3056;
+static const int32_t kEglWidth = 0x3057;
+
+static const char *kDefaultEgl = "libEGL.so.1";
+
+// where GL comes from for EGL games that never load libGL, in order.
+// Only the dlsym fallback: eglGetProcAddress is asked first.
+static const char *kClientLibraries[] = {
+  "libGLESv2.so.2",
+  "libOpenGL.so.0",
+  "libGL.so.1",
+};
+
+// using the leading underscore convention, like GLSYM
+typedef unsigned int (*eglSwapBuffers_t)(void*, void*);
+static eglSwapBuffers_t _eglSwapBuffers = nullptr;
+
+typedef unsigned int (*eglSwapBuffersWithDamage_t)(void*, void*, const int32_t*, int32_t);
+static eglSwapBuffersWithDamage_t _eglSwapBuffersWithDamageKHR = nullptr;
+static eglSwapBuffersWithDamage_t _eglSwapBuffersWithDamageEXT = nullptr;
+
+typedef unsigned int (*eglMakeCurrent_t)(void*, void*, void*, void*);
+static eglMakeCurrent_t _eglMakeCurrent = nullptr;
+
+typedef unsigned int (*eglDestroyContext_t)(void*, void*);
+static eglDestroyContext_t _eglDestroyContext = nullptr;
+
+typedef void* (*eglGetCurrentContext_t)();
+static eglGetCurrentContext_t _eglGetCurrentContext = nullptr;
+
+typedef unsigned int (*eglQuerySurface_t)(void*, void*, int32_t, int32_t*);
+static eglQuerySurface_t _eglQuerySurface = nullptr;
+
+typedef void* (*eglGetProcAddress_t)(const char*);
+static eglGetProcAddress_t _eglGetProcAddress = nullptr;
+
+static LibHandle handle;
+static bool in_use = false;
+
+#define EGLSYM(sym) { \
+  _ ## sym = (sym ## _t) dlsym(handle, #sym); \
+  if (! _ ## sym) { \
+    Log("Could not find EGL function %s", #sym); \
+    return false; \
+  } \
+}
+
+bool LoadEgl(const char *path) {
+  handle = dl::NakedOpen(path, (RTLD_NOW|RTLD_LOCAL));
+  if (!handle) {
+    return false;
+  }
+
+  EGLSYM(eglSwapBuffers)
+  EGLSYM(eglMakeCurrent)
+  EGLSYM(eglDestroyContext)
+  EGLSYM(eglGetCurrentContext)
+  EGLSYM(eglQuerySurface)
+  EGLSYM(eglGetProcAddress)
+
+  return true;
+}
+
+#undef EGLSYM
+
+static void EnsureEgl() {
+  if (_eglGetProcAddress) {
+    return;
+  }
+
+  Log("Loading default EGL %s", kDefaultEgl);
+  if (!LoadEgl(kDefaultEgl)) {
+    Log("Could not load EGL from %s, cannot forward EGL calls", kDefaultEgl);
+    exit(124);
+  }
+}
+
+// called by every hook on the way to a frame: from then on GL
+// is resolved through EGL
+static void Use() {
+  EnsureEgl();
+  if (in_use) {
+    return;
+  }
+  in_use = true;
+
+  if (!gl::handle) {
+    for (const char *lib : kClientLibraries) {
+      gl::handle = dl::NakedOpen(lib, (RTLD_NOW|RTLD_LOCAL));
+      if (gl::handle) {
+        Log("EGL: resolving GL through eglGetProcAddress, then %s", lib);
+        return;
+      }
+    }
+    // GL can still be found with eglGetProcAddress, which Mesa and
+    // libglvnd answer for core functions too
+    Log("EGL: no GL client library found, relying on eglGetProcAddress");
+    gl::handle = handle;
+  }
+}
+
+bool InUse() {
+  return in_use;
+}
+
+void *GetProcAddress(const char *symbol) {
+  if (!_eglGetProcAddress) {
+    return nullptr;
+  }
+  return _eglGetProcAddress(symbol);
+}
+
+// feeds gl::Capture right before the real swap, sized like the surface
+static void Capture(void *dpy, void *surface) {
+  Use();
+  void *ctx = _eglGetCurrentContext();
+  gl::shadow::Sync(ctx);
+
+  int32_t width = 0;
+  int32_t height = 0;
+  if (!_eglQuerySurface(dpy, surface, kEglWidth, &width) ||
+      !_eglQuerySurface(dpy, surface, kEglHeight, &height)) {
+    // gl::Capture falls back to the viewport
+    width = 0;
+    height = 0;
+  }
+  gl::Capture(ctx, surface, width, height);
+}
+
+} // namespace egl
+} // namespace capsule
+
+extern "C" {
+
+// interposed libEGL function
+unsigned int eglSwapBuffers (void *dpy, void *surface) {
+  capsule::egl::Capture(dpy, surface);
+  return capsule::egl::_eglSwapBuffers(dpy, surface);
+}
+
+// only ever handed out by eglGetProcAddress, see below
+static unsigned int eglSwapBuffersWithDamageKHR (void *dpy, void *surface, const int32_t *rects, int32_t n_rects) {
+  capsule::egl::Capture(dpy, surface);
+  return capsule::egl::_eglSwapBuffersWithDamageKHR(dpy, surface, rects, n_rects);
+}
+
+// only ever handed out by eglGetProcAddress, see below
+static unsigned int eglSwapBuffersWithDamageEXT (void *dpy, void *surface, const int32_t *rects, int32_t n_rects) {
+  capsule::egl::Capture(dpy, surface);
+  return capsule::egl::_eglSwapBuffersWithDamageEXT(dpy, surface, rects, n_rects);
+}
+
+// interposed libEGL function
+unsigned int eglMakeCurrent (void *dpy, void *draw, void *read, void *ctx) {
+  capsule::egl::Use();
+  unsigned int ret = capsule::egl::_eglMakeCurrent(dpy, draw, read, ctx);
+  if (ret) {
+    capsule::gl::shadow::MakeCurrent(ctx);
+  }
+  return ret;
+}
+
+// interposed libEGL function
+unsigned int eglDestroyContext (void *dpy, void *ctx) {
+  capsule::egl::EnsureEgl();
+  capsule::gl::ForgetContext(ctx);
+  unsigned int ret = capsule::egl::_eglDestroyContext(dpy, ctx);
+  capsule::gl::shadow::DestroyContext(ctx);
+  return ret;
+}
+
+#define HOOK_PROC(sym) if (lab::strings::CEquals(name, #sym)) { return (void*) &sym; }
+
+// interposed libEGL function
+void* eglGetProcAddress (const char *name) {
+  capsule::egl::Use();
+
+  if (lab::strings::CEquals(name, "eglSwapBuffers")) {
+    capsule::Log("Hooking eglSwapBuffers");
+    return (void*) &eglSwapBuffers;
+  }
+
+  // extensions: we only know the real one once asked for it
+  if (lab::strings::CEquals(name, "eglSwapBuffersWithDamageKHR")) {
+    capsule::egl::_eglSwapBuffersWithDamageKHR =
+      (capsule::egl::eglSwapBuffersWithDamage_t) capsule::egl::_eglGetProcAddress(name);
+    if (!capsule::egl::_eglSwapBuffersWithDamageKHR) {
+      return nullptr;
+    }
+    capsule::Log("Hooking eglSwapBuffersWithDamageKHR");
+    return (void*) &eglSwapBuffersWithDamageKHR;
+  }
+  if (lab::strings::CEquals(name, "eglSwapBuffersWithDamageEXT")) {
+    capsule::egl::_eglSwapBuffersWithDamageEXT =
+      (capsule::egl::eglSwapBuffersWithDamage_t) capsule::egl::_eglGetProcAddress(name);
+    if (!capsule::egl::_eglSwapBuffersWithDamageEXT) {
+      return nullptr;
+    }
+    capsule::Log("Hooking eglSwapBuffersWithDamageEXT");
+    return (void*) &eglSwapBuffersWithDamageEXT;
+  }
+
+  HOOK_PROC(eglMakeCurrent)
+  HOOK_PROC(eglDestroyContext)
+
+  // GL functions too, with EGL 1.5 or EGL_KHR_get_all_proc_addresses
+  void *interposed = capsule::gl::InterposedProc(name);
+  if (interposed) {
+    return interposed;
+  }
+
+  return capsule::egl::_eglGetProcAddress(name);
+}
+
+#undef HOOK_PROC
+
+} // extern "C"
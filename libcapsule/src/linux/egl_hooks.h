@@ -0,0 +1,50 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+namespace capsule {
+namespace gl {
+
+// our interposer for a GLX/GL function the binding shadows depend on,
+// or nullptr. Shared with EGL, whose games ask eglGetProcAddress instead
+void *InterposedProc(const char *name);
+
+} // namespace gl
+} // namespace capsule
+
+#pragma once
+
+namespace capsule {
+namespace egl {
+
+// loads the real libEGL from path, see dlopen_hooks.cc
+bool LoadEgl(const char *path);
+
+// whether the game has rendered through EGL: GL functions are then
+// resolved through eglGetProcAddress rather than glXGetProcAddressARB
+bool InUse();
+
+// eglGetProcAddress from the real libEGL, nullptr if it isn't loaded
+void *GetProcAddress(const char *symbol);
+
+} // namespace egl
+} // namespace capsule
@@ -22,9 +22,12 @@
 #include <lab/strings.h>
 
 #include "../gl_capture.h"
+#include "../gl_shadow.h"
 #include "../ensure.h"
 #include "../logging.h"
 #include "dlopen_hooks.h"
+#include "egl_hooks.h"
+#include "gl_hooks.h"
 
 namespace capsule {
 namespace gl {
@@ -39,6 +42,58 @@ static glXSwapBuffers_t _glXSwapBuffers = nullptr;
 typedef void* (*glXGetProcAddressARB_t)(const char*);
 static glXGetProcAddressARB_t _glXGetProcAddressARB = nullptr;
 
+typedef void* (*glXGetCurrentContext_t)();
+static glXGetCurrentContext_t _glXGetCurrentContext = nullptr;
+
+typedef int (*glXMakeCurrent_t)(void*, unsigned long, void*);
+typedef int (*glXMakeContextCurrent_t)(void*, unsigned long, unsigned long, void*);
+typedef void (*glXDestroyContext_t)(void*, void*);
+
+// only interposed, to keep the binding shadows up to date
+typedef void (*glActiveTexture_t)(GLenum);
+typedef void (*glBindTextures_t)(GLuint, GLsizei, const GLuint*);
+typedef void (*glBindTextureUnit_t)(GLuint, GLuint);
+typedef void (*glDeleteBuffersConst_t)(GLsizei, const GLuint*);
+typedef void (*glDeleteTexturesConst_t)(GLsizei, const GLuint*);
+typedef void (*glDeleteFramebuffersConst_t)(GLsizei, const GLuint*);
+typedef void (*glDeleteVertexArrays_t)(GLsizei, const GLuint*);
+typedef void (*glEnablei_t)(GLenum, GLuint);
+typedef void (*glPopAttrib_t)();
+typedef void (*glPopClientAttrib_t)();
+
+// the real functions behind our interposed ones, see EnsureSymbol
+namespace real {
+static glXMakeCurrent_t glXMakeCurrent;
+static glXMakeContextCurrent_t glXMakeContextCurrent;
+static glXDestroyContext_t glXDestroyContext;
+static glBindTexture_t glBindTexture;
+static glActiveTexture_t glActiveTexture;
+static glActiveTexture_t glActiveTextureARB;
+static glBindTextures_t glBindTextures;
+static glBindTextureUnit_t glBindTextureUnit;
+static glBindBuffer_t glBindBuffer;
+static glBindBuffer_t glBindBufferARB;
+static glBindFramebuffer_t glBindFramebuffer;
+static glBindFramebuffer_t glBindFramebufferEXT;
+static glBindVertexArray_t glBindVertexArray;
+static glUseProgram_t glUseProgram;
+static glUseProgram_t glUseProgramObjectARB;
+static glReadBuffer_t glReadBuffer;
+static glDeleteTexturesConst_t glDeleteTextures;
+static glDeleteBuffersConst_t glDeleteBuffers;
+static glDeleteBuffersConst_t glDeleteBuffersARB;
+static glDeleteFramebuffersConst_t glDeleteFramebuffers;
+static glDeleteFramebuffersConst_t glDeleteFramebuffersEXT;
+static glDeleteVertexArrays_t glDeleteVertexArrays;
+static glViewport_t glViewport;
+static glEnable_t glEnable;
+static glDisable_t glDisable;
+static glEnablei_t glEnablei;
+static glEnablei_t glDisablei;
+static glPopAttrib_t glPopAttrib;
+static glPopClientAttrib_t glPopClientAttrib;
+} // namespace real
+
 bool LoadOpengl (const char *path) {
   handle = dl::NakedOpen(path, (RTLD_NOW|RTLD_LOCAL));
   if (!handle) {
@@ -48,6 +103,7 @@ bool LoadOpengl (const char *path) {
   GLSYM(glXQueryExtension)
   GLSYM(glXSwapBuffers)
   GLSYM(glXGetProcAddressARB)
+  GLSYM(glXGetCurrentContext)
 
   return true;
 }
@@ -55,16 +111,33 @@ bool LoadOpengl (const char *path) {
 void *GetProcAddress (const char *symbol) {
   void *addr = nullptr;
 
-  if (_glXGetProcAddressARB) {
+  if (egl::InUse()) {
+    addr = egl::GetProcAddress(symbol);
+  }
+  if (!addr && _glXGetProcAddressARB) {
     addr = _glXGetProcAddressARB(symbol);
   }
-  if (!addr) {
+  if (!addr && handle) {
     addr = dlsym(handle, symbol);
   }
 
   return addr;
 }
 
+static void EnsureSymbol(void **ptr, const char *name) {
+  if (*ptr) {
+    return;
+  }
+
+  if (!EnsureOpengl()) {
+    Log("Could not load opengl library, cannot forward %s", name);
+    exit(124);
+  }
+
+  *ptr = GetProcAddress(name);
+  Ensure(name, !!*ptr);
+}
+
 } // namespace gl
 } // namespace capsule
 
@@ -72,7 +145,12 @@ extern "C" {
 
 // interposed libGL function
 void glXSwapBuffers (void *a, void *b) {
-  capsule::gl::Capture(0, 0);
+  void *ctx = nullptr;
+  if (capsule::gl::_glXGetCurrentContext) {
+    ctx = capsule::gl::_glXGetCurrentContext();
+    capsule::gl::shadow::Sync(ctx);
+  }
+  capsule::gl::Capture(ctx, b, 0, 0);
   return capsule::gl::_glXSwapBuffers(a, b);
 }
 
@@ -81,6 +159,271 @@ int glXQueryExtension (void *a, void *b, void *c) {
   return capsule::gl::_glXQueryExtension(a, b, c);
 }
 
+#define ENSURE_REAL(sym) capsule::gl::EnsureSymbol((void**) &capsule::gl::real::sym, #sym);
+
+// interposed libGL function
+int glXMakeCurrent (void *dpy, unsigned long drawable, void *ctx) {
+  ENSURE_REAL(glXMakeCurrent)
+  int ret = capsule::gl::real::glXMakeCurrent(dpy, drawable, ctx);
+  if (ret) {
+    capsule::gl::shadow::MakeCurrent(ctx);
+  }
+  return ret;
+}
+
+// interposed libGL function
+int glXMakeContextCurrent (void *dpy, unsigned long draw, unsigned long read, void *ctx) {
+  ENSURE_REAL(glXMakeContextCurrent)
+  int ret = capsule::gl::real::glXMakeContextCurrent(dpy, draw, read, ctx);
+  if (ret) {
+    capsule::gl::shadow::MakeCurrent(ctx);
+  }
+  return ret;
+}
+
+// interposed libGL function
+void glXDestroyContext (void *dpy, void *ctx) {
+  ENSURE_REAL(glXDestroyContext)
+  capsule::gl::ForgetContext(ctx);
+  capsule::gl::real::glXDestroyContext(dpy, ctx);
+  capsule::gl::shadow::DestroyContext(ctx);
+}
+
+// interposed libGL function
+void glBindTexture (GLenum target, GLuint texture) {
+  ENSURE_REAL(glBindTexture)
+  capsule::gl::real::glBindTexture(target, texture);
+  capsule::gl::shadow::BindTexture(target, texture);
+}
+
+// interposed libGL function
+void glActiveTexture (GLenum texture) {
+  ENSURE_REAL(glActiveTexture)
+  capsule::gl::real::glActiveTexture(texture);
+  capsule::gl::shadow::ActiveTexture(texture);
+}
+
+// interposed libGL function
+void glActiveTextureARB (GLenum texture) {
+  ENSURE_REAL(glActiveTextureARB)
+  capsule::gl::real::glActiveTextureARB(texture);
+  capsule::gl::shadow::ActiveTexture(texture);
+}
+
+// interposed libGL function
+void glBindTextures (GLuint first, GLsizei count, const GLuint *textures) {
+  ENSURE_REAL(glBindTextures)
+  capsule::gl::real::glBindTextures(first, count, textures);
+  capsule::gl::shadow::ForgetTextureUnits(first, count);
+}
+
+// interposed libGL function
+void glBindTextureUnit (GLuint unit, GLuint texture) {
+  ENSURE_REAL(glBindTextureUnit)
+  capsule::gl::real::glBindTextureUnit(unit, texture);
+  capsule::gl::shadow::ForgetTextureUnits(unit, 1);
+}
+
+// interposed libGL function
+void glBindBuffer (GLenum target, GLuint buffer) {
+  ENSURE_REAL(glBindBuffer)
+  capsule::gl::real::glBindBuffer(target, buffer);
+  capsule::gl::shadow::BindBuffer(target, buffer);
+}
+
+// interposed libGL function
+void glBindBufferARB (GLenum target, GLuint buffer) {
+  ENSURE_REAL(glBindBufferARB)
+  capsule::gl::real::glBindBufferARB(target, buffer);
+  capsule::gl::shadow::BindBuffer(target, buffer);
+}
+
+// interposed libGL function
+void glBindFramebuffer (GLenum target, GLuint framebuffer) {
+  ENSURE_REAL(glBindFramebuffer)
+  capsule::gl::real::glBindFramebuffer(target, framebuffer);
+  capsule::gl::shadow::BindFramebuffer(target, framebuffer);
+}
+
+// interposed libGL function
+void glBindFramebufferEXT (GLenum target, GLuint framebuffer) {
+  ENSURE_REAL(glBindFramebufferEXT)
+  capsule::gl::real::glBindFramebufferEXT(target, framebuffer);
+  capsule::gl::shadow::BindFramebuffer(target, framebuffer);
+}
+
+// interposed libGL function
+void glBindVertexArray (GLuint array) {
+  ENSURE_REAL(glBindVertexArray)
+  capsule::gl::real::glBindVertexArray(array);
+  capsule::gl::shadow::BindVertexArray(array);
+}
+
+// interposed libGL function
+void glUseProgram (GLuint program) {
+  ENSURE_REAL(glUseProgram)
+  capsule::gl::real::glUseProgram(program);
+  capsule::gl::shadow::UseProgram(program);
+}
+
+// interposed libGL function
+void glUseProgramObjectARB (GLuint program) {
+  ENSURE_REAL(glUseProgramObjectARB)
+  capsule::gl::real::glUseProgramObjectARB(program);
+  capsule::gl::shadow::UseProgram(program);
+}
+
+// interposed libGL function
+void glReadBuffer (GLenum mode) {
+  ENSURE_REAL(glReadBuffer)
+  capsule::gl::real::glReadBuffer(mode);
+  capsule::gl::shadow::ReadBuffer(mode);
+}
+
+// interposed libGL function
+void glDeleteTextures (GLsizei n, const GLuint *textures) {
+  ENSURE_REAL(glDeleteTextures)
+  capsule::gl::real::glDeleteTextures(n, textures);
+  capsule::gl::shadow::DeleteTextures(n, textures);
+}
+
+// interposed libGL function
+void glDeleteBuffers (GLsizei n, const GLuint *buffers) {
+  ENSURE_REAL(glDeleteBuffers)
+  capsule::gl::real::glDeleteBuffers(n, buffers);
+  capsule::gl::shadow::DeleteBuffers(n, buffers);
+}
+
+// interposed libGL function
+void glDeleteBuffersARB (GLsizei n, const GLuint *buffers) {
+  ENSURE_REAL(glDeleteBuffersARB)
+  capsule::gl::real::glDeleteBuffersARB(n, buffers);
+  capsule::gl::shadow::DeleteBuffers(n, buffers);
+}
+
+// interposed libGL function
+void glDeleteFramebuffers (GLsizei n, const GLuint *framebuffers) {
+  ENSURE_REAL(glDeleteFramebuffers)
+  capsule::gl::real::glDeleteFramebuffers(n, framebuffers);
+  capsule::gl::shadow::DeleteFramebuffers(n, framebuffers);
+}
+
+// interposed libGL function
+void glDeleteFramebuffersEXT (GLsizei n, const GLuint *framebuffers) {
+  ENSURE_REAL(glDeleteFramebuffersEXT)
+  capsule::gl::real::glDeleteFramebuffersEXT(n, framebuffers);
+  capsule::gl::shadow::DeleteFramebuffers(n, framebuffers);
+}
+
+// interposed libGL function
+void glDeleteVertexArrays (GLsizei n, const GLuint *arrays) {
+  ENSURE_REAL(glDeleteVertexArrays)
+  capsule::gl::real::glDeleteVertexArrays(n, arrays);
+  capsule::gl::shadow::DeleteVertexArrays(n, arrays);
+}
+
+// interposed libGL function
+void glViewport (GLint x, GLint y, GLsizei width, GLsizei height) {
+  ENSURE_REAL(glViewport)
+  capsule::gl::real::glViewport(x, y, width, height);
+  capsule::gl::shadow::Viewport(x, y, width, height);
+}
+
+// interposed libGL function
+void glEnable (GLenum cap) {
+  ENSURE_REAL(glEnable)
+  capsule::gl::real::glEnable(cap);
+  capsule::gl::shadow::Enable(cap, true);
+}
+
+// interposed libGL function
+void glDisable (GLenum cap) {
+  ENSURE_REAL(glDisable)
+  capsule::gl::real::glDisable(cap);
+  capsule::gl::shadow::Enable(cap, false);
+}
+
+// interposed libGL function
+void glEnablei (GLenum cap, GLuint index) {
+  ENSURE_REAL(glEnablei)
+  capsule::gl::real::glEnablei(cap, index);
+  // per draw buffer, glIsEnabled only tells about the first one
+  capsule::gl::shadow::Forget();
+}
+
+// interposed libGL function
+void glDisablei (GLenum cap, GLuint index) {
+  ENSURE_REAL(glDisablei)
+  capsule::gl::real::glDisablei(cap, index);
+  capsule::gl::shadow::Forget();
+}
+
+// interposed libGL function
+void glPopAttrib () {
+  ENSURE_REAL(glPopAttrib)
+  capsule::gl::real::glPopAttrib();
+  // may restore texture bindings & the read buffer
+  capsule::gl::shadow::Forget();
+}
+
+// interposed libGL function
+void glPopClientAttrib () {
+  ENSURE_REAL(glPopClientAttrib)
+  capsule::gl::real::glPopClientAttrib();
+  capsule::gl::shadow::Forget();
+}
+
+#undef ENSURE_REAL
+
+} // extern "C"
+
+namespace capsule {
+namespace gl {
+
+#define HOOK_PROC(sym) if (lab::strings::CEquals(name, #sym)) { return (void*) &sym; }
+
+void *InterposedProc (const char *name) {
+  // whoever asks for these must go through us, or the shadows go stale
+  HOOK_PROC(glXMakeCurrent)
+  HOOK_PROC(glXMakeContextCurrent)
+  HOOK_PROC(glXDestroyContext)
+  HOOK_PROC(glBindTexture)
+  HOOK_PROC(glActiveTexture)
+  HOOK_PROC(glActiveTextureARB)
+  HOOK_PROC(glBindTextures)
+  HOOK_PROC(glBindTextureUnit)
+  HOOK_PROC(glBindBuffer)
+  HOOK_PROC(glBindBufferARB)
+  HOOK_PROC(glBindFramebuffer)
+  HOOK_PROC(glBindFramebufferEXT)
+  HOOK_PROC(glBindVertexArray)
+  HOOK_PROC(glUseProgram)
+  HOOK_PROC(glUseProgramObjectARB)
+  HOOK_PROC(glReadBuffer)
+  HOOK_PROC(glDeleteTextures)
+  HOOK_PROC(glDeleteBuffers)
+  HOOK_PROC(glDeleteBuffersARB)
+  HOOK_PROC(glDeleteFramebuffers)
+  HOOK_PROC(glDeleteFramebuffersEXT)
+  HOOK_PROC(glDeleteVertexArrays)
+  HOOK_PROC(glViewport)
+  HOOK_PROC(glEnable)
+  HOOK_PROC(glDisable)
+  HOOK_PROC(glEnablei)
+  HOOK_PROC(glDisablei)
+  HOOK_PROC(glPopAttrib)
+  HOOK_PROC(glPopClientAttrib)
+
+  return nullptr;
+}
+
+#undef HOOK_PROC
+
+} // namespace gl
+} // namespace capsule
+
+extern "C" {
+
 // interposed libGL function
 void* glXGetProcAddressARB (const char *name) {
   if (lab::strings::CEquals(name, "glXSwapBuffers")) {
@@ -88,6 +431,11 @@ void* glXGetProcAddressARB (const char *name) {
     return (void*) &glXSwapBuffers;
   }
 
+  void *interposed = capsule::gl::InterposedProc(name);
+  if (interposed) {
+    return interposed;
+  }
+
   if (!capsule::gl::EnsureOpengl()) {
     capsule::Log("Could not load opengl library, cannot get proc address for child");
     exit(124);
@@ -95,4 +443,9 @@ void* glXGetProcAddressARB (const char *name) {
   return capsule::gl::_glXGetProcAddressARB(name);
 }
 
+// interposed libGL function, same as the ARB one
+void* glXGetProcAddress (const char *name) {
+  return glXGetProcAddressARB(name);
+}
+
 } // extern "C"
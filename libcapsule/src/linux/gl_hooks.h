@@ -21,4 +21,12 @@
 
 #pragma once
 
-#include "gl_hooks.h"
+namespace capsule {
+namespace gl {
+
+// our interposer for a GLX/GL function the binding shadows depend on,
+// or nullptr. Shared with EGL, whose games ask eglGetProcAddress instead
+void *InterposedProc(const char *name);
+
+} // namespace gl
+} // namespace capsule
@@ -60,7 +60,7 @@ CGLError CapsuleCglFlushDrawable (CGLContextObj ctx) {
     }
   }
 
-  capsule::gl::Capture(width, height);
+  capsule::gl::Capture(ctx, nullptr, width, height);
 
   CGLError ret = CGLFlushDrawable(ctx);
 
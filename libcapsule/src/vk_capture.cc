@@ -0,0 +1,753 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "vk_capture.h"
+
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "capture.h"
+#include "copy_worker.h"
+#include "io.h"
+#include "logging.h"
+
+namespace capsule {
+namespace vk {
+
+// readback buffers: capture::kNumBuffers to start with, more if the
+// GPU falls behind, up to this many
+static const int kMaxBuffers = 6;
+
+// how many dropped frames between two log lines
+static const int64_t kDroppedLogInterval = 100;
+
+struct Swapchain {
+  Device *device;
+  VkSwapchainKHR handle;
+  VkFormat format;
+  VkExtent2D extent;
+  // has transfer source usage, and a format we can send
+  bool capturable;
+  std::vector<VkImage> images;
+};
+
+struct Readback {
+  VkBuffer buffer;
+  VkDeviceMemory memory;
+  char *data; // mapped for as long as the buffer lives
+  bool coherent;
+  VkCommandBuffer cmd;
+  VkFence fence;
+  // signalled by our copy, waited on by the present
+  VkSemaphore semaphore;
+  int64_t timestamp;
+  bool in_flight; // submitted, fence not seen signalled yet
+  bool copying; // with the copy worker
+  bool presenting; // a present waits on its semaphore, not queued yet
+};
+
+struct State {
+  // the swapchain we capture from, null if none
+  Swapchain *swapchain;
+  VkCommandPool pool;
+
+  // what capsulerun was told, it can't change until capture stops
+  bool format_sent;
+  bool failed;
+  int cx;
+  int cy;
+  messages::PixFmt pix_fmt;
+  io::FrameLayout layout;
+
+  Readback readbacks[kMaxBuffers];
+  int num_buffers;
+  // in-flight readbacks, oldest first
+  int queue[kMaxBuffers];
+  int queue_start;
+  int queue_length;
+
+  int64_t dropped;
+};
+
+struct Queue {
+  Device *device;
+  VkQueue handle;
+  uint32_t family;
+};
+
+// guards everything below, presents may come from several threads
+static std::mutex mutex;
+// a present that waits on one of our semaphores got queued
+static std::condition_variable presented;
+static State state;
+static std::atomic<bool> copy_done[kMaxBuffers];
+static std::vector<Swapchain *> swapchains;
+static std::vector<Queue> queues;
+
+static messages::PixFmt PixFmtOf(VkFormat format) {
+  switch (format) {
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+      return messages::PixFmt_BGRA;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+      return messages::PixFmt_RGBA;
+    default:
+      return messages::PixFmt_UNKNOWN;
+  }
+}
+
+static Swapchain *FindSwapchain(VkSwapchainKHR handle) {
+  for (auto sc : swapchains) {
+    if (sc->handle == handle) {
+      return sc;
+    }
+  }
+  return nullptr;
+}
+
+static bool FamilyOf(VkQueue handle, uint32_t *family) {
+  for (auto &queue : queues) {
+    if (queue.handle == handle) {
+      *family = queue.family;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int FindMemoryType(Device *device, uint32_t type_bits, VkMemoryPropertyFlags flags) {
+  const auto &props = device->memory_properties;
+  for (uint32_t i = 0; i < props.memoryTypeCount; i++) {
+    if ((type_bits & (1u << i)) && (props.memoryTypes[i].propertyFlags & flags) == flags) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+// destroys whatever got created, handles may be null
+static void FreeReadback(Device *device, int idx) {
+  auto &rb = state.readbacks[idx];
+  if (rb.semaphore) {
+    device->DestroySemaphore(device->handle, rb.semaphore, nullptr);
+  }
+  if (rb.fence) {
+    device->DestroyFence(device->handle, rb.fence, nullptr);
+  }
+  // the command buffer goes with the pool
+  if (rb.data) {
+    device->UnmapMemory(device->handle, rb.memory);
+  }
+  if (rb.buffer) {
+    device->DestroyBuffer(device->handle, rb.buffer, nullptr);
+  }
+  if (rb.memory) {
+    device->FreeMemory(device->handle, rb.memory, nullptr);
+  }
+  memset(&rb, 0, sizeof(rb));
+}
+
+// adds one buffer to the readback ring
+static bool AddReadback(Device *device) {
+  int idx = state.num_buffers;
+  if (idx >= kMaxBuffers) {
+    return false;
+  }
+  auto &rb = state.readbacks[idx];
+  memset(&rb, 0, sizeof(rb));
+
+  bool success = false;
+  do {
+    VkBufferCreateInfo buffer_info = {};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.size = static_cast<VkDeviceSize>(state.layout.size);
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (device->CreateBuffer(device->handle, &buffer_info, nullptr, &rb.buffer) != VK_SUCCESS) {
+      Log("Vulkan: could not create readback buffer");
+      break;
+    }
+
+    VkMemoryRequirements reqs;
+    device->GetBufferMemoryRequirements(device->handle, rb.buffer, &reqs);
+    // reading uncached (write-combined) memory back is very slow
+    int type = FindMemoryType(device, reqs.memoryTypeBits,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    if (type < 0) {
+      type = FindMemoryType(device, reqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+    }
+    if (type < 0) {
+      Log("Vulkan: no host-visible memory for readback buffers");
+      break;
+    }
+    auto type_flags = device->memory_properties.memoryTypes[type].propertyFlags;
+    rb.coherent = (type_flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = reqs.size;
+    alloc_info.memoryTypeIndex = static_cast<uint32_t>(type);
+    if (device->AllocateMemory(device->handle, &alloc_info, nullptr, &rb.memory) != VK_SUCCESS) {
+      Log("Vulkan: could not allocate %" PRId64 " bytes for readback", static_cast<int64_t>(reqs.size));
+      break;
+    }
+    if (device->BindBufferMemory(device->handle, rb.buffer, rb.memory, 0) != VK_SUCCESS ||
+        device->MapMemory(device->handle, rb.memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void **>(&rb.data)) != VK_SUCCESS) {
+      Log("Vulkan: could not map readback buffer");
+      rb.data = nullptr;
+      break;
+    }
+
+    VkCommandBufferAllocateInfo cmd_info = {};
+    cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_info.commandPool = state.pool;
+    cmd_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_info.commandBufferCount = 1;
+    if (device->AllocateCommandBuffers(device->handle, &cmd_info, &rb.cmd) != VK_SUCCESS) {
+      Log("Vulkan: could not allocate command buffer");
+      break;
+    }
+    // the loader only does this for command buffers the game allocates
+    if (device->SetDeviceLoaderData) {
+      device->SetDeviceLoaderData(device->handle, rb.cmd);
+    } else {
+      *reinterpret_cast<void **>(rb.cmd) = *reinterpret_cast<void **>(device->handle);
+    }
+
+    VkFenceCreateInfo fence_info = {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    if (device->CreateFence(device->handle, &fence_info, nullptr, &rb.fence) != VK_SUCCESS ||
+        device->CreateSemaphore(device->handle, &semaphore_info, nullptr, &rb.semaphore) != VK_SUCCESS) {
+      Log("Vulkan: could not create readback sync objects");
+      break;
+    }
+
+    success = true;
+  } while (false);
+
+  if (!success) {
+    FreeReadback(device, idx);
+    return false;
+  }
+
+  copy_done[idx].store(true, std::memory_order_relaxed);
+  state.num_buffers++;
+  return true;
+}
+
+static bool Presenting(void) {
+  for (int i = 0; i < state.num_buffers; i++) {
+    if (state.readbacks[i].presenting) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// presents run unlocked: wait until none of them still needs one of
+// our semaphores before freeing the ring.
+static void WaitPresents(std::unique_lock<std::mutex> &lock) {
+  presented.wait(lock, [] { return !Presenting(); });
+}
+
+// waits for our copies and frees the ring. Only when capture stops or
+// its swapchain goes away, never per frame.
+static void FreeRing(void) {
+  if (!state.swapchain) {
+    return;
+  }
+  Device *device = state.swapchain->device;
+
+  int leaked = 0;
+  for (int i = 0; i < state.num_buffers; i++) {
+    auto &rb = state.readbacks[i];
+    if (rb.in_flight) {
+      // our copies only wait on semaphores the game already submitted
+      // signal operations for, so this returns. A lost device owns nothing.
+      VkResult res = device->WaitForFences(device->handle, 1, &rb.fence, VK_TRUE, UINT64_MAX);
+      if (res != VK_SUCCESS && res != VK_ERROR_DEVICE_LOST) {
+        // the GPU may still write to it: leaking beats a use-after-free
+        Log("Vulkan: could not wait for readback %d (%d), leaking it", i, res);
+        memset(&rb, 0, sizeof(rb));
+        leaked++;
+        continue;
+      }
+    }
+    if (rb.copying) {
+      copy_worker::Wait(&copy_done[i]);
+    }
+    FreeReadback(device, i);
+  }
+  if (leaked > 0) {
+    // its command buffers may still be pending too
+    state.pool = VK_NULL_HANDLE;
+  }
+  if (state.pool) {
+    device->DestroyCommandPool(device->handle, state.pool, nullptr);
+  }
+
+  Log("Vulkan: readback ring freed, %d buffers, %" PRId64 " frames dropped",
+    state.num_buffers, state.dropped);
+
+  state.swapchain = nullptr;
+  state.pool = VK_NULL_HANDLE;
+  state.num_buffers = 0;
+  state.queue_start = 0;
+  state.queue_length = 0;
+}
+
+// capture stopped: forget everything, including what capsulerun was told
+static void Reset(std::unique_lock<std::mutex> &lock) {
+  WaitPresents(lock);
+  FreeRing();
+  memset(&state, 0, sizeof(state));
+}
+
+static bool Init(Swapchain *sc, uint32_t family) {
+  Device *device = sc->device;
+
+  if (!sc->capturable) {
+    Log("Vulkan: swapchain 0x%" PRIx64 " can't be copied from (format %d), not capturing",
+      (uint64_t) sc->handle, (int) sc->format);
+    return false;
+  }
+  if (family >= Device::kMaxQueueFamilies || !device->family_can_copy[family]) {
+    Log("Vulkan: presenting from queue family %u, which can't copy, not capturing", family);
+    return false;
+  }
+
+  int cx = static_cast<int>(sc->extent.width);
+  int cy = static_cast<int>(sc->extent.height);
+  messages::PixFmt pix_fmt = PixFmtOf(sc->format);
+  if (state.format_sent && (cx != state.cx || cy != state.cy || pix_fmt != state.pix_fmt)) {
+    Log("Vulkan: swapchain went from %dx%d %s to %dx%d %s mid-capture, stopping",
+      state.cx, state.cy, messages::EnumNamePixFmt(state.pix_fmt),
+      cx, cy, messages::EnumNamePixFmt(pix_fmt));
+    return false;
+  }
+
+  if (!state.format_sent) {
+    state.cx = cx;
+    state.cy = cy;
+    state.pix_fmt = capture::NegotiatePixFmt(&pix_fmt, 1);
+    state.layout = io::PackedLayout(static_cast<int64_t>(cx) * 4, cy);
+
+    int divider = capture::GetState()->settings.size_divider;
+    if (divider > 1) {
+      Log("Vulkan: size divider %d not supported yet, capturing at full size", divider);
+    }
+  }
+
+  state.swapchain = sc;
+
+  VkCommandPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  // each readback re-records its own command buffer
+  pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  pool_info.queueFamilyIndex = family;
+  if (device->CreateCommandPool(device->handle, &pool_info, nullptr, &state.pool) != VK_SUCCESS) {
+    Log("Vulkan: could not create command pool");
+    FreeRing();
+    return false;
+  }
+
+  for (int i = 0; i < capture::kNumBuffers; i++) {
+    if (!AddReadback(device)) {
+      FreeRing();
+      return false;
+    }
+  }
+
+  Log("Vulkan: capturing swapchain 0x%" PRIx64 ", %dx%d %s, %d buffers",
+    (uint64_t) sc->handle, cx, cy, messages::EnumNamePixFmt(state.pix_fmt), state.num_buffers);
+  return true;
+}
+
+// hands the oldest readback to the copy worker, pops it from the queue.
+// its fence must have signalled.
+static void Send(void) {
+  Device *device = state.swapchain->device;
+  int idx = state.queue[state.queue_start];
+  state.queue_start = (state.queue_start + 1) % kMaxBuffers;
+  state.queue_length--;
+
+  auto &rb = state.readbacks[idx];
+  rb.in_flight = false;
+  device->ResetFences(device->handle, 1, &rb.fence);
+
+  if (!rb.coherent) {
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = rb.memory;
+    range.offset = 0;
+    range.size = VK_WHOLE_SIZE;
+    device->InvalidateMappedMemoryRanges(device->handle, 1, &range);
+  }
+
+  rb.copying = true;
+  copy_worker::Job job = {rb.timestamp, rb.data, static_cast<size_t>(state.layout.size), &copy_done[idx]};
+  copy_worker::Submit(job);
+}
+
+// sends every readback that's done, in order, and takes back the
+// buffers the copy worker is done with. Never waits.
+static void Drain(void) {
+  Device *device = state.swapchain->device;
+
+  for (int i = 0; i < state.num_buffers; i++) {
+    auto &rb = state.readbacks[i];
+    if (rb.copying && copy_done[i].load(std::memory_order_acquire)) {
+      rb.copying = false;
+    }
+  }
+
+  while (state.queue_length > 0) {
+    auto &rb = state.readbacks[state.queue[state.queue_start]];
+    if (device->GetFenceStatus(device->handle, rb.fence) != VK_SUCCESS) {
+      break;
+    }
+    Send();
+  }
+}
+
+// a buffer with no copy in flight, growing the ring if there's none.
+// -1 if the ring is full: the frame gets dropped, the game never waits.
+static int FreeBuffer(void) {
+  for (int i = 0; i < state.num_buffers; i++) {
+    auto &rb = state.readbacks[i];
+    if (!rb.in_flight && !rb.copying && !rb.presenting) {
+      return i;
+    }
+  }
+
+  if (AddReadback(state.swapchain->device)) {
+    Log("Vulkan: readbacks falling behind, ring grown to %d buffers", state.num_buffers);
+    return state.num_buffers - 1;
+  }
+
+  if (state.dropped % kDroppedLogInterval == 0) {
+    Log("Vulkan: readback ring full at %d buffers, %" PRId64 " frames dropped",
+      state.num_buffers, state.dropped + 1);
+  }
+  state.dropped++;
+  return -1;
+}
+
+static bool Record(Readback &rb, VkImage image) {
+  Device *device = state.swapchain->device;
+
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  if (device->BeginCommandBuffer(rb.cmd, &begin_info) != VK_SUCCESS) {
+    return false;
+  }
+
+  VkImageMemoryBarrier to_transfer = {};
+  to_transfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  // the game's semaphores, waited at the transfer stage, make its writes visible
+  to_transfer.srcAccessMask = 0;
+  to_transfer.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  to_transfer.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  to_transfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  to_transfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  to_transfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  to_transfer.image = image;
+  to_transfer.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  to_transfer.subresourceRange.levelCount = 1;
+  to_transfer.subresourceRange.layerCount = 1;
+  device->CmdPipelineBarrier(rb.cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+    0, 0, nullptr, 0, nullptr, 1, &to_transfer);
+
+  VkBufferImageCopy region = {};
+  // rows tightly packed: bufferRowLength 0
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent.width = static_cast<uint32_t>(state.cx);
+  region.imageExtent.height = static_cast<uint32_t>(state.cy);
+  region.imageExtent.depth = 1;
+  device->CmdCopyImageToBuffer(rb.cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, rb.buffer, 1, &region);
+
+  VkImageMemoryBarrier to_present = to_transfer;
+  to_present.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  to_present.dstAccessMask = 0;
+  to_present.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+  to_present.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+  VkBufferMemoryBarrier to_host = {};
+  to_host.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  to_host.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  to_host.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  to_host.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  to_host.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  to_host.buffer = rb.buffer;
+  to_host.offset = 0;
+  to_host.size = VK_WHOLE_SIZE;
+  device->CmdPipelineBarrier(rb.cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+    VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+    0, 0, nullptr, 1, &to_host, 1, &to_present);
+
+  return device->EndCommandBuffer(rb.cmd) == VK_SUCCESS;
+}
+
+// copies the image into a free readback, between the game's semaphores
+// and the present. Returns the readback whose semaphore the present must
+// wait on instead of the game's, or -1 if nothing was submitted.
+static int CaptureImage(VkQueue queue, VkImage image, const VkPresentInfoKHR *info) {
+  int idx = FreeBuffer();
+  if (idx < 0) {
+    return -1;
+  }
+  auto &rb = state.readbacks[idx];
+  auto timestamp = capture::FrameTimestamp();
+
+  if (!Record(rb, image)) {
+    Log("Vulkan: could not record copy");
+    return -1;
+  }
+
+  // grows to the most semaphores a present had, then stays
+  static std::vector<VkPipelineStageFlags> wait_stages;
+  if (wait_stages.size() < info->waitSemaphoreCount) {
+    wait_stages.resize(info->waitSemaphoreCount, VK_PIPELINE_STAGE_TRANSFER_BIT);
+  }
+  VkSubmitInfo submit = {};
+  submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit.waitSemaphoreCount = info->waitSemaphoreCount;
+  submit.pWaitSemaphores = info->pWaitSemaphores;
+  submit.pWaitDstStageMask = wait_stages.empty() ? nullptr : wait_stages.data();
+  submit.commandBufferCount = 1;
+  submit.pCommandBuffers = &rb.cmd;
+  submit.signalSemaphoreCount = 1;
+  submit.pSignalSemaphores = &rb.semaphore;
+
+  Device *device = state.swapchain->device;
+  VkResult res = device->QueueSubmit(queue, 1, &submit, rb.fence);
+  if (res != VK_SUCCESS) {
+    Log("Vulkan: could not submit copy (%d)", res);
+    return -1;
+  }
+
+  rb.timestamp = timestamp;
+  rb.in_flight = true;
+  state.queue[(state.queue_start + state.queue_length) % kMaxBuffers] = idx;
+  state.queue_length++;
+  return idx;
+}
+
+void GotQueue(Device *device, VkQueue queue, uint32_t family) {
+  std::lock_guard<std::mutex> lock(mutex);
+  uint32_t known;
+  if (!FamilyOf(queue, &known)) {
+    queues.push_back(Queue{device, queue, family});
+  }
+}
+
+void PrepareSwapchain(Device *device, VkSwapchainCreateInfoKHR *info) {
+  auto get_caps = device->instance->GetPhysicalDeviceSurfaceCapabilitiesKHR;
+  if (!get_caps) {
+    return;
+  }
+
+  VkSurfaceCapabilitiesKHR caps;
+  if (get_caps(device->physical_device, info->surface, &caps) != VK_SUCCESS) {
+    return;
+  }
+  if (caps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) {
+    info->imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  }
+}
+
+void SwapchainCreated(Device *device, VkSwapchainKHR handle, const VkSwapchainCreateInfoKHR *info) {
+  auto sc = new Swapchain();
+  sc->device = device;
+  sc->handle = handle;
+  sc->format = info->imageFormat;
+  sc->extent = info->imageExtent;
+  // shared presentable images are never in PRESENT_SRC layout
+  bool shared = info->presentMode == VK_PRESENT_MODE_SHARED_DEMAND_REFRESH_KHR ||
+                info->presentMode == VK_PRESENT_MODE_SHARED_CONTINUOUS_REFRESH_KHR;
+  sc->capturable = (info->imageUsage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) &&
+                   !shared &&
+                   info->imageArrayLayers == 1 &&
+                   PixFmtOf(info->imageFormat) != messages::PixFmt_UNKNOWN;
+
+  uint32_t num_images = 0;
+  device->GetSwapchainImagesKHR(device->handle, handle, &num_images, nullptr);
+  sc->images.resize(num_images);
+  if (num_images > 0) {
+    device->GetSwapchainImagesKHR(device->handle, handle, &num_images, sc->images.data());
+  }
+
+  Log("Vulkan: swapchain 0x%" PRIx64 " created, %ux%u, format %d, %u images%s",
+    (uint64_t) handle, sc->extent.width, sc->extent.height, (int) sc->format, num_images,
+    sc->capturable ? "" : ", can't capture");
+
+  std::lock_guard<std::mutex> lock(mutex);
+  swapchains.push_back(sc);
+}
+
+void SwapchainDestroyed(Device *device, VkSwapchainKHR handle) {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (auto it = swapchains.begin(); it != swapchains.end(); ++it) {
+    Swapchain *sc = *it;
+    if (sc->handle != handle || sc->device != device) {
+      continue;
+    }
+    if (state.swapchain == sc) {
+      // capture picks up the next one, if it looks the same
+      WaitPresents(lock);
+      FreeRing();
+    }
+    swapchains.erase(it);
+    delete sc;
+    return;
+  }
+}
+
+void ForgetDevice(Device *device) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (state.swapchain && state.swapchain->device == device) {
+    WaitPresents(lock);
+    FreeRing();
+  }
+  for (auto it = swapchains.begin(); it != swapchains.end();) {
+    if ((*it)->device == device) {
+      delete *it;
+      it = swapchains.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto it = queues.begin(); it != queues.end();) {
+    if (it->device == device) {
+      it = queues.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+VkResult Present(Device *device, VkQueue queue, const VkPresentInfoKHR *info) {
+  capture::SawBackend(capture::kBackendVulkan);
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (!capture::Active()) {
+    if (state.swapchain) {
+      // presents may still wait on our semaphores: the only time we
+      // wait on the game's queue is once, when capture stops
+      device->QueueWaitIdle(queue);
+    }
+    if (state.swapchain || state.format_sent || state.failed) {
+      Reset(lock);
+    }
+    lock.unlock();
+    return device->QueuePresentKHR(queue, info);
+  }
+
+  // keep finished frames moving even when we don't capture this one
+  if (state.swapchain) {
+    Drain();
+  }
+
+  if (state.failed || !capture::Ready()) {
+    lock.unlock();
+    return device->QueuePresentKHR(queue, info);
+  }
+
+  // the first swapchain we see is the one we capture
+  Swapchain *sc = nullptr;
+  uint32_t image_index = 0;
+  for (uint32_t i = 0; i < info->swapchainCount; i++) {
+    Swapchain *candidate = FindSwapchain(info->pSwapchains[i]);
+    if (candidate && candidate->device == device && (!state.swapchain || candidate == state.swapchain)) {
+      sc = candidate;
+      image_index = info->pImageIndices[i];
+      break;
+    }
+  }
+
+  if (sc && !state.swapchain) {
+    uint32_t family = 0;
+    if (!FamilyOf(queue, &family)) {
+      Log("Vulkan: presenting on a queue we never saw handed out, assuming family 0");
+    }
+    if (!Init(sc, family)) {
+      state.failed = true;
+      io::WriteCaptureStop();
+      lock.unlock();
+      return device->QueuePresentKHR(queue, info);
+    }
+  }
+
+  int copied = -1;
+  if (sc && image_index < sc->images.size()) {
+    copied = CaptureImage(queue, sc->images[image_index], info);
+  }
+
+  if (copied >= 0 && !state.format_sent) {
+    io::WriteVideoFormat(
+      state.cx,
+      state.cy,
+      state.pix_fmt,
+      false /* vflip */,
+      state.layout,
+      &state.pix_fmt,
+      1
+    );
+    state.format_sent = true;
+  }
+
+  if (copied < 0) {
+    lock.unlock();
+    return device->QueuePresentKHR(queue, info);
+  }
+
+  // our copy already waited on the game's semaphores. The present may
+  // block on vsync, so it runs unlocked: the flag keeps the semaphore
+  // alive and out of FreeBuffer until the wait is queued.
+  auto &rb = state.readbacks[copied];
+  rb.presenting = true;
+  VkSemaphore semaphore = rb.semaphore;
+  lock.unlock();
+
+  VkPresentInfoKHR our_info = *info;
+  our_info.waitSemaphoreCount = 1;
+  our_info.pWaitSemaphores = &semaphore;
+  VkResult res = device->QueuePresentKHR(queue, &our_info);
+
+  lock.lock();
+  state.readbacks[copied].presenting = false;
+  lock.unlock();
+  presented.notify_all();
+  return res;
+}
+
+} // namespace vk
+} // namespace capsule
@@ -0,0 +1,56 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include "vk_layer.h"
+
+namespace capsule {
+namespace vk {
+
+/**
+ * Vulkan capture: on present, the swapchain image is copied into a
+ * host-visible buffer on the presenting queue, between the game's
+ * semaphores and the actual present. Buffers are handed to the copy
+ * worker once their fence signals, polled on later presents: nothing
+ * here ever waits on the GPU while capturing. If every buffer is busy,
+ * the frame is dropped instead.
+ */
+
+// a queue was handed out, remembers its family for command pools
+void GotQueue(Device *device, VkQueue queue, uint32_t family);
+
+// adds the usage we copy with to a swapchain about to be created,
+// if its surface supports it
+void PrepareSwapchain(Device *device, VkSwapchainCreateInfoKHR *info);
+
+// after the real vkCreateSwapchainKHR succeeded
+void SwapchainCreated(Device *device, VkSwapchainKHR swapchain, const VkSwapchainCreateInfoKHR *info);
+
+// before the real vkDestroySwapchainKHR / vkDestroyDevice
+void SwapchainDestroyed(Device *device, VkSwapchainKHR swapchain);
+void ForgetDevice(Device *device);
+
+// captures a frame if it's time to, then presents
+VkResult Present(Device *device, VkQueue queue, const VkPresentInfoKHR *info);
+
+} // namespace vk
+} // namespace capsule
@@ -0,0 +1,370 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#include "vk_layer.h"
+
+#include <string.h>
+
+#include <map>
+#include <mutex>
+
+#include "vk_capture.h"
+#include "logging.h"
+
+namespace capsule {
+namespace vk {
+
+// instances & devices, by dispatch key. Physical devices share
+// their instance's key, queues their device's.
+static std::mutex mutex;
+static std::map<void *, Instance *> instances;
+static std::map<void *, Device *> devices;
+
+static inline void *DispatchKey(void *dispatchable) {
+  return *reinterpret_cast<void **>(dispatchable);
+}
+
+static Instance *GetInstance(void *dispatchable) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = instances.find(DispatchKey(dispatchable));
+  return it == instances.end() ? nullptr : it->second;
+}
+
+Device *GetDevice(void *dispatchable) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = devices.find(DispatchKey(dispatchable));
+  return it == devices.end() ? nullptr : it->second;
+}
+
+static VkResult VKAPI_CALL CreateInstance(const VkInstanceCreateInfo *info, const VkAllocationCallbacks *allocator, VkInstance *out) {
+  auto link = reinterpret_cast<VkLayerInstanceCreateInfo *>(const_cast<void *>(info->pNext));
+  while (link && !(link->sType == VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO && link->function == VK_LAYER_LINK_INFO)) {
+    link = reinterpret_cast<VkLayerInstanceCreateInfo *>(const_cast<void *>(link->pNext));
+  }
+  if (!link) {
+    Log("Vulkan: no layer link info in vkCreateInstance, is the loader too old?");
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  PFN_vkGetInstanceProcAddr gipa = link->u.pLayerInfo->pfnNextGetInstanceProcAddr;
+  // the next layer gets the rest of the chain
+  link->u.pLayerInfo = link->u.pLayerInfo->pNext;
+
+  auto create = reinterpret_cast<PFN_vkCreateInstance>(gipa(VK_NULL_HANDLE, "vkCreateInstance"));
+  VkResult res = create(info, allocator, out);
+  if (res != VK_SUCCESS) {
+    return res;
+  }
+
+  auto instance = new Instance();
+  instance->handle = *out;
+  instance->GetInstanceProcAddr = gipa;
+#define INSTANCE_PROC(name) instance->name = reinterpret_cast<PFN_vk##name>(gipa(*out, "vk" #name))
+  INSTANCE_PROC(DestroyInstance);
+  INSTANCE_PROC(CreateDevice);
+  INSTANCE_PROC(GetPhysicalDeviceMemoryProperties);
+  INSTANCE_PROC(GetPhysicalDeviceQueueFamilyProperties);
+  INSTANCE_PROC(GetPhysicalDeviceSurfaceCapabilitiesKHR);
+#undef INSTANCE_PROC
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    instances[DispatchKey(*out)] = instance;
+  }
+  Log("Vulkan: layer active on instance %p", *out);
+  return VK_SUCCESS;
+}
+
+static void VKAPI_CALL DestroyInstance(VkInstance handle, const VkAllocationCallbacks *allocator) {
+  if (!handle) {
+    return;
+  }
+
+  Instance *instance = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = instances.find(DispatchKey(handle));
+    if (it != instances.end()) {
+      instance = it->second;
+      instances.erase(it);
+    }
+  }
+  if (!instance) {
+    return;
+  }
+
+  instance->DestroyInstance(handle, allocator);
+  delete instance;
+}
+
+static VkResult VKAPI_CALL CreateDevice(VkPhysicalDevice physical_device, const VkDeviceCreateInfo *info,
+                                        const VkAllocationCallbacks *allocator, VkDevice *out) {
+  Instance *instance = GetInstance(physical_device);
+  if (!instance) {
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  VkLayerDeviceCreateInfo *link = nullptr;
+  PFN_vkSetDeviceLoaderData set_loader_data = nullptr;
+  for (auto p = reinterpret_cast<VkLayerDeviceCreateInfo *>(const_cast<void *>(info->pNext)); p;
+       p = reinterpret_cast<VkLayerDeviceCreateInfo *>(const_cast<void *>(p->pNext))) {
+    if (p->sType != VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO) {
+      continue;
+    }
+    if (p->function == VK_LAYER_LINK_INFO && !link) {
+      link = p;
+    } else if (p->function == VK_LOADER_DATA_CALLBACK) {
+      set_loader_data = p->u.pfnSetDeviceLoaderData;
+    }
+  }
+  if (!link) {
+    Log("Vulkan: no layer link info in vkCreateDevice, is the loader too old?");
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  PFN_vkGetInstanceProcAddr gipa = link->u.pLayerInfo->pfnNextGetInstanceProcAddr;
+  PFN_vkGetDeviceProcAddr gdpa = link->u.pLayerInfo->pfnNextGetDeviceProcAddr;
+  link->u.pLayerInfo = link->u.pLayerInfo->pNext;
+
+  auto create = reinterpret_cast<PFN_vkCreateDevice>(gipa(instance->handle, "vkCreateDevice"));
+  VkResult res = create(physical_device, info, allocator, out);
+  if (res != VK_SUCCESS) {
+    return res;
+  }
+
+  auto device = new Device();
+  device->handle = *out;
+  device->physical_device = physical_device;
+  device->instance = instance;
+  device->SetDeviceLoaderData = set_loader_data;
+  device->GetDeviceProcAddr = gdpa;
+
+  instance->GetPhysicalDeviceMemoryProperties(physical_device, &device->memory_properties);
+
+  VkQueueFamilyProperties families[Device::kMaxQueueFamilies];
+  uint32_t num_families = Device::kMaxQueueFamilies;
+  instance->GetPhysicalDeviceQueueFamilyProperties(physical_device, &num_families, families);
+  for (uint32_t i = 0; i < num_families; i++) {
+    // graphics & compute queues can always do transfers
+    const VkQueueFlags copy_flags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+    device->family_can_copy[i] = (families[i].queueFlags & copy_flags) != 0;
+  }
+
+#define DEVICE_PROC(name) device->name = reinterpret_cast<PFN_vk##name>(gdpa(*out, "vk" #name))
+  DEVICE_PROC(DestroyDevice);
+  DEVICE_PROC(GetDeviceQueue);
+  DEVICE_PROC(GetDeviceQueue2);
+  DEVICE_PROC(CreateSwapchainKHR);
+  DEVICE_PROC(DestroySwapchainKHR);
+  DEVICE_PROC(GetSwapchainImagesKHR);
+  DEVICE_PROC(QueuePresentKHR);
+
+  DEVICE_PROC(CreateBuffer);
+  DEVICE_PROC(DestroyBuffer);
+  DEVICE_PROC(GetBufferMemoryRequirements);
+  DEVICE_PROC(AllocateMemory);
+  DEVICE_PROC(FreeMemory);
+  DEVICE_PROC(BindBufferMemory);
+  DEVICE_PROC(MapMemory);
+  DEVICE_PROC(UnmapMemory);
+  DEVICE_PROC(InvalidateMappedMemoryRanges);
+
+  DEVICE_PROC(CreateCommandPool);
+  DEVICE_PROC(DestroyCommandPool);
+  DEVICE_PROC(AllocateCommandBuffers);
+  DEVICE_PROC(BeginCommandBuffer);
+  DEVICE_PROC(EndCommandBuffer);
+  DEVICE_PROC(CmdPipelineBarrier);
+  DEVICE_PROC(CmdCopyImageToBuffer);
+
+  DEVICE_PROC(CreateFence);
+  DEVICE_PROC(DestroyFence);
+  DEVICE_PROC(GetFenceStatus);
+  DEVICE_PROC(ResetFences);
+  DEVICE_PROC(WaitForFences);
+  DEVICE_PROC(CreateSemaphore);
+  DEVICE_PROC(DestroySemaphore);
+  DEVICE_PROC(QueueSubmit);
+  DEVICE_PROC(QueueWaitIdle);
+#undef DEVICE_PROC
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    devices[DispatchKey(*out)] = device;
+  }
+  return VK_SUCCESS;
+}
+
+static void VKAPI_CALL DestroyDevice(VkDevice handle, const VkAllocationCallbacks *allocator) {
+  if (!handle) {
+    return;
+  }
+
+  Device *device = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = devices.find(DispatchKey(handle));
+    if (it != devices.end()) {
+      device = it->second;
+      devices.erase(it);
+    }
+  }
+  if (!device) {
+    return;
+  }
+
+  ForgetDevice(device);
+  device->DestroyDevice(handle, allocator);
+  delete device;
+}
+
+static void VKAPI_CALL GetDeviceQueue(VkDevice handle, uint32_t family, uint32_t index, VkQueue *queue) {
+  Device *device = GetDevice(handle);
+  device->GetDeviceQueue(handle, family, index, queue);
+  GotQueue(device, *queue, family);
+}
+
+static void VKAPI_CALL GetDeviceQueue2(VkDevice handle, const VkDeviceQueueInfo2 *info, VkQueue *queue) {
+  Device *device = GetDevice(handle);
+  device->GetDeviceQueue2(handle, info, queue);
+  if (*queue) {
+    GotQueue(device, *queue, info->queueFamilyIndex);
+  }
+}
+
+static VkResult VKAPI_CALL CreateSwapchainKHR(VkDevice handle, const VkSwapchainCreateInfoKHR *info,
+                                              const VkAllocationCallbacks *allocator, VkSwapchainKHR *out) {
+  Device *device = GetDevice(handle);
+
+  // we need to copy from its images
+  VkSwapchainCreateInfoKHR our_info = *info;
+  PrepareSwapchain(device, &our_info);
+
+  VkResult res = device->CreateSwapchainKHR(handle, &our_info, allocator, out);
+  if (res != VK_SUCCESS && our_info.imageUsage != info->imageUsage) {
+    Log("Vulkan: swapchain creation failed with transfer usage (%d), retrying without", res);
+    res = device->CreateSwapchainKHR(handle, info, allocator, out);
+    our_info = *info;
+  }
+  if (res == VK_SUCCESS) {
+    SwapchainCreated(device, *out, &our_info);
+  }
+  return res;
+}
+
+static void VKAPI_CALL DestroySwapchainKHR(VkDevice handle, VkSwapchainKHR swapchain, const VkAllocationCallbacks *allocator) {
+  Device *device = GetDevice(handle);
+  if (swapchain) {
+    SwapchainDestroyed(device, swapchain);
+  }
+  device->DestroySwapchainKHR(handle, swapchain, allocator);
+}
+
+static VkResult VKAPI_CALL QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *info) {
+  return Present(GetDevice(queue), queue, info);
+}
+
+// hooks both GetProcAddrs hand out, null if the next layer doesn't have them
+static PFN_vkVoidFunction DeviceHook(const char *name) {
+#define HOOK(fn) if (!strcmp(name, "vk" #fn)) { return reinterpret_cast<PFN_vkVoidFunction>(fn); }
+  HOOK(DestroyDevice);
+  HOOK(GetDeviceQueue);
+  HOOK(GetDeviceQueue2);
+  HOOK(CreateSwapchainKHR);
+  HOOK(DestroySwapchainKHR);
+  HOOK(QueuePresentKHR);
+#undef HOOK
+  return nullptr;
+}
+
+} // namespace vk
+} // namespace capsule
+
+using namespace capsule;
+
+extern "C" {
+
+CAPSULE_VK_EXPORT PFN_vkVoidFunction VKAPI_CALL capsule_vkGetDeviceProcAddr(VkDevice handle, const char *name) {
+  if (!strcmp(name, "vkGetDeviceProcAddr")) {
+    return reinterpret_cast<PFN_vkVoidFunction>(capsule_vkGetDeviceProcAddr);
+  }
+
+  vk::Device *device = vk::GetDevice(handle);
+  if (!device) {
+    return nullptr;
+  }
+
+  PFN_vkVoidFunction next = device->GetDeviceProcAddr(handle, name);
+  PFN_vkVoidFunction hook = vk::DeviceHook(name);
+  // don't hand out hooks for extensions the game didn't enable
+  return (hook && next) ? hook : next;
+}
+
+CAPSULE_VK_EXPORT PFN_vkVoidFunction VKAPI_CALL capsule_vkGetInstanceProcAddr(VkInstance handle, const char *name) {
+  if (!strcmp(name, "vkGetInstanceProcAddr")) {
+    return reinterpret_cast<PFN_vkVoidFunction>(capsule_vkGetInstanceProcAddr);
+  }
+  if (!strcmp(name, "vkCreateInstance")) {
+    return reinterpret_cast<PFN_vkVoidFunction>(vk::CreateInstance);
+  }
+  if (!strcmp(name, "vkGetDeviceProcAddr")) {
+    return reinterpret_cast<PFN_vkVoidFunction>(capsule_vkGetDeviceProcAddr);
+  }
+  if (!handle) {
+    return nullptr;
+  }
+  if (!strcmp(name, "vkDestroyInstance")) {
+    return reinterpret_cast<PFN_vkVoidFunction>(vk::DestroyInstance);
+  }
+  if (!strcmp(name, "vkCreateDevice")) {
+    return reinterpret_cast<PFN_vkVoidFunction>(vk::CreateDevice);
+  }
+
+  vk::Instance *instance = vk::GetInstance(handle);
+  if (!instance) {
+    return nullptr;
+  }
+
+  PFN_vkVoidFunction hook = vk::DeviceHook(name);
+  if (hook) {
+    return hook;
+  }
+  return instance->GetInstanceProcAddr(handle, name);
+}
+
+CAPSULE_VK_EXPORT VkResult VKAPI_CALL capsule_vkNegotiateLoaderLayerInterfaceVersion(VkNegotiateLayerInterface *version) {
+  if (version->sType != LAYER_NEGOTIATE_INTERFACE_STRUCT) {
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  // version 2 is all we need: no physical device hooks
+  if (version->loaderLayerInterfaceVersion > 2) {
+    version->loaderLayerInterfaceVersion = 2;
+  }
+  if (version->loaderLayerInterfaceVersion >= 2) {
+    version->pfnGetInstanceProcAddr = capsule_vkGetInstanceProcAddr;
+    version->pfnGetDeviceProcAddr = capsule_vkGetDeviceProcAddr;
+    version->pfnGetPhysicalDeviceProcAddr = nullptr;
+  }
+  return VK_SUCCESS;
+}
+
+} // extern "C"
@@ -0,0 +1,125 @@
+
+/*
+ *  capsule - the game recording and overlay toolkit
+ *  Copyright (C) 2017, Amos Wenger
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details:
+ * https://github.com/itchio/capsule/blob/master/LICENSE
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vulkan/vk_layer.h>
+
+// newer Vulkan-Headers dropped CAPSULE_VK_EXPORT, don't rely on it
+#if defined(_WIN32)
+#define CAPSULE_VK_EXPORT __declspec(dllexport)
+#else
+#define CAPSULE_VK_EXPORT __attribute__((visibility("default")))
+#endif
+
+namespace capsule {
+namespace vk {
+
+/**
+ * libcapsule doubles as an implicit Vulkan layer: capsulerun points the
+ * loader at our manifest, which names the entry points below. Since the
+ * library is already preloaded, the loader gets the same copy and the
+ * layer shares capture state with everything else. The manifest only
+ * enables the layer when CAPSULE_VULKAN=1 is in the game's environment.
+ *
+ * The layer only intercepts what capture needs (devices, swapchains and
+ * presents), everything else goes straight to the next layer.
+ */
+
+// what we call on an instance, from the next layer
+struct Instance {
+  VkInstance handle;
+  PFN_vkGetInstanceProcAddr GetInstanceProcAddr;
+  PFN_vkDestroyInstance DestroyInstance;
+  PFN_vkCreateDevice CreateDevice;
+  PFN_vkGetPhysicalDeviceMemoryProperties GetPhysicalDeviceMemoryProperties;
+  PFN_vkGetPhysicalDeviceQueueFamilyProperties GetPhysicalDeviceQueueFamilyProperties;
+  // null unless the game enabled VK_KHR_surface
+  PFN_vkGetPhysicalDeviceSurfaceCapabilitiesKHR GetPhysicalDeviceSurfaceCapabilitiesKHR;
+};
+
+// what we call on a device, from the next layer
+struct Device {
+  VkDevice handle;
+  VkPhysicalDevice physical_device;
+  Instance *instance;
+  // gives the command buffers we allocate the loader's dispatch table
+  PFN_vkSetDeviceLoaderData SetDeviceLoaderData;
+
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  // whether each queue family can run vkCmdCopyImageToBuffer
+  static const uint32_t kMaxQueueFamilies = 16;
+  bool family_can_copy[kMaxQueueFamilies];
+
+  PFN_vkGetDeviceProcAddr GetDeviceProcAddr;
+  PFN_vkDestroyDevice DestroyDevice;
+  PFN_vkGetDeviceQueue GetDeviceQueue;
+  PFN_vkGetDeviceQueue2 GetDeviceQueue2;
+  PFN_vkCreateSwapchainKHR CreateSwapchainKHR;
+  PFN_vkDestroySwapchainKHR DestroySwapchainKHR;
+  PFN_vkGetSwapchainImagesKHR GetSwapchainImagesKHR;
+  PFN_vkQueuePresentKHR QueuePresentKHR;
+
+  PFN_vkCreateBuffer CreateBuffer;
+  PFN_vkDestroyBuffer DestroyBuffer;
+  PFN_vkGetBufferMemoryRequirements GetBufferMemoryRequirements;
+  PFN_vkAllocateMemory AllocateMemory;
+  PFN_vkFreeMemory FreeMemory;
+  PFN_vkBindBufferMemory BindBufferMemory;
+  PFN_vkMapMemory MapMemory;
+  PFN_vkUnmapMemory UnmapMemory;
+  PFN_vkInvalidateMappedMemoryRanges InvalidateMappedMemoryRanges;
+
+  PFN_vkCreateCommandPool CreateCommandPool;
+  PFN_vkDestroyCommandPool DestroyCommandPool;
+  PFN_vkAllocateCommandBuffers AllocateCommandBuffers;
+  PFN_vkBeginCommandBuffer BeginCommandBuffer;
+  PFN_vkEndCommandBuffer EndCommandBuffer;
+  PFN_vkCmdPipelineBarrier CmdPipelineBarrier;
+  PFN_vkCmdCopyImageToBuffer CmdCopyImageToBuffer;
+
+  PFN_vkCreateFence CreateFence;
+  PFN_vkDestroyFence DestroyFence;
+  PFN_vkGetFenceStatus GetFenceStatus;
+  PFN_vkResetFences ResetFences;
+  PFN_vkWaitForFences WaitForFences;
+  PFN_vkCreateSemaphore CreateSemaphore;
+  PFN_vkDestroySemaphore DestroySemaphore;
+  PFN_vkQueueSubmit QueueSubmit;
+  PFN_vkQueueWaitIdle QueueWaitIdle;
+};
+
+// the device a queue belongs to (dispatchable handles share a key)
+Device *GetDevice(void *dispatchable);
+
+} // namespace vk
+} // namespace capsule
+
+// layer entry points, named in the manifest. Not called vkXxx so they
+// don't interpose the game's own calls into the loader.
+extern "C" {
+
+CAPSULE_VK_EXPORT VkResult VKAPI_CALL capsule_vkNegotiateLoaderLayerInterfaceVersion(VkNegotiateLayerInterface *version);
+CAPSULE_VK_EXPORT PFN_vkVoidFunction VKAPI_CALL capsule_vkGetInstanceProcAddr(VkInstance instance, const char *name);
+CAPSULE_VK_EXPORT PFN_vkVoidFunction VKAPI_CALL capsule_vkGetDeviceProcAddr(VkDevice device, const char *name);
+
+} // extern "C"
@@ -47,6 +47,9 @@ struct State {
   bool                      multisampled; // if true, subresource needs to be resolved on GPU before downloading
 
   bool                      gpu_color_conv; // whether to do color conversion on the GPU
+  messages::PixFmt          pix_fmts[2]; // what we can capture in, native last
+  int                       num_pix_fmts;
+  messages::PixFmt          pix_fmt; // negotiated with capsulerun
 
   ID3D11Texture2D                *scale_tex; // texture & resource used for in-GPU scaling
   ID3D11ShaderResourceView       *scale_resource;
@@ -682,10 +685,17 @@ static void Init(IDXGISwapChain *swap) {
   state.device->GetImmediateContext(&state.context);
   state.context->Release();
 
-  state.gpu_color_conv = capture::GetState()->settings.gpu_color_conv;
-
   InitFormat(swap, &window);
 
+  // the YUV444P shader is still opt-in
+  state.num_pix_fmts = 0;
+  if (capture::GetState()->settings.gpu_color_conv) {
+    state.pix_fmts[state.num_pix_fmts++] = messages::PixFmt_YUV444P;
+  }
+  state.pix_fmts[state.num_pix_fmts++] = dxgi::FormatToPixFmt(state.format);
+  state.pix_fmt = capture::NegotiatePixFmt(state.pix_fmts, state.num_pix_fmts);
+  state.gpu_color_conv = (state.pix_fmt == messages::PixFmt_YUV444P);
+
   if (!InitOverlayTexture() || !InitOverlayVbo()) {
     exit(1337);
     return;
@@ -1010,18 +1020,26 @@ void Capture(void *swap_ptr, void *backbuffer_ptr) {
   }
 
   if (first_frame) {
-    messages::PixFmt pix_fmt;
+    int width = state.cx / state.size_divider;
+    int height = state.cy / state.size_divider;
+    auto layout = io::PackedLayout(state.pitch, height);
     if (state.gpu_color_conv) {
-      pix_fmt = messages::PixFmt_YUV444P;
-    } else {
-      pix_fmt = dxgi::FormatToPixFmt(state.format);
+      // the conversion shader writes Y, U and V side by side in each row
+      layout.num_planes = 3;
+      for (int i = 0; i < 3; i++) {
+        layout.offset[i] = width * i;
+        layout.linesize[i] = state.pitch;
+      }
     }
+
     io::WriteVideoFormat(
-      state.cx / state.size_divider,
-      state.cy / state.size_divider,
-      pix_fmt,
+      width,
+      height,
+      state.pix_fmt,
       false /* no vflip */,
-      state.pitch
+      layout,
+      state.pix_fmts,
+      state.num_pix_fmts
     );
     first_frame = false;
   }
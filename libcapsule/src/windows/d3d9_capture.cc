@@ -299,9 +299,11 @@ void Capture (IDirect3DDevice9 *device, IDirect3DSurface9 *backbuffer) {
   }
 
   if (first_frame) {
-    auto pix_fmt = dxgi::FormatToPixFmt(ToDxgiFormat(state.format));
+    // only the backbuffer's own format, no GPU conversion here
+    auto native_pix_fmt = dxgi::FormatToPixFmt(ToDxgiFormat(state.format));
+    auto pix_fmt = capture::NegotiatePixFmt(&native_pix_fmt, 1);
     io::WriteVideoFormat(state.cx, state.cy, pix_fmt, false /* no vflip */,
-                         state.pitch);
+                         io::PackedLayout(state.pitch, state.cy), &native_pix_fmt, 1);
     first_frame = false;
   }
 
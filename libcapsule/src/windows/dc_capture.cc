@@ -78,8 +78,10 @@ static void CaptureHwnd(HWND hwnd) {
   auto timestamp = capture::FrameTimestamp();
 
   if (first_frame) {
-    io::WriteVideoFormat(state.cx, state.cy, messages::PixFmt_BGRA, true /* vflip */,
-                         state.cx * components);
+    // GetDIBits only does BGRA, nothing to negotiate
+    static const messages::PixFmt pix_fmt = messages::PixFmt_BGRA;
+    io::WriteVideoFormat(state.cx, state.cy, capture::NegotiatePixFmt(&pix_fmt, 1), true /* vflip */,
+                         io::PackedLayout(state.cx * components, state.cy), &pix_fmt, 1);
     first_frame = false;
   }
 
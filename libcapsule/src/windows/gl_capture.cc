@@ -26,16 +26,29 @@
 namespace capsule {
 namespace gl {
 
+typedef HGLRC (LAB_STDCALL *wglGetCurrentContext_t)();
+wglGetCurrentContext_t wglGetCurrentContext_real;
+
 typedef bool (LAB_STDCALL *wglSwapBuffers_t)(HANDLE hdc);
 wglSwapBuffers_t wglSwapBuffers_real;
 SIZE_T wglSwapBuffersHookId;
 
 bool LAB_STDCALL wglSwapBuffers_hook (HANDLE hdc) {
   capture::SawBackend(capture::kBackendGL);
-  Capture(0, 0);
+  // surfaces are keyed by context and drawable, like glX and EGL
+  Capture(wglGetCurrentContext_real(), hdc, 0, 0);
   return wglSwapBuffers_real(hdc);
 }
 
+typedef BOOL (LAB_STDCALL *wglDeleteContext_t)(HGLRC hglrc);
+wglDeleteContext_t wglDeleteContext_real;
+SIZE_T wglDeleteContextHookId;
+
+BOOL LAB_STDCALL wglDeleteContext_hook (HGLRC hglrc) {
+  ForgetContext(hglrc);
+  return wglDeleteContext_real(hglrc);
+}
+
 void InstallHooks () {
   DWORD err;
 
@@ -45,6 +58,18 @@ void InstallHooks () {
     return;
   }
 
+  wglGetCurrentContext_real = (wglGetCurrentContext_t) NktHookLibHelpers::GetProcedureAddress(opengl, "wglGetCurrentContext");
+  if (!wglGetCurrentContext_real) {
+    Log("Could not find wglGetCurrentContext, disabling OpenGL capture");
+    return;
+  }
+
+  LPVOID wglDeleteContext_addr = NktHookLibHelpers::GetProcedureAddress(opengl, "wglDeleteContext");
+  if (!wglDeleteContext_addr) {
+    Log("Could not find wglDeleteContext, disabling OpenGL capture");
+    return;
+  }
+
   LPVOID wglSwapBuffers_addr = NktHookLibHelpers::GetProcedureAddress(opengl, "wglSwapBuffers");
   if (!wglSwapBuffers_addr) {
     Log("Could not find wglSwapBuffers, disabling OpenGL capture");
@@ -58,6 +83,15 @@ void InstallHooks () {
   }
 
   Log("Installed wglSwapBuffers hook");
+
+  // forget the context's surfaces before it goes away, like glXDestroyContext
+  err = cHookMgr.Hook(&wglDeleteContextHookId, (LPVOID *) &wglDeleteContext_real, wglDeleteContext_addr, wglDeleteContext_hook, 0);
+  if (err != ERROR_SUCCESS) {
+    Log("Hooking wglDeleteContext derped with error %d (%x)", err, err);
+    return;
+  }
+
+  Log("Installed wglDeleteContext hook");
 }
 
 } // namespace gl
@@ -1,5 +1,10 @@
 #!/bin/sh -xe
 
+# Converts a raw frame dump to mp4. To reproduce a whole session
+# (timing, audio, capsulerun's own encoder), record it with
+# `capsulerun --record session.trace -- game` and encode it offline
+# with `capsulerun --replay session.trace [--replay-max-speed]` instead.
+
 if [ -z "$FPS" ]; then
   FPS=30
 fi
@@ -0,0 +1,87 @@
+#!/bin/sh -e
+
+# Measures what libcapsule costs a game: runs capsule-gl-test-game (through
+# EGL with API=egl, or capsule-vk-test-game with API=vk) plain,
+# injected with capture idle, and injected while capturing, then prints
+# one row of frame time percentiles per mode.
+#
+# usage: scripts/injection-overhead.sh BUILD_DIR [extra test game args]
+#
+# BUILD_DIR must contain dist/capsulerun (and libcapsule64.so next to it)
+# and bench/capsule-gl-test-game (configure with -DCAPSULE_BUILD_BENCH=ON).
+#
+# If DISPLAY isn't set, runs everything under Xvfb with Mesa's llvmpipe
+# (or Mesa's lavapipe for Vulkan), so results are comparable between
+# machines without a GPU.
+
+if [ -z "$1" ]; then
+  echo "usage: $0 BUILD_DIR [extra test game args]"
+  exit 1
+fi
+
+BUILD_DIR=$1
+shift
+
+CAPSULERUN=$BUILD_DIR/dist/capsulerun
+if [ -z "$API" ]; then
+  API=gl
+fi
+if [ "$API" = "egl" ]; then
+  # the GL test game, swapping an EGL pbuffer instead of a GLX window
+  GAME=$BUILD_DIR/bench/capsule-gl-test-game
+  set -- --egl "$@"
+else
+  GAME=$BUILD_DIR/bench/capsule-$API-test-game
+fi
+
+if [ -z "$FRAMES" ]; then
+  FRAMES=600
+fi
+
+if [ -z "$OUT_DIR" ]; then
+  OUT_DIR=$(mktemp -d)
+fi
+
+XVFB_PID=
+cleanup() {
+  if [ -n "$XVFB_PID" ]; then
+    kill $XVFB_PID || true
+  fi
+}
+trap cleanup EXIT
+
+if [ -z "$DISPLAY" ]; then
+  export DISPLAY=:99
+  Xvfb $DISPLAY -screen 0 1920x1080x24 >/dev/null 2>&1 &
+  XVFB_PID=$!
+  sleep 1
+  export LIBGL_ALWAYS_SOFTWARE=1
+  export GALLIUM_DRIVER=llvmpipe
+  for ICD in /usr/share/vulkan/icd.d/lvp_icd*.json; do
+    if [ -f "$ICD" ] && [ -z "$VK_DRIVER_FILES" ]; then
+      export VK_DRIVER_FILES=$ICD
+      export VK_ICD_FILENAMES=$ICD
+    fi
+  done
+fi
+
+# never wait for vblank, we want the game's own frame times
+export vblank_mode=0
+
+if [ "$API" = "vk" ]; then
+  # the capture layer is opt-in
+  export CAPSULE_VULKAN=1
+fi
+
+GAME_ARGS="--frames $FRAMES $*"
+
+# plain: no injection at all
+$GAME $GAME_ARGS --label plain --header
+
+# injected, idle: libcapsule hooks are in place but nothing is captured
+(cd $OUT_DIR && $CAPSULERUN -- $GAME $GAME_ARGS --label injected-idle) 2>$OUT_DIR/idle.log
+
+# injected, capturing: capture starts as soon as the game draws
+(cd $OUT_DIR && $CAPSULERUN --autostart -- $GAME $GAME_ARGS --label capturing) 2>$OUT_DIR/capture.log
+
+echo "capsulerun logs and capture in $OUT_DIR" >&2